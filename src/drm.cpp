@@ -13,6 +13,13 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <sys/ioctl.h>
+
+#include <linux/sync_file.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 extern "C" {
 #include <wlr/types/wlr_buffer.h>
@@ -29,8 +36,10 @@ extern "C" {
 #include "steamcompmgr.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <list>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
 
 struct drm_t g_DRM = {};
 
@@ -44,6 +53,10 @@ const char *g_sOutputName = nullptr;
 #define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
 #endif
 
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+
 bool g_bSupportsAsyncFlips = false;
 
 enum drm_mode_generation g_drmModeGeneration = DRM_MODE_GENERATE_CVT;
@@ -57,11 +70,112 @@ static LogScope drm_verbose_log("drm", LOG_SILENT);
 static std::map< std::string, std::string > pnps = {};
 
 drm_screen_type drm_get_connector_type(drmModeConnector *connector);
+static void drm_start_liftoff_prevalidation( struct drm_t *drm );
+static void drm_stop_liftoff_prevalidation( struct drm_t *drm );
+static void drm_start_hotplug_thread( struct drm_t *drm );
+static void drm_update_mirror( struct drm_t *drm );
+static void drm_mirror_disable( struct drm_t *drm, bool connector_gone );
+static void drm_mirror_flip( struct drm_t *drm, const FrameInfo_t::Layer_t *layer );
+static void drm_mirror_page_flip( struct drm_t *drm, uint64_t vblanktime );
+static void drm_build_mode_table( struct drm_t *drm, struct connector *conn, const drmModeModeInfo *base );
+static void drm_free_mode_table( struct drm_t *drm, struct connector *conn );
+static void drm_destroy_loose_mode_blobs( struct drm_t *drm );
+
+/* fb::id of slots whose FB got removed, or that are being filled in */
+#define DRM_FB_SLOT_TOMBSTONE UINT32_MAX
+#define DRM_FB_SLOT_BUSY      ( UINT32_MAX - 1 )
+
+/* fb::state */
+#define DRM_FB_REFS_MASK      0x00ffffffu
+#define DRM_FB_PENDING_UNLOCK 0x01000000u
+#define DRM_FB_PENDING_FREE   0x02000000u
+#define DRM_FB_RECLAIM_QUEUED 0x04000000u
+
+static uint32_t fb_slot_hash( uint32_t id )
+{
+	return ( id * 2654435761u ) & ( k_nMaxFBs - 1 );
+}
+
+/* Slots are only filled in by drm_fbid_from_dmabuf and only emptied once
+ * nothing can reference the FB anymore, so any thread can look up a FB it
+ * holds a reference to without locking. */
+static struct fb *find_fb( struct drm_t& drm, uint32_t id )
+{
+	uint32_t hash = fb_slot_hash( id );
+	for ( uint32_t i = 0; i < k_nMaxFBs; i++ )
+	{
+		struct fb *fb = &drm.fbs[ ( hash + i ) & ( k_nMaxFBs - 1 ) ];
+		uint32_t slot_id = fb->id.load( std::memory_order_acquire );
+		if ( slot_id == id )
+			return fb;
+		if ( slot_id == 0 )
+			break;
+	}
+
+	return nullptr;
+}
+
+/* Like find_fb, for FBs the caller expects to be imported. A miss is a bug
+ * somewhere else, callers log it and leave the FB alone. */
+static struct fb *get_fb( struct drm_t& drm, uint32_t id )
+{
+	struct fb *fb = find_fb( drm, id );
+	if ( fb == nullptr )
+		drm_log.errorf( "unknown fbid %u", id );
+	return fb;
+}
+
+/* Must be called with drm_t::fb_alloc_lock held */
+static struct fb *alloc_fb( struct drm_t& drm, uint32_t id )
+{
+	uint32_t hash = fb_slot_hash( id );
+	for ( uint32_t i = 0; i < k_nMaxFBs; i++ )
+	{
+		struct fb *fb = &drm.fbs[ ( hash + i ) & ( k_nMaxFBs - 1 ) ];
+		uint32_t slot_id = fb->id.load( std::memory_order_relaxed );
+		if ( slot_id != 0 && slot_id != DRM_FB_SLOT_TOMBSTONE )
+			continue;
+
+		// Claim the slot, the caller publishes the ID once it's filled in
+		if ( fb->id.compare_exchange_strong( slot_id, DRM_FB_SLOT_BUSY ) )
+			return fb;
+	}
 
-static struct fb& get_fb( struct drm_t& drm, uint32_t id )
+	return nullptr;
+}
+
+static void free_fb_slot( struct fb *fb )
+{
+	fb->buf = nullptr;
+	fb->held_refs = 0;
+	fb->id.store( DRM_FB_SLOT_TOMBSTONE, std::memory_order_release );
+}
+
+/* Turns tombstones back into empty slots, so that probe sequences don't keep
+ * growing over the session. A tombstone can only go if the slot after it is
+ * empty, as no FB's probe sequence can run past an empty slot; walking back
+ * from every empty slot clears whole runs of them. Lookups stay lock-free,
+ * alloc_fb can't fill the empty slot under us. */
+static void drm_compact_fb_slots( struct drm_t *drm )
 {
-	std::lock_guard<std::mutex> m( drm.fb_map_mutex );
-	return drm.fb_map[ id ];
+	std::lock_guard<std::mutex> lock( drm->fb_alloc_lock );
+
+	uint32_t cleared = 0;
+	for ( uint32_t i = 0; i < k_nMaxFBs; i++ )
+	{
+		if ( drm->fbs[ i ].id.load( std::memory_order_relaxed ) != 0 )
+			continue;
+
+		for ( uint32_t j = ( i - 1 ) & ( k_nMaxFBs - 1 ); j != i; j = ( j - 1 ) & ( k_nMaxFBs - 1 ) )
+		{
+			uint32_t slot_id = DRM_FB_SLOT_TOMBSTONE;
+			if ( !drm->fbs[ j ].id.compare_exchange_strong( slot_id, 0 ) )
+				break;
+			cleared++;
+		}
+	}
+
+	drm_verbose_log.debugf( "cleared %u FB tombstones", cleared );
 }
 
 static struct crtc *find_crtc_for_connector(struct drm_t *drm, const struct connector *connector) {
@@ -157,71 +271,243 @@ static struct plane *find_primary_plane(struct drm_t *drm)
 	return primary;
 }
 
-static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb );
+/* Pick the cursor plane of the chosen CRTC, if the driver exposes one. */
+static struct plane *find_cursor_plane(struct drm_t *drm)
+{
+	for (size_t i = 0; i < drm->planes.size(); i++) {
+		struct plane *plane = &drm->planes[i];
 
-std::atomic<uint64_t> g_nCompletedPageFlipCount = { 0u };
+		if (!(plane->plane->possible_crtcs & (1 << drm->crtc_index)))
+			continue;
 
-static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+		uint64_t plane_type = drm->planes[i].initial_prop_values["type"];
+		if (plane_type == DRM_PLANE_TYPE_CURSOR)
+			return plane;
+	}
+
+	return nullptr;
+}
+
+/* Pick a writeback connector that can be fed by the chosen CRTC, and read
+ * the formats it can write. */
+static struct connector *find_writeback_connector(struct drm_t *drm)
 {
-	uint64_t flipcount = (uint64_t)data;
-	g_nCompletedPageFlipCount = flipcount;
+	drm->writeback_formats.clear();
 
-	if ( g_DRM.crtc->id != crtc_id )
-		return;
+	for (auto &kv : drm->connectors) {
+		struct connector *conn = &kv.second;
 
-	// This is the last vblank time
-	uint64_t vblanktime = sec * 1'000'000'000lu + usec * 1'000lu;
-	vblank_mark_possible_vblank(vblanktime);
+		if (conn->connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK)
+			continue;
 
-	// TODO: get the fbids_queued instance from data if we ever have more than one in flight
+		if (!(conn->possible_crtcs & (1 << drm->crtc_index)))
+			continue;
 
-	drm_verbose_log.debugf("page_flip_handler %" PRIu64, flipcount);
-	gpuvis_trace_printf("page_flip_handler %" PRIu64, flipcount);
+		uint64_t blob_id = conn->initial_prop_values["WRITEBACK_PIXEL_FORMATS"];
+		drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(drm->fd, blob_id);
+		if (blob == nullptr)
+			continue;
+
+		const uint32_t *formats = (const uint32_t *)blob->data;
+		drm->writeback_formats.assign(formats, formats + blob->length / sizeof(uint32_t));
+		drmModeFreePropertyBlob(blob);
+
+		return conn;
+	}
+
+	return nullptr;
+}
+
+/* Drops a page-flip reference on the FB. Returns true if that left it to
+ * drm_reclaim_fbs. */
+static bool drm_fb_flip_unref( struct drm_t *drm, struct fb *fb )
+{
+	uint32_t old_state = fb->state.load();
+	uint32_t new_state;
+	do
+	{
+		assert( old_state & DRM_FB_REFS_MASK );
+		new_state = old_state - 1;
+		if ( ( new_state & DRM_FB_REFS_MASK ) == 0 && ( new_state & ( DRM_FB_PENDING_UNLOCK | DRM_FB_PENDING_FREE ) ) )
+			new_state |= DRM_FB_RECLAIM_QUEUED;
+	}
+	while ( !fb->state.compare_exchange_weak( old_state, new_state ) );
+
+	if ( !( new_state & DRM_FB_RECLAIM_QUEUED ) || ( old_state & DRM_FB_RECLAIM_QUEUED ) )
+		return false;
+
+	uint32_t index = fb - drm->fbs.data();
+	uint32_t head = drm->fb_reclaim_head.load();
+	do
+	{
+		fb->next_reclaim = head;
+	}
+	while ( !drm->fb_reclaim_head.compare_exchange_weak( head, index + 1 ) );
+
+	return true;
+}
+
+/* Capture (screenshots, PipeWire) through a KMS writeback connector instead
+ * of compositing, where the driver has one. */
+static bool is_writeback_capture_enabled()
+{
+	static bool enabled = []() {
+		const char *env = getenv( "GAMESCOPE_WRITEBACK_CAPTURE" );
+		return env && *env && atoi( env ) != 0;
+	}();
+	return enabled;
+}
 
-	for ( uint32_t i = 0; i < g_DRM.fbids_on_screen.size(); i++ )
+/* Retires the oldest flip in flight: the FBs that were on screen before it
+ * lose their page-flip reference. Must be called with flip_lock held.
+ * Returns true if that left FBs to drm_reclaim_fbs. */
+static bool drm_retire_flip( struct drm_t *drm )
+{
+	struct drm_t::flip flip = std::move( drm->flips_queued.front() );
+	drm->flips_queued.pop_front();
+
+	bool bReclaim = false;
+	for ( uint32_t i = 0; i < drm->fbids_on_screen.size(); i++ )
 	{
-		uint32_t previous_fbid = g_DRM.fbids_on_screen[ i ];
+		uint32_t previous_fbid = drm->fbids_on_screen[ i ];
 		assert( previous_fbid != 0 );
 
-		struct fb &previous_fb = get_fb( g_DRM, previous_fbid );
+		// we flipped away from this previous fbid, drm_reclaim_fbs
+		// unlocks/frees it if that was waiting on us
+		struct fb *fb = get_fb( *drm, previous_fbid );
+		if ( fb != nullptr && drm_fb_flip_unref( drm, fb ) )
+			bReclaim = true;
+	}
 
-		if ( --previous_fb.n_refs == 0 )
-		{
-			// we flipped away from this previous fbid, now safe to delete
-			std::lock_guard<std::mutex> lock( g_DRM.free_queue_lock );
+	drm->fbids_on_screen = std::move( flip.fbids );
 
-			for ( uint32_t i = 0; i < g_DRM.fbid_unlock_queue.size(); i++ )
-			{
-				if ( g_DRM.fbid_unlock_queue[ i ] == previous_fbid )
-				{
-					drm_verbose_log.debugf("deferred unlock %u", previous_fbid);
+	if ( flip.out_fence_fd >= 0 )
+		close( flip.out_fence_fd );
 
-					drm_unlock_fb_internal( &g_DRM, &get_fb( g_DRM, previous_fbid ) );
+	return bReclaim;
+}
 
-					g_DRM.fbid_unlock_queue.erase( g_DRM.fbid_unlock_queue.begin() + i );
-					break;
-				}
-			}
+/* Returns true and the time it signalled if the sync_file has signalled. */
+static bool get_sync_file_signal_time( int fd, uint64_t *signal_time )
+{
+	struct sync_fence_info fence_info = {};
+	struct sync_file_info file_info = {};
+	file_info.num_fences = 1;
+	file_info.sync_fence_info = (uint64_t)(uintptr_t)&fence_info;
 
-			for ( uint32_t i = 0; i < g_DRM.fbid_free_queue.size(); i++ )
-			{
-				if ( g_DRM.fbid_free_queue[ i ] == previous_fbid )
-				{
-					drm_verbose_log.debugf( "deferred free %u", previous_fbid );
+	if ( ioctl( fd, SYNC_IOC_FILE_INFO, &file_info ) != 0 )
+	{
+		drm_log.errorf_errno( "SYNC_IOC_FILE_INFO failed" );
+		return false;
+	}
+
+	// 1 if signalled, 0 if still active, negative on error
+	if ( file_info.status <= 0 )
+		return false;
 
-					drm_drop_fbid( &g_DRM, previous_fbid );
+	*signal_time = fence_info.timestamp_ns;
+	return true;
+}
 
-					g_DRM.fbid_free_queue.erase( g_DRM.fbid_free_queue.begin() + i );
-					break;
-				}
-			}
+/* Returns a duplicate of the KMS out-fence of the oldest flip in flight,
+ * which the caller owns, or -1 if there's none. */
+int drm_dup_flip_out_fence( struct drm_t *drm )
+{
+	std::lock_guard< std::mutex > lock( drm->flip_lock );
+
+	if ( drm->flips_queued.empty() || drm->flips_queued.front().out_fence_fd < 0 )
+		return -1;
+
+	return fcntl( drm->flips_queued.front().out_fence_fd, F_DUPFD_CLOEXEC, 0 );
+}
+
+/* Retires the flips whose out-fence has signalled, so that the FBs they
+ * flipped away from get released right away on the steamcompmgr thread
+ * instead of waiting for the page-flip event to go through the gamescope-kms
+ * thread. The out-fence signals with the flip's vblank timestamp, which goes
+ * to the vblank manager from here then, and from the page-flip handler for
+ * the flips it retires itself. */
+void drm_retire_signalled_flips( struct drm_t *drm )
+{
+	bool bRetired = false;
+
+	{
+		std::lock_guard< std::mutex > lock( drm->flip_lock );
+
+		while ( !drm->flips_queued.empty() )
+		{
+			const struct drm_t::flip &flip = drm->flips_queued.front();
+
+			uint64_t flip_time;
+			if ( flip.out_fence_fd < 0 || !get_sync_file_signal_time( flip.out_fence_fd, &flip_time ) )
+				break;
+
+			vblank_mark_possible_vblank( flip_time );
+
+			drm_verbose_log.debugf( "flip %" PRIu64 " out-fence signalled, %" PRIu64 "us after commit", flip.flipcount, ( flip_time - flip.commit_time ) / 1'000lu );
+			gpuvis_trace_printf( "flip %" PRIu64 " on screen, %" PRIu64 "us after commit", flip.flipcount, ( flip_time - flip.commit_time ) / 1'000lu );
+
+			drm_retire_flip( drm );
+			bRetired = true;
 		}
 	}
 
-	g_DRM.fbids_on_screen = g_DRM.fbids_queued;
-	g_DRM.fbids_queued.clear();
+	if ( bRetired )
+	{
+		drm->flip_cv.notify_all();
+		drm_reclaim_fbs( drm );
+	}
+}
+
+std::atomic<uint64_t> g_nCompletedPageFlipCount = { 0u };
+
+/* Event cookie of the mirror output's flips, which don't count towards
+ * flipcount */
+static const uint64_t k_uMirrorFlipCookie = UINT64_MAX;
+
+static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+{
+	// This is the last vblank time
+	uint64_t vblanktime = sec * 1'000'000'000lu + usec * 1'000lu;
+
+	if ( (uint64_t)data == k_uMirrorFlipCookie )
+	{
+		drm_mirror_page_flip( &g_DRM, vblanktime );
+		return;
+	}
+
+	uint64_t flipcount = (uint64_t)data;
+	g_nCompletedPageFlipCount = flipcount;
+
+	if ( g_DRM.crtc->id != crtc_id )
+		return;
+
+	drm_verbose_log.debugf("page_flip_handler %" PRIu64, flipcount);
+	gpuvis_trace_printf("page_flip_handler %" PRIu64, flipcount);
+
+	bool bReclaim = false;
+
+	std::unique_lock< std::mutex > queue_lock( g_DRM.flip_lock );
+
+	// Flips complete in order, retire everything up to this one. The
+	// steamcompmgr thread may have beaten us to it, see
+	// drm_retire_signalled_flips, and then already marked the vblank.
+	bool bRetired = false;
+	while ( !g_DRM.flips_queued.empty() && g_DRM.flips_queued.front().flipcount <= flipcount )
+	{
+		if ( drm_retire_flip( &g_DRM ) )
+			bReclaim = true;
+		bRetired = true;
+	}
+
+	if ( bRetired )
+		vblank_mark_possible_vblank(vblanktime);
 
-	g_DRM.flip_lock.unlock();
+	queue_lock.unlock();
+	g_DRM.flip_cv.notify_all();
+
+	if ( bReclaim )
+		nudge_steamcompmgr();
 }
 
 void flip_handler_thread_run(void)
@@ -249,8 +535,15 @@ void flip_handler_thread_run(void)
 	}
 }
 
+/* Property metadata is cached in drm_t::props, which the hotplug thread
+ * fills in too. The entries are never freed, so pointers to them stay
+ * valid without holding the lock. */
+static std::mutex g_PropsLock;
+
 static const drmModePropertyRes *get_prop(struct drm_t *drm, uint32_t prop_id)
 {
+	std::lock_guard<std::mutex> lock(g_PropsLock);
+
 	if (drm->props.count(prop_id) > 0) {
 		return drm->props[prop_id];
 	}
@@ -309,19 +602,52 @@ static bool compare_modes( drmModeModeInfo mode1, drmModeModeInfo mode2 )
 	return mode1.vrefresh > mode2.vrefresh;
 }
 
-static void parse_edid( drm_t *drm, struct connector *conn)
+/* Everything refresh_state reads from the kernel for a connector. Filled in
+ * without touching drm_t::connectors, so that it can happen on the hotplug
+ * thread, see drm_probe_state. */
+struct drm_connector_probe {
+	uint32_t id;
+	drmModeConnector *connector;
+	uint32_t possible_crtcs;
+	std::map<std::string, const drmModePropertyRes *> props;
+	std::map<std::string, uint64_t> prop_values;
+
+	char make_pnp[4];
+	char *make;
+	char *model;
+};
+
+struct drm_object_probe {
+	std::map<std::string, const drmModePropertyRes *> props;
+	std::map<std::string, uint64_t> prop_values;
+};
+
+struct drm_state_probe {
+	/* drm_hotplug_request serial this answers, 0 for synchronous probes */
+	uint64_t serial;
+	std::vector<struct drm_connector_probe> connectors;
+	/* In the same order as drm_t::crtcs and drm_t::planes */
+	std::vector<struct drm_object_probe> crtcs;
+	std::vector<struct drm_object_probe> planes;
+};
+
+static void drm_free_state_probe( struct drm_state_probe *probe )
 {
-	memset(conn->make_pnp, 0, sizeof(conn->make_pnp));
-	free(conn->make);
-	conn->make = NULL;
-	free(conn->model);
-	conn->model = NULL;
+	for (auto &conn : probe->connectors) {
+		drmModeFreeConnector(conn.connector);
+		free(conn.make);
+		free(conn.model);
+	}
+	delete probe;
+}
 
+static void parse_edid( drm_t *drm, struct drm_connector_probe *conn)
+{
 	if (conn->props.count("EDID") == 0) {
 		return;
 	}
 
-	uint64_t blob_id = conn->initial_prop_values["EDID"];
+	uint64_t blob_id = conn->prop_values["EDID"];
 	if (blob_id == 0) {
 		return;
 	}
@@ -334,6 +660,7 @@ static void parse_edid( drm_t *drm, struct connector *conn)
 
 	if (blob->length < 128) {
 		drm_log.errorf("Truncated EDID");
+		drmModeFreePropertyBlob(blob);
 		return;
 	}
 
@@ -368,6 +695,7 @@ static void parse_edid( drm_t *drm, struct connector *conn)
 				*nl = '\0';
 			}
 
+			free(conn->model);
 			conn->model = strdup(model);
 		}
 	}
@@ -375,21 +703,78 @@ static void parse_edid( drm_t *drm, struct connector *conn)
 	drmModeFreePropertyBlob(blob);
 }
 
-static bool refresh_state( drm_t *drm )
+/* Re-enumerates connectors and re-reads all connector, CRTC and plane
+ * properties. Doesn't modify drm_t, apart from the property cache, so it's
+ * safe to call from any thread. */
+static struct drm_state_probe *drm_probe_state( drm_t *drm )
 {
 	drmModeRes *resources = drmModeGetResources(drm->fd);
 	if (resources == nullptr) {
 		drm_log.errorf_errno("drmModeGetResources failed");
-		return false;
+		return nullptr;
 	}
 
-	// Add connectors which appeared
+	struct drm_state_probe *probe = new drm_state_probe();
+
 	for (int i = 0; i < resources->count_connectors; i++) {
-		uint32_t conn_id = resources->connectors[i];
+		probe->connectors.push_back({ .id = resources->connectors[i] });
+	}
+
+	drmModeFreeResources(resources);
+
+	for (auto &conn : probe->connectors) {
+		conn.connector = drmModeGetConnector(drm->fd, conn.id);
+		if (conn.connector == nullptr) {
+			drm_log.errorf_errno("drmModeGetConnector failed");
+			drm_free_state_probe(probe);
+			return nullptr;
+		}
+
+		if (!get_object_properties(drm, conn.id, DRM_MODE_OBJECT_CONNECTOR, conn.props, conn.prop_values)) {
+			drm_free_state_probe(probe);
+			return nullptr;
+		}
+
+		/* sort modes by preference: preferred flag, then highest area, then
+		 * highest refresh rate */
+		std::stable_sort(conn.connector->modes, conn.connector->modes + conn.connector->count_modes, compare_modes);
+
+		parse_edid(drm, &conn);
+
+		conn.possible_crtcs = drmModeConnectorGetPossibleCrtcs(drm->fd, conn.connector);
+		if (!conn.possible_crtcs)
+			drm_log.errorf_errno("drmModeConnectorGetPossibleCrtcs failed");
+	}
+
+	// The CRTC and plane lists are fixed after get_resources
+	probe->crtcs.resize(drm->crtcs.size());
+	for (size_t i = 0; i < drm->crtcs.size(); i++) {
+		if (!get_object_properties(drm, drm->crtcs[i].id, DRM_MODE_OBJECT_CRTC, probe->crtcs[i].props, probe->crtcs[i].prop_values)) {
+			drm_free_state_probe(probe);
+			return nullptr;
+		}
+	}
+
+	probe->planes.resize(drm->planes.size());
+	for (size_t i = 0; i < drm->planes.size(); i++) {
+		if (!get_object_properties(drm, drm->planes[i].id, DRM_MODE_OBJECT_PLANE, probe->planes[i].props, probe->planes[i].prop_values)) {
+			drm_free_state_probe(probe);
+			return nullptr;
+		}
+	}
+
+	return probe;
+}
 
-		if (drm->connectors.count(conn_id) == 0) {
-			struct connector conn = { .id = conn_id };
-			drm->connectors[conn_id] = conn;
+/* Swaps the results of drm_probe_state in, and frees it. Only moves pointers
+ * around, so that hotplugs don't stall the compositor. */
+static void drm_apply_state( drm_t *drm, struct drm_state_probe *probe )
+{
+	// Add connectors which appeared
+	for (const auto &probed : probe->connectors) {
+		if (drm->connectors.count(probed.id) == 0) {
+			struct connector conn = { .id = probed.id };
+			drm->connectors[probed.id] = conn;
 		}
 	}
 
@@ -399,8 +784,8 @@ static bool refresh_state( drm_t *drm )
 		struct connector *conn = &it->second;
 
 		bool found = false;
-		for (int j = 0; j < resources->count_connectors; j++) {
-			if (resources->connectors[j] == conn->id) {
+		for (const auto &probed : probe->connectors) {
+			if (probed.id == conn->id) {
 				found = true;
 				break;
 			}
@@ -413,9 +798,16 @@ static bool refresh_state( drm_t *drm )
 				drm_log.infof("current connector '%s' disappeared", conn->name);
 				drm->connector = nullptr;
 			}
+			if (drm->writeback_connector == conn)
+				drm->writeback_connector = nullptr;
+			if (drm->mirror.connector == conn)
+				drm_mirror_disable(drm, true);
 
+			drm_free_mode_table(drm, conn);
 			free(conn->name);
 			conn->name = nullptr;
+			free(conn->make);
+			free(conn->model);
 			drmModeFreeConnector(conn->connector);
 			it = drm->connectors.erase(it);
 		} else {
@@ -423,29 +815,16 @@ static bool refresh_state( drm_t *drm )
 		}
 	}
 
-	drmModeFreeResources(resources);
-
-	// Re-probe connectors props and status
-	for (auto &kv : drm->connectors) {
-		struct connector *conn = &kv.second;
-		if (conn->connector != nullptr)
-			drmModeFreeConnector(conn->connector);
-
-		conn->connector = drmModeGetConnector(drm->fd, conn->id);
-		if (conn->connector == nullptr) {
-			drm_log.errorf_errno("drmModeGetConnector failed");
-			return false;
-		}
-
-		if (!get_object_properties(drm, conn->id, DRM_MODE_OBJECT_CONNECTOR, conn->props, conn->initial_prop_values)) {
-			return false;
-		}
-
-		/* sort modes by preference: preferred flag, then highest area, then
-		 * highest refresh rate */
-		std::stable_sort(conn->connector->modes, conn->connector->modes + conn->connector->count_modes, compare_modes);
+	// Swap in the new connectors props and status
+	for (auto &probed : probe->connectors) {
+		struct connector *conn = &drm->connectors[probed.id];
 
-		parse_edid(drm, conn);
+		std::swap(conn->connector, probed.connector);
+		std::swap(conn->make, probed.make);
+		std::swap(conn->model, probed.model);
+		memcpy(conn->make_pnp, probed.make_pnp, sizeof(conn->make_pnp));
+		conn->props = std::move(probed.props);
+		conn->initial_prop_values = std::move(probed.prop_values);
 
 		if ( conn->name != nullptr )
 			continue;
@@ -458,9 +837,7 @@ static bool refresh_state( drm_t *drm )
 		snprintf(name, sizeof(name), "%s-%d", type_str, conn->connector->connector_type_id);
 		conn->name = strdup(name);
 
-		conn->possible_crtcs = drmModeConnectorGetPossibleCrtcs(drm->fd, conn->connector);
-		if (!conn->possible_crtcs)
-			drm_log.errorf_errno("drmModeConnectorGetPossibleCrtcs failed");
+		conn->possible_crtcs = probed.possible_crtcs;
 
 		conn->current.crtc_id = conn->initial_prop_values["CRTC_ID"];
 
@@ -473,9 +850,8 @@ static bool refresh_state( drm_t *drm )
 
 	for (size_t i = 0; i < drm->crtcs.size(); i++) {
 		struct crtc *crtc = &drm->crtcs[i];
-		if (!get_object_properties(drm, crtc->id, DRM_MODE_OBJECT_CRTC, crtc->props, crtc->initial_prop_values)) {
-			return false;
-		}
+		crtc->props = std::move(probe->crtcs[i].props);
+		crtc->initial_prop_values = std::move(probe->crtcs[i].prop_values);
 
 		crtc->has_gamma_lut = (crtc->props.find( "GAMMA_LUT" ) != crtc->props.end());
 		if (!crtc->has_gamma_lut)
@@ -497,11 +873,20 @@ static bool refresh_state( drm_t *drm )
 
 	for (size_t i = 0; i < drm->planes.size(); i++) {
 		struct plane *plane = &drm->planes[i];
-		if (!get_object_properties(drm, plane->id, DRM_MODE_OBJECT_PLANE, plane->props, plane->initial_prop_values)) {
-			return false;
-		}
+		plane->props = std::move(probe->planes[i].props);
+		plane->initial_prop_values = std::move(probe->planes[i].prop_values);
 	}
 
+	drm_free_state_probe(probe);
+}
+
+static bool refresh_state( drm_t *drm )
+{
+	struct drm_state_probe *probe = drm_probe_state(drm);
+	if (probe == nullptr)
+		return false;
+
+	drm_apply_state(drm, probe);
 	return true;
 }
 
@@ -669,6 +1054,10 @@ static bool setup_best_connector(struct drm_t *drm, bool force)
 		if (conn->connector->connection != DRM_MODE_CONNECTED)
 			continue;
 
+		// Not a display, see find_writeback_connector
+		if (conn->connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK)
+			continue;
+
 		if (drm->force_internal && drm_get_connector_type(conn->connector) == DRM_SCREEN_TYPE_EXTERNAL)
 			continue;
 
@@ -731,6 +1120,8 @@ static bool setup_best_connector(struct drm_t *drm, bool force)
 
 	best->target_refresh = mode->vrefresh;
 
+	drm_build_mode_table(drm, best, mode);
+
 	if (!drm_set_mode(drm, mode)) {
 		return false;
 	}
@@ -788,7 +1179,13 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 
 	drm->device_name = nullptr;
 	dev_t dev_id = 0;
-	if (vulkan_primary_dev_id(&dev_id)) {
+	if (const char *device_override = getenv("GAMESCOPE_DRM_DEVICE")) {
+		// e.g. a display-only device like vkms to scan out from the primary
+		// GPU's buffers, or "fake" for --drm-benchmark without any display
+		drm->device_name = strdup(device_override);
+		drm_log.infof("opening DRM node '%s' (GAMESCOPE_DRM_DEVICE)", drm->device_name);
+	}
+	else if (vulkan_primary_dev_id(&dev_id)) {
 		drmDevice *drm_dev = nullptr;
 		if (drmGetDeviceFromDevId(dev_id, 0, &drm_dev) != 0) {
 			drm_log.errorf("Failed to find DRM device with device ID %" PRIu64, (uint64_t)dev_id);
@@ -803,6 +1200,11 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 		drm_log.infof("warning: picking an arbitrary DRM device");
 	}
 
+#if HAVE_DRM_BENCHMARK
+	if ( drm_fake_requested() )
+		drm->fd = drm_fake_open( drm->device_name );
+	else
+#endif
 	drm->fd = wlsession_open_kms( drm->device_name );
 	if ( drm->fd < 0 )
 	{
@@ -815,6 +1217,13 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 		return false;
 	}
 
+	// Writeback connectors only show up once we ask for them. Routing the
+	// CRTC to one takes a modeset, so it's opt-in.
+	if (is_writeback_capture_enabled()) {
+		if (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1) != 0)
+			drm_log.infof("drmSetClientCap(WRITEBACK_CONNECTORS) failed, capture will composite");
+	}
+
 	if (drmGetCap(drm->fd, DRM_CAP_CURSOR_WIDTH, &drm->cursor_width) != 0) {
 		drm->cursor_width = 64;
 	}
@@ -838,8 +1247,17 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 	drm->lo_device = liftoff_device_create( drm->fd );
 	if ( drm->lo_device == nullptr )
 		return false;
-	if ( liftoff_device_register_all_planes( drm->lo_device ) < 0 )
-		return false;
+	// One by one, so that the mirror output can take its primary plane away
+	// from libliftoff
+	for ( auto &plane : drm->planes )
+	{
+		plane.lo_plane = liftoff_plane_create( drm->lo_device, plane.id );
+		if ( plane.lo_plane == nullptr )
+			return false;
+	}
+
+	if ( g_bUseLayers )
+		drm_start_liftoff_prevalidation( drm );
 
 	drm_log.infof("Connectors:");
 	for (const auto &kv : drm->connectors) {
@@ -858,6 +1276,8 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 		return false;
 	}
 
+	drm_update_mirror(drm);
+
 	// Fetch formats which can be scanned out
 	for (size_t i = 0; i < drm->planes.size(); i++) {
 		struct plane *plane = &drm->planes[i];
@@ -880,6 +1300,8 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_
 	std::thread flip_handler_thread( flip_handler_thread_run );
 	flip_handler_thread.detach();
 
+	drm_start_hotplug_thread( drm );
+
 	if (g_bUseLayers) {
 		liftoff_log_set_priority(g_bDebugLayers ? LIFTOFF_DEBUG : LIFTOFF_ERROR);
 	}
@@ -925,6 +1347,8 @@ static int add_plane_property(drmModeAtomicReq *req, struct plane *plane, const
 
 void finish_drm(struct drm_t *drm)
 {
+	drm_stop_liftoff_prevalidation( drm );
+
 	// Disable all connectors, CRTCs and planes. This is necessary to leave a
 	// clean KMS state behind. Some other KMS clients might not support all of
 	// the properties we use, e.g. "rotation" and Xorg don't play well
@@ -985,31 +1409,43 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 
 	assert( drm->req != nullptr );
 
-// 	if (drm->kms_in_fence_fd != -1) {
-// 		add_plane_property(req, plane_id, "IN_FENCE_FD", drm->kms_in_fence_fd);
-// 	}
-
-// 	drm->kms_out_fence_fd = -1;
+	std::unique_lock< std::mutex > queue_lock( drm->flip_lock );
 
-// 	add_crtc_property(req, drm->crtc_id, "OUT_FENCE_PTR",
-// 					  (uint64_t)(unsigned long)&drm->kms_out_fence_fd);
-
-	drm->flip_lock.lock();
+	// Only block once the flip queue is full, the page-flip handler
+	// retires flips and signals us as they land.
+	if ( drm->flips_queued.size() >= (size_t)k_nMaxQueuedFlips )
+	{
+		gpuvis_trace_printf( "flip queue full" );
+		drm->flip_cv.wait( queue_lock, [drm]{ return drm->flips_queued.size() < (size_t)k_nMaxQueuedFlips; } );
+	}
 
 	// Do it before the commit, as otherwise the pageflip handler could
 	// potentially beat us to the refcount checks.
 	for ( uint32_t i = 0; i < drm->fbids_in_req.size(); i++ )
 	{
-		struct fb &fb = get_fb( g_DRM, drm->fbids_in_req[ i ] );
-		assert( fb.held_refs );
-		fb.n_refs++;
+		struct fb *fb = get_fb( g_DRM, drm->fbids_in_req[ i ] );
+		if ( fb == nullptr )
+			continue;
+		assert( fb->held_refs );
+		fb->state++;
 	}
 
-	assert( drm->fbids_queued.size() == 0 );
-	drm->fbids_queued = drm->fbids_in_req;
-
 	g_DRM.flipcount++;
 
+	drm->flips_queued.push_back( { (uint64_t)g_DRM.flipcount, drm->fbids_in_req } );
+
+	// KMS writes the out-fence FD of the flip there during the commit.
+	// References to deque elements stay valid as it grows and shrinks.
+	{
+		struct drm_t::flip &flip = drm->flips_queued.back();
+		flip.out_fence_fd = -1;
+		flip.commit_time = get_time_in_nanos();
+
+		// Async flips can't change anything but FB_ID
+		if ( drm->crtc->props.count( "OUT_FENCE_PTR" ) != 0 && !( drm->flags & DRM_MODE_PAGE_FLIP_ASYNC ) )
+			add_crtc_property( drm->req, drm->crtc, "OUT_FENCE_PTR", (uint64_t)(uintptr_t)&flip.out_fence_fd );
+	}
+
 	drm_verbose_log.debugf("flip commit %" PRIu64, (uint64_t)g_DRM.flipcount);
 	gpuvis_trace_printf( "flip commit %" PRIu64, (uint64_t)g_DRM.flipcount );
 
@@ -1021,7 +1457,6 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 		if ( ret != -EBUSY && ret != -EACCES )
 		{
 			drm_log.errorf( "fatal flip error, aborting" );
-			drm->flip_lock.unlock();
 			abort();
 		}
 
@@ -1040,29 +1475,29 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 		// Undo refcount if the commit didn't actually work
 		for ( uint32_t i = 0; i < drm->fbids_in_req.size(); i++ )
 		{
-			get_fb( g_DRM, drm->fbids_in_req[ i ] ).n_refs--;
+			struct fb *fb = get_fb( g_DRM, drm->fbids_in_req[ i ] );
+			if ( fb != nullptr )
+				fb->state--;
 		}
 
-		drm->fbids_queued.clear();
+		if ( drm->flips_queued.back().out_fence_fd >= 0 )
+			close( drm->flips_queued.back().out_fence_fd );
+		drm->flips_queued.pop_back();
 
 		g_DRM.flipcount--;
 
-		drm->flip_lock.unlock();
-
 		goto out;
 	} else {
+		queue_lock.unlock();
+
 		drm->fbids_in_req.clear();
 
 		drm->current = drm->pending;
 
+		drm_destroy_loose_mode_blobs( drm );
+
 		for ( size_t i = 0; i < drm->crtcs.size(); i++ )
 		{
-			if ( drm->pending.mode_id != drm->current.mode_id )
-				drmModeDestroyPropertyBlob(drm->fd, drm->current.mode_id);
-			if ( drm->pending.gamma_lut_id != drm->current.gamma_lut_id )
-				drmModeDestroyPropertyBlob(drm->fd, drm->current.gamma_lut_id);
-			if ( drm->pending.degamma_lut_id != drm->current.degamma_lut_id )
-				drmModeDestroyPropertyBlob(drm->fd, drm->current.degamma_lut_id);
 			drm->crtcs[i].current = drm->crtcs[i].pending;
 		}
 
@@ -1079,16 +1514,13 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 	// not when it is successfully queued.
 	g_uVblankDrawTimeNS = get_time_in_nanos() - g_SteamCompMgrVBlankTime;
 
-	// Wait for flip handler to unlock
-	drm->flip_lock.lock();
-	drm->flip_lock.unlock();
+	// Don't wait for the flip to land, the next drm_commit blocks instead
+	// if the flip queue is full.
 
-// 	if (drm->kms_in_fence_fd != -1) {
-// 		close(drm->kms_in_fence_fd);
-// 		drm->kms_in_fence_fd = -1;
-// 	}
-//
-// 	drm->kms_in_fence_fd = drm->kms_out_fence_fd;
+	// Frames are only composited into one layer when mirroring, see
+	// drm_mirror_active
+	if ( frameInfo->layerCount == 1 )
+		drm_mirror_flip( drm, &frameInfo->layers[ 0 ] );
 
 out:
 	drmModeAtomicFree( drm->req );
@@ -1147,13 +1579,24 @@ uint32_t drm_fbid_from_dmabuf( struct drm_t *drm, struct wlr_buffer *buf, struct
 
 	/* Nested scope so fb doesn't end up in the out: label */
 	{
-		struct fb &fb = get_fb( *drm, fb_id );
-		assert( fb.held_refs == 0 );
-		fb.id = fb_id;
-		fb.buf = buf;
-		if (!buf)
-			fb.held_refs++;
-		fb.n_refs = 0;
+		std::lock_guard<std::mutex> lock( drm->fb_alloc_lock );
+
+		struct fb *fb = alloc_fb( *drm, fb_id );
+		if ( fb == nullptr )
+		{
+			drm_log.errorf( "Cannot import FB to DRM: too many FBs" );
+			drmModeRmFB( drm->fd, fb_id );
+			fb_id = 0;
+			goto out;
+		}
+
+		fb->buf = buf;
+		fb->held_refs = buf ? 0 : 1;
+		fb->state = 0;
+		fb->next_reclaim = 0;
+		fb->format = dma_buf->format;
+		fb->modifier = dma_buf->modifier;
+		fb->id.store( fb_id, std::memory_order_release );
 	}
 
 out:
@@ -1181,22 +1624,16 @@ out:
 	return fb_id;
 }
 
-void drm_drop_fbid( struct drm_t *drm, uint32_t fbid )
+static void drm_free_fb( struct drm_t *drm, struct fb *fb )
 {
-	struct fb &fb = get_fb( *drm, fbid );
-	assert( fb.held_refs == 0 ||
-	        fb.buf == nullptr );
-
-	fb.held_refs = 0;
-
-	if ( fb.n_refs != 0 )
-	{
-		std::lock_guard<std::mutex> lock( drm->free_queue_lock );
-		drm->fbid_free_queue.push_back( fbid );
-		return;
-	}
-
-	if (drmModeRmFB( drm->fd, fbid ) != 0 )
+	// The kernel hands the ID out again as soon as it's removed, so the slot
+	// has to be gone by then, or drm_fbid_from_dmabuf on another thread
+	// would find it for its new FB
+	uint32_t fb_id = fb->id.load( std::memory_order_relaxed );
+	free_fb_slot( fb );
+	drm->fb_slots_freed++;
+
+	if (drmModeRmFB( drm->fd, fb_id ) != 0 )
 	{
 		drm_log.errorf_errno( "drmModeRmFB failed" );
 	}
@@ -1205,7 +1642,7 @@ void drm_drop_fbid( struct drm_t *drm, uint32_t fbid )
 static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb )
 {
 	assert( fb->held_refs == 0 );
-	assert( fb->n_refs == 0 );
+	assert( ( fb->state & DRM_FB_REFS_MASK ) == 0 );
 
 	if ( fb->buf != nullptr )
 	{
@@ -1215,17 +1652,85 @@ static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb )
 	}
 }
 
+/* Does the unlocking and freeing that was waiting on page-flips */
+static void drm_reclaim_fb( struct drm_t *drm, struct fb *fb, uint32_t state )
+{
+	assert( ( state & DRM_FB_REFS_MASK ) == 0 );
+
+	if ( state & DRM_FB_PENDING_UNLOCK )
+	{
+		drm_verbose_log.debugf( "deferred unlock %u", fb->id.load() );
+		drm_unlock_fb_internal( drm, fb );
+	}
+
+	if ( state & DRM_FB_PENDING_FREE )
+	{
+		drm_verbose_log.debugf( "deferred free %u", fb->id.load() );
+		drm_free_fb( drm, fb );
+	}
+}
+
+/* Marks the FB as needing flag's work once no page-flip uses it anymore.
+ * Returns the work to do right away if that's already the case, 0 if the
+ * page-flip handler will hand it to drm_reclaim_fbs later. */
+static uint32_t drm_fb_defer( struct fb *fb, uint32_t flag )
+{
+	uint32_t old_state = fb->state.fetch_or( flag );
+	if ( ( old_state & DRM_FB_REFS_MASK ) != 0 || ( old_state & DRM_FB_RECLAIM_QUEUED ) )
+		return 0;
+
+	return fb->state.exchange( 0 );
+}
+
+/* Called from the steamcompmgr thread, so that the page-flip handler doesn't
+ * need to take the wlserver lock or call into KMS. */
+void drm_reclaim_fbs( struct drm_t *drm )
+{
+	uint32_t next = drm->fb_reclaim_head.exchange( 0 );
+	while ( next != 0 )
+	{
+		struct fb *fb = &drm->fbs[ next - 1 ];
+		next = fb->next_reclaim;
+
+		drm_reclaim_fb( drm, fb, fb->state.exchange( 0 ) );
+	}
+
+	if ( drm->fb_slots_freed >= k_nMaxFBs / 16 )
+	{
+		drm->fb_slots_freed = 0;
+		drm_compact_fb_slots( drm );
+	}
+}
+
+void drm_drop_fbid( struct drm_t *drm, uint32_t fbid )
+{
+	struct fb *fb = get_fb( *drm, fbid );
+	if ( fb == nullptr )
+		return;
+	assert( fb->held_refs == 0 ||
+	        fb->buf == nullptr );
+
+	fb->held_refs = 0;
+
+	uint32_t state = drm_fb_defer( fb, DRM_FB_PENDING_FREE );
+	if ( state != 0 )
+		drm_reclaim_fb( drm, fb, state );
+}
+
 void drm_lock_fbid( struct drm_t *drm, uint32_t fbid )
 {
-	struct fb &fb = get_fb( *drm, fbid );
-	assert( fb.n_refs == 0 );
+	struct fb *fb = get_fb( *drm, fbid );
+	if ( fb == nullptr )
+		return;
+	// Prevalidation jobs may hold a reference on FBs we lock again
+	assert( !( fb->state & DRM_FB_PENDING_FREE ) );
 
-	if ( fb.held_refs++ == 0 )
+	if ( fb->held_refs++ == 0 )
 	{
-		if ( fb.buf != nullptr )
+		if ( fb->buf != nullptr )
 		{
 			wlserver_lock();
-			wlr_buffer_lock( fb.buf );
+			wlr_buffer_lock( fb->buf );
 			wlserver_unlock();
 		}
 	}
@@ -1233,22 +1738,21 @@ void drm_lock_fbid( struct drm_t *drm, uint32_t fbid )
 
 void drm_unlock_fbid( struct drm_t *drm, uint32_t fbid )
 {
-	struct fb &fb = get_fb( *drm, fbid );
+	struct fb *fb = get_fb( *drm, fbid );
+	if ( fb == nullptr )
+		return;
 
-	assert( fb.held_refs > 0 );
-	if ( --fb.held_refs != 0 )
+	assert( fb->held_refs > 0 );
+	if ( --fb->held_refs != 0 )
 		return;
 
-	if ( fb.n_refs != 0 )
+	/* If the FB isn't being used in any page-flip, free it immediately */
+	uint32_t state = drm_fb_defer( fb, DRM_FB_PENDING_UNLOCK );
+	if ( state != 0 )
 	{
-		std::lock_guard<std::mutex> lock( drm->free_queue_lock );
-		drm->fbid_unlock_queue.push_back( fbid );
-		return;
+		drm_verbose_log.debugf("free fbid %u", fbid);
+		drm_reclaim_fb( drm, fb, state );
 	}
-
-	/* FB isn't being used in any page-flip, free it immediately */
-	drm_verbose_log.debugf("free fbid %u", fbid);
-	drm_unlock_fb_internal( drm, &fb );
 }
 
 /* Handle the orientation of the display */
@@ -1437,16 +1941,28 @@ struct LiftoffStateCacheEntry
 		memset(this, 0, sizeof(LiftoffStateCacheEntry));
 	}
 
+	// A layout is only known to work (or not) on the CRTC, connector
+	// and mode it was tried on.
+	uint32_t crtcId;
+	uint32_t connectorId;
+	int outputWidth, outputHeight, outputRefresh;
+	uint64_t rotation;
+	bool bPartialComposition;
+
     int nLayerCount;
 
 	struct LiftoffLayerState_t
 	{
 		bool ycbcr;
+		bool opaque;
+		bool visible;
 		uint32_t zpos;
 		uint32_t srcW, srcH;
 		uint32_t crtcX, crtcY, crtcW, crtcH;
 		drm_color_encoding colorEncoding;
 		drm_color_range    colorRange;
+		uint32_t format;
+		uint64_t modifier;
 	} layerState[ k_nMaxLayers ];
 
 	bool operator == (const LiftoffStateCacheEntry& entry) const
@@ -1460,10 +1976,19 @@ struct LiftoffStateCacheEntryKasher
 	size_t operator()(const LiftoffStateCacheEntry& k) const
 	{
 		size_t hash = 0;
+		hash_combine(hash, k.crtcId);
+		hash_combine(hash, k.connectorId);
+		hash_combine(hash, k.outputWidth);
+		hash_combine(hash, k.outputHeight);
+		hash_combine(hash, k.outputRefresh);
+		hash_combine(hash, k.rotation);
+		hash_combine(hash, k.bPartialComposition);
 		hash_combine(hash, k.nLayerCount);
 		for ( int i = 0; i < k.nLayerCount; i++ )
 		{
 			hash_combine(hash, k.layerState[i].ycbcr);
+			hash_combine(hash, k.layerState[i].opaque);
+			hash_combine(hash, k.layerState[i].visible);
 			hash_combine(hash, k.layerState[i].zpos);
 			hash_combine(hash, k.layerState[i].srcW);
 			hash_combine(hash, k.layerState[i].srcH);
@@ -1473,57 +1998,190 @@ struct LiftoffStateCacheEntryKasher
 			hash_combine(hash, k.layerState[i].crtcH);
 			hash_combine(hash, k.layerState[i].colorEncoding);
 			hash_combine(hash, k.layerState[i].colorRange);
+			hash_combine(hash, k.layerState[i].format);
+			hash_combine(hash, k.layerState[i].modifier);
 		}
 
 		return hash;
   	}
 };
 
+struct LiftoffStateCacheResult
+{
+	bool bSuccess;
+	// Plane each layer ended up on, 0 if it got composited
+	uint32_t planeIds[ k_nMaxLayers ];
+	uint32_t compositionPlaneId;
+	uint32_t compositedLayers;
+};
+
+// Remembers what libliftoff made of the layouts we've tried, most recently
+// used first. Entries are keyed on CRTC, connector and mode so we can keep
+// them across modesets and hotplugs.
+//
+// The prevalidation thread fills it in too, hence the lock.
+static const size_t k_nMaxLiftoffStateCacheEntries = 256;
+typedef std::list< std::pair< LiftoffStateCacheEntry, LiftoffStateCacheResult > > LiftoffStateCacheList_t;
+static std::mutex g_LiftoffStateCacheLock;
+static LiftoffStateCacheList_t g_LiftoffStateCacheLRU;
+static std::unordered_map< LiftoffStateCacheEntry, LiftoffStateCacheList_t::iterator, LiftoffStateCacheEntryKasher > g_LiftoffStateCache;
+
+static bool liftoff_state_cache_find( const LiftoffStateCacheEntry &entry, LiftoffStateCacheResult *result )
+{
+	std::lock_guard< std::mutex > lock( g_LiftoffStateCacheLock );
+
+	auto iter = g_LiftoffStateCache.find( entry );
+	if ( iter == g_LiftoffStateCache.end() )
+		return false;
 
-std::unordered_set<LiftoffStateCacheEntry, LiftoffStateCacheEntryKasher> g_LiftoffStateCache;
+	g_LiftoffStateCacheLRU.splice( g_LiftoffStateCacheLRU.begin(), g_LiftoffStateCacheLRU, iter->second );
+	if ( result != nullptr )
+		*result = iter->second->second;
+	return true;
+}
 
-LiftoffStateCacheEntry FrameInfoToLiftoffStateCacheEntry( const FrameInfo_t *frameInfo )
+static void liftoff_state_cache_insert( const LiftoffStateCacheEntry &entry, const LiftoffStateCacheResult &result )
 {
-	LiftoffStateCacheEntry entry{};
+	std::lock_guard< std::mutex > lock( g_LiftoffStateCacheLock );
 
-	entry.nLayerCount = frameInfo->layerCount;
-	for ( int i = 0; i < entry.nLayerCount; i++ )
+	auto iter = g_LiftoffStateCache.find( entry );
+	if ( iter != g_LiftoffStateCache.end() )
 	{
-		const uint16_t srcWidth  = frameInfo->layers[ i ].tex->width();
-		const uint16_t srcHeight = frameInfo->layers[ i ].tex->height();
+		iter->second->second = result;
+		g_LiftoffStateCacheLRU.splice( g_LiftoffStateCacheLRU.begin(), g_LiftoffStateCacheLRU, iter->second );
+		return;
+	}
 
-		int32_t crtcX = -frameInfo->layers[ i ].offset.x;
-		int32_t crtcY = -frameInfo->layers[ i ].offset.y;
-		uint64_t crtcW = srcWidth / frameInfo->layers[ i ].scale.x;
-		uint64_t crtcH = srcHeight / frameInfo->layers[ i ].scale.y;
+	if ( g_LiftoffStateCacheLRU.size() >= k_nMaxLiftoffStateCacheEntries )
+	{
+		g_LiftoffStateCache.erase( g_LiftoffStateCacheLRU.back().first );
+		g_LiftoffStateCacheLRU.pop_back();
+	}
 
-		if (g_bRotated)
-		{
-			int64_t imageH = frameInfo->layers[ i ].tex->contentHeight() / frameInfo->layers[ i ].scale.y;
-
-			const int32_t x = crtcX;
-			const uint64_t w = crtcW;
-			crtcX = g_nOutputHeight - imageH - crtcY;
-			crtcY = x;
-			crtcW = crtcH;
-			crtcH = w;
-		}
-
-		entry.layerState[i].zpos  = frameInfo->layers[ i ].zpos;
-		entry.layerState[i].srcW  = srcWidth  << 16;
-		entry.layerState[i].srcH  = srcHeight << 16;
-		entry.layerState[i].crtcX = crtcX;
-		entry.layerState[i].crtcY = crtcY;
-		entry.layerState[i].crtcW = crtcW;
-		entry.layerState[i].crtcH = crtcH;
-		entry.layerState[i].ycbcr = frameInfo->layers[i].isYcbcr();
-		if ( entry.layerState[i].ycbcr )
+	g_LiftoffStateCacheLRU.emplace_front( entry, result );
+	g_LiftoffStateCache[ entry ] = g_LiftoffStateCacheLRU.begin();
+}
+
+static void liftoff_state_cache_clear()
+{
+	std::lock_guard< std::mutex > lock( g_LiftoffStateCacheLock );
+
+	g_LiftoffStateCache.clear();
+	g_LiftoffStateCacheLRU.clear();
+}
+
+// The last couple of layouts liftoff_output_apply succeeded with, so that
+// drm_prepare_liftoff can tell which plane allocation is on screen, see
+// liftoff_layout_serial.
+struct LiftoffLayout_t
+{
+	uint64_t serial;
+	LiftoffStateCacheEntry entry;
+	LiftoffStateCacheResult result;
+};
+
+static LiftoffLayout_t g_LiftoffLayouts[ 2 ];
+static uint64_t g_nLiftoffLayoutSerial = 0;
+
+static const LiftoffLayout_t *find_liftoff_layout( uint64_t serial )
+{
+	if ( serial == 0 )
+		return nullptr;
+
+	for ( const auto &layout : g_LiftoffLayouts )
+	{
+		if ( layout.serial == serial )
+			return &layout;
+	}
+
+	return nullptr;
+}
+
+static uint64_t add_liftoff_layout( const LiftoffStateCacheEntry &entry, const LiftoffStateCacheResult &result )
+{
+	uint64_t serial = ++g_nLiftoffLayoutSerial;
+
+	LiftoffLayout_t &layout = g_LiftoffLayouts[ serial % 2 ];
+	layout.serial = serial;
+	layout.entry = entry;
+	layout.result = result;
+
+	return serial;
+}
+
+static LiftoffStateCacheEntry::LiftoffLayerState_t LayerToLiftoffLayerState( const FrameInfo_t::Layer_t *layer )
+{
+	// Compared with memcmp, so padding needs to be zeroed too
+	LiftoffStateCacheEntry::LiftoffLayerState_t state;
+	memset( &state, 0, sizeof( state ) );
+
+	const uint16_t srcWidth  = layer->tex->width();
+	const uint16_t srcHeight = layer->tex->height();
+
+	int32_t crtcX = -layer->offset.x;
+	int32_t crtcY = -layer->offset.y;
+	uint64_t crtcW = srcWidth / layer->scale.x;
+	uint64_t crtcH = srcHeight / layer->scale.y;
+
+	if (g_bRotated)
+	{
+		int64_t imageH = layer->tex->contentHeight() / layer->scale.y;
+
+		const int32_t x = crtcX;
+		const uint64_t w = crtcW;
+		crtcX = g_nOutputHeight - imageH - crtcY;
+		crtcY = x;
+		crtcW = crtcH;
+		crtcH = w;
+	}
+
+	state.zpos  = layer->zpos;
+	state.srcW  = srcWidth  << 16;
+	state.srcH  = srcHeight << 16;
+	state.crtcX = crtcX;
+	state.crtcY = crtcY;
+	state.crtcW = crtcW;
+	state.crtcH = crtcH;
+	state.ycbcr = layer->isYcbcr();
+	if ( state.ycbcr )
+	{
+		state.colorEncoding = drm_get_color_encoding( g_ForcedNV12ColorSpace );
+		state.colorRange    = drm_get_color_range( g_ForcedNV12ColorSpace );
+	}
+
+	// Planes may be picky about blending, but not about the exact value
+	state.opaque  = layer->opacity >= 1.0f;
+	state.visible = layer->opacity > 0.0f;
+
+	if ( layer->fbid != 0 )
+	{
+		struct fb *fb = get_fb( g_DRM, layer->fbid );
+		if ( fb != nullptr )
 		{
-			entry.layerState[i].colorEncoding = drm_get_color_encoding( g_ForcedNV12ColorSpace );
-			entry.layerState[i].colorRange    = drm_get_color_range( g_ForcedNV12ColorSpace );
+			state.format   = fb->format;
+			state.modifier = fb->modifier;
 		}
 	}
 
+	return state;
+}
+
+LiftoffStateCacheEntry FrameInfoToLiftoffStateCacheEntry( struct drm_t *drm, const FrameInfo_t *frameInfo, bool bPartialComposition )
+{
+	LiftoffStateCacheEntry entry{};
+
+	entry.crtcId = drm->crtc->id;
+	entry.connectorId = drm->connector->id;
+	entry.outputWidth = g_nOutputWidth;
+	entry.outputHeight = g_nOutputHeight;
+	entry.outputRefresh = g_nOutputRefresh;
+	entry.rotation = g_drmEffectiveOrientation;
+	entry.bPartialComposition = bPartialComposition;
+
+	entry.nLayerCount = frameInfo->layerCount;
+	for ( int i = 0; i < entry.nLayerCount; i++ )
+		entry.layerState[i] = LayerToLiftoffLayerState( &frameInfo->layers[ i ] );
+
 	return entry;
 }
 
@@ -1541,310 +2199,1774 @@ static bool is_liftoff_caching_enabled()
 	return !disabled;
 }
 
-static int
-drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, bool needs_modeset )
+static bool is_partial_composition_enabled()
+{
+	static bool disabled = env_to_bool(getenv("GAMESCOPE_PARTIAL_COMPOSITION_DISABLE"));
+	return !disabled;
+}
+
+static void
+drm_set_liftoff_layer( struct liftoff_layer *lo_layer, const LiftoffStateCacheEntry::LiftoffLayerState_t &state, uint32_t fbid, float opacity )
 {
-	auto entry = FrameInfoToLiftoffStateCacheEntry( frameInfo );
+	liftoff_layer_set_property( lo_layer, "FB_ID", fbid );
+
+	liftoff_layer_set_property( lo_layer, "zpos", state.zpos );
+	liftoff_layer_set_property( lo_layer, "alpha", opacity * 0xffff);
 
-	// If we are modesetting, reset the state cache, we might
-	// move to another CRTC or whatever which might have differing caps.
-	// (same with different modes)
-	if (needs_modeset)
-		g_LiftoffStateCache.clear();
+	liftoff_layer_set_property( lo_layer, "SRC_X", 0);
+	liftoff_layer_set_property( lo_layer, "SRC_Y", 0);
+	liftoff_layer_set_property( lo_layer, "SRC_W", state.srcW );
+	liftoff_layer_set_property( lo_layer, "SRC_H", state.srcH );
 
-	if (is_liftoff_caching_enabled())
+	liftoff_layer_set_property( lo_layer, "rotation", g_drmEffectiveOrientation );
+
+	liftoff_layer_set_property( lo_layer, "CRTC_X", state.crtcX);
+	liftoff_layer_set_property( lo_layer, "CRTC_Y", state.crtcY);
+
+	liftoff_layer_set_property( lo_layer, "CRTC_W", state.crtcW);
+	liftoff_layer_set_property( lo_layer, "CRTC_H", state.crtcH);
+
+	if ( state.ycbcr )
 	{
-		if (g_LiftoffStateCache.count(entry) != 0)
-			return -EINVAL;
+		liftoff_layer_set_property( lo_layer, "COLOR_ENCODING", state.colorEncoding );
+		liftoff_layer_set_property( lo_layer, "COLOR_RANGE",    state.colorRange );
 	}
-
-	for ( int i = 0; i < k_nMaxLayers; i++ )
+	else
 	{
-		if ( i < frameInfo->layerCount )
-		{
-			if ( frameInfo->layers[ i ].fbid == 0 )
-			{
-				drm_verbose_log.errorf("drm_prepare_liftoff: layer %d has no FB", i );
-				return -EINVAL;
-			}
-
-			liftoff_layer_set_property( drm->lo_layers[ i ], "FB_ID", frameInfo->layers[ i ].fbid);
-			drm->fbids_in_req.push_back( frameInfo->layers[ i ].fbid );
+		liftoff_layer_unset_property( lo_layer, "COLOR_ENCODING" );
+		liftoff_layer_unset_property( lo_layer, "COLOR_RANGE" );
+	}
+}
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "zpos", entry.layerState[i].zpos );
-			liftoff_layer_set_property( drm->lo_layers[ i ], "alpha", frameInfo->layers[ i ].opacity * 0xffff);
+static struct plane *find_plane_by_id( struct drm_t *drm, uint32_t id )
+{
+	for ( size_t i = 0; i < drm->planes.size(); i++ )
+	{
+		if ( drm->planes[ i ].id == id )
+			return &drm->planes[ i ];
+	}
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_X", 0);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_Y", 0);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_W", entry.layerState[i].srcW );
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_H", entry.layerState[i].srcH );
+	return nullptr;
+}
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "rotation", g_drmEffectiveOrientation );
+/* The layout is the same as the one on screen, so every layer stays on the
+ * same plane with the same geometry: only flip the FBs (and alpha) instead of
+ * having libliftoff search for a plane allocation again. */
+static int
+drm_reuse_liftoff_layout( struct drm_t *drm, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer, const LiftoffStateCacheResult &result )
+{
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
+	{
+		if ( result.planeIds[ i ] == 0 )
+			continue;
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_X", entry.layerState[i].crtcX);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_Y", entry.layerState[i].crtcY);
+		struct plane *plane = find_plane_by_id( drm, result.planeIds[ i ] );
+		if ( plane == nullptr )
+			return -EINVAL;
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_W", entry.layerState[i].crtcW);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "CRTC_H", entry.layerState[i].crtcH);
+		int ret = add_plane_property( drm->req, plane, "FB_ID", frameInfo->layers[ i ].fbid );
+		if ( ret < 0 )
+			return ret;
 
-			if ( entry.layerState[i].ycbcr )
-			{
-				liftoff_layer_set_property( drm->lo_layers[ i ], "COLOR_ENCODING", entry.layerState[i].colorEncoding );
-				liftoff_layer_set_property( drm->lo_layers[ i ], "COLOR_RANGE",    entry.layerState[i].colorRange );
-			}
-			else
-			{
-				liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_ENCODING" );
-				liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_RANGE" );
-			}
-		}
-		else
+		if ( plane->props.count( "alpha" ) != 0 )
 		{
-			liftoff_layer_set_property( drm->lo_layers[ i ], "FB_ID", 0 );
-
-			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_ENCODING" );
-			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_RANGE" );
+			ret = add_plane_property( drm->req, plane, "alpha", frameInfo->layers[ i ].opacity * 0xffff );
+			if ( ret < 0 )
+				return ret;
 		}
 	}
 
-	int ret = liftoff_output_apply( drm->lo_output, drm->req, drm->flags );
-
-	if ( ret == 0 )
+	if ( result.compositedLayers != 0 )
 	{
-		// We don't support partial composition yet
-		if ( liftoff_output_needs_composition( drm->lo_output ) )
-			ret = -EINVAL;
+		struct plane *plane = find_plane_by_id( drm, result.compositionPlaneId );
+		if ( plane == nullptr || compositionLayer == nullptr || compositionLayer->fbid == 0 )
+			return -EINVAL;
+
+		int ret = add_plane_property( drm->req, plane, "FB_ID", compositionLayer->fbid );
+		if ( ret < 0 )
+			return ret;
 	}
 
-	// If we aren't modesetting and we got -EINVAL, that means that we
-	// probably can't do this layout, so add it to our state cache so we don't
-	// try it again.
-	if (!needs_modeset)
+	return 0;
+}
+
+/* Like libliftoff does it: immutable properties are left alone, missing ones
+ * are only a problem if the value isn't the default. */
+static int add_plane_layer_property( drmModeAtomicReq *req, struct plane *plane, const char *name, uint64_t value, uint64_t default_value )
+{
+	auto prop = plane->props.find( name );
+	if ( prop == plane->props.end() )
+		return value == default_value ? 0 : -EINVAL;
+	if ( prop->second->flags & DRM_MODE_PROP_IMMUTABLE )
+		return 0;
+
+	return add_plane_property( req, plane, name, value );
+}
+
+/* What libliftoff would put on the plane for the layer, see
+ * drm_set_liftoff_layer. */
+static int drm_set_plane_layer( struct drm_t *drm, struct plane *plane, const LiftoffStateCacheEntry::LiftoffLayerState_t &state, uint32_t fbid, float opacity )
+{
+	const std::pair< const char *, uint64_t > props[] = {
+		{ "FB_ID", fbid },
+		{ "CRTC_ID", drm->crtc->id },
+		{ "SRC_X", 0 },
+		{ "SRC_Y", 0 },
+		{ "SRC_W", state.srcW },
+		{ "SRC_H", state.srcH },
+		{ "CRTC_X", state.crtcX },
+		{ "CRTC_Y", state.crtcY },
+		{ "CRTC_W", state.crtcW },
+		{ "CRTC_H", state.crtcH },
+	};
+
+	for ( const auto &prop : props )
 	{
-		if (ret == -EINVAL)
-			g_LiftoffStateCache.insert(entry);
+		int ret = add_plane_property( drm->req, plane, prop.first, prop.second );
+		if ( ret < 0 )
+			return ret;
 	}
 
-	if ( ret == 0 )
-		drm_verbose_log.debugf( "can drm present %i layers", frameInfo->layerCount );
-	else
-		drm_verbose_log.debugf( "can NOT drm present %i layers", frameInfo->layerCount );
+	int ret = add_plane_layer_property( drm->req, plane, "zpos", state.zpos, state.zpos );
+	if ( ret >= 0 )
+		ret = add_plane_layer_property( drm->req, plane, "alpha", uint64_t( opacity * 0xffff ), 0xffff );
+	if ( ret >= 0 )
+		ret = add_plane_layer_property( drm->req, plane, "rotation", g_drmEffectiveOrientation, DRM_MODE_ROTATE_0 );
+	if ( ret >= 0 && state.ycbcr )
+	{
+		ret = add_plane_layer_property( drm->req, plane, "COLOR_ENCODING", state.colorEncoding, state.colorEncoding );
+		if ( ret >= 0 )
+			ret = add_plane_layer_property( drm->req, plane, "COLOR_RANGE", state.colorRange, state.colorRange );
+	}
 
-	return ret;
+	return ret < 0 ? ret : 0;
 }
 
-/* Prepares an atomic commit for the provided scene-graph. Returns 0 on success,
- * negative errno on failure or if the scene-graph can't be presented directly. */
-int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo )
+/* The layout worked before, on an earlier frame or in the prevalidation
+ * thread: put every layer back on the plane it got then and check that with
+ * a single TEST_ONLY commit, instead of having libliftoff search for a plane
+ * allocation again. */
+static int
+drm_apply_liftoff_layout( struct drm_t *drm, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer,
+	const LiftoffStateCacheEntry::LiftoffLayerState_t &compositionState, const LiftoffStateCacheEntry &entry, const LiftoffStateCacheResult &result )
 {
-	if (!(drm->connector)){
-		return -EACCES;
+	if ( result.compositedLayers != 0 && ( compositionLayer == nullptr || compositionLayer->fbid == 0 ) )
+		return -EINVAL;
+
+	for ( auto &plane : drm->planes )
+	{
+		// The mirror output's, see drm_update_mirror
+		if ( plane.lo_plane == nullptr )
+			continue;
+
+		int layer = -1;
+		for ( int i = 0; i < frameInfo->layerCount; i++ )
+		{
+			if ( result.planeIds[ i ] == plane.id )
+				layer = i;
+		}
+
+		int ret;
+		if ( layer >= 0 )
+			ret = drm_set_plane_layer( drm, &plane, entry.layerState[ layer ], frameInfo->layers[ layer ].fbid, frameInfo->layers[ layer ].opacity );
+		else if ( result.compositedLayers != 0 && result.compositionPlaneId == plane.id )
+			ret = drm_set_plane_layer( drm, &plane, compositionState, compositionLayer->fbid, 1.0f );
+		else
+		{
+			ret = add_plane_property( drm->req, &plane, "FB_ID", 0 );
+			if ( ret >= 0 )
+				ret = add_plane_property( drm->req, &plane, "CRTC_ID", 0 );
+		}
+
+		if ( ret < 0 )
+			return ret;
 	}
-	
-	drm->pending.screen_type = drm_get_screen_type(drm);
 
-	drm_update_gamma_lut(drm);
-	drm_update_degamma_lut(drm);
-	drm_update_color_mtx(drm);
-	drm_update_vrr_state(drm);
+	unsigned test_flags = ( drm->flags & DRM_MODE_ATOMIC_ALLOW_MODESET ) | DRM_MODE_ATOMIC_TEST_ONLY;
+	return drmModeAtomicCommit( drm->fd, drm->req, test_flags, nullptr );
+}
 
-	drm->fbids_in_req.clear();
+/* Works out which layers liftoff_output_apply left for us to composite into
+ * the composition layer, returns -EINVAL if we can't do that. */
+static int
+liftoff_get_composited_layers( struct liftoff_output *lo_output, struct liftoff_layer *const *lo_layers, const LiftoffStateCacheEntry &entry, uint32_t *composited_layers )
+{
+	*composited_layers = 0;
 
-	bool needs_modeset = drm->needs_modeset.exchange(false);
+	if ( !liftoff_output_needs_composition( lo_output ) )
+		return 0;
 
-	assert( drm->req == nullptr );
-	drm->req = drmModeAtomicAlloc();
+	if ( !entry.bPartialComposition )
+		return -EINVAL;
 
-	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+	// The composition layer sits on top, so we can only composite
+	// the top-most layers: everything above the lowest composited
+	// layer must be composited too.
+	uint32_t composited = 0;
+	uint32_t minComposedZpos = UINT32_MAX;
+	uint32_t maxPlaneZpos = 0;
+	bool bHasPlaneLayer = false;
+	for ( int i = 0; i < entry.nLayerCount; i++ )
+	{
+		if ( liftoff_layer_needs_composition( lo_layers[ i ] ) )
+		{
+			composited |= 1u << i;
+			minComposedZpos = std::min( minComposedZpos, entry.layerState[ i ].zpos );
+		}
+		else
+		{
+			maxPlaneZpos = std::max( maxPlaneZpos, entry.layerState[ i ].zpos );
+			bHasPlaneLayer = true;
+		}
+	}
 
-	// We do internal refcounting with these events
-	flags |= DRM_MODE_PAGE_FLIP_EVENT;
+	// If nothing got a plane, the caller is better off compositing
+	// everything the usual way.
+	if ( !bHasPlaneLayer || maxPlaneZpos > minComposedZpos )
+		return -EINVAL;
 
-	if ( async )
-		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	*composited_layers = composited;
+	return 0;
+}
 
-	if ( needs_modeset ) {
-		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+static LiftoffStateCacheResult
+liftoff_get_result( int ret, const LiftoffStateCacheEntry &entry, struct liftoff_layer *const *lo_layers, struct liftoff_layer *lo_composition_layer, uint32_t composited_layers )
+{
+	LiftoffStateCacheResult result;
+	memset( &result, 0, sizeof( result ) );
 
-		// Disable all connectors and CRTCs
+	result.bSuccess = ret == 0;
+	if ( result.bSuccess )
+	{
+		for ( int i = 0; i < entry.nLayerCount; i++ )
+			result.planeIds[ i ] = liftoff_layer_get_plane_id( lo_layers[ i ] );
+		if ( composited_layers != 0 )
+			result.compositionPlaneId = liftoff_layer_get_plane_id( lo_composition_layer );
+		result.compositedLayers = composited_layers;
+	}
 
-		for ( auto &kv : drm->connectors ) {
-			struct connector *conn = &kv.second;
+	return result;
+}
 
-			if ( conn->current.crtc_id == 0 )
-				continue;
+static bool is_liftoff_prevalidation_enabled()
+{
+	static bool disabled = env_to_bool(getenv("GAMESCOPE_LIFTOFF_PREVALIDATION_DISABLE"));
+	return !disabled;
+}
 
-			conn->pending.crtc_id = 0;
-			int ret = add_connector_property( drm->req, conn, "CRTC_ID", 0 );
-			if (ret < 0)
-				return ret;
-		}
-		for ( size_t i = 0; i < drm->crtcs.size(); i++ ) {
-			struct crtc *crtc = &drm->crtcs[i];
+static bool liftoff_state_cache_contains( const LiftoffStateCacheEntry &entry )
+{
+	std::lock_guard< std::mutex > lock( g_LiftoffStateCacheLock );
+	return g_LiftoffStateCache.count( entry ) != 0;
+}
 
-			// We can't disable a CRTC if it's already disabled, or else the
-			// kernel will error out with "requesting event but off".
-			if (crtc->current.active == 0)
-				continue;
+/* A layout we expect to show up soon. The prevalidation thread tries it with
+ * its own libliftoff device, so that the state cache already has the answer
+ * by the time drm_prepare_liftoff gets there: it skips layouts known not to
+ * work, and puts the layers of the others straight on the planes found here,
+ * see drm_apply_liftoff_layout.
+ *
+ * A queued job holds a reference on its FBs, like a page-flip would, see
+ * liftoff_prevalidation_ref_fbs. Jobs are dropped as soon as the scene
+ * changes shape again, so client buffers aren't held past that. */
+struct LiftoffPrevalidationJob_t
+{
+	LiftoffStateCacheEntry entry;
+	uint32_t fbids[ k_nMaxLayers ];
+	float opacities[ k_nMaxLayers ];
+	uint32_t compositionFbid;
+	LiftoffStateCacheEntry::LiftoffLayerState_t compositionState;
+};
 
-			if (add_crtc_property(drm->req, crtc, "MODE_ID", 0) < 0)
-				return false;
-			if (crtc->has_gamma_lut)
-			{
-				int ret = add_crtc_property(drm->req, crtc, "GAMMA_LUT", 0);
-				if (ret < 0)
-					return ret;
-			}
-			if (crtc->has_degamma_lut)
-			{
-				int ret = add_crtc_property(drm->req, crtc, "DEGAMMA_LUT", 0);
-				if (ret < 0)
-					return ret;
-			}
-			if (crtc->has_ctm)
-			{
-				int ret = add_crtc_property(drm->req, crtc, "CTM", 0);
-				if (ret < 0)
-					return ret;
-			}
-			if (crtc->has_vrr_enabled)
-			{
-				int ret = add_crtc_property(drm->req, crtc, "VRR_ENABLED", 0);
-				if (ret < 0)
-					return ret;
-			}
+static const size_t k_nMaxLiftoffPrevalidationJobs = 8;
+static std::mutex g_LiftoffPrevalidationLock;
+static std::condition_variable g_LiftoffPrevalidationCV;
+static std::deque< LiftoffPrevalidationJob_t > g_LiftoffPrevalidationJobs;
+static bool g_bLiftoffPrevalidation = false;
+static bool g_bLiftoffPrevalidationStop = false;
+static std::thread g_LiftoffPrevalidationThread;
+
+/* The plane the mirror output took away from libliftoff, which the
+ * prevalidation thread has to take out of its device too, and a serial bumped
+ * whenever that changes so that it doesn't cache results from before. */
+static uint32_t g_nLiftoffMirrorPlane = 0;
+static uint64_t g_nLiftoffMirrorSerial = 0;
+
+/* The last layer we've seen at each zpos above the base layers, those are
+ * the ones which come and go. */
+struct LiftoffRecentLayer_t
+{
+	uint32_t fbid;
+	float opacity;
+	LiftoffStateCacheEntry::LiftoffLayerState_t state;
+};
+static LiftoffRecentLayer_t g_LiftoffRecentLayers[ g_zposCursor + 1 ];
 
-			int ret = add_crtc_property(drm->req, crtc, "ACTIVE", 0);
-			if (ret < 0)
-				return ret;
-			crtc->pending.active = 0;
+struct LiftoffPrevalidator_t
+{
+	struct liftoff_device *lo_device;
+	struct liftoff_output *lo_output;
+	struct liftoff_layer *lo_layers[ k_nMaxLayers ];
+	struct liftoff_layer *lo_composition_layer;
+	uint32_t crtc_id;
+	/* Our handle for each plane, nullptr for the mirror output's */
+	std::vector< std::pair< uint32_t, struct liftoff_plane * > > lo_planes;
+	uint64_t mirror_serial;
+};
+
+/* libliftoff disables every plane it knows of and doesn't use, so with the
+ * mirror output's primary plane registered every test commit would fail
+ * while its CRTC is on. */
+static void liftoff_prevalidator_sync_planes( LiftoffPrevalidator_t *v, uint32_t mirror_plane, uint64_t mirror_serial )
+{
+	if ( v->mirror_serial == mirror_serial )
+		return;
+
+	for ( auto &lo_plane : v->lo_planes )
+	{
+		if ( lo_plane.first == mirror_plane && lo_plane.second != nullptr )
+		{
+			liftoff_plane_destroy( lo_plane.second );
+			lo_plane.second = nullptr;
+		}
+		else if ( lo_plane.first != mirror_plane && lo_plane.second == nullptr )
+		{
+			lo_plane.second = liftoff_plane_create( v->lo_device, lo_plane.first );
+			if ( lo_plane.second == nullptr )
+				drm_log.errorf( "failed to give plane %u back to the prevalidation thread", lo_plane.first );
 		}
+	}
 
-		// Then enable the one we've picked
+	v->mirror_serial = mirror_serial;
+}
 
-		int ret = 0;
+static bool liftoff_prevalidator_set_crtc( LiftoffPrevalidator_t *v, uint32_t crtc_id )
+{
+	if ( v->crtc_id == crtc_id && v->lo_output != nullptr )
+		return true;
 
-		// Always set our CRTC_ID for the modeset, especially
-		// as we zero-ed it above.
-		drm->connector->pending.crtc_id = drm->crtc->id;
-		ret = add_connector_property(drm->req, drm->connector, "CRTC_ID", drm->crtc->id);
-		if (ret < 0)
-			return ret;
+	for ( int i = 0; i < k_nMaxLayers; i++ )
+	{
+		liftoff_layer_destroy( v->lo_layers[ i ] );
+		v->lo_layers[ i ] = nullptr;
+	}
+	liftoff_layer_destroy( v->lo_composition_layer );
+	v->lo_composition_layer = nullptr;
+	liftoff_output_destroy( v->lo_output );
 
-		ret = add_crtc_property(drm->req, drm->crtc, "MODE_ID", drm->pending.mode_id);
-		if (ret < 0)
-			return ret;
+	// Only set once everything is there, so that we try again next time
+	v->crtc_id = 0;
+	v->lo_output = liftoff_output_create( v->lo_device, crtc_id );
+	if ( v->lo_output == nullptr )
+		return false;
 
-		if (drm->crtc->has_gamma_lut)
+	for ( int i = 0; i < k_nMaxLayers; i++ )
+	{
+		v->lo_layers[ i ] = liftoff_layer_create( v->lo_output );
+		if ( v->lo_layers[ i ] == nullptr )
+			return false;
+	}
+
+	v->lo_composition_layer = liftoff_layer_create( v->lo_output );
+	if ( v->lo_composition_layer == nullptr )
+		return false;
+	liftoff_output_set_composition_layer( v->lo_output, v->lo_composition_layer );
+
+	v->crtc_id = crtc_id;
+	return true;
+}
+
+/* Takes a reference on the FB like a page-flip does, so that it isn't
+ * removed until the matching drm_fb_flip_unref. Fails if it's already on
+ * its way out. */
+static bool drm_fb_try_ref( struct fb *fb )
+{
+	uint32_t old_state = fb->state.load();
+	do
+	{
+		if ( old_state & ~DRM_FB_REFS_MASK )
+			return false;
+	}
+	while ( !fb->state.compare_exchange_weak( old_state, old_state + 1 ) );
+
+	return true;
+}
+
+/* A FB being removed while we test with it fails the commit as well, which
+ * says nothing about the layout, and KMS hands its ID out again right away.
+ * So jobs keep their FBs around until they're done. */
+static bool liftoff_prevalidation_ref_fbs( struct drm_t *drm, const LiftoffPrevalidationJob_t &job )
+{
+	uint32_t fbids[ k_nMaxLayers + 1 ];
+	int count = 0;
+	for ( int i = 0; i < job.entry.nLayerCount; i++ )
+		fbids[ count++ ] = job.fbids[ i ];
+	if ( job.compositionFbid != 0 )
+		fbids[ count++ ] = job.compositionFbid;
+
+	struct fb *fbs[ k_nMaxLayers + 1 ];
+	for ( int i = 0; i < count; i++ )
+	{
+		fbs[ i ] = find_fb( *drm, fbids[ i ] );
+		if ( fbs[ i ] != nullptr && drm_fb_try_ref( fbs[ i ] ) )
+			continue;
+
+		// Only drop the ones we got
+		bool bReclaim = false;
+		while ( i-- > 0 )
 		{
-			ret = add_crtc_property(drm->req, drm->crtc, "GAMMA_LUT", drm->pending.gamma_lut_id);
-			if (ret < 0)
-				return false;
+			if ( drm_fb_flip_unref( drm, fbs[ i ] ) )
+				bReclaim = true;
 		}
+		if ( bReclaim )
+			nudge_steamcompmgr();
+		return false;
+	}
 
-		if (drm->crtc->has_degamma_lut)
+	return true;
+}
+
+static void liftoff_prevalidation_unref_fbs( struct drm_t *drm, const LiftoffPrevalidationJob_t &job )
+{
+	bool bReclaim = false;
+	for ( int i = 0; i < job.entry.nLayerCount; i++ )
+	{
+		struct fb *fb = find_fb( *drm, job.fbids[ i ] );
+		if ( fb != nullptr && drm_fb_flip_unref( drm, fb ) )
+			bReclaim = true;
+	}
+
+	if ( job.compositionFbid != 0 )
+	{
+		struct fb *fb = find_fb( *drm, job.compositionFbid );
+		if ( fb != nullptr && drm_fb_flip_unref( drm, fb ) )
+			bReclaim = true;
+	}
+
+	// drm_reclaim_fbs runs on the steamcompmgr thread
+	if ( bReclaim )
+		nudge_steamcompmgr();
+}
+
+static int liftoff_prevalidate( LiftoffPrevalidator_t *v, const LiftoffPrevalidationJob_t &job, uint32_t *composited_layers )
+{
+	*composited_layers = 0;
+
+	if ( !liftoff_prevalidator_set_crtc( v, job.entry.crtcId ) )
+		return -ENOMEM;
+
+	uint32_t maxZpos = 0;
+	for ( int i = 0; i < k_nMaxLayers; i++ )
+	{
+		if ( i < job.entry.nLayerCount )
 		{
-			ret = add_crtc_property(drm->req, drm->crtc, "DEGAMMA_LUT", drm->pending.degamma_lut_id);
-			if (ret < 0)
-				return false;
+			drm_set_liftoff_layer( v->lo_layers[ i ], job.entry.layerState[ i ], job.fbids[ i ], job.opacities[ i ] );
+			maxZpos = std::max( maxZpos, job.entry.layerState[ i ].zpos );
 		}
+		else
+		{
+			liftoff_layer_set_property( v->lo_layers[ i ], "FB_ID", 0 );
 
-		if (drm->crtc->has_ctm)
+			liftoff_layer_unset_property( v->lo_layers[ i ], "COLOR_ENCODING" );
+			liftoff_layer_unset_property( v->lo_layers[ i ], "COLOR_RANGE" );
+		}
+	}
+
+	if ( job.compositionFbid != 0 )
+	{
+		auto compositionState = job.compositionState;
+		compositionState.zpos = maxZpos + 1;
+
+		drm_set_liftoff_layer( v->lo_composition_layer, compositionState, job.compositionFbid, 1.0f );
+	}
+	else
+	{
+		liftoff_layer_set_property( v->lo_composition_layer, "FB_ID", 0 );
+	}
+
+	// libliftoff only does TEST_ONLY commits itself, the request is
+	// thrown away.
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	int ret = liftoff_output_apply( v->lo_output, req, DRM_MODE_ATOMIC_NONBLOCK );
+	drmModeAtomicFree( req );
+
+	if ( ret == 0 )
+		ret = liftoff_get_composited_layers( v->lo_output, v->lo_layers, job.entry, composited_layers );
+
+	return ret;
+}
+
+static void liftoff_prevalidation_thread_run( struct drm_t *drm, LiftoffPrevalidator_t *v )
+{
+	pthread_setname_np( pthread_self(), "gamescope-lval" );
+
+	while ( true )
+	{
+		LiftoffPrevalidationJob_t job;
+		uint32_t mirror_plane;
+		uint64_t mirror_serial;
 		{
-			ret = add_crtc_property(drm->req, drm->crtc, "CTM", drm->pending.ctm_id);
-			if (ret < 0)
-				return false;
+			std::unique_lock< std::mutex > lock( g_LiftoffPrevalidationLock );
+			g_LiftoffPrevalidationCV.wait( lock, []{ return !g_LiftoffPrevalidationJobs.empty() || g_bLiftoffPrevalidationStop; } );
+
+			if ( g_bLiftoffPrevalidationStop )
+				break;
+
+			job = g_LiftoffPrevalidationJobs.front();
+			g_LiftoffPrevalidationJobs.pop_front();
+
+			mirror_plane = g_nLiftoffMirrorPlane;
+			mirror_serial = g_nLiftoffMirrorSerial;
 		}
 
-		if (drm->crtc->has_vrr_enabled)
+		liftoff_prevalidator_sync_planes( v, mirror_plane, mirror_serial );
+
+		// The compositor might have gotten there first, and the layer
+		// state doesn't carry the rotation
+		if ( !liftoff_state_cache_contains( job.entry ) && job.entry.rotation == g_drmEffectiveOrientation )
 		{
-			ret = add_crtc_property(drm->req, drm->crtc, "VRR_ENABLED", drm->pending.vrr_enabled);
-			if (ret < 0)
-				return false;
+			uint32_t composited_layers = 0;
+			int ret = liftoff_prevalidate( v, job, &composited_layers );
+
+			if ( ret == 0 || ret == -EINVAL )
+			{
+				// Not if the mirror output came or went in the meantime
+				std::lock_guard< std::mutex > lock( g_LiftoffPrevalidationLock );
+				if ( mirror_serial == g_nLiftoffMirrorSerial )
+					liftoff_state_cache_insert( job.entry, liftoff_get_result( ret, job.entry, v->lo_layers, v->lo_composition_layer, composited_layers ) );
+
+				gpuvis_trace_printf( "liftoff layout prevalidated: %s", ret == 0 ? "ok" : "failed" );
+				drm_verbose_log.debugf( "prevalidated %i layers: %s", job.entry.nLayerCount, ret == 0 ? "ok" : "failed" );
+			}
 		}
 
-		ret = add_crtc_property(drm->req, drm->crtc, "ACTIVE", 1);
-		if (ret < 0)
-			return false;
-		drm->crtc->pending.active = 1;
+		liftoff_prevalidation_unref_fbs( drm, job );
 	}
-	else
+
+	liftoff_device_destroy( v->lo_device );
+	delete v;
+}
+
+static void drm_start_liftoff_prevalidation( struct drm_t *drm )
+{
+	if ( !is_liftoff_caching_enabled() || !is_liftoff_prevalidation_enabled() )
+		return;
+
+	// A separate device, so that the thread never touches the libliftoff
+	// state drm_prepare_liftoff is using.
+	struct liftoff_device *lo_device = liftoff_device_create( drm->fd );
+	if ( lo_device == nullptr )
+		return;
+
+	// One by one like drm_prepare_liftoff's, so that the mirror output's
+	// primary plane can be taken out of both devices.
+	LiftoffPrevalidator_t *v = new LiftoffPrevalidator_t{};
+	v->lo_device = lo_device;
+	for ( const auto &plane : drm->planes )
 	{
-		if ( drm->crtc->has_gamma_lut && drm->pending.gamma_lut_id != drm->current.gamma_lut_id )
+		struct liftoff_plane *lo_plane = liftoff_plane_create( lo_device, plane.id );
+		if ( lo_plane == nullptr )
 		{
-			int ret = add_crtc_property(drm->req, drm->crtc, "GAMMA_LUT", drm->pending.gamma_lut_id);
-			if (ret < 0)
-				return ret;
+			liftoff_device_destroy( lo_device );
+			delete v;
+			return;
 		}
+		v->lo_planes.push_back( { plane.id, lo_plane } );
+	}
 
-		if ( drm->crtc->has_degamma_lut && drm->pending.degamma_lut_id != drm->current.degamma_lut_id )
+	g_LiftoffPrevalidationThread = std::thread( liftoff_prevalidation_thread_run, drm, v );
+
+	g_bLiftoffPrevalidation = true;
+}
+
+/* Before drm->fd and the FBs go away, the thread uses both. */
+static void drm_stop_liftoff_prevalidation( struct drm_t *drm )
+{
+	if ( !g_bLiftoffPrevalidation )
+		return;
+
+	{
+		std::lock_guard< std::mutex > lock( g_LiftoffPrevalidationLock );
+
+		g_bLiftoffPrevalidation = false;
+		g_bLiftoffPrevalidationStop = true;
+
+		for ( const auto &job : g_LiftoffPrevalidationJobs )
+			liftoff_prevalidation_unref_fbs( drm, job );
+		g_LiftoffPrevalidationJobs.clear();
+	}
+	g_LiftoffPrevalidationCV.notify_one();
+
+	g_LiftoffPrevalidationThread.join();
+}
+
+/* Hands the mirror output's primary plane over from libliftoff, or back with
+ * 0. Everything tested or cached so far was with the other set of planes. */
+static void liftoff_set_mirror_plane( struct drm_t *drm, uint32_t plane_id )
+{
+	std::lock_guard< std::mutex > lock( g_LiftoffPrevalidationLock );
+
+	g_nLiftoffMirrorPlane = plane_id;
+	g_nLiftoffMirrorSerial++;
+
+	for ( const auto &job : g_LiftoffPrevalidationJobs )
+		liftoff_prevalidation_unref_fbs( drm, job );
+	g_LiftoffPrevalidationJobs.clear();
+
+	liftoff_state_cache_clear();
+}
+
+static void liftoff_prevalidation_remove_layer( LiftoffPrevalidationJob_t *job, int index )
+{
+	LiftoffStateCacheEntry &entry = job->entry;
+
+	for ( int i = index; i < entry.nLayerCount - 1; i++ )
+	{
+		entry.layerState[ i ] = entry.layerState[ i + 1 ];
+		job->fbids[ i ] = job->fbids[ i + 1 ];
+		job->opacities[ i ] = job->opacities[ i + 1 ];
+	}
+
+	entry.nLayerCount--;
+
+	// The entry is compared with memcmp
+	memset( &entry.layerState[ entry.nLayerCount ], 0, sizeof( entry.layerState[ entry.nLayerCount ] ) );
+	job->fbids[ entry.nLayerCount ] = 0;
+	job->opacities[ entry.nLayerCount ] = 0.0f;
+}
+
+static void liftoff_prevalidation_insert_layer( LiftoffPrevalidationJob_t *job, const LiftoffRecentLayer_t &layer )
+{
+	LiftoffStateCacheEntry &entry = job->entry;
+
+	int index = 0;
+	while ( index < entry.nLayerCount && entry.layerState[ index ].zpos < layer.state.zpos )
+		index++;
+
+	for ( int i = entry.nLayerCount; i > index; i-- )
+	{
+		entry.layerState[ i ] = entry.layerState[ i - 1 ];
+		job->fbids[ i ] = job->fbids[ i - 1 ];
+		job->opacities[ i ] = job->opacities[ i - 1 ];
+	}
+
+	entry.layerState[ index ] = layer.state;
+	job->fbids[ index ] = layer.fbid;
+	job->opacities[ index ] = layer.opacity;
+	entry.nLayerCount++;
+}
+
+/* Queues the layouts we're likely to go to from this one for the
+ * prevalidation thread: one of the layers on top going away, or one we've
+ * seen lately (cursor, overlay, notification...) coming back. */
+static void drm_prevalidate_liftoff_layouts( struct drm_t *drm, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer, const LiftoffStateCacheEntry &entry )
+{
+	if ( !g_bLiftoffPrevalidation )
+		return;
+
+	LiftoffPrevalidationJob_t current;
+	current.entry = entry;
+	memset( current.fbids, 0, sizeof( current.fbids ) );
+	memset( current.opacities, 0, sizeof( current.opacities ) );
+	memset( &current.compositionState, 0, sizeof( current.compositionState ) );
+	current.compositionFbid = 0;
+
+	bool bSeen[ g_zposCursor + 1 ] = {};
+	for ( int i = 0; i < entry.nLayerCount; i++ )
+	{
+		current.fbids[ i ] = frameInfo->layers[ i ].fbid;
+		current.opacities[ i ] = frameInfo->layers[ i ].opacity;
+
+		int zpos = frameInfo->layers[ i ].zpos;
+		if ( zpos >= (int)g_zposOverride && zpos <= (int)g_zposCursor )
 		{
-			int ret = add_crtc_property(drm->req, drm->crtc, "DEGAMMA_LUT", drm->pending.degamma_lut_id);
-			if (ret < 0)
-				return ret;
+			g_LiftoffRecentLayers[ zpos ] = { current.fbids[ i ], current.opacities[ i ], entry.layerState[ i ] };
+			bSeen[ zpos ] = true;
 		}
+	}
 
-		if ( drm->crtc->has_ctm && drm->pending.ctm_id != drm->current.ctm_id )
+	if ( entry.bPartialComposition )
+	{
+		current.compositionFbid = compositionLayer->fbid;
+		current.compositionState = LayerToLiftoffLayerState( compositionLayer );
+	}
+
+	std::vector< LiftoffPrevalidationJob_t > jobs;
+
+	for ( int i = 1; i < entry.nLayerCount; i++ )
+	{
+		LiftoffPrevalidationJob_t job = current;
+		liftoff_prevalidation_remove_layer( &job, i );
+		jobs.push_back( job );
+	}
+
+	for ( uint32_t zpos = g_zposOverride; zpos <= g_zposCursor && entry.nLayerCount < k_nMaxLayers; zpos++ )
+	{
+		LiftoffRecentLayer_t &layer = g_LiftoffRecentLayers[ zpos ];
+		if ( bSeen[ zpos ] || layer.fbid == 0 )
+			continue;
+
+		// Only FBs still around, we're the ones removing them
+		struct fb *fb = find_fb( *drm, layer.fbid );
+		if ( fb == nullptr || ( fb->state & ( DRM_FB_PENDING_UNLOCK | DRM_FB_PENDING_FREE ) ) )
 		{
-			int ret = add_crtc_property(drm->req, drm->crtc, "CTM", drm->pending.ctm_id);
-			if (ret < 0)
-				return ret;
+			layer.fbid = 0;
+			continue;
 		}
 
-		if ( drm->crtc->has_vrr_enabled && drm->pending.vrr_enabled != drm->current.vrr_enabled )
+		LiftoffPrevalidationJob_t job = current;
+		liftoff_prevalidation_insert_layer( &job, layer );
+		jobs.push_back( job );
+	}
+
+	{
+		std::unique_lock< std::mutex > lock( g_LiftoffPrevalidationLock );
+
+		// Whatever was queued was a guess from a layout we already left
+		for ( const auto &job : g_LiftoffPrevalidationJobs )
+			liftoff_prevalidation_unref_fbs( drm, job );
+		g_LiftoffPrevalidationJobs.clear();
+
+		for ( const auto &job : jobs )
 		{
-			int ret = add_crtc_property(drm->req, drm->crtc, "VRR_ENABLED", drm->pending.vrr_enabled );
-			if (ret < 0)
-				return ret;
+			if ( g_LiftoffPrevalidationJobs.size() >= k_nMaxLiftoffPrevalidationJobs )
+				break;
+			if ( liftoff_state_cache_contains( job.entry ) )
+				continue;
+			if ( !liftoff_prevalidation_ref_fbs( drm, job ) )
+				continue;
+
+			g_LiftoffPrevalidationJobs.push_back( job );
 		}
 	}
 
-	drm->flags = flags;
+	g_LiftoffPrevalidationCV.notify_one();
+}
 
-	int ret;
-	if ( g_bUseLayers == true ) {
-		ret = drm_prepare_liftoff( drm, frameInfo, needs_modeset );
-	} else {
-		ret = drm_prepare_basic( drm, frameInfo );
+/* The pending state for a layout we didn't have libliftoff work out, see
+ * drm_reuse_liftoff_layout and drm_apply_liftoff_layout. */
+static void
+drm_use_liftoff_layout( struct drm_t *drm, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer, const LiftoffStateCacheEntry &entry, const LiftoffStateCacheResult &result )
+{
+	drm->pending_composited_layers = result.compositedLayers;
+	if ( result.compositedLayers != 0 )
+		drm->fbids_in_req.push_back( compositionLayer->fbid );
+
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
+	{
+		if ( drm->cursor_plane != nullptr && result.planeIds[ i ] == drm->cursor_plane->id )
+		{
+			drm->pending.cursor_fb_id = frameInfo->layers[ i ].fbid;
+			drm->pending.cursor_x = entry.layerState[ i ].crtcX;
+			drm->pending.cursor_y = entry.layerState[ i ].crtcY;
+		}
 	}
+}
 
-	if ( ret != 0 ) {
-		drmModeAtomicFree( drm->req );
-		drm->req = nullptr;
+static int
+drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer, bool needs_modeset )
+{
+	// Whatever liftoff can't put on a plane gets composited into this layer,
+	// which we put on top of everything else.
+	bool bCanCompose = compositionLayer != nullptr && compositionLayer->fbid != 0 && is_partial_composition_enabled();
+
+	// More than we have liftoff layers for, that's for the compositor
+	if ( frameInfo->layerCount > k_nMaxLayers )
+	{
+		drm_verbose_log.debugf("drm_prepare_liftoff: cannot handle %d layers", frameInfo->layerCount);
+		return -EINVAL;
+	}
+
+	auto entry = FrameInfoToLiftoffStateCacheEntry( drm, frameInfo, bCanCompose );
+
+	// Modesetting might change what the CRTC can do in ways that
+	// aren't part of the key, don't trust the cache until it's done.
+	bool bUseCache = is_liftoff_caching_enabled() && !needs_modeset;
+
+	LiftoffStateCacheResult cached;
+	bool bCached = bUseCache && liftoff_state_cache_find( entry, &cached );
+	if ( bCached && !cached.bSuccess )
+		return -EINVAL;
+
+	uint32_t maxZpos = 0;
+
+	for ( int i = 0; i < k_nMaxLayers; i++ )
+	{
+		if ( i < frameInfo->layerCount )
+		{
+			if ( frameInfo->layers[ i ].fbid == 0 )
+			{
+				drm_verbose_log.errorf("drm_prepare_liftoff: layer %d has no FB", i );
+				return -EINVAL;
+			}
+
+			drm_set_liftoff_layer( drm->lo_layers[ i ], entry.layerState[ i ], frameInfo->layers[ i ].fbid, frameInfo->layers[ i ].opacity );
+			drm->fbids_in_req.push_back( frameInfo->layers[ i ].fbid );
+
+			maxZpos = std::max( maxZpos, entry.layerState[ i ].zpos );
+		}
+		else
+		{
+			liftoff_layer_set_property( drm->lo_layers[ i ], "FB_ID", 0 );
+
+			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_ENCODING" );
+			liftoff_layer_unset_property( drm->lo_layers[ i ], "COLOR_RANGE" );
+		}
+	}
+
+	LiftoffStateCacheEntry::LiftoffLayerState_t compositionState{};
+	if ( bCanCompose )
+	{
+		compositionState = LayerToLiftoffLayerState( compositionLayer );
+		compositionState.zpos = maxZpos + 1;
+
+		drm_set_liftoff_layer( drm->lo_composition_layer, compositionState, compositionLayer->fbid, 1.0f );
+	}
+	else
+	{
+		liftoff_layer_set_property( drm->lo_composition_layer, "FB_ID", 0 );
+	}
+
+	drm->pending_composited_layers = 0;
+
+	// We still keep the liftoff layers up to date above, so liftoff has the
+	// right idea of things the next time we go through it.
+	const LiftoffLayout_t *currentLayout = find_liftoff_layout( drm->current.liftoff_layout_serial );
+	int reqCursor = drmModeAtomicGetCursor( drm->req );
+	if ( bUseCache && currentLayout != nullptr && currentLayout->entry == entry &&
+	     drm_reuse_liftoff_layout( drm, frameInfo, compositionLayer, currentLayout->result ) == 0 )
+	{
+		drm_use_liftoff_layout( drm, frameInfo, compositionLayer, entry, currentLayout->result );
+		drm->pending.liftoff_layout_serial = currentLayout->serial;
+
+		gpuvis_trace_printf( "liftoff layout reused" );
+		drm_verbose_log.debugf( "can drm present %i layers (%i composited, same layout)", frameInfo->layerCount, __builtin_popcount( drm->pending_composited_layers ) );
+
+		return 0;
+	}
+
+	// drm_reuse_liftoff_layout may have bailed out half-way
+	drmModeAtomicSetCursor( drm->req, reqCursor );
+
+	if ( bCached && drm_apply_liftoff_layout( drm, frameInfo, compositionLayer, compositionState, entry, cached ) == 0 )
+	{
+		drm_use_liftoff_layout( drm, frameInfo, compositionLayer, entry, cached );
+		drm->pending.liftoff_layout_serial = add_liftoff_layout( entry, cached );
+
+		gpuvis_trace_printf( "liftoff layout from cache" );
+		drm_verbose_log.debugf( "can drm present %i layers (%i composited, cached layout)", frameInfo->layerCount, __builtin_popcount( drm->pending_composited_layers ) );
+
+		return 0;
+	}
+
+	// Gone stale, e.g. the FBs aren't quite what they were when it got
+	// tested, have libliftoff work it out from scratch
+	drmModeAtomicSetCursor( drm->req, reqCursor );
+
+	int ret = liftoff_output_apply( drm->lo_output, drm->req, drm->flags );
+
+	if ( ret == 0 )
+	{
+		ret = liftoff_get_composited_layers( drm->lo_output, drm->lo_layers, entry, &drm->pending_composited_layers );
+		if ( ret == 0 && drm->pending_composited_layers != 0 )
+			drm->fbids_in_req.push_back( compositionLayer->fbid );
+	}
+
+	if ( ret == 0 && drm->cursor_plane != nullptr )
+	{
+		// Remember whether the cursor got the cursor plane to itself, so that
+		// drm_update_cursor can move it around without a full commit.
+		for ( int i = 0; i < frameInfo->layerCount; i++ )
+		{
+			if ( frameInfo->layers[ i ].zpos != (int)g_zposCursor )
+				continue;
+
+			if ( liftoff_layer_get_plane_id( drm->lo_layers[ i ] ) == drm->cursor_plane->id )
+			{
+				drm->pending.cursor_fb_id = frameInfo->layers[ i ].fbid;
+				drm->pending.cursor_x = entry.layerState[ i ].crtcX;
+				drm->pending.cursor_y = entry.layerState[ i ].crtcY;
+			}
+			break;
+		}
+	}
+
+	// Only remember what we got a definite answer for: -EINVAL means
+	// that we probably can't do this layout, so we don't try it again.
+	if ( ret == 0 || ret == -EINVAL )
+	{
+		LiftoffStateCacheResult result = liftoff_get_result( ret, entry, drm->lo_layers, drm->lo_composition_layer, drm->pending_composited_layers );
+
+		if ( bUseCache )
+		{
+			liftoff_state_cache_insert( entry, result );
+
+			// The scene just changed shape, have a go at what it might
+			// look like next while we're busy with this one.
+			drm_prevalidate_liftoff_layouts( drm, frameInfo, compositionLayer, entry );
+		}
+
+		if ( result.bSuccess )
+			drm->pending.liftoff_layout_serial = add_liftoff_layout( entry, result );
+	}
+
+	if ( ret == 0 )
+		drm_verbose_log.debugf( "can drm present %i layers (%i composited)", frameInfo->layerCount, __builtin_popcount( drm->pending_composited_layers ) );
+	else
+		drm_verbose_log.debugf( "can NOT drm present %i layers", frameInfo->layerCount );
+
+	return ret;
+}
+
+/* Routes the CRTC to the writeback connector as part of a modeset that's
+ * happening anyway, if the driver takes it, so that captures never need a
+ * modeset of their own. See drm_prepare_writeback. */
+static void drm_route_writeback( struct drm_t *drm )
+{
+	struct connector *conn = drm->writeback_connector;
+	if ( conn == nullptr || drm->req == nullptr )
+		return;
+
+	int cursor = drmModeAtomicGetCursor( drm->req );
+
+	int ret = add_connector_property( drm->req, conn, "CRTC_ID", drm->crtc->id );
+	if ( ret >= 0 )
+		ret = drmModeAtomicCommit( drm->fd, drm->req, DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_TEST_ONLY, nullptr );
+
+	if ( ret != 0 )
+	{
+		drmModeAtomicSetCursor( drm->req, cursor );
+		drm_log.infof( "driver won't route the CRTC to the writeback connector, capture will composite" );
+		return;
+	}
+
+	conn->pending.crtc_id = drm->crtc->id;
+}
+
+/* Prepares an atomic commit for the provided scene-graph. Returns 0 on success,
+ * negative errno on failure or if the scene-graph can't be presented directly.
+ *
+ * If compositionLayer is provided, layers that can't be put on a plane may be
+ * left for the caller to composite into it, see drm_get_composited_layers. */
+int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer )
+{
+	if (!(drm->connector)){
+		return -EACCES;
+	}
+	
+	drm->pending.screen_type = drm_get_screen_type(drm);
+
+	drm_update_gamma_lut(drm);
+	drm_update_degamma_lut(drm);
+	drm_update_color_mtx(drm);
+	drm_update_vrr_state(drm);
+
+	drm->fbids_in_req.clear();
+
+	drm->pending.cursor_fb_id = 0;
+	drm->pending.liftoff_layout_serial = 0;
+	drm->pending_composited_layers = 0;
+
+	bool needs_modeset = drm->needs_modeset.exchange(false);
+	drm->req_needs_modeset = needs_modeset;
+
+	assert( drm->req == nullptr );
+	drm->req = drmModeAtomicAlloc();
+
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+
+	// We do internal refcounting with these events
+	flags |= DRM_MODE_PAGE_FLIP_EVENT;
+
+	// Async flips can only change planes' FB_ID, a mode switch has to go
+	// through a regular flip or the kernel rejects the whole commit.
+	if ( async && !needs_modeset && drm->pending.mode_id == drm->current.mode_id )
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+	if ( needs_modeset ) {
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		// Disable all connectors and CRTCs, except the mirror output's,
+		// which it commits on its own
+
+		for ( auto &kv : drm->connectors ) {
+			struct connector *conn = &kv.second;
+
+			if ( conn->current.crtc_id == 0 || conn == drm->mirror.connector )
+				continue;
+
+			conn->pending.crtc_id = 0;
+			int ret = add_connector_property( drm->req, conn, "CRTC_ID", 0 );
+			if (ret < 0)
+				return ret;
+		}
+		for ( size_t i = 0; i < drm->crtcs.size(); i++ ) {
+			struct crtc *crtc = &drm->crtcs[i];
+
+			// We can't disable a CRTC if it's already disabled, or else the
+			// kernel will error out with "requesting event but off".
+			if (crtc->current.active == 0 || crtc == drm->mirror.crtc)
+				continue;
+
+			if (add_crtc_property(drm->req, crtc, "MODE_ID", 0) < 0)
+				return false;
+			if (crtc->has_gamma_lut)
+			{
+				int ret = add_crtc_property(drm->req, crtc, "GAMMA_LUT", 0);
+				if (ret < 0)
+					return ret;
+			}
+			if (crtc->has_degamma_lut)
+			{
+				int ret = add_crtc_property(drm->req, crtc, "DEGAMMA_LUT", 0);
+				if (ret < 0)
+					return ret;
+			}
+			if (crtc->has_ctm)
+			{
+				int ret = add_crtc_property(drm->req, crtc, "CTM", 0);
+				if (ret < 0)
+					return ret;
+			}
+			if (crtc->has_vrr_enabled)
+			{
+				int ret = add_crtc_property(drm->req, crtc, "VRR_ENABLED", 0);
+				if (ret < 0)
+					return ret;
+			}
+
+			int ret = add_crtc_property(drm->req, crtc, "ACTIVE", 0);
+			if (ret < 0)
+				return ret;
+			crtc->pending.active = 0;
+		}
+
+		// Then enable the one we've picked
+
+		int ret = 0;
+
+		// Always set our CRTC_ID for the modeset, especially
+		// as we zero-ed it above.
+		drm->connector->pending.crtc_id = drm->crtc->id;
+		ret = add_connector_property(drm->req, drm->connector, "CRTC_ID", drm->crtc->id);
+		if (ret < 0)
+			return ret;
+
+		ret = add_crtc_property(drm->req, drm->crtc, "MODE_ID", drm->pending.mode_id);
+		if (ret < 0)
+			return ret;
+
+		if (drm->crtc->has_gamma_lut)
+		{
+			ret = add_crtc_property(drm->req, drm->crtc, "GAMMA_LUT", drm->pending.gamma_lut_id);
+			if (ret < 0)
+				return false;
+		}
+
+		if (drm->crtc->has_degamma_lut)
+		{
+			ret = add_crtc_property(drm->req, drm->crtc, "DEGAMMA_LUT", drm->pending.degamma_lut_id);
+			if (ret < 0)
+				return false;
+		}
+
+		if (drm->crtc->has_ctm)
+		{
+			ret = add_crtc_property(drm->req, drm->crtc, "CTM", drm->pending.ctm_id);
+			if (ret < 0)
+				return false;
+		}
+
+		if (drm->crtc->has_vrr_enabled)
+		{
+			ret = add_crtc_property(drm->req, drm->crtc, "VRR_ENABLED", drm->pending.vrr_enabled);
+			if (ret < 0)
+				return false;
+		}
+
+		ret = add_crtc_property(drm->req, drm->crtc, "ACTIVE", 1);
+		if (ret < 0)
+			return false;
+		drm->crtc->pending.active = 1;
+	}
+	else
+	{
+		// Switching to a mode the driver can do without a modeset, see
+		// drm_is_mode_switch_seamless
+		if ( drm->pending.mode_id != drm->current.mode_id )
+		{
+			int ret = add_crtc_property(drm->req, drm->crtc, "MODE_ID", drm->pending.mode_id);
+			if (ret < 0)
+				return ret;
+		}
+
+		if ( drm->crtc->has_gamma_lut && drm->pending.gamma_lut_id != drm->current.gamma_lut_id )
+		{
+			int ret = add_crtc_property(drm->req, drm->crtc, "GAMMA_LUT", drm->pending.gamma_lut_id);
+			if (ret < 0)
+				return ret;
+		}
+
+		if ( drm->crtc->has_degamma_lut && drm->pending.degamma_lut_id != drm->current.degamma_lut_id )
+		{
+			int ret = add_crtc_property(drm->req, drm->crtc, "DEGAMMA_LUT", drm->pending.degamma_lut_id);
+			if (ret < 0)
+				return ret;
+		}
+
+		if ( drm->crtc->has_ctm && drm->pending.ctm_id != drm->current.ctm_id )
+		{
+			int ret = add_crtc_property(drm->req, drm->crtc, "CTM", drm->pending.ctm_id);
+			if (ret < 0)
+				return ret;
+		}
+
+		if ( drm->crtc->has_vrr_enabled && drm->pending.vrr_enabled != drm->current.vrr_enabled )
+		{
+			int ret = add_crtc_property(drm->req, drm->crtc, "VRR_ENABLED", drm->pending.vrr_enabled );
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	drm->flags = flags;
+
+	int ret;
+	if ( g_bUseLayers == true ) {
+		ret = drm_prepare_liftoff( drm, frameInfo, compositionLayer, needs_modeset );
+	} else {
+		ret = drm_prepare_basic( drm, frameInfo );
+	}
+
+	if ( ret != 0 ) {
+		drmModeAtomicFree( drm->req );
+		drm->req = nullptr;
+
+		drm->fbids_in_req.clear();
+
+		if ( needs_modeset )
+			drm->needs_modeset = true;
+	}
+	else if ( needs_modeset )
+	{
+		drm_route_writeback( drm );
+	}
+
+	return ret;
+}
+
+void drm_rollback( struct drm_t *drm )
+{
+	// Drop the prepared commit if we decided not to go through with it
+	if ( drm->req != nullptr )
+	{
+		drmModeAtomicFree( drm->req );
+		drm->req = nullptr;
+
+		drm->fbids_in_req.clear();
+	}
+
+	drm->pending_composited_layers = 0;
+
+	drm->pending = drm->current;
+
+	for ( size_t i = 0; i < drm->crtcs.size(); i++ )
+	{
+		drm->crtcs[i].pending = drm->crtcs[i].current;
+	}
+
+	for (auto &kv : drm->connectors) {
+		struct connector *conn = &kv.second;
+		conn->pending = conn->current;
+	}
+}
+
+/* Drops a successfully prepared commit without touching what the commit was
+ * going to apply, unlike drm_rollback: the next drm_prepare picks up the
+ * pending mode and the modeset again. */
+void drm_drop_prepared( struct drm_t *drm )
+{
+	if ( drm->req == nullptr )
+		return;
+
+	drmModeAtomicFree( drm->req );
+	drm->req = nullptr;
+
+	drm->fbids_in_req.clear();
+
+	drm->pending_composited_layers = 0;
+
+	if ( drm->req_needs_modeset )
+		drm->needs_modeset = true;
+	drm->req_needs_modeset = false;
+
+	// Only drm_prepare touches these
+	for ( size_t i = 0; i < drm->crtcs.size(); i++ )
+	{
+		drm->crtcs[i].pending = drm->crtcs[i].current;
+	}
+
+	for (auto &kv : drm->connectors) {
+		struct connector *conn = &kv.second;
+		conn->pending = conn->current;
+	}
+}
+
+uint32_t drm_get_composited_layers( struct drm_t *drm )
+{
+	return drm->pending_composited_layers;
+}
+
+bool drm_has_cursor_plane( struct drm_t *drm )
+{
+	return drm->cursor_plane != nullptr;
+}
+
+/* Name of the connector to mirror the main output to, if any */
+static const char *drm_get_mirror_output_name( void )
+{
+	const char *name = getenv( "GAMESCOPE_MIRROR_OUTPUT" );
+	return ( name && *name ) ? name : nullptr;
+}
+
+bool drm_mirror_requested( void )
+{
+	return drm_get_mirror_output_name() != nullptr;
+}
+
+/* The mirror output can only show a single FB, so every frame needs to be
+ * composited while it's up. */
+bool drm_mirror_active( struct drm_t *drm )
+{
+	return drm->mirror.connector != nullptr;
+}
+
+/* Whether a page-flip, of the main or mirror output, or a prevalidation job
+ * still uses the FB. */
+bool drm_fbid_in_flight( struct drm_t *drm, uint32_t fbid )
+{
+	struct fb *fb = find_fb( *drm, fbid );
+	return fb != nullptr && ( fb->state.load() & DRM_FB_REFS_MASK ) != 0;
+}
+
+/* Blocks until a flip, of the main or mirror output, lets go of one of the
+ * FBs, for when every one of them is still in flight. Returns the index of
+ * the first free one, or -1 if none freed up in time. */
+int drm_wait_for_free_fbid( struct drm_t *drm, const std::vector< uint32_t > &fbids )
+{
+	int nFree = -1;
+
+	std::unique_lock< std::mutex > lock( drm->flip_lock );
+	drm->flip_cv.wait_for( lock, std::chrono::milliseconds( 100 ), [drm, &fbids, &nFree]
+	{
+		for ( size_t i = 0; i < fbids.size(); i++ )
+		{
+			if ( !drm_fbid_in_flight( drm, fbids[ i ] ) )
+			{
+				nFree = i;
+				return true;
+			}
+		}
+		return false;
+	});
+
+	return nFree;
+}
+
+/* Turns the mirror output off and gives its primary plane back to
+ * libliftoff. */
+static void drm_mirror_disable( struct drm_t *drm, bool connector_gone )
+{
+	struct drm_mirror *mirror = &drm->mirror;
+	if ( mirror->connector == nullptr )
+		return;
+
+	{
+		std::unique_lock< std::mutex > lock( drm->flip_lock );
+		drm->flip_cv.wait( lock, [mirror]{ return mirror->fbid_pending == 0; } );
+	}
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	add_plane_property( req, mirror->primary, "FB_ID", 0 );
+	add_plane_property( req, mirror->primary, "CRTC_ID", 0 );
+	if ( mirror->crtc->current.active )
+	{
+		// The kernel already unlinked it if it's gone
+		if ( !connector_gone )
+			add_connector_property( req, mirror->connector, "CRTC_ID", 0 );
+		add_crtc_property( req, mirror->crtc, "MODE_ID", 0 );
+		add_crtc_property( req, mirror->crtc, "ACTIVE", 0 );
+	}
+
+	if ( drmModeAtomicCommit( drm->fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr ) != 0 )
+		drm_log.errorf_errno( "failed to turn off mirror output" );
+	drmModeAtomicFree( req );
+
+	mirror->connector->current.crtc_id = mirror->connector->pending.crtc_id = 0;
+	mirror->crtc->current.active = mirror->crtc->pending.active = 0;
+
+	{
+		std::lock_guard< std::mutex > lock( drm->flip_lock );
+		struct fb *fb = mirror->fbid_on_screen != 0 ? get_fb( *drm, mirror->fbid_on_screen ) : nullptr;
+		if ( fb != nullptr )
+			drm_fb_flip_unref( drm, fb );
+		mirror->fbid_on_screen = 0;
+	}
+
+	if ( mirror->mode_id != 0 )
+		drmModeDestroyPropertyBlob( drm->fd, mirror->mode_id );
+
+	mirror->primary->lo_plane = liftoff_plane_create( drm->lo_device, mirror->primary->id );
+	if ( mirror->primary->lo_plane == nullptr )
+		drm_log.errorf( "failed to give plane %u back to libliftoff", mirror->primary->id );
+	liftoff_set_mirror_plane( drm, 0 );
+
+	drm_log.infof( "stopped mirroring to '%s', %" PRIu64 " frames dropped", mirror->connector->name, mirror->dropped_frames );
+
+	*mirror = {};
+}
+
+/* Sets up the mirror output on GAMESCOPE_MIRROR_OUTPUT if it's connected,
+ * with a CRTC and primary plane the main output isn't using. */
+static void drm_update_mirror( struct drm_t *drm )
+{
+	const char *name = drm_get_mirror_output_name();
+	if ( name == nullptr || drm->crtc == nullptr )
+		return;
+
+	struct connector *conn = nullptr;
+	for ( auto &kv : drm->connectors )
+	{
+		struct connector *candidate = &kv.second;
+		if ( candidate != drm->connector && strcmp( candidate->name, name ) == 0 &&
+		     candidate->connector->connection == DRM_MODE_CONNECTED )
+			conn = candidate;
+	}
+
+	struct drm_mirror *mirror = &drm->mirror;
+	if ( conn != nullptr && conn == mirror->connector && mirror->crtc != drm->crtc )
+		return;
+
+	drm_mirror_disable( drm, false );
+
+	if ( conn == nullptr )
+		return;
+
+	struct crtc *crtc = nullptr;
+	int crtc_index = -1;
+	for ( size_t i = 0; i < drm->crtcs.size(); i++ )
+	{
+		if ( ( conn->possible_crtcs & ( 1 << i ) ) && &drm->crtcs[ i ] != drm->crtc )
+		{
+			crtc = &drm->crtcs[ i ];
+			crtc_index = i;
+			break;
+		}
+	}
+	if ( crtc == nullptr )
+	{
+		drm_log.errorf( "no free CRTC to mirror to '%s'", conn->name );
+		return;
+	}
+
+	struct plane *primary = nullptr;
+	for ( auto &plane : drm->planes )
+	{
+		if ( &plane == drm->primary || !( plane.plane->possible_crtcs & ( 1 << crtc_index ) ) )
+			continue;
+
+		if ( plane.initial_prop_values[ "type" ] == DRM_PLANE_TYPE_PRIMARY )
+		{
+			primary = &plane;
+			break;
+		}
+	}
+	if ( primary == nullptr )
+	{
+		drm_log.errorf( "no primary plane to mirror to '%s'", conn->name );
+		return;
+	}
+
+	const drmModeModeInfo *mode = find_mode( conn->connector, 0, 0, 0 );
+	if ( mode == nullptr )
+	{
+		drm_log.errorf( "no mode to mirror to '%s'", conn->name );
+		return;
+	}
+
+	uint32_t mode_id = 0;
+	if ( drmModeCreatePropertyBlob( drm->fd, mode, sizeof( *mode ), &mode_id ) != 0 )
+	{
+		drm_log.errorf_errno( "drmModeCreatePropertyBlob failed" );
+		return;
+	}
+
+	// libliftoff would turn the plane off in every commit of the main output,
+	// and in the prevalidation thread's tests
+	liftoff_plane_destroy( primary->lo_plane );
+	primary->lo_plane = nullptr;
+	liftoff_set_mirror_plane( drm, primary->id );
+
+	mirror->connector = conn;
+	mirror->crtc = crtc;
+	mirror->primary = primary;
+	mirror->mode = *mode;
+	mirror->mode_id = mode_id;
+	mirror->needs_modeset = true;
+
+	drm_log.infof( "mirroring to '%s' on CRTC %" PRIu32 " at %dx%d@%d", conn->name, crtc->id, mode->hdisplay, mode->vdisplay, mode->vrefresh );
+}
+
+/* Puts the layer on the mirror output, unless it's still busy flipping to
+ * the previous one. Must be called after the main output's commit. */
+static void drm_mirror_flip( struct drm_t *drm, const FrameInfo_t::Layer_t *layer )
+{
+	struct drm_mirror *mirror = &drm->mirror;
+	if ( mirror->connector == nullptr || layer->tex == nullptr || layer->fbid == 0 )
+		return;
+
+	std::unique_lock< std::mutex > lock( drm->flip_lock );
+
+	if ( mirror->fbid_pending != 0 )
+	{
+		mirror->dropped_frames++;
+		return;
+	}
+
+	struct fb *fb = get_fb( *drm, layer->fbid );
+	if ( fb == nullptr )
+		return;
+
+	// Fit the frame into the mode, keeping its aspect ratio
+	uint64_t width = layer->tex->width();
+	uint64_t height = layer->tex->height();
+	uint64_t crtc_w = mirror->mode.hdisplay;
+	uint64_t crtc_h = mirror->mode.vdisplay;
+	if ( width * crtc_h > height * crtc_w )
+		crtc_h = height * crtc_w / width;
+	else
+		crtc_w = width * crtc_h / height;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+
+	if ( mirror->needs_modeset )
+	{
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+		add_connector_property( req, mirror->connector, "CRTC_ID", mirror->crtc->id );
+		add_crtc_property( req, mirror->crtc, "MODE_ID", mirror->mode_id );
+		add_crtc_property( req, mirror->crtc, "ACTIVE", 1 );
+	}
+
+	add_plane_property( req, mirror->primary, "FB_ID", layer->fbid );
+	add_plane_property( req, mirror->primary, "CRTC_ID", mirror->crtc->id );
+	add_plane_property( req, mirror->primary, "SRC_X", 0 );
+	add_plane_property( req, mirror->primary, "SRC_Y", 0 );
+	add_plane_property( req, mirror->primary, "SRC_W", width << 16 );
+	add_plane_property( req, mirror->primary, "SRC_H", height << 16 );
+	add_plane_property( req, mirror->primary, "CRTC_X", ( mirror->mode.hdisplay - crtc_w ) / 2 );
+	add_plane_property( req, mirror->primary, "CRTC_Y", ( mirror->mode.vdisplay - crtc_h ) / 2 );
+	add_plane_property( req, mirror->primary, "CRTC_W", crtc_w );
+	add_plane_property( req, mirror->primary, "CRTC_H", crtc_h );
+
+	// The main output already holds the FB, this keeps it around for as
+	// long as the mirror output shows it
+	fb->state++;
+	mirror->fbid_pending = layer->fbid;
+
+	int ret = drmModeAtomicCommit( drm->fd, req, flags, (void *)k_uMirrorFlipCookie );
+	drmModeAtomicFree( req );
+
+	if ( ret != 0 )
+	{
+		fb->state--;
+		mirror->fbid_pending = 0;
+
+		if ( ret == -EBUSY )
+		{
+			mirror->dropped_frames++;
+			return;
+		}
+
+		drm_log.errorf( "mirror flip failed: %s", strerror( -ret ) );
+
+		lock.unlock();
+		drm_mirror_disable( drm, false );
+		return;
+	}
+
+	if ( mirror->needs_modeset )
+	{
+		mirror->connector->current.crtc_id = mirror->connector->pending.crtc_id = mirror->crtc->id;
+		mirror->crtc->current.active = mirror->crtc->pending.active = 1;
+		mirror->needs_modeset = false;
+	}
+}
+
+/* Page-flip event of the mirror output, on the gamescope-kms thread */
+static void drm_mirror_page_flip( struct drm_t *drm, uint64_t vblanktime )
+{
+	struct drm_mirror *mirror = &drm->mirror;
+	bool bReclaim = false;
+
+	{
+		std::lock_guard< std::mutex > lock( drm->flip_lock );
+
+		struct fb *fb = mirror->fbid_on_screen != 0 ? get_fb( *drm, mirror->fbid_on_screen ) : nullptr;
+		if ( fb != nullptr && drm_fb_flip_unref( drm, fb ) )
+			bReclaim = true;
+
+		mirror->fbid_on_screen = mirror->fbid_pending;
+		mirror->fbid_pending = 0;
+
+		if ( mirror->last_vblank != 0 )
+			drm_verbose_log.debugf( "mirror flip, %" PRIu64 "us since the last one", ( vblanktime - mirror->last_vblank ) / 1'000lu );
+		mirror->last_vblank = vblanktime;
+	}
+
+	drm->flip_cv.notify_all();
+
+	if ( bReclaim )
+		nudge_steamcompmgr();
+}
+
+/* Whether drm_prepare_writeback can capture into a linear FB of the given
+ * format. */
+bool drm_supports_writeback( struct drm_t *drm, uint32_t format )
+{
+	// Writeback captures what the CRTC scans out, which is sideways when
+	// we rotate.
+	if ( drm->writeback_connector == nullptr || g_bRotated )
+		return false;
+
+	if ( std::find( drm->writeback_formats.begin(), drm->writeback_formats.end(), format ) == drm->writeback_formats.end() )
+		return false;
+
+	return wlr_drm_format_set_has( &drm->formats, format, DRM_FORMAT_MOD_LINEAR );
+}
+
+/* Adds a capture of the prepared commit into fbid, which must be the size of
+ * the mode. out_fence_fd gets a fence that signals once the capture is done
+ * if the commit goes through, so it needs to stay around until drm_commit. */
+int drm_prepare_writeback( struct drm_t *drm, uint32_t fbid, int *out_fence_fd )
+{
+	struct connector *conn = drm->writeback_connector;
+
+	*out_fence_fd = -1;
+
+	if ( drm->req == nullptr || conn == nullptr || fbid == 0 )
+		return -EINVAL;
+
+	// Async flips can only change planes' FB_ID
+	if ( drm->flags & DRM_MODE_PAGE_FLIP_ASYNC )
+		return -EINVAL;
+
+	// Routing the CRTC to the writeback connector takes a modeset, which a
+	// capture is no reason for, see drm_route_writeback
+	if ( conn->pending.crtc_id != drm->crtc->id )
+		return -EINVAL;
+
+	int cursor = drmModeAtomicGetCursor( drm->req );
+
+	int ret = add_connector_property( drm->req, conn, "WRITEBACK_FB_ID", fbid );
+	if ( ret >= 0 )
+		ret = add_connector_property( drm->req, conn, "WRITEBACK_OUT_FENCE_PTR", (uint64_t)(uintptr_t)out_fence_fd );
+
+	// drm_commit can't take a failure, so test it along with the rest of
+	// the commit, and leave that as it was if the driver won't have it
+	if ( ret >= 0 )
+		ret = drmModeAtomicCommit( drm->fd, drm->req, ( drm->flags & DRM_MODE_ATOMIC_ALLOW_MODESET ) | DRM_MODE_ATOMIC_TEST_ONLY, nullptr );
+	if ( ret != 0 )
+	{
+		drmModeAtomicSetCursor( drm->req, cursor );
+		return ret;
+	}
+
+	// Keep the FB alive until we've flipped past this commit
+	drm->fbids_in_req.push_back( fbid );
+
+	gpuvis_trace_printf( "writeback capture into fbid %u", fbid );
+
+	return 0;
+}
+
+/* Moves the cursor plane without going through drm_prepare/drm_commit. Only
+ * possible if the last commit put the cursor layer on the cursor plane and
+ * the cursor image hasn't changed since. Returns false if the caller needs to
+ * repaint instead. */
+bool drm_update_cursor( struct drm_t *drm, const FrameInfo_t::Layer_t *layer )
+{
+	if ( drm->cursor_plane == nullptr || drm->crtc == nullptr || drm->paused )
+		return false;
+
+	if ( drm->current.cursor_fb_id == 0 || drm->current.cursor_fb_id != layer->fbid )
+		return false;
+
+	int32_t crtcX = -layer->offset.x;
+	int32_t crtcY = -layer->offset.y;
+
+	if ( g_bRotated )
+	{
+		int32_t imageH = layer->tex->contentHeight() / layer->scale.y;
+
+		const int32_t x = crtcX;
+		crtcX = g_nOutputHeight - imageH - crtcY;
+		crtcY = x;
+	}
+
+	if ( crtcX == drm->current.cursor_x && crtcY == drm->current.cursor_y )
+		return true;
+
+	// The legacy cursor ioctl goes through the drivers' async cursor path:
+	// it neither waits for nor blocks a pending page-flip, unlike a
+	// non-blocking atomic commit which would make our next flip fail with
+	// EBUSY.
+	int ret = drmModeMoveCursor( drm->fd, drm->crtc->id, crtcX, crtcY );
+	if ( ret != 0 )
+	{
+		drm_verbose_log.errorf_errno( "drmModeMoveCursor failed" );
+		return false;
+	}
+
+	gpuvis_trace_printf( "cursor move %d,%d", crtcX, crtcY );
+
+	drm->current.cursor_x = drm->pending.cursor_x = crtcX;
+	drm->current.cursor_y = drm->pending.cursor_y = crtcY;
+
+	// The cursor plane isn't where the last commit put it anymore
+	drm->current.liftoff_layout_serial = drm->pending.liftoff_layout_serial = 0;
+
+	return true;
+}
+
+static bool is_hotplug_thread_enabled()
+{
+	static bool disabled = env_to_bool(getenv("GAMESCOPE_DRM_HOTPLUG_THREAD_DISABLE"));
+	return !disabled;
+}
+
+/* Re-probing means a round of ioctls per connector, CRTC and plane, plus
+ * reading EDIDs, which can take several frames with a dock plugged in. The
+ * hotplug thread does that and publishes the result in
+ * g_pHotplugProbe for drm_poll_state to swap in. */
+static std::mutex g_HotplugLock;
+static std::condition_variable g_HotplugCV;
+static uint64_t g_uHotplugRequestSerial = 0;
+static uint64_t g_uHotplugProbedSerial = 0;
+static std::atomic< struct drm_state_probe * > g_pHotplugProbe = { nullptr };
+static bool g_bHotplugThread = false;
+
+/* Only touched by the compositor: the first request asking to force a
+ * connector change, 0 if none */
+static uint64_t g_uHotplugForceSerial = 0;
+
+static void hotplug_thread_run( struct drm_t *drm )
+{
+	pthread_setname_np( pthread_self(), "gamescope-hplug" );
+
+	// Doubles with each failed probe, so a device that keeps failing isn't
+	// hammered, and the requests still get answered once it recovers
+	std::chrono::milliseconds backoff( 0 );
+
+	while ( true )
+	{
+		uint64_t serial;
+		{
+			std::unique_lock< std::mutex > lock( g_HotplugLock );
+			g_HotplugCV.wait( lock, []{ return g_uHotplugRequestSerial != g_uHotplugProbedSerial; } );
+
+			// Requests which came in since the last probe are all
+			// answered by this one
+			serial = g_uHotplugRequestSerial;
+		}
+
+		struct drm_state_probe *probe = drm_probe_state( drm );
+		if ( probe == nullptr )
+		{
+			backoff = std::min( std::max( backoff * 2, std::chrono::milliseconds( 16 ) ), std::chrono::milliseconds( 1000 ) );
+			drm_log.errorf( "probing after hotplug failed, retrying in %lldms", (long long)backoff.count() );
+			std::this_thread::sleep_for( backoff );
+			continue;
+		}
+		backoff = std::chrono::milliseconds( 0 );
+		probe->serial = serial;
 
-		drm->fbids_in_req.clear();
+		{
+			std::lock_guard< std::mutex > lock( g_HotplugLock );
+			g_uHotplugProbedSerial = serial;
+		}
 
-		if ( needs_modeset )
-			drm->needs_modeset = true;
-	}
+		// Nobody picked up the previous one, this one supersedes it
+		struct drm_state_probe *stale = g_pHotplugProbe.exchange( probe );
+		if ( stale != nullptr )
+			drm_free_state_probe( stale );
 
-	return ret;
+		nudge_steamcompmgr();
+	}
 }
 
-void drm_rollback( struct drm_t *drm )
+static void drm_start_hotplug_thread( struct drm_t *drm )
 {
-	drm->pending = drm->current;
+	if ( !is_hotplug_thread_enabled() )
+		return;
 
-	for ( size_t i = 0; i < drm->crtcs.size(); i++ )
+	std::thread hotplug_thread( hotplug_thread_run, drm );
+	hotplug_thread.detach();
+
+	g_bHotplugThread = true;
+}
+
+static uint64_t drm_hotplug_request( void )
+{
+	uint64_t serial;
 	{
-		drm->crtcs[i].pending = drm->crtcs[i].current;
+		std::unique_lock< std::mutex > lock( g_HotplugLock );
+		serial = ++g_uHotplugRequestSerial;
 	}
+	g_HotplugCV.notify_one();
 
-	for (auto &kv : drm->connectors) {
-		struct connector *conn = &kv.second;
-		conn->pending = conn->current;
-	}
+	return serial;
 }
 
 bool drm_poll_state( struct drm_t *drm )
 {
 	int out_of_date = drm->out_of_date.exchange(false);
-	if ( !out_of_date )
+
+	if ( !g_bHotplugThread )
+	{
+		if ( !out_of_date )
+			return false;
+
+		refresh_state( drm );
+
+		setup_best_connector(drm, out_of_date >= 2);
+		drm_update_mirror(drm);
+
+		return true;
+	}
+
+	if ( out_of_date )
+	{
+		uint64_t serial = drm_hotplug_request();
+		if ( out_of_date >= 2 && g_uHotplugForceSerial == 0 )
+			g_uHotplugForceSerial = serial;
+	}
+
+	struct drm_state_probe *probe = g_pHotplugProbe.exchange( nullptr );
+	if ( probe == nullptr )
 		return false;
 
-	refresh_state( drm );
+	// Only force once we have state from after the request that asked for
+	// it, re-picking the connector from older state is pointless
+	bool force = g_uHotplugForceSerial != 0 && probe->serial >= g_uHotplugForceSerial;
+	if ( force )
+		g_uHotplugForceSerial = 0;
 
-	setup_best_connector(drm, out_of_date >= 2);
+	drm_apply_state( drm, probe );
+
+	setup_best_connector(drm, force);
+	drm_update_mirror(drm);
 
 	return true;
 }
@@ -1867,6 +3989,17 @@ static bool drm_set_crtc( struct drm_t *drm, struct crtc *crtc )
 		return false;
 	}
 
+	drm->cursor_plane = find_cursor_plane( drm );
+	if ( drm->cursor_plane == nullptr )
+		drm_log.infof("no cursor plane, cursor will always be composited");
+
+	if ( is_writeback_capture_enabled() )
+	{
+		drm->writeback_connector = find_writeback_connector( drm );
+		if ( drm->writeback_connector == nullptr )
+			drm_log.infof("no writeback connector, capture will composite");
+	}
+
 	struct liftoff_output *lo_output = liftoff_output_create( drm->lo_device, crtc->id );
 	if ( lo_output == nullptr )
 		return false;
@@ -1879,6 +4012,12 @@ static bool drm_set_crtc( struct drm_t *drm, struct crtc *crtc )
 			return false;
 	}
 
+	liftoff_layer_destroy( drm->lo_composition_layer );
+	drm->lo_composition_layer = liftoff_layer_create( lo_output );
+	if ( drm->lo_composition_layer == nullptr )
+		return false;
+	liftoff_output_set_composition_layer( lo_output, drm->lo_composition_layer );
+
 	liftoff_output_destroy( drm->lo_output );
 	drm->lo_output = lo_output;
 
@@ -1889,6 +4028,10 @@ bool drm_set_connector( struct drm_t *drm, struct connector *conn )
 {
 	drm_log.infof("selecting connector %s", conn->name);
 
+	// It may be on the connector or CRTC we're about to pick,
+	// drm_update_mirror sets it up again afterwards
+	drm_mirror_disable(drm, false);
+
 	struct crtc *crtc = find_crtc_for_connector(drm, conn);
 	if (crtc == nullptr) {
 		drm_log.errorf("no CRTC found!");
@@ -2039,10 +4182,108 @@ inline uint16_t drm_quantize_lut_value( float flValue )
 	return (uint16_t)quantize( flValue, (float)UINT16_MAX );
 }
 
-inline uint16_t drm_calc_lut_value( float input, float flLinearGain, float flGain, float flBlend )
+/* Property blobs we've created for the colour management CRTC properties,
+ * keyed on what went into them. Night mode transitions change gain_blend
+ * every frame, this way each step of the way only gets a blob once instead
+ * of once per frame. */
+enum drm_color_blob_type
+{
+	DRM_COLOR_BLOB_GAMMA_LUT,
+	DRM_COLOR_BLOB_DEGAMMA_LUT,
+	DRM_COLOR_BLOB_CTM,
+};
+
+struct drm_color_blob_key
+{
+	enum drm_color_blob_type type;
+	/* The LUT sizes depend on the CRTC */
+	uint32_t crtc_id;
+	float params[ 10 ];
+};
+
+struct drm_color_blob
+{
+	struct drm_color_blob_key key;
+	uint32_t blob_id;
+	uint64_t last_used;
+};
+
+/* gain_blend is quantized to that many steps, so that a whole transition
+ * fits in the blob cache */
+static const int k_nGainBlendSteps = 64;
+static const int k_nMaxColorBlobs = 96;
+static struct drm_color_blob g_ColorBlobs[ k_nMaxColorBlobs ];
+static uint64_t g_nColorBlobUseCount = 0;
+
+static struct drm_color_blob_key drm_color_blob_make_key( struct drm_t *drm, enum drm_color_blob_type type, const float *params, int count )
+{
+	// Compared with memcmp
+	struct drm_color_blob_key key;
+	memset( &key, 0, sizeof( key ) );
+
+	key.type = type;
+	key.crtc_id = drm->crtc->id;
+	for ( int i = 0; i < count; i++ )
+		key.params[ i ] = params[ i ];
+
+	return key;
+}
+
+static uint32_t drm_color_blob_find( const struct drm_color_blob_key &key )
+{
+	for ( int i = 0; i < k_nMaxColorBlobs; i++ )
+	{
+		struct drm_color_blob &blob = g_ColorBlobs[ i ];
+		if ( blob.blob_id != 0 && memcmp( &blob.key, &key, sizeof( key ) ) == 0 )
+		{
+			blob.last_used = ++g_nColorBlobUseCount;
+			return blob.blob_id;
+		}
+	}
+
+	return 0;
+}
+
+/* Blobs referenced by the current or pending state are pinned: the kernel
+ * keeps its own reference once they're committed, but we put them in the
+ * request again when modesetting. */
+static bool drm_color_blob_in_use( struct drm_t *drm, uint32_t blob_id )
+{
+	return blob_id == drm->current.gamma_lut_id || blob_id == drm->pending.gamma_lut_id ||
+	       blob_id == drm->current.degamma_lut_id || blob_id == drm->pending.degamma_lut_id ||
+	       blob_id == drm->current.ctm_id || blob_id == drm->pending.ctm_id;
+}
+
+static uint32_t drm_color_blob_create( struct drm_t *drm, const struct drm_color_blob_key &key, const void *data, size_t size )
 {
-    float flValue = lerp( flGain * input, linear_to_srgb( flLinearGain * srgb_to_linear( input ) ), flBlend );
-	return drm_quantize_lut_value( flValue );
+	uint32_t blob_id = 0;
+	if ( drmModeCreatePropertyBlob( drm->fd, data, size, &blob_id ) != 0 )
+		return 0;
+
+	// Take over the least recently used slot, free slots have never
+	// been used.
+	struct drm_color_blob *victim = nullptr;
+	for ( int i = 0; i < k_nMaxColorBlobs; i++ )
+	{
+		struct drm_color_blob &blob = g_ColorBlobs[ i ];
+		if ( blob.blob_id != 0 && drm_color_blob_in_use( drm, blob.blob_id ) )
+			continue;
+
+		if ( victim == nullptr || blob.last_used < victim->last_used )
+			victim = &blob;
+	}
+
+	// There are a lot more slots than blobs that can be pinned
+	assert( victim != nullptr );
+
+	if ( victim->blob_id != 0 )
+		drmModeDestroyPropertyBlob( drm->fd, victim->blob_id );
+
+	victim->key = key;
+	victim->blob_id = blob_id;
+	victim->last_used = ++g_nColorBlobUseCount;
+
+	return blob_id;
 }
 
 bool drm_update_color_mtx(struct drm_t *drm)
@@ -2087,6 +4328,14 @@ bool drm_update_color_mtx(struct drm_t *drm)
 		return true;
 	}
 
+	auto key = drm_color_blob_make_key( drm, DRM_COLOR_BLOB_CTM, drm->pending.color_mtx[screen_type], 9 );
+	uint32_t blob_id = drm_color_blob_find( key );
+	if ( blob_id != 0 )
+	{
+		drm->pending.ctm_id = blob_id;
+		return true;
+	}
+
 	struct drm_color_ctm drm_ctm;
 	for (int i = 0; i < 9; i++)
 	{
@@ -2114,9 +4363,8 @@ bool drm_update_color_mtx(struct drm_t *drm)
 		drm_ctm.matrix[i] = color.s31_32;
 	}
 
-	uint32_t blob_id = 0;
-	if (drmModeCreatePropertyBlob(drm->fd, &drm_ctm,
-			sizeof(struct drm_color_ctm), &blob_id) != 0) {
+	blob_id = drm_color_blob_create( drm, key, &drm_ctm, sizeof(struct drm_color_ctm) );
+	if ( blob_id == 0 ) {
 		drm_log.errorf_errno("Unable to create CTM property blob");
 		return false;
 	}
@@ -2150,6 +4398,101 @@ static float safe_pow(float x, float y)
 	return pow(x, y);
 }
 
+/* The gamma LUT is a blend between a gain curve and a linear gain curve, and
+ * only the blend changes during night mode transitions. Keep both curves
+ * around so that a new blend is a lerp per entry instead of a few pows. */
+struct drm_gamma_curves
+{
+	uint32_t crtc_id;
+	int lut_entries;
+	/* color_gain, color_linear_gain and the gamma exponent */
+	float params[ 9 ];
+	/* RGBx, lut_entries * 4 */
+	std::vector< float > gain;
+	std::vector< float > linear_gain;
+};
+
+static struct drm_gamma_curves g_GammaCurves;
+/* Scratch buffer for the LUT blobs, so that we don't allocate every time */
+static std::vector< struct drm_color_lut > g_ColorLut;
+
+static void drm_update_gamma_curves( struct drm_gamma_curves *curves, uint32_t crtc_id, int lut_entries, const float *params )
+{
+	if ( curves->crtc_id == crtc_id && curves->lut_entries == lut_entries &&
+	     memcmp( curves->params, params, sizeof( curves->params ) ) == 0 )
+		return;
+
+	curves->crtc_id = crtc_id;
+	curves->lut_entries = lut_entries;
+	memcpy( curves->params, params, sizeof( curves->params ) );
+	curves->gain.resize( lut_entries * 4 );
+	curves->linear_gain.resize( lut_entries * 4 );
+
+	const float *color_gain = &params[ 0 ];
+	const float *color_linear_gain = &params[ 3 ];
+	const float *gamma_exponent = &params[ 6 ];
+
+	for ( int i = 0; i < lut_entries; i++ )
+	{
+		float input = float(i) / float(lut_entries - 1);
+
+		for ( int c = 0; c < 3; c++ )
+		{
+			float x = safe_pow( input, gamma_exponent[c] );
+
+			curves->gain[ i * 4 + c ] = color_gain[c] * x;
+			curves->linear_gain[ i * 4 + c ] = linear_to_srgb( color_linear_gain[c] * srgb_to_linear( x ) );
+		}
+
+		curves->gain[ i * 4 + 3 ] = 0.0f;
+		curves->linear_gain[ i * 4 + 3 ] = 0.0f;
+	}
+}
+
+static void drm_blend_gamma_lut( struct drm_color_lut *lut, const float *gain, const float *linear_gain, float blend, int lut_entries )
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	// A drm_color_lut is 4 uint16s, same as the RGBx curves, so do two
+	// entries at a time.
+	const __m128 t = _mm_set1_ps( blend );
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 max = _mm_set1_ps( (float)UINT16_MAX );
+	const __m128i bias = _mm_set1_epi32( 0x8000 );
+	const __m128i sign = _mm_set1_epi16( (short)0x8000 );
+
+	for ( ; i + 2 <= lut_entries; i += 2 )
+	{
+		__m128 a0 = _mm_loadu_ps( &gain[ i * 4 ] );
+		__m128 a1 = _mm_loadu_ps( &gain[ i * 4 + 4 ] );
+		__m128 b0 = _mm_loadu_ps( &linear_gain[ i * 4 ] );
+		__m128 b1 = _mm_loadu_ps( &linear_gain[ i * 4 + 4 ] );
+
+		__m128 v0 = _mm_add_ps( a0, _mm_mul_ps( t, _mm_sub_ps( b0, a0 ) ) );
+		__m128 v1 = _mm_add_ps( a1, _mm_mul_ps( t, _mm_sub_ps( b1, a1 ) ) );
+
+		v0 = _mm_min_ps( _mm_max_ps( _mm_mul_ps( v0, max ), zero ), max );
+		v1 = _mm_min_ps( _mm_max_ps( _mm_mul_ps( v1, max ), zero ), max );
+
+		// There's no unsigned saturating pack in SSE2, go through int16
+		__m128i q0 = _mm_sub_epi32( _mm_cvtps_epi32( v0 ), bias );
+		__m128i q1 = _mm_sub_epi32( _mm_cvtps_epi32( v1 ), bias );
+		__m128i q = _mm_xor_si128( _mm_packs_epi32( q0, q1 ), sign );
+
+		_mm_storeu_si128( (__m128i *)&lut[ i ], q );
+	}
+#endif
+
+	for ( ; i < lut_entries; i++ )
+	{
+		lut[i].red      = drm_quantize_lut_value( lerp( gain[ i * 4 + 0 ], linear_gain[ i * 4 + 0 ], blend ) );
+		lut[i].green    = drm_quantize_lut_value( lerp( gain[ i * 4 + 1 ], linear_gain[ i * 4 + 1 ], blend ) );
+		lut[i].blue     = drm_quantize_lut_value( lerp( gain[ i * 4 + 2 ], linear_gain[ i * 4 + 2 ], blend ) );
+		lut[i].reserved = 0;
+	}
+}
+
 bool drm_update_gamma_lut(struct drm_t *drm)
 {
 	if ( !drm->crtc->has_gamma_lut )
@@ -2172,12 +4515,14 @@ bool drm_update_gamma_lut(struct drm_t *drm)
 		return true;
 	}
 
-	bool color_gain_identity = drm->pending.gain_blend == 1.0f ||
+	float blend = roundf( std::max( 0.0f, std::min( 1.0f, drm->pending.gain_blend ) ) * k_nGainBlendSteps ) / k_nGainBlendSteps;
+
+	bool color_gain_identity = blend == 1.0f ||
 		( drm->pending.color_gain[0] == 1.0f &&
 		  drm->pending.color_gain[1] == 1.0f &&
 		  drm->pending.color_gain[2] == 1.0f );
 
-	bool linear_gain_identity = drm->pending.gain_blend == 0.0f ||
+	bool linear_gain_identity = blend == 0.0f ||
 		( drm->pending.color_linear_gain[0] == 1.0f &&
 		  drm->pending.color_linear_gain[1] == 1.0f &&
 		  drm->pending.color_linear_gain[2] == 1.0f );
@@ -2193,29 +4538,34 @@ bool drm_update_gamma_lut(struct drm_t *drm)
 		return true;
 	}
 
-	const int lut_entries = drm->crtc->initial_prop_values["GAMMA_LUT_SIZE"];
-	drm_color_lut *gamma_lut = new drm_color_lut[lut_entries];
-	for ( int i = 0; i < lut_entries; i++ )
+	float params[10];
+	for ( int i = 0; i < 3; i++ )
 	{
-        float input = float(i) / float(lut_entries - 1);
-
-		float r_exp = safe_pow( input, drm->pending.color_gamma_exponent[screen_type][0] );
-		float g_exp = safe_pow( input, drm->pending.color_gamma_exponent[screen_type][1] );
-		float b_exp = safe_pow( input, drm->pending.color_gamma_exponent[screen_type][2] );
+		params[i]     = drm->pending.color_gain[i];
+		params[3 + i] = drm->pending.color_linear_gain[i];
+		params[6 + i] = drm->pending.color_gamma_exponent[screen_type][i];
+	}
+	params[9] = blend;
 
-		gamma_lut[i].red   = drm_calc_lut_value( r_exp, drm->pending.color_linear_gain[0], drm->pending.color_gain[0], drm->pending.gain_blend );
-		gamma_lut[i].green = drm_calc_lut_value( g_exp, drm->pending.color_linear_gain[1], drm->pending.color_gain[1], drm->pending.gain_blend );
-		gamma_lut[i].blue  = drm_calc_lut_value( b_exp, drm->pending.color_linear_gain[2], drm->pending.color_gain[2], drm->pending.gain_blend );
+	auto key = drm_color_blob_make_key( drm, DRM_COLOR_BLOB_GAMMA_LUT, params, 10 );
+	uint32_t blob_id = drm_color_blob_find( key );
+	if ( blob_id != 0 )
+	{
+		drm->pending.gamma_lut_id = blob_id;
+		return true;
 	}
 
-	uint32_t blob_id = 0;
-	if (drmModeCreatePropertyBlob(drm->fd, gamma_lut,
-			lut_entries * sizeof(struct drm_color_lut), &blob_id) != 0) {
+	const int lut_entries = drm->crtc->initial_prop_values["GAMMA_LUT_SIZE"];
+	drm_update_gamma_curves( &g_GammaCurves, drm->crtc->id, lut_entries, params );
+
+	g_ColorLut.resize( lut_entries );
+	drm_blend_gamma_lut( g_ColorLut.data(), g_GammaCurves.gain.data(), g_GammaCurves.linear_gain.data(), blend, lut_entries );
+
+	blob_id = drm_color_blob_create( drm, key, g_ColorLut.data(), lut_entries * sizeof(struct drm_color_lut) );
+	if ( blob_id == 0 ) {
 		drm_log.errorf_errno("Unable to create gamma LUT property blob");
-		delete[] gamma_lut;
 		return false;
 	}
-	delete[] gamma_lut;
 
 	drm->pending.gamma_lut_id = blob_id;
 
@@ -2248,44 +4598,198 @@ bool drm_update_degamma_lut(struct drm_t *drm)
 		return true;
 	}
 
+	auto key = drm_color_blob_make_key( drm, DRM_COLOR_BLOB_DEGAMMA_LUT, drm->pending.color_degamma_exponent[screen_type], 3 );
+	uint32_t blob_id = drm_color_blob_find( key );
+	if ( blob_id != 0 )
+	{
+		drm->pending.degamma_lut_id = blob_id;
+		return true;
+	}
+
 	const int lut_entries = drm->crtc->initial_prop_values["DEGAMMA_LUT_SIZE"];
-	drm_color_lut *degamma_lut = new drm_color_lut[lut_entries];
+	g_ColorLut.resize( lut_entries );
 	for ( int i = 0; i < lut_entries; i++ )
 	{
         float input = float(i) / float(lut_entries - 1);
 
-		degamma_lut[i].red   = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][0] ) );
-		degamma_lut[i].green = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][1] ) );
-		degamma_lut[i].blue  = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][2] ) );
+		g_ColorLut[i].red      = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][0] ) );
+		g_ColorLut[i].green    = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][1] ) );
+		g_ColorLut[i].blue     = drm_quantize_lut_value( safe_pow( input, drm->pending.color_degamma_exponent[screen_type][2] ) );
+		g_ColorLut[i].reserved = 0;
 	}
 
-	uint32_t blob_id = 0;
-	if (drmModeCreatePropertyBlob(drm->fd, degamma_lut,
-			lut_entries * sizeof(struct drm_color_lut), &blob_id) != 0) {
+	blob_id = drm_color_blob_create( drm, key, g_ColorLut.data(), lut_entries * sizeof(struct drm_color_lut) );
+	if ( blob_id == 0 ) {
 		drm_log.errorf_errno("Unable to create degamma LUT property blob");
-		delete[] degamma_lut;
 		return false;
 	}
-	delete[] degamma_lut;
 
 	drm->pending.degamma_lut_id = blob_id;
 
 	return true;
 }
 
-bool drm_set_mode( struct drm_t *drm, const drmModeModeInfo *mode )
+static void drm_generate_mode( struct connector *conn, drmModeModeInfo *mode, int width, int height, int refresh )
 {
-	if (!drm->connector || !drm->connector->connector)
+	drmModeConnector *connector = conn->connector;
+
+	/* TODO: check refresh is within the EDID limits */
+	switch ( g_drmModeGeneration )
+	{
+	case DRM_MODE_GENERATE_CVT:
+		generate_cvt_mode( mode, width, height, refresh, true, false );
+		break;
+	case DRM_MODE_GENERATE_FIXED:
+		{
+			const char *make_pnp = conn->make_pnp;
+			const char *model = conn->model ? conn->model : "";
+			bool is_steam_deck_display =
+				(strcmp(make_pnp, "WLC") == 0 && strcmp(model, "ANX7530 U") == 0) ||
+				(strcmp(make_pnp, "ANX") == 0 && strcmp(model, "ANX7530 U") == 0) ||
+				(strcmp(make_pnp, "VLV") == 0 && strcmp(model, "ANX7530 U") == 0) ||
+				(strcmp(make_pnp, "VLV") == 0 && strcmp(model, "Jupiter") == 0);
+
+			const drmModeModeInfo *preferred_mode = find_mode(connector, 0, 0, 0);
+			generate_fixed_mode( mode, preferred_mode, refresh, is_steam_deck_display );
+			break;
+		}
+	}
+
+	mode->type = DRM_MODE_TYPE_USERDEF;
+}
+
+static void drm_free_mode_table( struct drm_t *drm, struct connector *conn )
+{
+	for ( const auto &entry : conn->mode_table )
+	{
+		// Still needed for the next modeset, goes once it's replaced
+		if ( entry.blob_id == drm->current.mode_id || entry.blob_id == drm->pending.mode_id )
+		{
+			drm->loose_mode_blobs.push_back( entry.blob_id );
+			continue;
+		}
+
+		drmModeDestroyPropertyBlob( drm->fd, entry.blob_id );
+	}
+
+	conn->mode_table.clear();
+}
+
+/* Destroys the mode blobs no mode table owns once neither the current nor
+ * the pending state uses them anymore. */
+static void drm_destroy_loose_mode_blobs( struct drm_t *drm )
+{
+	auto it = drm->loose_mode_blobs.begin();
+	while ( it != drm->loose_mode_blobs.end() )
+	{
+		if ( *it == drm->current.mode_id || *it == drm->pending.mode_id )
+		{
+			it++;
+			continue;
+		}
+
+		drmModeDestroyPropertyBlob( drm->fd, *it );
+		it = drm->loose_mode_blobs.erase( it );
+	}
+}
+
+/* Works out the modes at that resolution we might want to switch the refresh
+ * rate to, from the connector's own modes and generated ones, and creates
+ * their blobs up-front so that switching doesn't need to. */
+static void drm_build_mode_table( struct drm_t *drm, struct connector *conn, const drmModeModeInfo *base )
+{
+	drm_free_mode_table( drm, conn );
+
+	drmModeConnector *connector = conn->connector;
+
+	// Dynamic refresh goes down from the native refresh rate, half of it
+	// is already well into frame doubling territory.
+	const int max_refresh = base->vrefresh;
+	const int min_refresh = std::max( 30, max_refresh / 2 );
+
+	for ( int refresh = max_refresh; refresh >= min_refresh; refresh-- )
+	{
+		struct drm_mode_table_entry entry = {};
+
+		const drmModeModeInfo *existing_mode = find_mode( connector, base->hdisplay, base->vdisplay, refresh );
+		if ( existing_mode )
+			entry.mode = *existing_mode;
+		else
+			drm_generate_mode( conn, &entry.mode, base->hdisplay, base->vdisplay, refresh );
+
+		if ( drmModeCreatePropertyBlob( drm->fd, &entry.mode, sizeof( entry.mode ), &entry.blob_id ) != 0 )
+		{
+			drm_log.errorf_errno( "failed to create mode blob" );
+			continue;
+		}
+
+		conn->mode_table.push_back( entry );
+	}
+
+	drm_log.debugf( "built mode table for %dx%d: %d-%dHz", base->hdisplay, base->vdisplay, min_refresh, max_refresh );
+}
+
+static struct drm_mode_table_entry *drm_find_mode_table_entry( struct drm_t *drm, int width, int height, int refresh )
+{
+	if ( !drm->connector )
+		return nullptr;
+
+	for ( auto &entry : drm->connector->mode_table )
+	{
+		if ( entry.mode.hdisplay == width && entry.mode.vdisplay == height && (int)entry.mode.vrefresh == refresh )
+			return &entry;
+	}
+
+	return nullptr;
+}
+
+/* Whether the driver can switch to the mode without a full modeset, e.g.
+ * when only the vertical blanking changes. Checked with a TEST_ONLY commit
+ * that doesn't allow modesets, and remembered for the current mode. */
+static bool drm_is_mode_switch_seamless( struct drm_t *drm, struct drm_mode_table_entry *entry )
+{
+	if ( drm->crtc == nullptr || drm->current.mode_id == 0 || !drm->crtc->current.active )
 		return false;
 
-	uint32_t mode_id = 0;
-	if (drmModeCreatePropertyBlob(drm->fd, mode, sizeof(*mode), &mode_id) != 0)
+	// A full modeset is coming anyway
+	if ( drm->needs_modeset || drm->pending.mode_id != drm->current.mode_id )
 		return false;
 
-	drm_log.infof("selecting mode %dx%d@%uHz", mode->hdisplay, mode->vdisplay, mode->vrefresh);
+	if ( entry->seamless_from == drm->current.mode_id )
+		return entry->seamless;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	int ret = add_crtc_property( req, drm->crtc, "MODE_ID", entry->blob_id );
+	if ( ret >= 0 )
+		ret = drmModeAtomicCommit( drm->fd, req, DRM_MODE_ATOMIC_TEST_ONLY, nullptr );
+	drmModeAtomicFree( req );
+
+	entry->seamless_from = drm->current.mode_id;
+	entry->seamless = ret == 0;
+
+	drm_log.debugf( "switching to %dHz %s", entry->mode.vrefresh, entry->seamless ? "is seamless" : "needs a modeset" );
+
+	return entry->seamless;
+}
+
+/* With VRR, the display follows our page-flips: we can get a lower refresh
+ * rate by just pacing frames at it, without touching the mode. */
+static bool drm_can_use_virtual_refresh( struct drm_t *drm, int refresh )
+{
+	return drm_get_vrr_in_use( drm ) && refresh <= g_nOutputRefresh;
+}
+
+static void drm_set_mode_blob( struct drm_t *drm, const drmModeModeInfo *mode, uint32_t mode_id, bool seamless )
+{
+	drm_log.infof("selecting mode %dx%d@%uHz%s", mode->hdisplay, mode->vdisplay, mode->vrefresh, seamless ? " (seamless)" : "");
 
 	drm->pending.mode_id = mode_id;
-	drm->needs_modeset = true;
+	drm->virtual_refresh = 0;
+
+	// drm_prepare puts the new MODE_ID in the next commit by itself if it
+	// doesn't need a modeset.
+	if ( !seamless )
+		drm->needs_modeset = true;
 
 	g_nOutputRefresh = mode->vrefresh;
 
@@ -2306,6 +4810,24 @@ bool drm_set_mode( struct drm_t *drm, const drmModeModeInfo *mode )
 		g_nOutputHeight = mode->hdisplay;
 		break;
 	}
+}
+
+bool drm_set_mode( struct drm_t *drm, const drmModeModeInfo *mode )
+{
+	if (!drm->connector || !drm->connector->connector)
+		return false;
+
+	uint32_t mode_id = 0;
+
+	struct drm_mode_table_entry *entry = drm_find_mode_table_entry( drm, mode->hdisplay, mode->vdisplay, mode->vrefresh );
+	if ( entry != nullptr && memcmp( &entry->mode, mode, sizeof( *mode ) ) == 0 )
+		mode_id = entry->blob_id;
+	else if (drmModeCreatePropertyBlob(drm->fd, mode, sizeof(*mode), &mode_id) != 0)
+		return false;
+	else
+		drm->loose_mode_blobs.push_back( mode_id );
+
+	drm_set_mode_blob( drm, mode, mode_id, false );
 
 	return true;
 }
@@ -2323,40 +4845,41 @@ bool drm_set_refresh( struct drm_t *drm, int refresh )
 	if (!drm->connector || !drm->connector->connector)
 		return false;
 
+	if ( refresh == g_nOutputRefresh )
+	{
+		drm->virtual_refresh = 0;
+		return true;
+	}
+
+	if ( drm_can_use_virtual_refresh( drm, refresh ) )
+	{
+		if ( drm->virtual_refresh != refresh )
+			drm_log.infof("pacing at %dHz with VRR", refresh);
+
+		drm->virtual_refresh = refresh;
+		return true;
+	}
+
+	struct drm_mode_table_entry *entry = drm_find_mode_table_entry( drm, width, height, refresh );
+	if ( entry != nullptr )
+	{
+		drm_set_mode_blob( drm, &entry->mode, entry->blob_id, drm_is_mode_switch_seamless( drm, entry ) );
+		return true;
+	}
+
 	drmModeConnector *connector = drm->connector->connector;
 	const drmModeModeInfo *existing_mode = find_mode(connector, width, height, refresh);
 	drmModeModeInfo mode = {0};
 	if ( existing_mode )
 	{
 		mode = *existing_mode;
+		mode.type = DRM_MODE_TYPE_USERDEF;
 	}
 	else
 	{
-		/* TODO: check refresh is within the EDID limits */
-		switch ( g_drmModeGeneration )
-		{
-		case DRM_MODE_GENERATE_CVT:
-			generate_cvt_mode( &mode, width, height, refresh, true, false );
-			break;
-		case DRM_MODE_GENERATE_FIXED:
-			{
-				const char *make_pnp = drm->connector->make_pnp;
-				const char *model = drm->connector->model;
-				bool is_steam_deck_display =
-					(strcmp(make_pnp, "WLC") == 0 && strcmp(model, "ANX7530 U") == 0) ||
-					(strcmp(make_pnp, "ANX") == 0 && strcmp(model, "ANX7530 U") == 0) ||
-					(strcmp(make_pnp, "VLV") == 0 && strcmp(model, "ANX7530 U") == 0) ||
-					(strcmp(make_pnp, "VLV") == 0 && strcmp(model, "Jupiter") == 0);
-
-				const drmModeModeInfo *preferred_mode = find_mode(connector, 0, 0, 0);
-				generate_fixed_mode( &mode, preferred_mode, refresh, is_steam_deck_display );
-				break;
-			}
-		}
+		drm_generate_mode( drm->connector, &mode, width, height, refresh );
 	}
 
-	mode.type = DRM_MODE_TYPE_USERDEF;
-
 	return drm_set_mode(drm, &mode);
 }
 
@@ -2372,9 +4895,38 @@ bool drm_set_resolution( struct drm_t *drm, int width, int height )
 		return false;
 	}
 
+	drm_build_mode_table( drm, drm->connector, mode );
+
 	return drm_set_mode(drm, mode);
 }
 
+/* Whether drm_set_refresh can get there without the screen blanking, in which
+ * case there's no point in holding off on it. */
+bool drm_can_switch_refresh_seamlessly( struct drm_t *drm, int refresh )
+{
+	if ( drm_can_use_virtual_refresh( drm, refresh ) )
+		return true;
+
+	int width = g_nOutputWidth;
+	int height = g_nOutputHeight;
+	if ( g_bRotated )
+		std::swap( width, height );
+
+	struct drm_mode_table_entry *entry = drm_find_mode_table_entry( drm, width, height, refresh );
+	return entry != nullptr && drm_is_mode_switch_seamless( drm, entry );
+}
+
+/* The refresh rate we're presenting at, which is lower than the mode's if
+ * we're pacing at a virtual refresh rate. */
+int drm_get_refresh( struct drm_t *drm )
+{
+	int virtual_refresh = drm->virtual_refresh;
+	if ( virtual_refresh != 0 && drm_get_vrr_in_use( drm ) )
+		return virtual_refresh;
+
+	return g_nOutputRefresh;
+}
+
 int drm_get_default_refresh(struct drm_t *drm)
 {
 	if ( drm->preferred_refresh )
@@ -40,12 +40,15 @@ extern "C" {
 
 #include "rendervulkan.hpp"
 
+#include <array>
 #include <unordered_map>
 #include <utility>
 #include <atomic>
 #include <map>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 
 struct saved_mode {
@@ -59,6 +62,9 @@ struct plane {
 	drmModePlane *plane;
 	std::map<std::string, const drmModePropertyRes *> props;
 	std::map<std::string, uint64_t> initial_prop_values;
+	/* Our libliftoff device's handle for the plane, nullptr while the
+	 * mirror output has it, see drm_mirror */
+	struct liftoff_plane *lo_plane;
 };
 
 struct crtc {
@@ -76,6 +82,16 @@ struct crtc {
 	} current, pending;
 };
 
+/* A mode we may switch to at runtime, see drm_build_mode_table */
+struct drm_mode_table_entry {
+	drmModeModeInfo mode;
+	uint32_t blob_id;
+	/* Whether switching to this mode from the seamless_from mode blob passed
+	 * a TEST_ONLY commit without ALLOW_MODESET */
+	uint32_t seamless_from;
+	bool seamless;
+};
+
 struct connector {
 	uint32_t id;
 	char *name;
@@ -91,21 +107,66 @@ struct connector {
 	int target_refresh;
 	bool vrr_capable;
 
+	/* Modes at the current resolution we can switch the refresh rate to,
+	 * with their blobs, built when the connector is picked */
+	std::vector< struct drm_mode_table_entry > mode_table;
+
 	struct {
 		uint32_t crtc_id;
 	} current, pending;
 };
 
+/* Size of the FB registry, see drm_t::fbs. Must be a power of two. */
+#define k_nMaxFBs 4096
+
+/* How many page-flips drm_commit can have in flight before it blocks. The
+ * kernel only takes one flip per CRTC at a time and fails the others with
+ * EBUSY, so this only lets the compositor thread get on with the next frame
+ * while the flip lands. */
+#define k_nMaxQueuedFlips 1
+
 struct fb {
-	uint32_t id;
+	/* KMS ID of the FB, 0 if the slot was never used */
+	std::atomic< uint32_t > id;
 	/* Client buffer, if any */
 	struct wlr_buffer *buf;
 	/* A FB is held if it's being used by steamcompmgr
 	 * doesn't need to be atomic as it's only ever
 	 * modified/read from the steamcompmgr thread */
 	int held_refs;
-	/* Number of page-flips using the FB */
-	std::atomic< uint32_t > n_refs;
+	/* Number of page-flips using the FB in the low bits, and what's left
+	 * to do once that drops to 0 in the high bits, see drm_reclaim_fbs */
+	std::atomic< uint32_t > state;
+	/* Next FB to reclaim, as an index into drm_t::fbs plus one */
+	uint32_t next_reclaim;
+	/* Layout of the buffer, planes may not support all of them */
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/* A second output showing the frames of the main one, on its own CRTC and
+ * primary plane. It flips whenever its CRTC is free, dropping the frames
+ * that come in while a flip is in flight, so it runs at its own refresh
+ * rate without holding up the main output. See drm_update_mirror.
+ *
+ * The mirror has no liftoff output, vblank estimator or commit queue of its
+ * own: the main output is composited for as long as the mirror is on, and
+ * the mirror shows those RTs. */
+struct drm_mirror {
+	struct connector *connector;
+	struct crtc *crtc;
+	struct plane *primary;
+	drmModeModeInfo mode;
+	uint32_t mode_id;
+	bool needs_modeset;
+
+	/* FB of the flip in flight, 0 if none, and the FB on screen. Protected
+	 * by drm_t::flip_lock, as the page-flip handler updates them */
+	uint32_t fbid_pending;
+	uint32_t fbid_on_screen;
+
+	uint64_t last_vblank;
+	uint64_t dropped_frames;
 };
 
 struct drm_t {
@@ -124,9 +185,15 @@ struct drm_t {
 	std::map< uint32_t, drmModePropertyRes * > props;
 
 	struct plane *primary;
+	struct plane *cursor_plane;
 	struct crtc *crtc;
 	struct connector *connector;
 	int crtc_index;
+	/* Writeback connector of the CRTC used for capture, if enabled and the
+	 * driver has one, and the formats it can write */
+	struct connector *writeback_connector;
+	std::vector< uint32_t > writeback_formats;
+	struct drm_mirror mirror;
 	int kms_in_fence_fd;
 	int kms_out_fence_fd;
 
@@ -138,6 +205,11 @@ struct drm_t {
 	struct liftoff_device *lo_device;
 	struct liftoff_output *lo_output;
 	struct liftoff_layer *lo_layers[ k_nMaxLayers ];
+	struct liftoff_layer *lo_composition_layer;
+
+	/* Mask of the layers in the prepared commit which didn't get a plane
+	 * and need to be composited into the composition layer */
+	uint32_t pending_composited_layers;
 
 	struct {
 		uint32_t mode_id;
@@ -165,30 +237,61 @@ struct drm_t {
 		float gain_blend = 0.0f;
 		enum drm_screen_type screen_type = DRM_SCREEN_TYPE_INTERNAL;
 		bool vrr_enabled = false;
+		/* FB and position of the cursor plane, cursor_fb_id is 0 if the
+		 * cursor layer didn't end up on the cursor plane. */
+		uint32_t cursor_fb_id = 0;
+		int32_t cursor_x = 0, cursor_y = 0;
+		/* Identifies the libliftoff plane allocation of the commit, 0 if
+		 * unknown. See drm_prepare_liftoff. */
+		uint64_t liftoff_layout_serial = 0;
 	} current, pending;
 	bool wants_vrr_enabled = false;
+	/* Mode blobs outside of any connector's mode table, destroyed once
+	 * current and pending are both done with them */
+	std::vector < uint32_t > loose_mode_blobs;
 
 	/* FBs in the atomic request, but not yet submitted to KMS */
 	std::vector < uint32_t > fbids_in_req;
-	/* FBs submitted to KMS, but not yet displayed on screen */
-	std::vector < uint32_t > fbids_queued;
+	/* Page-flips submitted to KMS, but not yet displayed on screen, oldest
+	 * first. The flipcount is the data cookie of the flip's events. */
+	struct flip {
+		uint64_t flipcount;
+		/* FBs the flip puts on screen */
+		std::vector < uint32_t > fbids;
+		/* KMS out-fence, signalled once the flip is on screen */
+		int out_fence_fd;
+		uint64_t commit_time;
+	};
+	std::deque < flip > flips_queued;
 	/* FBs currently on screen */
 	std::vector < uint32_t > fbids_on_screen;
 
-	std::unordered_map< uint32_t, struct fb > fb_map;
-	std::mutex fb_map_mutex;
-
-	std::mutex free_queue_lock;
-	std::vector< uint32_t > fbid_unlock_queue;
-	std::vector< uint32_t > fbid_free_queue;
-
+	/* Open-addressed table of the FBs we've imported, keyed on their KMS
+	 * ID. Lookups don't need a lock, see get_fb. */
+	std::array< struct fb, k_nMaxFBs > fbs;
+	/* FBs the page-flip handler left for drm_reclaim_fbs, as an index
+	 * into fbs plus one, linked through fb::next_reclaim */
+	std::atomic< uint32_t > fb_reclaim_head;
+	/* Serializes filling slots of fbs with drm_compact_fb_slots */
+	std::mutex fb_alloc_lock;
+	/* Slots emptied since the last drm_compact_fb_slots */
+	std::atomic< uint32_t > fb_slots_freed;
+
+	/* Protects flips_queued and fbids_on_screen, flip_cv is signalled
+	 * whenever a flip completes */
 	std::mutex flip_lock;
+	std::condition_variable flip_cv;
 
 	std::atomic < uint64_t > flipcount;
 
 	std::atomic < bool > paused;
 	std::atomic < int > out_of_date;
 	std::atomic < bool > needs_modeset;
+	/* Whether drm_prepare consumed needs_modeset for req */
+	bool req_needs_modeset = false;
+	/* Refresh rate we pace frames at with VRR instead of switching modes,
+	 * 0 if none. See drm_get_refresh. */
+	std::atomic < int > virtual_refresh;
 
 	std::unordered_map< std::string, int > connector_priorities;
 
@@ -228,17 +331,32 @@ extern std::atomic<uint64_t> g_drmEffectiveOrientation; // DRM_MODE_ROTATE_*
 bool init_drm(struct drm_t *drm, int width, int height, int refresh, bool wants_adaptive_sync);
 void finish_drm(struct drm_t *drm);
 int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo );
-int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo );
+int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo, const FrameInfo_t::Layer_t *compositionLayer = nullptr );
 void drm_rollback( struct drm_t *drm );
+void drm_drop_prepared( struct drm_t *drm );
+uint32_t drm_get_composited_layers( struct drm_t *drm );
+bool drm_has_cursor_plane( struct drm_t *drm );
+bool drm_mirror_active( struct drm_t *drm );
+bool drm_mirror_requested( void );
+bool drm_fbid_in_flight( struct drm_t *drm, uint32_t fbid );
+int drm_wait_for_free_fbid( struct drm_t *drm, const std::vector< uint32_t > &fbids );
+bool drm_supports_writeback( struct drm_t *drm, uint32_t format );
+int drm_prepare_writeback( struct drm_t *drm, uint32_t fbid, int *out_fence_fd );
+bool drm_update_cursor( struct drm_t *drm, const FrameInfo_t::Layer_t *layer );
 bool drm_poll_state(struct drm_t *drm);
 uint32_t drm_fbid_from_dmabuf( struct drm_t *drm, struct wlr_buffer *buf, struct wlr_dmabuf_attributes *dma_buf );
 void drm_lock_fbid( struct drm_t *drm, uint32_t fbid );
 void drm_unlock_fbid( struct drm_t *drm, uint32_t fbid );
 void drm_drop_fbid( struct drm_t *drm, uint32_t fbid );
+void drm_reclaim_fbs( struct drm_t *drm );
+int drm_dup_flip_out_fence( struct drm_t *drm );
+void drm_retire_signalled_flips( struct drm_t *drm );
 bool drm_set_connector( struct drm_t *drm, struct connector *conn );
 bool drm_set_mode( struct drm_t *drm, const drmModeModeInfo *mode );
 bool drm_set_refresh( struct drm_t *drm, int refresh );
 bool drm_set_resolution( struct drm_t *drm, int width, int height );
+bool drm_can_switch_refresh_seamlessly( struct drm_t *drm, int refresh );
+int drm_get_refresh( struct drm_t *drm );
 bool drm_set_color_linear_gains(struct drm_t *drm, float *gains);
 bool drm_set_color_gains(struct drm_t *drm, float *gains);
 bool drm_set_color_mtx(struct drm_t *drm, float *mtx, enum drm_screen_type screen_type);
@@ -262,4 +380,13 @@ const char *drm_get_device_name(struct drm_t *drm);
 
 std::pair<uint32_t, uint32_t> drm_get_connector_identifier(struct drm_t *drm);
 
+#if HAVE_DRM_BENCHMARK
+/* Implemented in drmbench.cpp, see --drm-benchmark */
+bool drm_run_benchmark( int frames );
+
+/* Implemented in drmfake.cpp, see GAMESCOPE_DRM_DEVICE=fake */
+bool drm_fake_requested( void );
+int drm_fake_open( const char *device_name );
+#endif
+
 extern bool g_bSupportsAsyncFlips;
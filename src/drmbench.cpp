@@ -0,0 +1,233 @@
+// Drives drm_prepare/drm_commit with synthetic scenes and reports how much CPU
+// time they take per frame, without clients or the compositor in the way.
+//
+// Meant to be run against the fake KMS device in drmfake.cpp (set
+// GAMESCOPE_DRM_DEVICE=fake), which needs neither a display nor a seat, so it
+// can run in CI, or against a display-only device such as vkms
+// (GAMESCOPE_DRM_DEVICE=/dev/dri/cardN).
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "drm.hpp"
+#include "main.hpp"
+#include "rendervulkan.hpp"
+#include "steamcompmgr.hpp"
+#include "log.hpp"
+
+static LogScope bench_log("drmbench");
+
+// Like a game's swapchain, each layer cycles through a few buffers
+static const int k_nBenchBuffers = 3;
+
+struct BenchLayer_t
+{
+	std::shared_ptr<CVulkanTexture> buffers[ k_nBenchBuffers ];
+	uint32_t zpos;
+	float opacity;
+	bool bMoving;
+};
+
+struct BenchScene_t
+{
+	const char *name;
+	std::vector< BenchLayer_t > layers;
+};
+
+struct BenchStats_t
+{
+	std::vector< uint64_t > prepareTimes;
+	std::vector< uint64_t > commitTimes;
+	int nRejected = 0;
+};
+
+static std::shared_ptr<CVulkanTexture> bench_create_buffer( uint32_t width, uint32_t height, uint32_t drmFormat )
+{
+	CVulkanTexture::createFlags flags;
+	flags.bFlippable = true;
+	flags.bSampled = true;
+
+	// Contents are left undefined, KMS doesn't care
+	auto tex = std::make_shared<CVulkanTexture>();
+	if ( !tex->BInit( width, height, drmFormat, flags ) || tex->fbid() == 0 )
+		return nullptr;
+
+	return tex;
+}
+
+static bool bench_add_layer( BenchScene_t &scene, uint32_t width, uint32_t height, uint32_t drmFormat, uint32_t zpos, float opacity, bool bMoving )
+{
+	BenchLayer_t layer;
+	for ( int i = 0; i < k_nBenchBuffers; i++ )
+	{
+		layer.buffers[ i ] = bench_create_buffer( width, height, drmFormat );
+		if ( layer.buffers[ i ] == nullptr )
+		{
+			bench_log.errorf( "failed to create %ux%u buffer for scene '%s'", width, height, scene.name );
+			return false;
+		}
+	}
+	layer.zpos = zpos;
+	layer.opacity = opacity;
+	layer.bMoving = bMoving;
+
+	scene.layers.push_back( layer );
+	return true;
+}
+
+static void bench_make_frame( const BenchScene_t &scene, int frame, FrameInfo_t *frameInfo )
+{
+	*frameInfo = {};
+	frameInfo->layerCount = scene.layers.size();
+
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
+	{
+		const BenchLayer_t &benchLayer = scene.layers[ i ];
+		FrameInfo_t::Layer_t *layer = &frameInfo->layers[ i ];
+
+		layer->tex = benchLayer.buffers[ frame % k_nBenchBuffers ];
+		layer->fbid = layer->tex->fbid();
+		layer->zpos = benchLayer.zpos;
+		layer->opacity = benchLayer.opacity;
+
+		// Centered, scaled up to fit the output
+		float scale = std::min( (float)g_nOutputWidth / layer->tex->width(), (float)g_nOutputHeight / layer->tex->height() );
+		if ( benchLayer.zpos != g_zposBase )
+			scale = 1.0f;
+
+		layer->scale.x = 1.0f / scale;
+		layer->scale.y = 1.0f / scale;
+		layer->offset.x = -( g_nOutputWidth - layer->tex->width() * scale ) / 2.0f;
+		layer->offset.y = -( g_nOutputHeight - layer->tex->height() * scale ) / 2.0f;
+
+		if ( benchLayer.bMoving )
+		{
+			layer->offset.x = -(float)( ( frame * 7 ) % std::max( 1u, g_nOutputWidth - layer->tex->width() ) );
+			layer->offset.y = -(float)( ( frame * 3 ) % std::max( 1u, g_nOutputHeight - layer->tex->height() ) );
+		}
+	}
+}
+
+static uint64_t bench_percentile( std::vector< uint64_t > times, int percentile )
+{
+	if ( times.empty() )
+		return 0;
+
+	std::sort( times.begin(), times.end() );
+	return times[ std::min( times.size() - 1, times.size() * percentile / 100 ) ];
+}
+
+static void bench_report( const char *name, const char *what, const std::vector< uint64_t > &times )
+{
+	if ( times.empty() )
+	{
+		bench_log.infof( "%-24s %-8s no samples", name, what );
+		return;
+	}
+
+	uint64_t total = 0;
+	for ( uint64_t time : times )
+		total += time;
+
+	bench_log.infof( "%-24s %-8s avg %7.1fus  p50 %7.1fus  p99 %7.1fus  max %7.1fus",
+		name, what,
+		total / (double)times.size() / 1000.0,
+		bench_percentile( times, 50 ) / 1000.0,
+		bench_percentile( times, 99 ) / 1000.0,
+		bench_percentile( times, 100 ) / 1000.0 );
+}
+
+static void bench_run_frames( const std::vector< const BenchScene_t * > &scenes, int frames, BenchStats_t *stats )
+{
+	// Async flips can only change FB_ID, so every layout change would fail
+	// and get cached as such: we'd be timing the cache, not liftoff.
+	const bool async = false;
+
+	for ( int frame = 0; frame < frames; frame++ )
+	{
+		const BenchScene_t &scene = *scenes[ frame % scenes.size() ];
+
+		FrameInfo_t frameInfo;
+		bench_make_frame( scene, frame, &frameInfo );
+
+		uint64_t start = get_time_in_nanos();
+		int ret = drm_prepare( &g_DRM, async, &frameInfo );
+		uint64_t prepared = get_time_in_nanos();
+
+		stats->prepareTimes.push_back( prepared - start );
+
+		if ( ret != 0 )
+		{
+			// steamcompmgr would composite this one instead
+			drm_rollback( &g_DRM );
+			stats->nRejected++;
+			continue;
+		}
+
+		drm_commit( &g_DRM, &frameInfo );
+		stats->commitTimes.push_back( get_time_in_nanos() - prepared );
+
+		// What steamcompmgr's main loop does between frames
+		drm_retire_signalled_flips( &g_DRM );
+		drm_reclaim_fbs( &g_DRM );
+	}
+}
+
+bool drm_run_benchmark( int frames )
+{
+	if ( BIsNested() )
+	{
+		bench_log.errorf( "the DRM benchmark needs to run on a KMS device" );
+		return false;
+	}
+
+	const uint32_t width = g_nOutputWidth;
+	const uint32_t height = g_nOutputHeight;
+
+	std::vector< BenchScene_t > scenes( 4 );
+	scenes[0].name = "fullscreen";
+	scenes[1].name = "scaled";
+	scenes[2].name = "overlay";
+	scenes[3].name = "overlay+cursor";
+
+	bool bOk = true;
+	bOk = bOk && bench_add_layer( scenes[0], width, height, g_nDRMFormat, g_zposBase, 1.0f, false );
+	bOk = bOk && bench_add_layer( scenes[1], width * 2 / 3, height * 2 / 3, g_nDRMFormat, g_zposBase, 1.0f, false );
+	bOk = bOk && bench_add_layer( scenes[2], width, height, g_nDRMFormat, g_zposBase, 1.0f, false );
+	bOk = bOk && bench_add_layer( scenes[2], width, height, DRM_FORMAT_ARGB8888, g_zposOverlay, 0.5f, false );
+	bOk = bOk && bench_add_layer( scenes[3], width, height, g_nDRMFormat, g_zposBase, 1.0f, false );
+	bOk = bOk && bench_add_layer( scenes[3], width, height, DRM_FORMAT_ARGB8888, g_zposOverlay, 0.5f, false );
+	bOk = bOk && bench_add_layer( scenes[3], 64, 64, DRM_FORMAT_ARGB8888, g_zposCursor, 1.0f, true );
+	if ( !bOk )
+		return false;
+
+	bench_log.infof( "running %d frames per scene at %ux%u", frames, width, height );
+
+	for ( const auto &scene : scenes )
+	{
+		BenchStats_t stats;
+		bench_run_frames( { &scene }, frames, &stats );
+
+		bench_report( scene.name, "prepare", stats.prepareTimes );
+		bench_report( scene.name, "commit", stats.commitTimes );
+		if ( stats.nRejected )
+			bench_log.infof( "%-24s %d/%d frames couldn't be scanned out directly", scene.name, stats.nRejected, frames );
+	}
+
+	// The layout changing every frame, which is what the liftoff caches
+	// are there for
+	{
+		std::vector< const BenchScene_t * > allScenes;
+		for ( const auto &scene : scenes )
+			allScenes.push_back( &scene );
+
+		BenchStats_t stats;
+		bench_run_frames( allScenes, frames, &stats );
+
+		bench_report( "changing layouts", "prepare", stats.prepareTimes );
+		bench_report( "changing layouts", "commit", stats.commitTimes );
+	}
+
+	return true;
+}
@@ -0,0 +1,1607 @@
+// A fake KMS device, so that --drm-benchmark can drive drm.cpp and libliftoff
+// without a display, a seat or even a KMS driver, e.g. in CI. Selected with
+// GAMESCOPE_DRM_DEVICE=fake, optionally followed by options:
+//
+//   GAMESCOPE_DRM_DEVICE=fake:overlays=1,scaling=0,commit_us=300
+//
+//   outputs=N         connectors, each with its own CRTC and primary plane (1)
+//   overlays=N        overlay planes, usable on any CRTC (3)
+//   cursor=0|1        a cursor plane per CRTC (1)
+//   scaling=0|1       whether primary and overlay planes can scale (1)
+//   async=0|1         DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP (1)
+//   vrr=0|1           VRR-capable connectors (1)
+//   seamless=0|1      refresh rate switches don't need a modeset (0)
+//   width=N,height=N,refresh=N   preferred mode (1920x1080@60)
+//   modifiers=0x..:0x..          modifiers scanned out on top of LINEAR
+//   commit_us=N       time a commit spends in the ioctl (0)
+//   test_us=N         time a TEST_ONLY commit spends in the ioctl (0)
+//   event_us=N        delay of page-flip events after the vblank (0)
+//
+// It's an ioctl shim rather than a backend, so that drm.cpp and libliftoff
+// run unmodified: drm_fake_open hands out one end of a pipe, which carries the
+// page-flip events for drmHandleEvent, and the KMS ioctls libdrm issues on it
+// (or on the dups libliftoff makes) are answered here instead of the kernel.
+// Atomic commits go through the same checks as the kernel's atomic core and a
+// typical driver's: formats and modifiers per plane, scaling, planes on
+// disabled CRTCs, overlays without a primary plane, modesets without
+// ALLOW_MODESET, async flips changing anything but the primary plane's FB_ID
+// and commits to a CRTC that still has a flip pending. Flips land on the next
+// vblank of the CRTC's mode, or right away with VRR or async flips.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "drm.hpp"
+#include "modegen.hpp"
+#include "steamcompmgr.hpp"
+#include "log.hpp"
+
+static LogScope fake_log("drmfake");
+
+struct FakeConfig_t
+{
+	int nOutputs = 1;
+	int nOverlays = 3;
+	bool bCursor = true;
+	bool bScaling = true;
+	bool bAsync = true;
+	bool bVRR = true;
+	bool bSeamless = false;
+	int nWidth = 1920;
+	int nHeight = 1080;
+	int nRefresh = 60;
+	std::vector< uint64_t > modifiers;
+	uint64_t ulCommitTime = 0;
+	uint64_t ulTestTime = 0;
+	uint64_t ulEventDelay = 0;
+};
+
+// Where each property's value lives in an object's FakeValues_t
+enum EFakeSlot
+{
+	FAKE_SLOT_TYPE,
+	FAKE_SLOT_FB_ID,
+	FAKE_SLOT_CRTC_ID,
+	FAKE_SLOT_SRC_X,
+	FAKE_SLOT_SRC_Y,
+	FAKE_SLOT_SRC_W,
+	FAKE_SLOT_SRC_H,
+	FAKE_SLOT_CRTC_X,
+	FAKE_SLOT_CRTC_Y,
+	FAKE_SLOT_CRTC_W,
+	FAKE_SLOT_CRTC_H,
+	FAKE_SLOT_ZPOS,
+	FAKE_SLOT_ALPHA,
+	FAKE_SLOT_ROTATION,
+	FAKE_SLOT_COLOR_ENCODING,
+	FAKE_SLOT_COLOR_RANGE,
+	FAKE_SLOT_IN_FENCE_FD,
+	FAKE_SLOT_IN_FORMATS,
+	FAKE_SLOT_ACTIVE,
+	FAKE_SLOT_MODE_ID,
+	FAKE_SLOT_GAMMA_LUT,
+	FAKE_SLOT_GAMMA_LUT_SIZE,
+	FAKE_SLOT_DEGAMMA_LUT,
+	FAKE_SLOT_DEGAMMA_LUT_SIZE,
+	FAKE_SLOT_CTM,
+	FAKE_SLOT_VRR_ENABLED,
+	FAKE_SLOT_VRR_CAPABLE,
+	FAKE_SLOT_COUNT,
+};
+
+static const EFakeSlot k_eFakeBlobSlots[] = { FAKE_SLOT_MODE_ID, FAKE_SLOT_GAMMA_LUT, FAKE_SLOT_DEGAMMA_LUT, FAKE_SLOT_CTM };
+
+static const uint32_t k_nFakeLutSize = 4096;
+static const uint32_t k_nFakeCursorSize = 64;
+
+struct FakeProp_t
+{
+	uint32_t id;
+	std::string name;
+	uint32_t flags;
+	// Range bounds, enum values, bitmask bits or object type
+	std::vector< uint64_t > values;
+	std::vector< std::string > enumNames;
+};
+
+// A CRTC, connector or plane. Property values are in FakeState_t.
+struct FakeObject_t
+{
+	uint32_t id;
+	// Property attached in each slot, or 0
+	uint32_t props[ FAKE_SLOT_COUNT ];
+};
+
+struct FakeCrtc_t : FakeObject_t
+{
+	// ns between vblanks, 0 while off
+	uint64_t period;
+	uint64_t lastVblank;
+	uint32_t sequence;
+	bool bFlipPending;
+};
+
+struct FakeEncoder_t
+{
+	uint32_t id;
+	uint32_t possible_crtcs;
+};
+
+struct FakeConnector_t : FakeObject_t
+{
+	uint32_t encoder_id;
+	uint32_t type_id;
+	std::vector< drmModeModeInfo > modes;
+};
+
+struct FakePlane_t : FakeObject_t
+{
+	uint64_t type;
+	uint32_t possible_crtcs;
+	bool bScaling;
+	std::vector< uint32_t > formats;
+	// Modifiers besides LINEAR, for the formats that aren't YUV
+	std::vector< uint64_t > modifiers;
+};
+
+typedef std::array< uint64_t, FAKE_SLOT_COUNT > FakeValues_t;
+
+// What atomic commits change. In the same order as FakeDevice_t's objects.
+struct FakeState_t
+{
+	std::vector< FakeValues_t > crtcs;
+	std::vector< FakeValues_t > connectors;
+	std::vector< FakeValues_t > planes;
+};
+
+struct FakeBlob_t
+{
+	std::vector< uint8_t > data;
+	// Still has the handle CREATEPROPBLOB gave out, or was made by us
+	bool bUser;
+	bool bKernel;
+};
+
+struct FakeFb_t
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	// DRM_FORMAT_MOD_INVALID for implicit modifiers
+	uint64_t modifier;
+};
+
+struct FakeFlip_t
+{
+	size_t crtc;
+	bool bEvent;
+	struct drm_event_vblank event;
+};
+
+struct FakeDevice_t
+{
+	FakeConfig_t config;
+
+	// Of the pipe, which both ends and any dups share
+	dev_t st_dev;
+	ino_t st_ino;
+	int writeFd;
+
+	std::mutex lock;
+	// Wakes the event thread up
+	std::condition_variable eventCV;
+	// Signalled as flips land
+	std::condition_variable flipCV;
+
+	uint32_t nextId = 1;
+	uint32_t nextHandle = 1;
+	bool bUniversalPlanes = false;
+	bool bAtomic = false;
+
+	std::map< uint32_t, FakeProp_t > props;
+	std::vector< FakeCrtc_t > crtcs;
+	std::vector< FakeEncoder_t > encoders;
+	std::vector< FakeConnector_t > connectors;
+	std::vector< FakePlane_t > planes;
+	FakeState_t current;
+
+	std::map< uint32_t, FakeBlob_t > blobs;
+	std::map< uint32_t, FakeFb_t > fbs;
+	// GEM handle of each dma-buf imported, by inode
+	std::map< std::pair< dev_t, ino_t >, uint32_t > handles;
+
+	// By the time they land, plus event_us
+	std::multimap< uint64_t, FakeFlip_t > flips;
+
+	std::set< unsigned long > unsupportedIoctls;
+};
+
+static std::atomic< FakeDevice_t * > s_pFakeDevice = { nullptr };
+
+bool drm_fake_requested( void )
+{
+	const char *device = getenv( "GAMESCOPE_DRM_DEVICE" );
+	return device != nullptr && ( strcmp( device, "fake" ) == 0 || strncmp( device, "fake:", 5 ) == 0 );
+}
+
+static bool fake_parse_config( const char *str, FakeConfig_t *config )
+{
+	std::string opts = str;
+	size_t pos = 0;
+	while ( pos < opts.size() )
+	{
+		size_t end = opts.find( ',', pos );
+		if ( end == std::string::npos )
+			end = opts.size();
+
+		std::string opt = opts.substr( pos, end - pos );
+		pos = end + 1;
+
+		size_t eq = opt.find( '=' );
+		if ( eq == std::string::npos )
+		{
+			fake_log.errorf( "option '%s' has no value", opt.c_str() );
+			return false;
+		}
+
+		std::string key = opt.substr( 0, eq );
+		const char *value = opt.c_str() + eq + 1;
+		long n = strtol( value, nullptr, 0 );
+
+		if ( key == "outputs" )
+			config->nOutputs = std::clamp( n, 1l, 8l );
+		else if ( key == "overlays" )
+			config->nOverlays = std::clamp( n, 0l, 16l );
+		else if ( key == "cursor" )
+			config->bCursor = n != 0;
+		else if ( key == "scaling" )
+			config->bScaling = n != 0;
+		else if ( key == "async" )
+			config->bAsync = n != 0;
+		else if ( key == "vrr" )
+			config->bVRR = n != 0;
+		else if ( key == "seamless" )
+			config->bSeamless = n != 0;
+		else if ( key == "width" )
+			config->nWidth = n;
+		else if ( key == "height" )
+			config->nHeight = n;
+		else if ( key == "refresh" )
+			config->nRefresh = n;
+		else if ( key == "commit_us" )
+			config->ulCommitTime = n * 1'000lu;
+		else if ( key == "test_us" )
+			config->ulTestTime = n * 1'000lu;
+		else if ( key == "event_us" )
+			config->ulEventDelay = n * 1'000lu;
+		else if ( key == "modifiers" )
+		{
+			char *next = (char *)value;
+			while ( *next != '\0' )
+			{
+				config->modifiers.push_back( strtoull( next, &next, 16 ) );
+				if ( *next == ':' )
+					next++;
+			}
+		}
+		else
+		{
+			fake_log.errorf( "unknown option '%s'", key.c_str() );
+			return false;
+		}
+	}
+
+	if ( config->nWidth <= 0 || config->nHeight <= 0 || config->nRefresh <= 0 )
+	{
+		fake_log.errorf( "invalid mode %dx%d@%d", config->nWidth, config->nHeight, config->nRefresh );
+		return false;
+	}
+
+	return true;
+}
+
+static uint32_t fake_add_prop( FakeDevice_t *dev, const char *name, uint32_t flags, std::vector< uint64_t > values = {}, std::vector< std::string > enumNames = {} )
+{
+	uint32_t id = dev->nextId++;
+	dev->props[ id ] = { id, name, flags, std::move( values ), std::move( enumNames ) };
+	return id;
+}
+
+static uint32_t fake_add_blob( FakeDevice_t *dev, const void *data, size_t size, bool bKernel )
+{
+	uint32_t id = dev->nextId++;
+	const uint8_t *bytes = (const uint8_t *)data;
+	dev->blobs[ id ] = { std::vector< uint8_t >( bytes, bytes + size ), !bKernel, bKernel };
+	return id;
+}
+
+static void fake_attach( FakeObject_t *obj, FakeValues_t *values, EFakeSlot eSlot, uint32_t prop, uint64_t value )
+{
+	obj->props[ eSlot ] = prop;
+	( *values )[ eSlot ] = value;
+}
+
+static bool fake_format_is_yuv( uint32_t format )
+{
+	return format == DRM_FORMAT_NV12 || format == DRM_FORMAT_P010;
+}
+
+static uint32_t fake_format_planes( uint32_t format )
+{
+	return fake_format_is_yuv( format ) ? 2 : 1;
+}
+
+static uint32_t fake_make_in_formats( FakeDevice_t *dev, const FakePlane_t &plane )
+{
+	std::vector< uint64_t > modifiers = { DRM_FORMAT_MOD_LINEAR };
+	modifiers.insert( modifiers.end(), plane.modifiers.begin(), plane.modifiers.end() );
+
+	assert( plane.formats.size() <= 64 );
+
+	size_t formats_offset = sizeof( struct drm_format_modifier_blob );
+	size_t modifiers_offset = formats_offset + ( ( plane.formats.size() * sizeof( uint32_t ) + 7 ) & ~7 );
+	std::vector< uint8_t > data( modifiers_offset + modifiers.size() * sizeof( struct drm_format_modifier ) );
+
+	struct drm_format_modifier_blob *header = (struct drm_format_modifier_blob *)data.data();
+	header->version = FORMAT_BLOB_CURRENT;
+	header->count_formats = plane.formats.size();
+	header->formats_offset = formats_offset;
+	header->count_modifiers = modifiers.size();
+	header->modifiers_offset = modifiers_offset;
+
+	memcpy( data.data() + formats_offset, plane.formats.data(), plane.formats.size() * sizeof( uint32_t ) );
+
+	struct drm_format_modifier *mods = (struct drm_format_modifier *)( data.data() + modifiers_offset );
+	for ( size_t i = 0; i < modifiers.size(); i++ )
+	{
+		mods[ i ].modifier = modifiers[ i ];
+		for ( size_t j = 0; j < plane.formats.size(); j++ )
+		{
+			if ( modifiers[ i ] == DRM_FORMAT_MOD_LINEAR || !fake_format_is_yuv( plane.formats[ j ] ) )
+				mods[ i ].formats |= 1ull << j;
+		}
+	}
+
+	return fake_add_blob( dev, data.data(), data.size(), true );
+}
+
+static void fake_add_mode( std::vector< drmModeModeInfo > *modes, int width, int height, int refresh, bool bPreferred )
+{
+	for ( const auto &mode : *modes )
+	{
+		if ( mode.hdisplay == width && mode.vdisplay == height && (int)mode.vrefresh == refresh )
+			return;
+	}
+
+	drmModeModeInfo mode = {};
+	generate_cvt_mode( &mode, width, height, refresh, true, false );
+	mode.type = DRM_MODE_TYPE_DRIVER | ( bPreferred ? DRM_MODE_TYPE_PREFERRED : 0 );
+	modes->push_back( mode );
+}
+
+static void fake_create_objects( FakeDevice_t *dev )
+{
+	const FakeConfig_t &config = dev->config;
+
+	// Like the kernel's, most properties are shared by all objects of a kind
+	uint32_t propType = fake_add_prop( dev, "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE,
+		{ DRM_PLANE_TYPE_OVERLAY, DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_CURSOR }, { "Overlay", "Primary", "Cursor" } );
+	uint32_t propFbId = fake_add_prop( dev, "FB_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { DRM_MODE_OBJECT_FB } );
+	uint32_t propCrtcId = fake_add_prop( dev, "CRTC_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { DRM_MODE_OBJECT_CRTC } );
+	uint32_t propSrcX = fake_add_prop( dev, "SRC_X", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, UINT32_MAX } );
+	uint32_t propSrcY = fake_add_prop( dev, "SRC_Y", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, UINT32_MAX } );
+	uint32_t propSrcW = fake_add_prop( dev, "SRC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, UINT32_MAX } );
+	uint32_t propSrcH = fake_add_prop( dev, "SRC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, UINT32_MAX } );
+	uint32_t propCrtcX = fake_add_prop( dev, "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { (uint64_t)(int64_t)INT32_MIN, INT32_MAX } );
+	uint32_t propCrtcY = fake_add_prop( dev, "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { (uint64_t)(int64_t)INT32_MIN, INT32_MAX } );
+	uint32_t propCrtcW = fake_add_prop( dev, "CRTC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, INT32_MAX } );
+	uint32_t propCrtcH = fake_add_prop( dev, "CRTC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, INT32_MAX } );
+	uint32_t propInFenceFd = fake_add_prop( dev, "IN_FENCE_FD", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC, { (uint64_t)(int64_t)-1, INT32_MAX } );
+	uint32_t propInFormats = fake_add_prop( dev, "IN_FORMATS", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE );
+	uint32_t propAlpha = fake_add_prop( dev, "alpha", DRM_MODE_PROP_RANGE, { 0, 0xffff } );
+	uint32_t propRotation = fake_add_prop( dev, "rotation", DRM_MODE_PROP_BITMASK,
+		{ 0, 2, 4, 5 }, { "rotate-0", "rotate-180", "reflect-x", "reflect-y" } );
+	uint32_t propCursorRotation = fake_add_prop( dev, "rotation", DRM_MODE_PROP_BITMASK, { 0 }, { "rotate-0" } );
+	uint32_t propColorEncoding = fake_add_prop( dev, "COLOR_ENCODING", DRM_MODE_PROP_ENUM,
+		{ 0, 1, 2 }, { "ITU-R BT.601 YCbCr", "ITU-R BT.709 YCbCr", "ITU-R BT.2020 YCbCr" } );
+	uint32_t propColorRange = fake_add_prop( dev, "COLOR_RANGE", DRM_MODE_PROP_ENUM,
+		{ 0, 1 }, { "YCbCr limited range", "YCbCr full range" } );
+
+	uint32_t propActive = fake_add_prop( dev, "ACTIVE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, 1 } );
+	uint32_t propModeId = fake_add_prop( dev, "MODE_ID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC );
+	uint32_t propGammaLut = fake_add_prop( dev, "GAMMA_LUT", DRM_MODE_PROP_BLOB );
+	uint32_t propGammaLutSize = fake_add_prop( dev, "GAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { 0, UINT32_MAX } );
+	uint32_t propDegammaLut = fake_add_prop( dev, "DEGAMMA_LUT", DRM_MODE_PROP_BLOB );
+	uint32_t propDegammaLutSize = fake_add_prop( dev, "DEGAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { 0, UINT32_MAX } );
+	uint32_t propCtm = fake_add_prop( dev, "CTM", DRM_MODE_PROP_BLOB );
+	uint32_t propVrrEnabled = fake_add_prop( dev, "VRR_ENABLED", DRM_MODE_PROP_RANGE, { 0, 1 } );
+	uint32_t propVrrCapable = fake_add_prop( dev, "vrr_capable", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { 0, 1 } );
+
+	uint32_t all_crtcs = ( 1u << config.nOutputs ) - 1;
+
+	for ( int i = 0; i < config.nOutputs; i++ )
+	{
+		FakeCrtc_t crtc = {};
+		FakeValues_t values = {};
+		crtc.id = dev->nextId++;
+		fake_attach( &crtc, &values, FAKE_SLOT_ACTIVE, propActive, 0 );
+		fake_attach( &crtc, &values, FAKE_SLOT_MODE_ID, propModeId, 0 );
+		fake_attach( &crtc, &values, FAKE_SLOT_GAMMA_LUT, propGammaLut, 0 );
+		fake_attach( &crtc, &values, FAKE_SLOT_GAMMA_LUT_SIZE, propGammaLutSize, k_nFakeLutSize );
+		fake_attach( &crtc, &values, FAKE_SLOT_DEGAMMA_LUT, propDegammaLut, 0 );
+		fake_attach( &crtc, &values, FAKE_SLOT_DEGAMMA_LUT_SIZE, propDegammaLutSize, k_nFakeLutSize );
+		fake_attach( &crtc, &values, FAKE_SLOT_CTM, propCtm, 0 );
+		fake_attach( &crtc, &values, FAKE_SLOT_VRR_ENABLED, propVrrEnabled, 0 );
+		dev->crtcs.push_back( crtc );
+		dev->current.crtcs.push_back( values );
+
+		dev->encoders.push_back( { dev->nextId++, 1u << i } );
+
+		FakeConnector_t conn = {};
+		values = {};
+		conn.id = dev->nextId++;
+		conn.encoder_id = dev->encoders.back().id;
+		conn.type_id = i + 1;
+		fake_add_mode( &conn.modes, config.nWidth, config.nHeight, config.nRefresh, true );
+		fake_add_mode( &conn.modes, config.nWidth, config.nHeight, 60, false );
+		fake_add_mode( &conn.modes, 1280, 800, 60, false );
+		fake_add_mode( &conn.modes, 1280, 720, 60, false );
+		fake_attach( &conn, &values, FAKE_SLOT_CRTC_ID, propCrtcId, 0 );
+		fake_attach( &conn, &values, FAKE_SLOT_VRR_CAPABLE, propVrrCapable, config.bVRR );
+		dev->connectors.push_back( conn );
+		dev->current.connectors.push_back( values );
+	}
+
+	const std::vector< uint32_t > rgbFormats = {
+		DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888,
+		DRM_FORMAT_RGB565, DRM_FORMAT_XRGB2101010, DRM_FORMAT_ARGB2101010,
+		DRM_FORMAT_XBGR2101010, DRM_FORMAT_ABGR2101010,
+	};
+	std::vector< uint32_t > overlayFormats = rgbFormats;
+	overlayFormats.push_back( DRM_FORMAT_NV12 );
+	overlayFormats.push_back( DRM_FORMAT_P010 );
+
+	// Primaries first, then overlays, then cursors, each type stacked above
+	// the previous one
+	int nPlanes = config.nOutputs + config.nOverlays + ( config.bCursor ? config.nOutputs : 0 );
+	for ( int i = 0; i < nPlanes; i++ )
+	{
+		FakePlane_t plane = {};
+		FakeValues_t values = {};
+		plane.id = dev->nextId++;
+
+		uint64_t zpos;
+		if ( i < config.nOutputs )
+		{
+			plane.type = DRM_PLANE_TYPE_PRIMARY;
+			plane.possible_crtcs = 1u << i;
+			plane.bScaling = config.bScaling;
+			plane.formats = rgbFormats;
+			zpos = 0;
+		}
+		else if ( i < config.nOutputs + config.nOverlays )
+		{
+			plane.type = DRM_PLANE_TYPE_OVERLAY;
+			plane.possible_crtcs = all_crtcs;
+			plane.bScaling = config.bScaling;
+			plane.formats = overlayFormats;
+			zpos = i - config.nOutputs + 1;
+		}
+		else
+		{
+			plane.type = DRM_PLANE_TYPE_CURSOR;
+			plane.possible_crtcs = 1u << ( i - config.nOutputs - config.nOverlays );
+			plane.bScaling = false;
+			plane.formats = { DRM_FORMAT_ARGB8888 };
+			zpos = config.nOverlays + 1;
+		}
+		if ( plane.type != DRM_PLANE_TYPE_CURSOR )
+			plane.modifiers = config.modifiers;
+
+		fake_attach( &plane, &values, FAKE_SLOT_TYPE, propType, plane.type );
+		fake_attach( &plane, &values, FAKE_SLOT_FB_ID, propFbId, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_CRTC_ID, propCrtcId, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_SRC_X, propSrcX, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_SRC_Y, propSrcY, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_SRC_W, propSrcW, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_SRC_H, propSrcH, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_CRTC_X, propCrtcX, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_CRTC_Y, propCrtcY, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_CRTC_W, propCrtcW, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_CRTC_H, propCrtcH, 0 );
+		fake_attach( &plane, &values, FAKE_SLOT_IN_FENCE_FD, propInFenceFd, (uint64_t)(int64_t)-1 );
+		fake_attach( &plane, &values, FAKE_SLOT_IN_FORMATS, propInFormats, fake_make_in_formats( dev, plane ) );
+
+		// Immutable, so each plane gets its own
+		uint32_t propZpos = fake_add_prop( dev, "zpos", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { zpos, zpos } );
+		fake_attach( &plane, &values, FAKE_SLOT_ZPOS, propZpos, zpos );
+
+		if ( plane.type == DRM_PLANE_TYPE_CURSOR )
+		{
+			fake_attach( &plane, &values, FAKE_SLOT_ROTATION, propCursorRotation, DRM_MODE_ROTATE_0 );
+		}
+		else
+		{
+			fake_attach( &plane, &values, FAKE_SLOT_ALPHA, propAlpha, 0xffff );
+			fake_attach( &plane, &values, FAKE_SLOT_ROTATION, propRotation, DRM_MODE_ROTATE_0 );
+		}
+
+		if ( plane.type == DRM_PLANE_TYPE_OVERLAY )
+		{
+			fake_attach( &plane, &values, FAKE_SLOT_COLOR_ENCODING, propColorEncoding, 1 );
+			fake_attach( &plane, &values, FAKE_SLOT_COLOR_RANGE, propColorRange, 0 );
+		}
+
+		dev->planes.push_back( plane );
+		dev->current.planes.push_back( values );
+	}
+}
+
+/* Finds a CRTC, connector or plane. */
+static FakeObject_t *fake_find_object( FakeDevice_t *dev, uint32_t id, uint32_t *type, size_t *index )
+{
+	for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+	{
+		if ( dev->crtcs[ i ].id == id )
+		{
+			*type = DRM_MODE_OBJECT_CRTC;
+			*index = i;
+			return &dev->crtcs[ i ];
+		}
+	}
+	for ( size_t i = 0; i < dev->connectors.size(); i++ )
+	{
+		if ( dev->connectors[ i ].id == id )
+		{
+			*type = DRM_MODE_OBJECT_CONNECTOR;
+			*index = i;
+			return &dev->connectors[ i ];
+		}
+	}
+	for ( size_t i = 0; i < dev->planes.size(); i++ )
+	{
+		if ( dev->planes[ i ].id == id )
+		{
+			*type = DRM_MODE_OBJECT_PLANE;
+			*index = i;
+			return &dev->planes[ i ];
+		}
+	}
+	return nullptr;
+}
+
+static FakeValues_t *fake_object_values( FakeState_t *state, uint32_t type, size_t index )
+{
+	switch ( type )
+	{
+	case DRM_MODE_OBJECT_CRTC:
+		return &state->crtcs[ index ];
+	case DRM_MODE_OBJECT_CONNECTOR:
+		return &state->connectors[ index ];
+	default:
+		return &state->planes[ index ];
+	}
+}
+
+static int fake_crtc_index( FakeDevice_t *dev, uint64_t crtc_id )
+{
+	for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+	{
+		if ( dev->crtcs[ i ].id == crtc_id )
+			return i;
+	}
+	return -1;
+}
+
+static bool fake_prop_value_valid( FakeDevice_t *dev, const FakeProp_t &prop, uint64_t value )
+{
+	switch ( prop.flags & ( DRM_MODE_PROP_LEGACY_TYPE | DRM_MODE_PROP_EXTENDED_TYPE ) )
+	{
+	case DRM_MODE_PROP_RANGE:
+		return value >= prop.values[ 0 ] && value <= prop.values[ 1 ];
+	case DRM_MODE_PROP_SIGNED_RANGE:
+		return (int64_t)value >= (int64_t)prop.values[ 0 ] && (int64_t)value <= (int64_t)prop.values[ 1 ];
+	case DRM_MODE_PROP_ENUM:
+		return std::find( prop.values.begin(), prop.values.end(), value ) != prop.values.end();
+	case DRM_MODE_PROP_BITMASK:
+	{
+		uint64_t mask = 0;
+		for ( uint64_t bit : prop.values )
+			mask |= 1ull << bit;
+		return ( value & ~mask ) == 0;
+	}
+	case DRM_MODE_PROP_OBJECT:
+		if ( value == 0 )
+			return true;
+		if ( prop.values[ 0 ] == DRM_MODE_OBJECT_FB )
+			return dev->fbs.count( value ) != 0;
+		return fake_crtc_index( dev, value ) >= 0;
+	case DRM_MODE_PROP_BLOB:
+		return value == 0 || dev->blobs.count( value ) != 0;
+	default:
+		return false;
+	}
+}
+
+static const drmModeModeInfo *fake_get_mode( FakeDevice_t *dev, uint64_t blob_id )
+{
+	if ( blob_id == 0 )
+		return nullptr;
+
+	const FakeBlob_t &blob = dev->blobs[ blob_id ];
+	if ( blob.data.size() != sizeof( drmModeModeInfo ) )
+		return nullptr;
+
+	return (const drmModeModeInfo *)blob.data.data();
+}
+
+/* ns between two vblanks of the mode */
+static uint64_t fake_mode_period( const drmModeModeInfo *mode )
+{
+	if ( mode == nullptr || mode->clock == 0 )
+		return 0;
+
+	return (uint64_t)mode->htotal * mode->vtotal * 1'000'000lu / mode->clock;
+}
+
+static bool fake_modes_equal( FakeDevice_t *dev, uint64_t a, uint64_t b )
+{
+	if ( a == b )
+		return true;
+	if ( a == 0 || b == 0 )
+		return false;
+	return dev->blobs[ a ].data == dev->blobs[ b ].data;
+}
+
+/* Whether switching between the modes takes a modeset */
+static bool fake_mode_needs_modeset( FakeDevice_t *dev, uint64_t from, uint64_t to )
+{
+	if ( fake_modes_equal( dev, from, to ) )
+		return false;
+	if ( !dev->config.bSeamless || from == 0 || to == 0 )
+		return true;
+
+	// Like a panel that changes refresh rate by stretching the vertical
+	// front porch
+	const drmModeModeInfo *a = fake_get_mode( dev, from );
+	const drmModeModeInfo *b = fake_get_mode( dev, to );
+	return a->hdisplay != b->hdisplay || a->vdisplay != b->vdisplay || a->htotal != b->htotal;
+}
+
+static bool fake_plane_check( FakeDevice_t *dev, const FakeState_t &state, size_t index )
+{
+	const FakePlane_t &plane = dev->planes[ index ];
+	const FakeValues_t &values = state.planes[ index ];
+
+	uint64_t fb_id = values[ FAKE_SLOT_FB_ID ];
+	uint64_t crtc_id = values[ FAKE_SLOT_CRTC_ID ];
+
+	if ( ( fb_id == 0 ) != ( crtc_id == 0 ) )
+	{
+		fake_log.debugf( "plane %u: FB_ID and CRTC_ID must be set together", plane.id );
+		return false;
+	}
+	if ( fb_id == 0 )
+		return true;
+
+	int crtc = fake_crtc_index( dev, crtc_id );
+	if ( !( plane.possible_crtcs & ( 1u << crtc ) ) )
+	{
+		fake_log.debugf( "plane %u: can't be used on CRTC %" PRIu64, plane.id, crtc_id );
+		return false;
+	}
+	if ( state.crtcs[ crtc ][ FAKE_SLOT_MODE_ID ] == 0 )
+	{
+		fake_log.debugf( "plane %u: CRTC %" PRIu64 " is disabled", plane.id, crtc_id );
+		return false;
+	}
+
+	const FakeFb_t &fb = dev->fbs[ fb_id ];
+	if ( std::find( plane.formats.begin(), plane.formats.end(), fb.format ) == plane.formats.end() )
+	{
+		fake_log.debugf( "plane %u: unsupported format 0x%" PRIX32, plane.id, fb.format );
+		return false;
+	}
+	if ( fb.modifier != DRM_FORMAT_MOD_INVALID && fb.modifier != DRM_FORMAT_MOD_LINEAR &&
+		( fake_format_is_yuv( fb.format ) || std::find( plane.modifiers.begin(), plane.modifiers.end(), fb.modifier ) == plane.modifiers.end() ) )
+	{
+		fake_log.debugf( "plane %u: unsupported modifier 0x%" PRIX64, plane.id, fb.modifier );
+		return false;
+	}
+
+	uint64_t src_x = values[ FAKE_SLOT_SRC_X ], src_y = values[ FAKE_SLOT_SRC_Y ];
+	uint64_t src_w = values[ FAKE_SLOT_SRC_W ], src_h = values[ FAKE_SLOT_SRC_H ];
+	uint64_t crtc_w = values[ FAKE_SLOT_CRTC_W ], crtc_h = values[ FAKE_SLOT_CRTC_H ];
+
+	if ( src_w == 0 || src_h == 0 || crtc_w == 0 || crtc_h == 0 )
+		return false;
+	if ( src_x + src_w > (uint64_t)fb.width << 16 || src_y + src_h > (uint64_t)fb.height << 16 )
+	{
+		fake_log.debugf( "plane %u: source rectangle outside of the FB", plane.id );
+		return false;
+	}
+
+	bool bScaled = src_w != crtc_w << 16 || src_h != crtc_h << 16;
+	if ( bScaled )
+	{
+		if ( !plane.bScaling )
+		{
+			fake_log.debugf( "plane %u: can't scale", plane.id );
+			return false;
+		}
+
+		// At most 4x down and 16x up
+		if ( crtc_w * 4 < src_w >> 16 || crtc_h * 4 < src_h >> 16 ||
+			crtc_w > ( src_w >> 16 ) * 16 || crtc_h > ( src_h >> 16 ) * 16 )
+		{
+			fake_log.debugf( "plane %u: scaling factor out of range", plane.id );
+			return false;
+		}
+	}
+
+	if ( plane.type == DRM_PLANE_TYPE_CURSOR && ( crtc_w > k_nFakeCursorSize || crtc_h > k_nFakeCursorSize ) )
+	{
+		fake_log.debugf( "plane %u: cursor too large", plane.id );
+		return false;
+	}
+
+	uint64_t rotation = values[ FAKE_SLOT_ROTATION ] & DRM_MODE_ROTATE_MASK;
+	if ( rotation == 0 || ( rotation & ( rotation - 1 ) ) != 0 )
+		return false;
+
+	return true;
+}
+
+static bool fake_crtc_check( FakeDevice_t *dev, const FakeState_t &state, size_t index )
+{
+	const FakeCrtc_t &crtc = dev->crtcs[ index ];
+	const FakeValues_t &values = state.crtcs[ index ];
+
+	bool bActive = values[ FAKE_SLOT_ACTIVE ] != 0;
+	uint64_t mode_id = values[ FAKE_SLOT_MODE_ID ];
+
+	if ( bActive && mode_id == 0 )
+	{
+		fake_log.debugf( "CRTC %u: active without a mode", crtc.id );
+		return false;
+	}
+	if ( mode_id != 0 && fake_get_mode( dev, mode_id ) == nullptr )
+	{
+		fake_log.debugf( "CRTC %u: MODE_ID isn't a mode", crtc.id );
+		return false;
+	}
+
+	int nConnectors = 0;
+	for ( const auto &conn : state.connectors )
+	{
+		if ( conn[ FAKE_SLOT_CRTC_ID ] == crtc.id )
+			nConnectors++;
+	}
+	if ( ( mode_id != 0 ) != ( nConnectors != 0 ) )
+	{
+		fake_log.debugf( "CRTC %u: enabled without connectors, or the other way around", crtc.id );
+		return false;
+	}
+
+	uint64_t lut = values[ FAKE_SLOT_GAMMA_LUT ];
+	if ( lut != 0 && dev->blobs[ lut ].data.size() != k_nFakeLutSize * sizeof( struct drm_color_lut ) )
+		return false;
+	lut = values[ FAKE_SLOT_DEGAMMA_LUT ];
+	if ( lut != 0 && dev->blobs[ lut ].data.size() != k_nFakeLutSize * sizeof( struct drm_color_lut ) )
+		return false;
+	uint64_t ctm = values[ FAKE_SLOT_CTM ];
+	if ( ctm != 0 && dev->blobs[ ctm ].data.size() != sizeof( struct drm_color_ctm ) )
+		return false;
+
+	// Like amdgpu, other planes need the primary plane underneath
+	bool bPrimary = false, bOthers = false;
+	for ( size_t i = 0; i < dev->planes.size(); i++ )
+	{
+		if ( state.planes[ i ][ FAKE_SLOT_CRTC_ID ] != crtc.id )
+			continue;
+		if ( dev->planes[ i ].type == DRM_PLANE_TYPE_PRIMARY )
+			bPrimary = true;
+		else
+			bOthers = true;
+	}
+	if ( bOthers && !bPrimary )
+	{
+		fake_log.debugf( "CRTC %u: planes enabled without the primary plane", crtc.id );
+		return false;
+	}
+
+	return true;
+}
+
+/* Frees the blobs whose handle got destroyed once no CRTC uses them anymore */
+static void fake_collect_blobs( FakeDevice_t *dev )
+{
+	auto it = dev->blobs.begin();
+	while ( it != dev->blobs.end() )
+	{
+		bool bUsed = it->second.bUser || it->second.bKernel;
+		for ( const auto &values : dev->current.crtcs )
+		{
+			for ( EFakeSlot eSlot : k_eFakeBlobSlots )
+				bUsed = bUsed || values[ eSlot ] == it->first;
+		}
+
+		if ( bUsed )
+			it++;
+		else
+			it = dev->blobs.erase( it );
+	}
+}
+
+/* Queues the flip of the CRTC a commit just went through, landing at its next
+ * vblank, or right away for async flips and VRR. */
+static void fake_schedule_flip( FakeDevice_t *dev, size_t index, bool bAsync, bool bEvent, uint64_t user_data )
+{
+	FakeCrtc_t &crtc = dev->crtcs[ index ];
+	uint64_t now = get_time_in_nanos();
+
+	uint64_t vblank;
+	if ( bAsync || crtc.period == 0 )
+	{
+		vblank = now;
+	}
+	else if ( dev->current.crtcs[ index ][ FAKE_SLOT_VRR_ENABLED ] )
+	{
+		vblank = std::max( now, crtc.lastVblank + crtc.period );
+	}
+	else
+	{
+		uint64_t elapsed = now > crtc.lastVblank ? now - crtc.lastVblank : 0;
+		vblank = crtc.lastVblank + ( elapsed / crtc.period + 1 ) * crtc.period;
+	}
+
+	if ( !bAsync )
+	{
+		crtc.lastVblank = vblank;
+		crtc.sequence++;
+	}
+
+	FakeFlip_t flip = {};
+	flip.crtc = index;
+	flip.bEvent = bEvent;
+	flip.event.base.type = DRM_EVENT_FLIP_COMPLETE;
+	flip.event.base.length = sizeof( flip.event );
+	flip.event.user_data = user_data;
+	flip.event.tv_sec = vblank / 1'000'000'000lu;
+	flip.event.tv_usec = ( vblank % 1'000'000'000lu ) / 1'000lu;
+	flip.event.sequence = crtc.sequence;
+	flip.event.crtc_id = crtc.id;
+
+	crtc.bFlipPending = true;
+	dev->flips.insert( { vblank + dev->config.ulEventDelay, flip } );
+	dev->eventCV.notify_all();
+}
+
+static int fake_atomic( FakeDevice_t *dev, struct drm_mode_atomic *args )
+{
+	uint32_t flags = args->flags;
+
+	if ( flags & ~DRM_MODE_ATOMIC_FLAGS )
+		return -EINVAL;
+	if ( !dev->bAtomic )
+		return -EINVAL;
+	if ( ( flags & DRM_MODE_ATOMIC_TEST_ONLY ) && ( flags & DRM_MODE_PAGE_FLIP_EVENT ) )
+		return -EINVAL;
+
+	bool bAsync = flags & DRM_MODE_PAGE_FLIP_ASYNC;
+	if ( bAsync && !dev->config.bAsync )
+		return -EINVAL;
+
+	bool bTest = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+	bool bBlocking = !bTest && !( flags & DRM_MODE_ATOMIC_NONBLOCK );
+
+	std::unique_lock< std::mutex > lock( dev->lock );
+
+	// Blocking commits wait for the previous ones to land
+	if ( bBlocking )
+	{
+		dev->flipCV.wait( lock, [dev]{
+			return std::none_of( dev->crtcs.begin(), dev->crtcs.end(), []( const FakeCrtc_t &crtc ) { return crtc.bFlipPending; } );
+		} );
+	}
+
+	FakeState_t state = dev->current;
+	uint32_t affected_crtcs = 0;
+
+	const uint32_t *objs = (const uint32_t *)(uintptr_t)args->objs_ptr;
+	const uint32_t *count_props = (const uint32_t *)(uintptr_t)args->count_props_ptr;
+	const uint32_t *props = (const uint32_t *)(uintptr_t)args->props_ptr;
+	const uint64_t *prop_values = (const uint64_t *)(uintptr_t)args->prop_values_ptr;
+
+	size_t iProp = 0;
+	for ( uint32_t i = 0; i < args->count_objs; i++ )
+	{
+		uint32_t type;
+		size_t index;
+		FakeObject_t *obj = fake_find_object( dev, objs[ i ], &type, &index );
+		if ( obj == nullptr )
+			return -ENOENT;
+
+		FakeValues_t *values = fake_object_values( &state, type, index );
+
+		// A plane or connector drags in the CRTC it's on, and the one it moves to
+		if ( type == DRM_MODE_OBJECT_CRTC )
+			affected_crtcs |= 1u << index;
+		else if ( ( *values )[ FAKE_SLOT_CRTC_ID ] != 0 )
+			affected_crtcs |= 1u << fake_crtc_index( dev, ( *values )[ FAKE_SLOT_CRTC_ID ] );
+
+		for ( uint32_t j = 0; j < count_props[ i ]; j++, iProp++ )
+		{
+			uint32_t prop_id = props[ iProp ];
+			uint64_t value = prop_values[ iProp ];
+
+			int slot = -1;
+			for ( int k = 0; k < FAKE_SLOT_COUNT; k++ )
+			{
+				if ( obj->props[ k ] == prop_id )
+				{
+					slot = k;
+					break;
+				}
+			}
+			if ( slot < 0 )
+				return -ENOENT;
+
+			const FakeProp_t &prop = dev->props[ prop_id ];
+			if ( ( prop.flags & DRM_MODE_PROP_IMMUTABLE ) || !fake_prop_value_valid( dev, prop, value ) )
+			{
+				fake_log.debugf( "object %u: invalid %s %" PRIu64, obj->id, prop.name.c_str(), value );
+				return -EINVAL;
+			}
+
+			if ( ( *values )[ slot ] == value )
+				continue;
+
+			// Only the primary plane's FB can change in an async flip
+			if ( bAsync && !( type == DRM_MODE_OBJECT_PLANE && slot == FAKE_SLOT_FB_ID && dev->planes[ index ].type == DRM_PLANE_TYPE_PRIMARY ) )
+			{
+				fake_log.debugf( "object %u: %s can't change in an async flip", obj->id, prop.name.c_str() );
+				return -EINVAL;
+			}
+
+			( *values )[ slot ] = value;
+
+			if ( slot == FAKE_SLOT_CRTC_ID && value != 0 )
+				affected_crtcs |= 1u << fake_crtc_index( dev, value );
+		}
+	}
+
+	for ( size_t i = 0; i < dev->planes.size(); i++ )
+	{
+		if ( !fake_plane_check( dev, state, i ) )
+			return -EINVAL;
+	}
+
+	for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+	{
+		if ( !( affected_crtcs & ( 1u << i ) ) )
+			continue;
+
+		if ( !fake_crtc_check( dev, state, i ) )
+			return -EINVAL;
+
+		const FakeValues_t &from = dev->current.crtcs[ i ];
+		const FakeValues_t &to = state.crtcs[ i ];
+
+		bool bModeset = from[ FAKE_SLOT_ACTIVE ] != to[ FAKE_SLOT_ACTIVE ] ||
+			fake_mode_needs_modeset( dev, from[ FAKE_SLOT_MODE_ID ], to[ FAKE_SLOT_MODE_ID ] );
+		for ( size_t j = 0; j < dev->connectors.size(); j++ )
+		{
+			uint64_t crtc_id = dev->crtcs[ i ].id;
+			if ( ( dev->current.connectors[ j ][ FAKE_SLOT_CRTC_ID ] == crtc_id ) != ( state.connectors[ j ][ FAKE_SLOT_CRTC_ID ] == crtc_id ) )
+				bModeset = true;
+		}
+		if ( bModeset && !( flags & DRM_MODE_ATOMIC_ALLOW_MODESET ) )
+		{
+			fake_log.debugf( "CRTC %u: modeset without ALLOW_MODESET", dev->crtcs[ i ].id );
+			return -EINVAL;
+		}
+
+		if ( ( flags & DRM_MODE_PAGE_FLIP_EVENT ) && !to[ FAKE_SLOT_ACTIVE ] )
+			return -EINVAL;
+
+		if ( !bTest && !bBlocking && dev->crtcs[ i ].bFlipPending )
+			return -EBUSY;
+	}
+
+	if ( bTest )
+	{
+		lock.unlock();
+		if ( dev->config.ulTestTime != 0 )
+			sleep_for_nanos( dev->config.ulTestTime );
+		return 0;
+	}
+
+	uint64_t now = get_time_in_nanos();
+	for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+	{
+		FakeCrtc_t &crtc = dev->crtcs[ i ];
+		const FakeValues_t &from = dev->current.crtcs[ i ];
+		const FakeValues_t &to = state.crtcs[ i ];
+
+		if ( !to[ FAKE_SLOT_ACTIVE ] )
+		{
+			crtc.period = 0;
+			continue;
+		}
+
+		uint64_t period = fake_mode_period( fake_get_mode( dev, to[ FAKE_SLOT_MODE_ID ] ) );
+		if ( !from[ FAKE_SLOT_ACTIVE ] || fake_mode_needs_modeset( dev, from[ FAKE_SLOT_MODE_ID ], to[ FAKE_SLOT_MODE_ID ] ) )
+			crtc.lastVblank = now;
+		crtc.period = period;
+	}
+
+	dev->current = std::move( state );
+	fake_collect_blobs( dev );
+
+	for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+	{
+		if ( ( affected_crtcs & ( 1u << i ) ) && dev->current.crtcs[ i ][ FAKE_SLOT_ACTIVE ] )
+			fake_schedule_flip( dev, i, bAsync, flags & DRM_MODE_PAGE_FLIP_EVENT, args->user_data );
+	}
+
+	if ( bBlocking )
+	{
+		dev->flipCV.wait( lock, [dev, affected_crtcs]{
+			for ( size_t i = 0; i < dev->crtcs.size(); i++ )
+			{
+				if ( ( affected_crtcs & ( 1u << i ) ) && dev->crtcs[ i ].bFlipPending )
+					return false;
+			}
+			return true;
+		} );
+	}
+
+	lock.unlock();
+	if ( dev->config.ulCommitTime != 0 )
+		sleep_for_nanos( dev->config.ulCommitTime );
+
+	return 0;
+}
+
+/* Lands flips as their time comes and writes their events to the pipe. */
+static void fake_event_thread_run( FakeDevice_t *dev )
+{
+	pthread_setname_np( pthread_self(), "gamescope-fake" );
+
+	std::unique_lock< std::mutex > lock( dev->lock );
+	while ( true )
+	{
+		if ( dev->flips.empty() )
+		{
+			dev->eventCV.wait( lock );
+			continue;
+		}
+
+		auto it = dev->flips.begin();
+		uint64_t now = get_time_in_nanos();
+		if ( it->first > now )
+		{
+			dev->eventCV.wait_for( lock, std::chrono::nanoseconds( it->first - now ) );
+			continue;
+		}
+
+		FakeFlip_t flip = it->second;
+		dev->flips.erase( it );
+
+		// Before the event goes out, so that the next commit doesn't get
+		// EBUSY
+		dev->crtcs[ flip.crtc ].bFlipPending = false;
+		dev->flipCV.notify_all();
+
+		if ( !flip.bEvent )
+			continue;
+
+		lock.unlock();
+		if ( write( dev->writeFd, &flip.event, sizeof( flip.event ) ) != sizeof( flip.event ) )
+			fake_log.errorf_errno( "failed to write page-flip event" );
+		lock.lock();
+	}
+}
+
+/* Copies an array out the way the kernel does: only if the caller made room
+ * for all of it, and always reporting how many there are. */
+template< typename T >
+static void fake_copy_array( uint64_t ptr, uint32_t *count, const T *data, size_t n )
+{
+	if ( ptr != 0 && *count >= n )
+		memcpy( (void *)(uintptr_t)ptr, data, n * sizeof( T ) );
+	*count = n;
+}
+
+static int fake_get_properties( FakeDevice_t *dev, const FakeObject_t &obj, const FakeValues_t &values, uint64_t props_ptr, uint64_t values_ptr, uint32_t *count )
+{
+	std::vector< uint32_t > ids;
+	std::vector< uint64_t > vals;
+	for ( int i = 0; i < FAKE_SLOT_COUNT; i++ )
+	{
+		if ( obj.props[ i ] == 0 )
+			continue;
+		if ( !dev->bAtomic && ( dev->props[ obj.props[ i ] ].flags & DRM_MODE_PROP_ATOMIC ) )
+			continue;
+
+		ids.push_back( obj.props[ i ] );
+		vals.push_back( values[ i ] );
+	}
+
+	uint32_t n = *count;
+	fake_copy_array( props_ptr, &n, ids.data(), ids.size() );
+	fake_copy_array( values_ptr, count, vals.data(), vals.size() );
+	return 0;
+}
+
+static int fake_ioctl_locked( FakeDevice_t *dev, unsigned long request, void *arg )
+{
+	switch ( request )
+	{
+	case DRM_IOCTL_VERSION:
+	{
+		struct drm_version *version = (struct drm_version *)arg;
+		static const char name[] = "fake", date[] = "20240101", desc[] = "gamescope fake KMS device";
+		version->version_major = 1;
+		version->version_minor = 0;
+		version->version_patchlevel = 0;
+		if ( version->name != nullptr )
+			memcpy( version->name, name, std::min< size_t >( version->name_len, sizeof( name ) - 1 ) );
+		if ( version->date != nullptr )
+			memcpy( version->date, date, std::min< size_t >( version->date_len, sizeof( date ) - 1 ) );
+		if ( version->desc != nullptr )
+			memcpy( version->desc, desc, std::min< size_t >( version->desc_len, sizeof( desc ) - 1 ) );
+		version->name_len = sizeof( name ) - 1;
+		version->date_len = sizeof( date ) - 1;
+		version->desc_len = sizeof( desc ) - 1;
+		return 0;
+	}
+	case DRM_IOCTL_GET_CAP:
+	{
+		struct drm_get_cap *cap = (struct drm_get_cap *)arg;
+		switch ( cap->capability )
+		{
+		case DRM_CAP_PRIME:
+			cap->value = DRM_PRIME_CAP_IMPORT;
+			return 0;
+		case DRM_CAP_TIMESTAMP_MONOTONIC:
+		case DRM_CAP_ADDFB2_MODIFIERS:
+		case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+			cap->value = 1;
+			return 0;
+		case DRM_CAP_ASYNC_PAGE_FLIP:
+		case DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP:
+			cap->value = dev->config.bAsync;
+			return 0;
+		case DRM_CAP_CURSOR_WIDTH:
+		case DRM_CAP_CURSOR_HEIGHT:
+			cap->value = k_nFakeCursorSize;
+			return 0;
+		case DRM_CAP_DUMB_BUFFER:
+			cap->value = 0;
+			return 0;
+		default:
+			return -EINVAL;
+		}
+	}
+	case DRM_IOCTL_SET_CLIENT_CAP:
+	{
+		struct drm_set_client_cap *cap = (struct drm_set_client_cap *)arg;
+		switch ( cap->capability )
+		{
+		case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+			dev->bUniversalPlanes = cap->value != 0;
+			return 0;
+		case DRM_CLIENT_CAP_ATOMIC:
+			dev->bAtomic = cap->value != 0;
+			dev->bUniversalPlanes = dev->bUniversalPlanes || dev->bAtomic;
+			return 0;
+		case DRM_CLIENT_CAP_ASPECT_RATIO:
+			return 0;
+		case DRM_CLIENT_CAP_WRITEBACK_CONNECTORS:
+			// There are none, so capture falls back to compositing
+			return dev->bAtomic ? 0 : -EINVAL;
+		default:
+			return -EINVAL;
+		}
+	}
+	case DRM_IOCTL_SET_MASTER:
+	case DRM_IOCTL_DROP_MASTER:
+		return 0;
+	case DRM_IOCTL_MODE_GETRESOURCES:
+	{
+		struct drm_mode_card_res *res = (struct drm_mode_card_res *)arg;
+
+		std::vector< uint32_t > ids;
+		for ( const auto &kv : dev->fbs )
+			ids.push_back( kv.first );
+		fake_copy_array( res->fb_id_ptr, &res->count_fbs, ids.data(), ids.size() );
+
+		ids.clear();
+		for ( const auto &crtc : dev->crtcs )
+			ids.push_back( crtc.id );
+		fake_copy_array( res->crtc_id_ptr, &res->count_crtcs, ids.data(), ids.size() );
+
+		ids.clear();
+		for ( const auto &conn : dev->connectors )
+			ids.push_back( conn.id );
+		fake_copy_array( res->connector_id_ptr, &res->count_connectors, ids.data(), ids.size() );
+
+		ids.clear();
+		for ( const auto &enc : dev->encoders )
+			ids.push_back( enc.id );
+		fake_copy_array( res->encoder_id_ptr, &res->count_encoders, ids.data(), ids.size() );
+
+		res->min_width = res->min_height = 0;
+		res->max_width = res->max_height = 16384;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETCRTC:
+	{
+		struct drm_mode_crtc *out = (struct drm_mode_crtc *)arg;
+		int index = fake_crtc_index( dev, out->crtc_id );
+		if ( index < 0 )
+			return -ENOENT;
+
+		const FakeValues_t &values = dev->current.crtcs[ index ];
+		out->count_connectors = 0;
+		out->fb_id = 0;
+		for ( size_t i = 0; i < dev->planes.size(); i++ )
+		{
+			if ( dev->planes[ i ].type == DRM_PLANE_TYPE_PRIMARY && dev->current.planes[ i ][ FAKE_SLOT_CRTC_ID ] == out->crtc_id )
+				out->fb_id = dev->current.planes[ i ][ FAKE_SLOT_FB_ID ];
+		}
+		out->x = out->y = 0;
+		out->gamma_size = k_nFakeLutSize;
+
+		const drmModeModeInfo *mode = fake_get_mode( dev, values[ FAKE_SLOT_MODE_ID ] );
+		out->mode_valid = mode != nullptr;
+		memset( &out->mode, 0, sizeof( out->mode ) );
+		if ( mode != nullptr )
+			memcpy( &out->mode, mode, sizeof( out->mode ) );
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETENCODER:
+	{
+		struct drm_mode_get_encoder *out = (struct drm_mode_get_encoder *)arg;
+		for ( size_t i = 0; i < dev->encoders.size(); i++ )
+		{
+			if ( dev->encoders[ i ].id != out->encoder_id )
+				continue;
+
+			out->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+			out->crtc_id = dev->current.connectors[ i ][ FAKE_SLOT_CRTC_ID ];
+			out->possible_crtcs = dev->encoders[ i ].possible_crtcs;
+			out->possible_clones = 0;
+			return 0;
+		}
+		return -ENOENT;
+	}
+	case DRM_IOCTL_MODE_GETCONNECTOR:
+	{
+		struct drm_mode_get_connector *out = (struct drm_mode_get_connector *)arg;
+		uint32_t type;
+		size_t index;
+		if ( fake_find_object( dev, out->connector_id, &type, &index ) == nullptr || type != DRM_MODE_OBJECT_CONNECTOR )
+			return -ENOENT;
+
+		const FakeConnector_t &conn = dev->connectors[ index ];
+		const FakeValues_t &values = dev->current.connectors[ index ];
+
+		out->encoder_id = values[ FAKE_SLOT_CRTC_ID ] != 0 ? conn.encoder_id : 0;
+		out->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+		out->connector_type_id = conn.type_id;
+		out->connection = DRM_MODE_CONNECTED;
+		out->mm_width = 527;
+		out->mm_height = 296;
+		out->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+
+		fake_copy_array( out->encoders_ptr, &out->count_encoders, &conn.encoder_id, 1 );
+		fake_copy_array( out->modes_ptr, &out->count_modes, conn.modes.data(), conn.modes.size() );
+		return fake_get_properties( dev, conn, values, out->props_ptr, out->prop_values_ptr, &out->count_props );
+	}
+	case DRM_IOCTL_MODE_GETPLANERESOURCES:
+	{
+		struct drm_mode_get_plane_res *res = (struct drm_mode_get_plane_res *)arg;
+		std::vector< uint32_t > ids;
+		for ( const auto &plane : dev->planes )
+		{
+			if ( dev->bUniversalPlanes || plane.type == DRM_PLANE_TYPE_OVERLAY )
+				ids.push_back( plane.id );
+		}
+		fake_copy_array( res->plane_id_ptr, &res->count_planes, ids.data(), ids.size() );
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPLANE:
+	{
+		struct drm_mode_get_plane *out = (struct drm_mode_get_plane *)arg;
+		uint32_t type;
+		size_t index;
+		if ( fake_find_object( dev, out->plane_id, &type, &index ) == nullptr || type != DRM_MODE_OBJECT_PLANE )
+			return -ENOENT;
+
+		const FakePlane_t &plane = dev->planes[ index ];
+		out->crtc_id = dev->current.planes[ index ][ FAKE_SLOT_CRTC_ID ];
+		out->fb_id = dev->current.planes[ index ][ FAKE_SLOT_FB_ID ];
+		out->possible_crtcs = plane.possible_crtcs;
+		out->gamma_size = 0;
+		fake_copy_array( out->format_type_ptr, &out->count_format_types, plane.formats.data(), plane.formats.size() );
+		return 0;
+	}
+	case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+	{
+		struct drm_mode_obj_get_properties *out = (struct drm_mode_obj_get_properties *)arg;
+		uint32_t type;
+		size_t index;
+		FakeObject_t *obj = fake_find_object( dev, out->obj_id, &type, &index );
+		if ( obj == nullptr || ( out->obj_type != DRM_MODE_OBJECT_ANY && out->obj_type != type ) )
+			return -ENOENT;
+
+		return fake_get_properties( dev, *obj, *fake_object_values( &dev->current, type, index ), out->props_ptr, out->prop_values_ptr, &out->count_props );
+	}
+	case DRM_IOCTL_MODE_GETPROPERTY:
+	{
+		struct drm_mode_get_property *out = (struct drm_mode_get_property *)arg;
+		auto it = dev->props.find( out->prop_id );
+		if ( it == dev->props.end() )
+			return -ENOENT;
+
+		const FakeProp_t &prop = it->second;
+		out->flags = prop.flags;
+		snprintf( out->name, sizeof( out->name ), "%s", prop.name.c_str() );
+		fake_copy_array( out->values_ptr, &out->count_values, prop.values.data(), prop.values.size() );
+
+		std::vector< struct drm_mode_property_enum > enums;
+		for ( size_t i = 0; i < prop.enumNames.size(); i++ )
+		{
+			struct drm_mode_property_enum e = {};
+			e.value = prop.values[ i ];
+			snprintf( e.name, sizeof( e.name ), "%s", prop.enumNames[ i ].c_str() );
+			enums.push_back( e );
+		}
+		fake_copy_array( out->enum_blob_ptr, &out->count_enum_blobs, enums.data(), enums.size() );
+		return 0;
+	}
+	case DRM_IOCTL_MODE_GETPROPBLOB:
+	{
+		struct drm_mode_get_blob *out = (struct drm_mode_get_blob *)arg;
+		auto it = dev->blobs.find( out->blob_id );
+		if ( it == dev->blobs.end() )
+			return -ENOENT;
+
+		const std::vector< uint8_t > &data = it->second.data;
+		if ( out->data != 0 && out->length >= data.size() )
+			memcpy( (void *)(uintptr_t)out->data, data.data(), data.size() );
+		out->length = data.size();
+		return 0;
+	}
+	case DRM_IOCTL_MODE_CREATEPROPBLOB:
+	{
+		struct drm_mode_create_blob *args = (struct drm_mode_create_blob *)arg;
+		if ( args->length == 0 )
+			return -EINVAL;
+
+		args->blob_id = fake_add_blob( dev, (const void *)(uintptr_t)args->data, args->length, false );
+		return 0;
+	}
+	case DRM_IOCTL_MODE_DESTROYPROPBLOB:
+	{
+		struct drm_mode_destroy_blob *args = (struct drm_mode_destroy_blob *)arg;
+		auto it = dev->blobs.find( args->blob_id );
+		if ( it == dev->blobs.end() || !it->second.bUser )
+			return -EINVAL;
+
+		// Stays around while a CRTC still uses it, like the kernel's
+		it->second.bUser = false;
+		fake_collect_blobs( dev );
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+	{
+		struct drm_prime_handle *args = (struct drm_prime_handle *)arg;
+		struct stat st;
+		if ( fstat( args->fd, &st ) != 0 )
+			return -EBADF;
+
+		// The same buffer always gets the same handle
+		auto key = std::make_pair( st.st_dev, st.st_ino );
+		auto it = dev->handles.find( key );
+		if ( it == dev->handles.end() )
+			it = dev->handles.insert( { key, dev->nextHandle++ } ).first;
+
+		args->handle = it->second;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_CLOSE:
+	{
+		struct drm_gem_close *args = (struct drm_gem_close *)arg;
+		for ( auto it = dev->handles.begin(); it != dev->handles.end(); it++ )
+		{
+			if ( it->second == args->handle )
+			{
+				dev->handles.erase( it );
+				return 0;
+			}
+		}
+		return -EINVAL;
+	}
+	case DRM_IOCTL_MODE_ADDFB2:
+	{
+		struct drm_mode_fb_cmd2 *args = (struct drm_mode_fb_cmd2 *)arg;
+		if ( args->width == 0 || args->height == 0 || args->width > 16384 || args->height > 16384 )
+			return -EINVAL;
+
+		bool bKnown = false;
+		for ( const auto &plane : dev->planes )
+			bKnown = bKnown || std::find( plane.formats.begin(), plane.formats.end(), args->pixel_format ) != plane.formats.end();
+		if ( !bKnown )
+			return -EINVAL;
+
+		for ( uint32_t i = 0; i < fake_format_planes( args->pixel_format ); i++ )
+		{
+			bool bHandle = false;
+			for ( const auto &kv : dev->handles )
+				bHandle = bHandle || kv.second == args->handles[ i ];
+			if ( !bHandle )
+				return -ENOENT;
+			if ( args->pitches[ i ] == 0 )
+				return -EINVAL;
+		}
+
+		uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+		if ( args->flags & DRM_MODE_FB_MODIFIERS )
+		{
+			modifier = args->modifier[ 0 ];
+			for ( uint32_t i = 1; i < fake_format_planes( args->pixel_format ); i++ )
+			{
+				if ( args->modifier[ i ] != modifier )
+					return -EINVAL;
+			}
+			if ( modifier != DRM_FORMAT_MOD_LINEAR && std::find( dev->config.modifiers.begin(), dev->config.modifiers.end(), modifier ) == dev->config.modifiers.end() )
+				return -EINVAL;
+		}
+
+		args->fb_id = dev->nextId++;
+		dev->fbs[ args->fb_id ] = { args->width, args->height, args->pixel_format, modifier };
+		return 0;
+	}
+	case DRM_IOCTL_MODE_RMFB:
+	{
+		uint32_t fb_id = *(uint32_t *)arg;
+		if ( dev->fbs.erase( fb_id ) == 0 )
+			return -ENOENT;
+
+		// Takes the planes still scanning it out down with it
+		for ( auto &values : dev->current.planes )
+		{
+			if ( values[ FAKE_SLOT_FB_ID ] == fb_id )
+			{
+				values[ FAKE_SLOT_FB_ID ] = 0;
+				values[ FAKE_SLOT_CRTC_ID ] = 0;
+			}
+		}
+		return 0;
+	}
+	default:
+		if ( dev->unsupportedIoctls.insert( request ).second )
+			fake_log.errorf( "unsupported ioctl 0x%lx", request );
+		return -EINVAL;
+	}
+}
+
+static int fake_ioctl( FakeDevice_t *dev, unsigned long request, void *arg )
+{
+	// Waits on flips, so it does its own locking
+	if ( request == DRM_IOCTL_MODE_ATOMIC )
+		return fake_atomic( dev, (struct drm_mode_atomic *)arg );
+
+	std::lock_guard< std::mutex > lock( dev->lock );
+	return fake_ioctl_locked( dev, request, arg );
+}
+
+static bool fake_is_device_fd( FakeDevice_t *dev, int fd )
+{
+	struct stat st;
+	return fstat( fd, &st ) == 0 && st.st_dev == dev->st_dev && st.st_ino == dev->st_ino;
+}
+
+/* Catches the KMS ioctls libdrm makes on the fake device, and forwards
+ * everything else, such as the Vulkan driver's, to the kernel. */
+extern "C" __attribute__(( visibility( "default" ) )) int ioctl( int fd, unsigned long request, ... ) noexcept
+{
+	va_list args;
+	va_start( args, request );
+	void *arg = va_arg( args, void * );
+	va_end( args );
+
+	// Only core DRM ioctls can be for us, spare driver-specific ones and
+	// everything else the fstat
+	FakeDevice_t *dev = s_pFakeDevice.load( std::memory_order_acquire );
+	bool bCore = _IOC_TYPE( request ) == DRM_IOCTL_BASE && ( _IOC_NR( request ) < DRM_COMMAND_BASE || _IOC_NR( request ) >= DRM_COMMAND_END );
+	if ( dev != nullptr && bCore && fake_is_device_fd( dev, fd ) )
+	{
+		int ret = fake_ioctl( dev, request, arg );
+		if ( ret < 0 )
+		{
+			errno = -ret;
+			return -1;
+		}
+		return ret;
+	}
+
+	return syscall( SYS_ioctl, fd, request, arg );
+}
+
+int drm_fake_open( const char *device_name )
+{
+	if ( s_pFakeDevice.load() != nullptr )
+	{
+		fake_log.errorf( "there's only one fake device" );
+		return -1;
+	}
+
+	const char *opts = device_name + strlen( "fake" );
+	if ( *opts == ':' )
+		opts++;
+
+	FakeDevice_t *dev = new FakeDevice_t();
+	if ( !fake_parse_config( opts, &dev->config ) )
+	{
+		delete dev;
+		return -1;
+	}
+
+	int fds[ 2 ];
+	struct stat st;
+	if ( pipe2( fds, O_CLOEXEC ) != 0 || fstat( fds[ 0 ], &st ) != 0 )
+	{
+		fake_log.errorf_errno( "failed to create the fake device's pipe" );
+		delete dev;
+		return -1;
+	}
+
+	dev->st_dev = st.st_dev;
+	dev->st_ino = st.st_ino;
+	dev->writeFd = fds[ 1 ];
+
+	fake_create_objects( dev );
+
+	std::thread event_thread( fake_event_thread_run, dev );
+	event_thread.detach();
+
+	s_pFakeDevice.store( dev, std::memory_order_release );
+
+	const FakeConfig_t &config = dev->config;
+	fake_log.infof( "%d output(s) at %dx%d@%d, %d overlay plane(s)%s%s%s", config.nOutputs,
+		config.nWidth, config.nHeight, config.nRefresh, config.nOverlays,
+		config.bCursor ? ", cursor planes" : "", config.bScaling ? ", scaling" : "",
+		config.bAsync ? ", async flips" : "" );
+
+	return fds[ 0 ];
+}
@@ -29,6 +29,7 @@
 
 EStreamColorspace g_ForcedNV12ColorSpace = k_EStreamColorspace_Unknown;
 static bool s_bInitialWantsVRREnabled = false;
+static int s_nDRMBenchmarkFrames = 0;
 
 const char *gamescope_optstring = nullptr;
 
@@ -83,6 +84,9 @@ const struct option *gamescope_options = (struct option[]){
 	{ "fade-out-duration", required_argument, nullptr, 0 },
 	{ "force-orientation", required_argument, nullptr, 0 },
 	{ "force-windows-fullscreen", no_argument, nullptr, 0 },
+#if HAVE_DRM_BENCHMARK
+	{ "drm-benchmark", required_argument, nullptr, 0 },
+#endif
 
 	{} // keep last
 };
@@ -136,6 +140,9 @@ const char usage[] =
 	"  --force-composition            disable direct scan-out\n"
 	"  --composite-debug              draw frame markers on alternating corners of the screen when compositing\n"
 	"  --disable-xres                 disable XRes for PID lookup\n"
+#if HAVE_DRM_BENCHMARK
+	"  --drm-benchmark <frames>       time DRM commits of synthetic scenes, then exit\n"
+#endif
 	"\n"
 	"Keyboard shortcuts:\n"
 	"  Super + F                      toggle fullscreen\n"
@@ -414,6 +421,8 @@ int main(int argc, char **argv)
 					g_nAsyncFlipsEnabled = 1;
 				} else if (strcmp(opt_name, "adaptive-sync") == 0) {
 					s_bInitialWantsVRREnabled = true;
+				} else if (strcmp(opt_name, "drm-benchmark") == 0) {
+					s_nDRMBenchmarkFrames = atoi( optarg );
 				}
 				break;
 			case '?':
@@ -524,6 +533,13 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+#if HAVE_DRM_BENCHMARK
+	if ( s_nDRMBenchmarkFrames > 0 )
+	{
+		return drm_run_benchmark( s_nDRMBenchmarkFrames ) ? 0 : 1;
+	}
+#endif
+
 	// Prevent our clients from connecting to the parent compositor
 	unsetenv("WAYLAND_DISPLAY");
 
@@ -5,6 +5,7 @@
 
 #include "steamcompmgr.hpp"
 #include "main.hpp"
+#include "rendervulkan.hpp"
 
 static bool inited = false;
 static int msgid = 0;
@@ -23,9 +24,13 @@ struct mangoapp_msg_v1 {
     uint8_t fsrSharpness;
     uint64_t app_frametime_ns;
     uint64_t latency_ns;
+    uint64_t gpu_draw_time_ns;
+    uint64_t gpu_pass_time_ns[8]; // indexed by EGPUPass
     // WARNING: Always ADD fields, never remove or repurpose fields
 } __attribute__((packed)) mangoapp_msg_v1;
 
+static_assert( k_EGPUPass_Count <= 8, "mangoapp_msg_v1.gpu_pass_time_ns is part of the protocol" );
+
 void init_mangoapp(){
     int key = ftok("mangoapp", 65);
     msgid = msgget(key, 0666 | IPC_CREAT);
@@ -46,5 +51,11 @@ void mangoapp_update( uint64_t visible_frametime, uint64_t app_frametime_ns, uin
     mangoapp_msg_v1.app_frametime_ns = app_frametime_ns;
     mangoapp_msg_v1.latency_ns = latency_ns;
     mangoapp_msg_v1.pid = focusWindow_pid;
+
+    VulkanGPUTimings_t gpuTimings;
+    vulkan_get_gpu_timings( &gpuTimings );
+    mangoapp_msg_v1.gpu_draw_time_ns = gpuTimings.drawTime;
+    for ( int i = 0; i < k_EGPUPass_Count; i++ )
+        mangoapp_msg_v1.gpu_pass_time_ns[i] = gpuTimings.passTime[i];
     msgsnd(msgid, &mangoapp_msg_v1, sizeof(mangoapp_msg_v1) - sizeof(mangoapp_msg_v1.hdr.msg_type), IPC_NOWAIT);
 }
@@ -157,6 +157,7 @@ static void request_buffer(struct pipewire_state *state)
 
 	struct pipewire_buffer *buffer = (struct pipewire_buffer *) pw_buffer->user_data;
 	buffer->copying = true;
+	buffer->capture_fence_fd = -1;
 
 	// Past this exchange, the PipeWire thread shares the buffer with the
 	// steamcompmgr thread
@@ -278,6 +279,19 @@ static void dispatch_nudge(struct pipewire_state *state, int fd)
 
 		buffer->copying = false;
 
+		if (buffer->capture_fence_fd >= 0) {
+			// KMS is writing the frame back into the texture
+			struct pollfd fence = { .fd = buffer->capture_fence_fd, .events = POLLIN };
+			if (poll(&fence, 1, 1000) <= 0)
+				pwr_log.errorf("timed out waiting for the writeback capture");
+			close(buffer->capture_fence_fd);
+			buffer->capture_fence_fd = -1;
+		} else if (buffer->texture != nullptr) {
+			// The capture may still be going on the async queue
+			if (!vulkan_wait_for_write(buffer->texture->writeSeqNo(), 1'000'000'000ul))
+				pwr_log.errorf("timed out waiting for the capture");
+		}
+
 		if (buffer->buffer != nullptr) {
 			copy_buffer(state, buffer);
 
@@ -45,6 +45,9 @@ struct pipewire_buffer {
 	// We pass the buffer to the steamcompmgr thread for copying. This is set
 	// to true if the buffer is currently owned by the steamcompmgr thread.
 	bool copying;
+	// Set by the steamcompmgr thread if the capture into texture is still in
+	// flight when it pushes the buffer back, signalled once it's done.
+	int capture_fence_fd;
 };
 
 bool init_pipewire(void);
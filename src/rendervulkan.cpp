@@ -4,12 +4,18 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <algorithm>
 #include <array>
 #include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <string>
 #include <thread>
+#include <unordered_set>
 #include <vulkan/vulkan_core.h>
 
 // Used to remove the config struct alignment specified by the NIS header
@@ -22,10 +28,13 @@
 #include "steamcompmgr.hpp"
 #include "sdlwindow.hpp"
 #include "log.hpp"
+#include "vblankmanager.hpp"
+#include "gpuvis_trace_utils.h"
 
 #include "cs_composite_blit.h"
 #include "cs_composite_blur.h"
 #include "cs_composite_blur_cond.h"
+#include "cs_composite_layers.h"
 #include "cs_composite_rcas.h"
 #include "cs_easu.h"
 #include "cs_easu_fp16.h"
@@ -100,12 +109,20 @@ struct VulkanOutput_t
 	VkSwapchainKHR swapChain;
 	VkFence acquireFence;
 
-	uint32_t nOutImage; // swapchain index in nested mode, or ping/pong between two RTs
+	uint32_t nOutImage; // swapchain index in nested mode, or round-robin between RTs, see vulkan_make_output_images
+	uint32_t nLastOutImage; // RT of the last composite, the round-robin skips the ones still on screen
 	std::vector<std::shared_ptr<CVulkanTexture>> outputImages;
 
 	VkFormat outputFormat;
 
 	std::array<std::shared_ptr<CVulkanTexture>, 8> pScreenshotImages;
+	// On the async queue, see vulkan_composite
+	uint64_t ulLastCaptureSeqNo;
+
+	// Partial composition of the layers liftoff couldn't put on a plane,
+	// round-robin between as many RTs as outputImages.
+	uint32_t nPartialOutImage;
+	std::vector<std::shared_ptr<CVulkanTexture>> partialCompositeImages;
 
 	// NIS and FSR
 	std::shared_ptr<CVulkanTexture> tmpOutput;
@@ -125,6 +142,7 @@ enum ShaderType {
 	SHADER_TYPE_RCAS,
 	SHADER_TYPE_NIS,
 	SHADER_TYPE_RGB_TO_NV12,
+	SHADER_TYPE_LAYERS,
 
 	SHADER_TYPE_COUNT
 };
@@ -198,6 +216,118 @@ namespace std
 	};
 }
 
+// Everything that goes into the descriptor set of a dispatch, see
+// CVulkanDevice::cachedDescriptorSet
+struct DescriptorSetKey_t
+{
+	uint64_t targetID;
+	std::array<uint64_t, VKR_SAMPLER_SLOTS> textureIDs;
+	uint32_t srgbMask;
+	// Two bits of SamplerState per slot
+	uint32_t samplerBits;
+
+	bool operator==(const DescriptorSetKey_t& o) const {
+		return targetID == o.targetID && textureIDs == o.textureIDs && srgbMask == o.srgbMask && samplerBits == o.samplerBits;
+	}
+};
+
+namespace std
+{
+	template <>
+	struct hash<DescriptorSetKey_t>
+	{
+		size_t operator()( const DescriptorSetKey_t& k ) const
+		{
+			uint32_t hash = k.targetID;
+			for (uint64_t id : k.textureIDs)
+				hash = hash_combine(hash, id);
+			hash = hash_combine(hash, k.srgbMask);
+			hash = hash_combine(hash, k.samplerBits);
+			return hash;
+		}
+	};
+}
+
+// Descriptor sets kept around when VK_KHR_push_descriptor isn't there.
+// Hits skip vkUpdateDescriptorSets entirely, which is the common case of
+// compositing the same buffers frame after frame.
+static const uint32_t k_nDescriptorSetCacheSize = 64;
+
+struct CachedDescriptorSet_t
+{
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	DescriptorSetKey_t key;
+	bool bValid = false;
+	// Submissions of each queue that last used it, k_ulNotSubmitted while
+	// it's in a command buffer for that queue that hasn't been submitted
+	// yet. Both have to be done before the set can be recycled.
+	uint64_t lastUsedSeqNo = 0;
+	uint64_t lastUsedAsyncSeqNo = 0;
+	inline uint64_t &lastUsed(bool bAsync) {return bAsync ? lastUsedAsyncSeqNo : lastUsedSeqNo;}
+	// Order of the last lookup, for picking the least recently used set,
+	// as the seq nos of the two queues don't compare
+	uint64_t lastUse = 0;
+};
+
+// In place of a submission's seq no for device resources a command buffer
+// still being recorded uses
+static const uint64_t k_ulNotSubmitted = UINT64_MAX;
+
+// Set in the seq no of submissions to the async queue, see
+// CVulkanDevice::commandBuffer. Each queue signals its own timeline
+// semaphore, the rest of the bits are a value on that one.
+static const uint64_t k_ulAsyncSubmission = 1ull << 63;
+
+static_assert(k_nMaxCompositeLayers <= VKR_SAMPLER_SLOTS, "Every layer needs its own sampler slot");
+
+// One entry of the layer buffer, keep in sync with cs_composite_layers
+struct LayerInfo_t
+{
+	vec2_t scale;
+	vec2_t offset;
+	float bounds[4];
+	float opacity;
+	uint32_t texIndex;
+	uint32_t flags;
+	uint32_t pad;
+};
+
+static_assert(sizeof(LayerInfo_t) == 48, "LayerInfo_t must match the std430 layout");
+
+#define LAYER_FLAG_YCBCR  1u
+#define LAYER_FLAG_BORDER 2u
+
+// Frames worth of layers the layer buffer holds, each of them is reused once
+// the timeline semaphore says the GPU is done with it
+static const uint32_t k_nLayerBufferSlots = 8;
+
+// Persistently mapped, enough for a 4K ARGB8888 SHM buffer with room to
+// spare. Uploads go in back to back and are reclaimed in submission order
+// once the timeline semaphore passes them, bigger ones get a buffer of
+// their own.
+static const VkDeviceSize k_ulStagingRingSize = 64 << 20;
+static const VkDeviceSize k_ulStagingAlignment = 256;
+
+// Two timestamps around each pass of a composite, for this many composites
+// at once. They're read back a frame or more later, without waiting, see
+// resolve_gpu_timestamps.
+static const uint32_t k_nTimestampFrames = 4;
+static const uint32_t k_nMaxTimestampPasses = 8;
+static const uint32_t k_nTimestampQueriesPerFrame = 2 * k_nMaxTimestampPasses;
+
+struct StagingAllocation_t
+{
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	// k_ulNotSubmitted until the command buffer copying from it
+	// is submitted
+	uint64_t seqNo;
+};
+
+// BLIT taking its layer count and YCbCr mask from push constants instead of
+// specialization constants, see CVulkanDevice::pipeline
+static const PipelineInfo_t k_uberBlitPipeline = { SHADER_TYPE_BLIT, 0, 0, 0, false };
+
 static uint32_t div_roundup(uint32_t x, uint32_t y)
 {
 	return (x + (y - 1)) / y;
@@ -360,7 +490,7 @@ struct TextureState
 class CVulkanCmdBuffer
 {
 public:
-	CVulkanCmdBuffer(CVulkanDevice *parent, VkCommandBuffer cmdBuffer);
+	CVulkanCmdBuffer(CVulkanDevice *parent, VkCommandBuffer cmdBuffer, bool bAsync);
 	~CVulkanCmdBuffer();
 	CVulkanCmdBuffer(const CVulkanCmdBuffer& other) = delete;
 	CVulkanCmdBuffer(CVulkanCmdBuffer&& other) = delete;
@@ -368,6 +498,20 @@ public:
 	CVulkanCmdBuffer& operator=(CVulkanCmdBuffer&& other) = delete;
 
 	inline VkCommandBuffer rawBuffer() {return m_cmdBuffer;}
+	inline const std::vector<uint32_t>& usedDescriptorSets() {return m_usedDescriptorSets;}
+	inline const std::vector<uint32_t>& usedLayerSlots() {return m_usedLayerSlots;}
+	inline void useLayerSlot(uint32_t slot) {m_usedLayerSlots.push_back(slot);}
+	inline const std::vector<VkDeviceSize>& usedStaging() {return m_usedStaging;}
+	inline void useStaging(VkDeviceSize offset) {m_usedStaging.push_back(offset);}
+	inline bool async() {return m_bAsync;}
+	uint32_t queueFamily();
+	// What has to be signalled on the other queue's timeline semaphore
+	// before this runs, 0 for nothing
+	inline uint64_t waitSeqNo() {return m_ulWaitSeqNo;}
+	// Orders this after the given submission if that went to the other
+	// queue, submissions to the same queue are ordered by the barriers
+	void waitFor(uint64_t sequence);
+	void holdBuffer(VkBuffer buffer, VkDeviceMemory memory);
 	void reset();
 	void begin();
 	void end();
@@ -384,6 +528,11 @@ public:
 	void dispatch(uint32_t x, uint32_t y = 1, uint32_t z = 1);
 	void copyImage(std::shared_ptr<CVulkanTexture> src, std::shared_ptr<CVulkanTexture> dst);
 	void copyBufferToImage(VkBuffer buffer, VkDeviceSize offset, uint32_t stride, std::shared_ptr<CVulkanTexture> dst);
+	// Unlike copyBufferToImage, leaves the rest of dst as it was
+	void updateImage(VkBuffer buffer, const std::vector<VkBufferImageCopy> &regions, std::shared_ptr<CVulkanTexture> dst);
+	// Into the device's timestamp query pool, once everything before is done
+	void resetTimestamps(uint32_t first, uint32_t count);
+	void writeTimestamp(uint32_t query);
 
 
 private:
@@ -391,13 +540,24 @@ private:
 	void prepareDestImage(CVulkanTexture *image);
 	void markDirty(CVulkanTexture *image);
 	void insertBarrier(bool flush = false);
+	void writeDescriptors(VkDescriptorSet descriptorSet);
 
 	VkCommandBuffer m_cmdBuffer;
 	CVulkanDevice *m_device;
+	bool m_bAsync;
 
 	// Per Use State
 	std::unordered_map<CVulkanTexture *, std::shared_ptr<CVulkanTexture>> m_textureRefs;
 	std::unordered_map<CVulkanTexture *, TextureState> m_textureState;
+	// Indices into the device's descriptor set cache
+	std::vector<uint32_t> m_usedDescriptorSets;
+	// Indices into the device's layer buffer
+	std::vector<uint32_t> m_usedLayerSlots;
+	// Offsets of its allocations in the device's staging ring
+	std::vector<VkDeviceSize> m_usedStaging;
+	// Uploads too big for the staging ring, freed once the GPU is done
+	std::vector<std::pair<VkBuffer, VkDeviceMemory>> m_heldBuffers;
+	uint64_t m_ulWaitSeqNo = 0;
 
 	// Draw State
 	std::array<CVulkanTexture *, VKR_SAMPLER_SLOTS> m_boundTextures;
@@ -406,6 +566,40 @@ private:
 	CVulkanTexture *m_target;
 };
 
+// Sub-allocates device memory for images nobody else sees: scratch images,
+// SHM and cursor textures and the like. Saves a vkAllocateMemory for each
+// of those, which can stall, fragments memory when resolutions change and
+// counts against maxMemoryAllocationCount.
+//
+// Anything imported, exported or mapped gets its own allocation as before.
+class CVulkanMemoryArena
+{
+public:
+	void init(CVulkanDevice *device);
+	bool allocate(const VkMemoryRequirements &requirements, uint32_t memoryTypeIndex, VkDeviceMemory *pMemory, VkDeviceSize *pOffset);
+	void free(VkDeviceMemory memory, VkDeviceSize offset);
+	void getStats(VulkanMemoryStats_t *stats);
+
+private:
+	struct Block_t
+	{
+		VkDeviceMemory memory;
+		uint32_t memoryTypeIndex;
+		bool bLarge;
+		VkDeviceSize size;
+		// offset -> size, both kept sorted so that free ranges can be merged
+		std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+		std::map<VkDeviceSize, VkDeviceSize> allocations;
+	};
+
+	bool allocateFromBlock(Block_t *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *pOffset);
+
+	CVulkanDevice *m_device = nullptr;
+	bool m_bDisabled = false;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<Block_t>> m_blocks;
+};
+
 #define VULKAN_INSTANCE_FUNCTIONS \
 	VK_FUNC(CreateDevice) \
 	VK_FUNC(EnumerateDeviceExtensionProperties) \
@@ -440,7 +634,9 @@ private:
 	VK_FUNC(CreateFence) \
 	VK_FUNC(CreateImage) \
 	VK_FUNC(CreateImageView) \
+	VK_FUNC(CreatePipelineCache) \
 	VK_FUNC(CreatePipelineLayout) \
+	VK_FUNC(CreateQueryPool) \
 	VK_FUNC(CreateSampler) \
 	VK_FUNC(CreateSamplerYcbcrConversion) \
 	VK_FUNC(CreateSemaphore) \
@@ -453,6 +649,9 @@ private:
 	VK_FUNC(CmdDispatch) \
 	VK_FUNC(CmdPipelineBarrier) \
 	VK_FUNC(CmdPushConstants) \
+	VK_FUNC(CmdPushDescriptorSetKHR) \
+	VK_FUNC(CmdResetQueryPool) \
+	VK_FUNC(CmdWriteTimestamp) \
 	VK_FUNC(DestroyBuffer) \
 	VK_FUNC(DestroyImage) \
 	VK_FUNC(DestroyImageView) \
@@ -462,11 +661,14 @@ private:
 	VK_FUNC(FreeCommandBuffers) \
 	VK_FUNC(FreeMemory) \
 	VK_FUNC(GetBufferMemoryRequirements) \
+	VK_FUNC(GetPipelineCacheData) \
+	VK_FUNC(GetQueryPoolResults) \
 	VK_FUNC(GetDeviceQueue) \
 	VK_FUNC(GetImageDrmFormatModifierPropertiesEXT) \
 	VK_FUNC(GetImageMemoryRequirements) \
 	VK_FUNC(GetImageSubresourceLayout) \
 	VK_FUNC(GetMemoryFdKHR) \
+	VK_FUNC(GetMemoryHostPointerPropertiesEXT) \
 	VK_FUNC(GetSemaphoreCounterValue) \
 	VK_FUNC(GetSwapchainImagesKHR) \
 	VK_FUNC(MapMemory) \
@@ -486,33 +688,45 @@ public:
 
 	VkSampler sampler(SamplerState key);
 	VkPipeline pipeline(ShaderType type, uint32_t layerCount = 1, uint32_t ycbcrMask = 0, uint32_t blur_layers = 0);
+	void getPipelineStats(VulkanPipelineStats_t *stats);
+	void countPipelineFrame();
 	int32_t findMemoryType( VkMemoryPropertyFlags properties, uint32_t requiredTypeBits );
-	std::unique_ptr<CVulkanCmdBuffer> commandBuffer();
+	std::unique_ptr<CVulkanCmdBuffer> commandBuffer(bool bAsync = false);
 	uint64_t submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuf);
 	void wait(uint64_t sequence);
+	bool waitForSubmission(uint64_t sequence, uint64_t timeout);
+	bool isSubmissionDone(uint64_t sequence);
 	void waitIdle();
 	void garbageCollect();
-	inline VkDescriptorSet descriptorSet()
-	{
-		VkDescriptorSet ret = m_descriptorSets[m_currentDescriptorSet];
-		m_currentDescriptorSet = (m_currentDescriptorSet + 1) % m_descriptorSets.size();
-		return ret;
-	}
+	VkDescriptorSet cachedDescriptorSet(const DescriptorSetKey_t &key, bool bAsync, uint32_t *pIndex, bool *pbNeedsUpdate);
+	LayerInfo_t *layerInfo(CVulkanCmdBuffer *cmdBuffer, uint32_t *pBase);
+	void *stagingAllocation(CVulkanCmdBuffer *cmdBuffer, VkDeviceSize size, VkBuffer *pBuffer, VkDeviceSize *pOffset);
+	inline CVulkanMemoryArena &memoryArena() {return m_memoryArena;}
 
 	inline VkDevice device() { return m_device; }
 	inline VkPhysicalDevice physDev() {return m_physDev; }
 	inline VkInstance instance() { return m_instance; }
 	inline VkQueue queue() {return m_queue;}
-	inline VkCommandPool commandPool() {return m_commandPool;}
-	inline uint32_t queueFamily() {return m_queueFamily;}
-	inline VkBuffer uploadBuffer() {return m_uploadBuffer;}
+	inline VkCommandPool commandPool(bool bAsync = false) {return bAsync ? m_asyncCommandPool : m_commandPool;}
+	inline uint32_t queueFamily(bool bAsync = false) {return bAsync ? m_asyncQueueFamily : m_queueFamily;}
+	inline bool hasAsyncQueue() {return m_asyncQueue != VK_NULL_HANDLE;}
+	// Whether images used on both queues need VK_SHARING_MODE_CONCURRENT
+	inline bool asyncQueueShared() {return hasAsyncQueue() && m_asyncQueueFamily != m_queueFamily;}
+	inline VkBuffer layerBuffer() {return m_layerBuffer;}
 	inline VkPipelineLayout pipelineLayout() {return m_pipelineLayout;}
-	inline void *uploadBufferData() {return m_uploadBufferData;}
 	inline int drmRenderFd() {return m_drmRendererFd;}
 	inline bool supportsModifiers() {return m_bSupportsModifiers;}
 	inline bool hasDrmPrimaryDevId() {return m_bHasDrmPrimaryDevId;}
 	inline dev_t primaryDevId() {return m_drmPrimaryDevId;}
 	inline bool supportsFp16() {return m_bSupportsFp16;}
+	inline bool supportsPushDescriptors() {return m_bSupportsPushDescriptors;}
+	inline bool supportsHostImport() {return m_bSupportsHostImport;}
+	inline VkDeviceSize hostPointerAlignment() {return m_ulHostPointerAlignment;}
+	// VK_NULL_HANDLE if the main queue can't do timestamps
+	inline VkQueryPool timestampQueryPool() {return m_timestampQueryPool;}
+	inline float timestampPeriod() {return m_flTimestampPeriod;}
+	// The bits of a timestamp that count on that queue, 0 if it has none
+	inline uint64_t timestampMask(bool bAsync = false) {return bAsync ? m_ulAsyncTimestampMask : m_ulTimestampMask;}
 
 	#define VK_FUNC(x) PFN_vk##x x = nullptr;
 	struct
@@ -531,27 +745,52 @@ private:
 	bool createPools();
 	bool createShaders();
 	bool createScratchResources();
+	void createPipelineCache();
+	void savePipelineCache();
+	void markPipelineCacheDirty();
 	VkPipeline compilePipeline(uint32_t layerCount, uint32_t ycbcrMask, ShaderType type, uint32_t blur_layer_count, bool composite_debug);
-	void compileAllPipelines();
+	void startPipelineCompiler();
+	void requestPipeline(const PipelineInfo_t &key);
+	void pipelineCompilerThread();
 	void resetCmdBuffers(uint64_t sequence);
+	VkSemaphore timelineSemaphore(uint64_t sequence);
+	void retireStagingAllocations();
+	bool findStagingSpace(VkDeviceSize size, VkDeviceSize *pOffset);
+	void *dedicatedStagingBuffer(CVulkanCmdBuffer *cmdBuffer, VkDeviceSize size, VkBuffer *pBuffer, VkDeviceSize *pOffset);
 
 	VkDevice m_device = nullptr;
 	VkPhysicalDevice m_physDev = nullptr;
 	VkInstance m_instance = nullptr;
 	VkQueue m_queue = nullptr;
+	// Optional, for captures and uploads so that they stay out of the way
+	// of composites. Can be a second queue in m_queueFamily.
+	VkQueue m_asyncQueue = VK_NULL_HANDLE;
 	VkSamplerYcbcrConversion m_ycbcrConversion = VK_NULL_HANDLE;
 	VkSampler m_ycbcrSampler = VK_NULL_HANDLE;
 	VkDescriptorSetLayout m_descriptorSetLayout = VK_NULL_HANDLE;
 	VkPipelineLayout m_pipelineLayout = VK_NULL_HANDLE;
 	VkDescriptorPool m_descriptorPool = VK_NULL_HANDLE;
 	VkCommandPool m_commandPool = VK_NULL_HANDLE;
+	VkCommandPool m_asyncCommandPool = VK_NULL_HANDLE;
+	VkPipelineCache m_pipelineCache = VK_NULL_HANDLE;
+	std::string m_pipelineCachePath;
+	std::mutex m_pipelineCacheSaveMutex;
 
 	uint32_t m_queueFamily = -1;
+	uint32_t m_asyncQueueFamily = -1;
+	uint32_t m_asyncQueueIndex = 0;
 
 	int m_drmRendererFd = -1;
 	dev_t m_drmPrimaryDevId = 0;
 
 	bool m_bSupportsFp16 = false;
+	bool m_bSupportsPushDescriptors = false;
+	bool m_bSupportsHostImport = false;
+	VkDeviceSize m_ulHostPointerAlignment = 0;
+	VkQueryPool m_timestampQueryPool = VK_NULL_HANDLE;
+	float m_flTimestampPeriod = 0.0f;
+	uint64_t m_ulTimestampMask = 0;
+	uint64_t m_ulAsyncTimestampMask = 0;
 	bool m_bHasDrmPrimaryDevId = false;
 	bool m_bSupportsModifiers = false;
 	bool m_bInitialized = false;
@@ -564,27 +803,69 @@ private:
 	std::unordered_map<PipelineInfo_t, VkPipeline> m_pipelineMap;
 	std::mutex m_pipelineMutex;
 
-	// currently just one set, no need to double buffer because we
-	// vkQueueWaitIdle after each submit.
-	// should be moved to the output if we are going to support multiple outputs
-	std::array<VkDescriptorSet, 3> m_descriptorSets;
-	uint32_t m_currentDescriptorSet = 0;
-
-	VkBuffer m_uploadBuffer;
-	VkDeviceMemory m_uploadBufferMemory;
-	void *m_uploadBufferData;
+	// Permutations left to compile, most likely to be needed first, see
+	// startPipelineCompiler. m_compileRequested has everything that was
+	// ever queued, so that nothing gets queued twice.
+	std::deque<PipelineInfo_t> m_compileQueue;
+	std::unordered_set<PipelineInfo_t> m_compileRequested;
+	std::mutex m_compileMutex;
+	std::condition_variable m_compileCV;
+	uint32_t m_nCompilesInFlight = 0;
+	uint64_t m_compileStartTime = 0;
+	bool m_bPipelinesWarm = false;
+	// Something was compiled since the cache was last saved, a compiler
+	// thread saves it again once they're all idle
+	bool m_bPipelineCacheDirty = false;
+
+	// Per frame, see countPipelineFrame. The flags are set by pipeline()
+	// while the frame is recorded.
+	std::atomic<uint64_t> m_nPipelineStalls = { 0 };
+	std::atomic<uint64_t> m_nPipelineStallsAvoided = { 0 };
+	std::atomic<bool> m_bFrameStalled = { false };
+	std::atomic<bool> m_bFrameUsedUber = { false };
+	std::atomic<uint64_t> m_pipelineWarmupTime = { 0 };
+	uint64_t m_initTime = 0;
+
+	// Only used without push descriptors. A set is reused for another key
+	// only once the timeline semaphore says the GPU is done with it, so
+	// this doesn't rely on waiting for idle after each submit.
+	std::array<CachedDescriptorSet_t, k_nDescriptorSetCacheSize> m_descriptorSetCache;
+	std::unordered_map<DescriptorSetKey_t, uint32_t> m_descriptorSetLookup;
+	uint64_t m_ulDescriptorSetLookups = 0;
+
+	VkBuffer m_stagingBuffer;
+	VkDeviceMemory m_stagingBufferMemory;
+	uint8_t *m_stagingBufferData;
+	// Oldest first, the front one is where the ring's free space ends
+	std::deque<StagingAllocation_t> m_stagingAllocations;
+	VkDeviceSize m_stagingHead = 0;
+
+	CVulkanMemoryArena m_memoryArena;
+
+	VkBuffer m_layerBuffer;
+	VkDeviceMemory m_layerBufferMemory;
+	LayerInfo_t *m_layerBufferData;
+	std::array<uint64_t, k_nLayerBufferSlots> m_layerSlotSeqNo = {};
+	uint32_t m_nextLayerSlot = 0;
 
 
 	VkSemaphore m_scratchTimelineSemaphore;
 	std::atomic<uint64_t> m_submissionSeqNo = { 0 };
 	std::vector<std::unique_ptr<CVulkanCmdBuffer>> m_unusedCmdBufs;
 	std::map<uint64_t, std::unique_ptr<CVulkanCmdBuffer>> m_pendingCmdBufs;
+
+	VkSemaphore m_asyncTimelineSemaphore = VK_NULL_HANDLE;
+	std::atomic<uint64_t> m_asyncSubmissionSeqNo = { 0 };
+	std::vector<std::unique_ptr<CVulkanCmdBuffer>> m_unusedAsyncCmdBufs;
+	std::map<uint64_t, std::unique_ptr<CVulkanCmdBuffer>> m_pendingAsyncCmdBufs;
 };
 
 bool CVulkanDevice::BInit()
 {
 	assert(!m_bInitialized);
 
+	uint64_t initStartTime = get_time_in_nanos();
+
 	if (!createInstance())
 		return false;
 	if (!selectPhysDev())
@@ -600,10 +881,16 @@ bool CVulkanDevice::BInit()
 	if (!createScratchResources())
 		return false;
 
+	createPipelineCache();
+
+	m_memoryArena.init(this);
+
 	m_bInitialized = true;
 
-	std::thread piplelineThread([this](){compileAllPipelines();});
-	piplelineThread.detach();
+	startPipelineCompiler();
+
+	m_initTime = get_time_in_nanos() - initStartTime;
+	vk_log.infof( "device initialized in %" PRIu64 "ms", m_initTime / 1'000'000lu );
 
 	return true;
 }
@@ -720,6 +1007,40 @@ bool CVulkanDevice::selectPhysDev()
 	vk.GetPhysicalDeviceProperties( m_physDev, &props );
 	vk_log.infof( "selecting physical device '%s': queue family %x", props.deviceName, m_queueFamily );
 
+	// Captures and uploads get a queue of their own if there's one to spare:
+	// a second queue in the same family first, as that needs no concurrent
+	// sharing, then any other family that can run compute.
+	const char *pchAsyncDisable = getenv( "GAMESCOPE_VK_ASYNC_QUEUE_DISABLE" );
+	if ( pchAsyncDisable == nullptr || pchAsyncDisable[0] != '1' )
+	{
+		uint32_t queueFamilyCount = 0;
+		vk.GetPhysicalDeviceQueueFamilyProperties(m_physDev, &queueFamilyCount, nullptr);
+		std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyCount);
+		vk.GetPhysicalDeviceQueueFamilyProperties(m_physDev, &queueFamilyCount, queueFamilyProperties.data());
+
+		if (queueFamilyProperties[m_queueFamily].queueCount >= 2)
+		{
+			m_asyncQueueFamily = m_queueFamily;
+			m_asyncQueueIndex = 1;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < queueFamilyCount; ++i) {
+				if (i != m_queueFamily && queueFamilyProperties[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
+				{
+					m_asyncQueueFamily = i;
+					m_asyncQueueIndex = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	if ( m_asyncQueueFamily != ~0u )
+		vk_log.infof( "async queue: family %x index %u", m_asyncQueueFamily, m_asyncQueueIndex );
+	else
+		vk_log.infof( "no async queue, captures and uploads go on the main one" );
+
 	return true;
 }
 
@@ -735,6 +1056,8 @@ bool CVulkanDevice::createDevice()
 
 	bool hasDrmProps = false;
 	bool supportsForeignQueue = false;
+	bool supportsPushDescriptors = false;
+	bool supportsHostImport = false;
 	for ( uint32_t i = 0; i < supportedExtensionCount; ++i )
 	{
 		if ( strcmp(supportedExts[i].extensionName,
@@ -748,6 +1071,14 @@ bool CVulkanDevice::createDevice()
 		if ( strcmp(supportedExts[i].extensionName,
 		     VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME) == 0 )
 			supportsForeignQueue = true;
+
+		if ( strcmp(supportedExts[i].extensionName,
+		     VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0 )
+			supportsPushDescriptors = true;
+
+		if ( strcmp(supportedExts[i].extensionName,
+		     VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0 )
+			supportsHostImport = true;
 	}
 
 	vk_log.infof( "physical device %s DRM format modifiers", m_bSupportsModifiers ? "supports" : "does not support" );
@@ -802,6 +1133,50 @@ bool CVulkanDevice::createDevice()
 		m_bSupportsModifiers = false;
 	}
 
+	if ( supportsPushDescriptors ) {
+		VkPhysicalDevicePushDescriptorPropertiesKHR pushDescriptorProps = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PUSH_DESCRIPTOR_PROPERTIES_KHR,
+		};
+		VkPhysicalDeviceProperties2 props2 = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+			.pNext = &pushDescriptorProps,
+		};
+		vk.GetPhysicalDeviceProperties2( physDev(), &props2 );
+
+		// Both targets, both sampler arrays and the layer buffer go in the
+		// one set, which is more than the 32 the spec guarantees
+		const uint32_t descriptorCount = VKR_TARGET_SLOTS + 2 * VKR_SAMPLER_SLOTS + 1;
+
+		const char *pchDisable = getenv( "GAMESCOPE_VK_PUSH_DESCRIPTORS_DISABLE" );
+		if ( pchDisable != nullptr && pchDisable[0] == '1' )
+			supportsPushDescriptors = false;
+		else if ( pushDescriptorProps.maxPushDescriptors < descriptorCount )
+			supportsPushDescriptors = false;
+	}
+
+	m_bSupportsPushDescriptors = supportsPushDescriptors;
+	vk_log.infof( "using %s", m_bSupportsPushDescriptors ? "push descriptors" : "cached descriptor sets" );
+
+	if ( supportsHostImport ) {
+		VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+		};
+		VkPhysicalDeviceProperties2 props2 = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+			.pNext = &hostProps,
+		};
+		vk.GetPhysicalDeviceProperties2( physDev(), &props2 );
+
+		m_ulHostPointerAlignment = hostProps.minImportedHostPointerAlignment;
+
+		const char *pchDisable = getenv( "GAMESCOPE_VK_HOST_IMPORT_DISABLE" );
+		if ( pchDisable != nullptr && pchDisable[0] == '1' )
+			supportsHostImport = false;
+	}
+
+	m_bSupportsHostImport = supportsHostImport;
+	vk_log.infof( "%s SHM buffers", m_bSupportsHostImport ? "importing" : "copying" );
+
 	{
 		VkPhysicalDeviceVulkan12Features vulkan12Features = {
 			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
@@ -815,7 +1190,8 @@ bool CVulkanDevice::createDevice()
 		m_bSupportsFp16 = vulkan12Features.shaderFloat16 && features2.features.shaderInt16;
 	}
 
-	float queuePriorities = 1.0f;
+	// The async queue's work is off the critical path, composites go first
+	const float queuePriorities[2] = { 1.0f, 0.5f };
 
 	VkDeviceQueueGlobalPriorityCreateInfoEXT queueCreateInfoEXT = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_GLOBAL_PRIORITY_CREATE_INFO_EXT,
@@ -823,13 +1199,27 @@ bool CVulkanDevice::createDevice()
 		.globalPriority = VK_QUEUE_GLOBAL_PRIORITY_REALTIME_EXT
 	};
 
-	VkDeviceQueueCreateInfo queueCreateInfo = {
-		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-		.pNext = g_bNiceCap ? &queueCreateInfoEXT : nullptr,
-		.queueFamilyIndex = m_queueFamily,
-		.queueCount = 1,
-		.pQueuePriorities = &queuePriorities
+	VkDeviceQueueCreateInfo queueCreateInfos[2] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+			.pNext = g_bNiceCap ? &queueCreateInfoEXT : nullptr,
+			.queueFamilyIndex = m_queueFamily,
+			.queueCount = 1,
+			.pQueuePriorities = &queuePriorities[0]
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+			.queueFamilyIndex = m_asyncQueueFamily,
+			.queueCount = 1,
+			.pQueuePriorities = &queuePriorities[1]
+		},
 	};
+	uint32_t queueCreateInfoCount = 1;
+
+	if ( m_asyncQueueFamily == m_queueFamily )
+		queueCreateInfos[0].queueCount = 2;
+	else if ( m_asyncQueueFamily != ~0u )
+		queueCreateInfoCount = 2;
 
 	std::vector< const char * > enabledExtensions;
 
@@ -850,9 +1240,17 @@ bool CVulkanDevice::createDevice()
 
 	enabledExtensions.push_back( VK_EXT_ROBUSTNESS_2_EXTENSION_NAME );
 
+	if ( m_bSupportsPushDescriptors )
+		enabledExtensions.push_back( VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME );
+
+	if ( m_bSupportsHostImport )
+		enabledExtensions.push_back( VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME );
+
 	VkPhysicalDeviceFeatures2 features2 = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
 		.features = {
+			// The uber blit and cs_composite_layers pick samplers in a loop
+			.shaderSampledImageArrayDynamicIndexing = VK_TRUE,
 			.shaderInt16 = m_bSupportsFp16,
 		},
 	};
@@ -860,8 +1258,8 @@ bool CVulkanDevice::createDevice()
 	VkDeviceCreateInfo deviceCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
 		.pNext = &features2,
-		.queueCreateInfoCount = 1,
-		.pQueueCreateInfos = &queueCreateInfo,
+		.queueCreateInfoCount = queueCreateInfoCount,
+		.pQueueCreateInfos = queueCreateInfos,
 		.enabledExtensionCount = (uint32_t)enabledExtensions.size(),
 		.ppEnabledExtensionNames = enabledExtensions.data(),
 	};
@@ -897,6 +1295,8 @@ bool CVulkanDevice::createDevice()
 	#undef VK_FUNC
 
 	vk.GetDeviceQueue(device(), m_queueFamily, 0, &m_queue);
+	if ( m_asyncQueueFamily != ~0u )
+		vk.GetDeviceQueue(device(), m_asyncQueueFamily, m_asyncQueueIndex, &m_asyncQueue);
 
 	return true;
 }
@@ -980,7 +1380,7 @@ bool CVulkanDevice::createLayouts()
 	for (auto& sampler : ycbcrSamplers)
 		sampler = m_ycbcrSampler;
 
-	std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings = {
+	std::array<VkDescriptorSetLayoutBinding, 5> layoutBindings = {
 		VkDescriptorSetLayoutBinding {
 			.binding = 0,
 			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
@@ -1006,11 +1406,18 @@ bool CVulkanDevice::createLayouts()
 			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
 			.pImmutableSamplers = ycbcrSamplers.data(),
 		},
+		VkDescriptorSetLayoutBinding {
+			.binding = 4,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		},
 	};
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo =
 	{
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.flags = m_bSupportsPushDescriptors ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0u,
 		.bindingCount = (uint32_t)layoutBindings.size(),
 		.pBindings = layoutBindings.data()
 	};
@@ -1061,20 +1468,41 @@ bool CVulkanDevice::createPools()
 		return false;
 	}
 
-	VkDescriptorPoolSize poolSizes[2] {
+	// Pools are per family, a second queue in the main one shares its pool
+	m_asyncCommandPool = m_commandPool;
+	if ( asyncQueueShared() )
+	{
+		commandPoolCreateInfo.queueFamilyIndex = m_asyncQueueFamily;
+
+		res = vk.CreateCommandPool(device(), &commandPoolCreateInfo, nullptr, &m_asyncCommandPool);
+		if ( res != VK_SUCCESS )
+		{
+			vk_errorf( res, "vkCreateCommandPool failed" );
+			return false;
+		}
+	}
+
+	if ( m_bSupportsPushDescriptors )
+		return true;
+
+	VkDescriptorPoolSize poolSizes[3] {
 		{
 			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-			uint32_t(m_descriptorSets.size()) * 2,
+			uint32_t(m_descriptorSetCache.size()) * VKR_TARGET_SLOTS,
 		},
 		{
 			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-			uint32_t(m_descriptorSets.size()) * 2 * VKR_SAMPLER_SLOTS,
+			uint32_t(m_descriptorSetCache.size()) * 2 * VKR_SAMPLER_SLOTS,
+		},
+		{
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			uint32_t(m_descriptorSetCache.size()),
 		},
 	};
 	
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-		.maxSets = uint32_t(m_descriptorSets.size()),
+		.maxSets = uint32_t(m_descriptorSetCache.size()),
 		.poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]),
 		.pPoolSizes = poolSizes,
 	};
@@ -1115,6 +1543,7 @@ bool CVulkanDevice::createShaders()
 		SHADER(NIS, cs_nis);
 	}
 	SHADER(RGB_TO_NV12, cs_rgb_to_nv12);
+	SHADER(LAYERS, cs_composite_layers);
 #undef SHADER
 
 	for (uint32_t i = 0; i < shaderInfos.size(); i++)
@@ -1138,31 +1567,40 @@ bool CVulkanDevice::createShaders()
 
 bool CVulkanDevice::createScratchResources()
 {
-	std::vector<VkDescriptorSetLayout> descriptorSetLayouts(m_descriptorSets.size(), m_descriptorSetLayout);
-	
-	VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
-		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-		.descriptorPool = m_descriptorPool,
-		.descriptorSetCount = (uint32_t)descriptorSetLayouts.size(),
-		.pSetLayouts = descriptorSetLayouts.data(),
-	};
-	
-	VkResult res = vk.AllocateDescriptorSets(device(), &descriptorSetAllocateInfo, m_descriptorSets.data());
-	if ( res != VK_SUCCESS )
+	VkResult res;
+
+	if ( !m_bSupportsPushDescriptors )
 	{
-		vk_log.errorf( "vkAllocateDescriptorSets failed" );
-		return false;
+		std::vector<VkDescriptorSetLayout> descriptorSetLayouts(m_descriptorSetCache.size(), m_descriptorSetLayout);
+		std::vector<VkDescriptorSet> descriptorSets(m_descriptorSetCache.size());
+
+		VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+			.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+			.descriptorPool = m_descriptorPool,
+			.descriptorSetCount = (uint32_t)descriptorSetLayouts.size(),
+			.pSetLayouts = descriptorSetLayouts.data(),
+		};
+
+		res = vk.AllocateDescriptorSets(device(), &descriptorSetAllocateInfo, descriptorSets.data());
+		if ( res != VK_SUCCESS )
+		{
+			vk_log.errorf( "vkAllocateDescriptorSets failed" );
+			return false;
+		}
+
+		for (uint32_t i = 0; i < m_descriptorSetCache.size(); i++)
+			m_descriptorSetCache[i].set = descriptorSets[i];
 	}
 
-	// Make and map upload buffer
-	
+	// Make and map the staging ring, see stagingAllocation
+
 	VkBufferCreateInfo bufferCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = 512 * 512 * 4,
+		.size = k_ulStagingRingSize,
 		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	};
 
-	res = vk.CreateBuffer( device(), &bufferCreateInfo, nullptr, &m_uploadBuffer );
+	res = vk.CreateBuffer( device(), &bufferCreateInfo, nullptr, &m_stagingBuffer );
 	if ( res != VK_SUCCESS )
 	{
 		vk_errorf( res, "vkCreateBuffer failed" );
@@ -1170,9 +1608,9 @@ bool CVulkanDevice::createScratchResources()
 	}
 	
 	VkMemoryRequirements memRequirements;
-	vk.GetBufferMemoryRequirements(device(), m_uploadBuffer, &memRequirements);
+	vk.GetBufferMemoryRequirements(device(), m_stagingBuffer, &memRequirements);
 	
-	uint32_t memTypeIndex =  findMemoryType(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
+	uint32_t memTypeIndex =  findMemoryType(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
 	if ( memTypeIndex == ~0u )
 	{
 		vk_log.errorf( "findMemoryType failed" );
@@ -1185,11 +1623,59 @@ bool CVulkanDevice::createScratchResources()
 		.memoryTypeIndex = memTypeIndex,
 	};
 	
-	vk.AllocateMemory( device(), &allocInfo, nullptr, &m_uploadBufferMemory);
+	res = vk.AllocateMemory( device(), &allocInfo, nullptr, &m_stagingBufferMemory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkAllocateMemory failed" );
+		return false;
+	}
 	
-	vk.BindBufferMemory( device(), m_uploadBuffer, m_uploadBufferMemory, 0 );
+	vk.BindBufferMemory( device(), m_stagingBuffer, m_stagingBufferMemory, 0 );
+
+	res = vk.MapMemory( device(), m_stagingBufferMemory, 0, VK_WHOLE_SIZE, 0, (void**)&m_stagingBufferData );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkMapMemory failed" );
+		return false;
+	}
+
+	// Make and map the layer buffer, see cs_composite_layers
+
+	VkBufferCreateInfo layerBufferCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = sizeof(LayerInfo_t) * k_nMaxCompositeLayers * k_nLayerBufferSlots,
+		.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+	};
+
+	res = vk.CreateBuffer( device(), &layerBufferCreateInfo, nullptr, &m_layerBuffer );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateBuffer failed" );
+		return false;
+	}
+
+	vk.GetBufferMemoryRequirements(device(), m_layerBuffer, &memRequirements);
+
+	memTypeIndex = findMemoryType(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
+	if ( memTypeIndex == ~0u )
+	{
+		vk_log.errorf( "findMemoryType failed" );
+		return false;
+	}
+
+	allocInfo.allocationSize = memRequirements.size;
+	allocInfo.memoryTypeIndex = memTypeIndex;
 
-	res = vk.MapMemory( device(), m_uploadBufferMemory, 0, VK_WHOLE_SIZE, 0, (void**)&m_uploadBufferData );
+	res = vk.AllocateMemory( device(), &allocInfo, nullptr, &m_layerBufferMemory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkAllocateMemory failed" );
+		return false;
+	}
+
+	vk.BindBufferMemory( device(), m_layerBuffer, m_layerBufferMemory, 0 );
+
+	res = vk.MapMemory( device(), m_layerBufferMemory, 0, VK_WHOLE_SIZE, 0, (void**)&m_layerBufferData );
 	if ( res != VK_SUCCESS )
 	{
 		vk_errorf( res, "vkMapMemory failed" );
@@ -1213,9 +1699,224 @@ bool CVulkanDevice::createScratchResources()
 		return false;
 	}
 
+	if ( hasAsyncQueue() )
+	{
+		res = vk.CreateSemaphore( device(), &semCreateInfo, NULL, &m_asyncTimelineSemaphore );
+		if ( res != VK_SUCCESS )
+		{
+			vk_errorf( res, "vkCreateSemaphore failed" );
+			return false;
+		}
+	}
+
+	uint32_t queueFamilyCount = 0;
+	vk.GetPhysicalDeviceQueueFamilyProperties(physDev(), &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilyProperties(queueFamilyCount);
+	vk.GetPhysicalDeviceQueueFamilyProperties(physDev(), &queueFamilyCount, queueFamilyProperties.data());
+
+	auto timestampMask = []( uint32_t validBits ) -> uint64_t
+	{
+		return validBits >= 64 ? ~0ull : ( 1ull << validBits ) - 1;
+	};
+
+	const char *pchTimestampsDisable = getenv( "GAMESCOPE_VK_TIMESTAMPS_DISABLE" );
+	if ( pchTimestampsDisable == nullptr || pchTimestampsDisable[0] != '1' )
+	{
+		m_ulTimestampMask = timestampMask( queueFamilyProperties[m_queueFamily].timestampValidBits );
+		if ( hasAsyncQueue() )
+			m_ulAsyncTimestampMask = timestampMask( queueFamilyProperties[m_asyncQueueFamily].timestampValidBits );
+	}
+
+	if ( m_ulTimestampMask != 0 )
+	{
+		VkPhysicalDeviceProperties props;
+		vk.GetPhysicalDeviceProperties( physDev(), &props );
+		m_flTimestampPeriod = props.limits.timestampPeriod;
+
+		VkQueryPoolCreateInfo queryPoolCreateInfo = {
+			.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+			.queryType = VK_QUERY_TYPE_TIMESTAMP,
+			.queryCount = k_nTimestampFrames * k_nTimestampQueriesPerFrame,
+		};
+
+		res = vk.CreateQueryPool( device(), &queryPoolCreateInfo, nullptr, &m_timestampQueryPool );
+		if ( res != VK_SUCCESS )
+		{
+			vk_errorf( res, "vkCreateQueryPool failed" );
+			return false;
+		}
+	}
+
+	vk_log.infof( "%s composite passes on the GPU", m_timestampQueryPool != VK_NULL_HANDLE ? "timing" : "not timing" );
+
 	return true;
 }
 
+// Prepended to the VkPipelineCache data on disk. Drivers check their own
+// header too, but not all of them check it well, and a cache from another
+// driver build isn't worth the risk.
+struct PipelineCacheFileHeader_t
+{
+	char magic[8];
+	uint32_t version;
+	uint8_t driverUUID[VK_UUID_SIZE];
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+};
+
+static const char k_szPipelineCacheMagic[8] = { 'G', 'S', 'P', 'I', 'P', 'E', 'C', 'A' };
+static const uint32_t k_nPipelineCacheVersion = 1;
+
+static std::string get_pipeline_cache_path()
+{
+	std::string dir;
+	const char *cacheHome = getenv( "XDG_CACHE_HOME" );
+	const char *home = getenv( "HOME" );
+	if ( cacheHome && *cacheHome )
+		dir = cacheHome;
+	else if ( home && *home )
+		dir = std::string( home ) + "/.cache";
+	else
+		return "";
+
+	mkdir( dir.c_str(), 0755 );
+	dir += "/gamescope";
+	if ( mkdir( dir.c_str(), 0755 ) != 0 && errno != EEXIST )
+		return "";
+
+	return dir + "/pipeline_cache";
+}
+
+static void get_pipeline_cache_header( CVulkanDevice *device, PipelineCacheFileHeader_t *header )
+{
+	VkPhysicalDeviceIDProperties idProps = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+	};
+	VkPhysicalDeviceProperties2 props = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+		.pNext = &idProps,
+	};
+	device->vk.GetPhysicalDeviceProperties2( device->physDev(), &props );
+
+	*header = {};
+	memcpy( header->magic, k_szPipelineCacheMagic, sizeof( header->magic ) );
+	header->version = k_nPipelineCacheVersion;
+	memcpy( header->driverUUID, idProps.driverUUID, VK_UUID_SIZE );
+	memcpy( header->pipelineCacheUUID, props.properties.pipelineCacheUUID, VK_UUID_SIZE );
+}
+
+// Seeds the pipeline cache with what the last run saved, so that the
+// compiler threads and the permutations compiled on demand mid-frame
+// mostly come out of it instead of the shader compiler.
+void CVulkanDevice::createPipelineCache()
+{
+	m_pipelineCachePath = get_pipeline_cache_path();
+
+	std::vector<uint8_t> data;
+	FILE *file = m_pipelineCachePath.empty() ? nullptr : fopen( m_pipelineCachePath.c_str(), "rb" );
+	if ( file )
+	{
+		PipelineCacheFileHeader_t expected, header;
+		get_pipeline_cache_header( this, &expected );
+
+		if ( fread( &header, sizeof( header ), 1, file ) == 1 &&
+		     memcmp( header.magic, expected.magic, sizeof( header.magic ) ) == 0 &&
+		     header.version == expected.version &&
+		     memcmp( header.driverUUID, expected.driverUUID, VK_UUID_SIZE ) == 0 &&
+		     memcmp( header.pipelineCacheUUID, expected.pipelineCacheUUID, VK_UUID_SIZE ) == 0 &&
+		     header.dataSize <= 64 * 1024 * 1024 )
+		{
+			data.resize( header.dataSize );
+			if ( fread( data.data(), 1, data.size(), file ) != data.size() )
+				data.clear();
+		}
+		else
+		{
+			vk_log.infof( "pipeline cache is from another driver, ignoring it" );
+		}
+
+		fclose( file );
+	}
+
+	VkPipelineCacheCreateInfo cacheCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = data.size(),
+		.pInitialData = data.data(),
+	};
+
+	VkResult res = vk.CreatePipelineCache( device(), &cacheCreateInfo, nullptr, &m_pipelineCache );
+	if ( res != VK_SUCCESS && !data.empty() )
+	{
+		// Try again from scratch, in case the data is what it choked on
+		cacheCreateInfo.initialDataSize = 0;
+		cacheCreateInfo.pInitialData = nullptr;
+		res = vk.CreatePipelineCache( device(), &cacheCreateInfo, nullptr, &m_pipelineCache );
+	}
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreatePipelineCache failed" );
+		m_pipelineCache = VK_NULL_HANDLE;
+		return;
+	}
+
+	if ( !data.empty() )
+		vk_log.infof( "loaded %zu bytes of pipeline cache from %s", data.size(), m_pipelineCachePath.c_str() );
+}
+
+void CVulkanDevice::savePipelineCache()
+{
+	if ( m_pipelineCache == VK_NULL_HANDLE || m_pipelineCachePath.empty() )
+		return;
+
+	// Compiler threads can get here at the same time, and would share the
+	// temporary file
+	std::lock_guard<std::mutex> lock( m_pipelineCacheSaveMutex );
+
+	size_t size = 0;
+	if ( vk.GetPipelineCacheData( device(), m_pipelineCache, &size, nullptr ) != VK_SUCCESS )
+		return;
+
+	std::vector<uint8_t> data( size );
+	if ( vk.GetPipelineCacheData( device(), m_pipelineCache, &size, data.data() ) != VK_SUCCESS )
+		return;
+	data.resize( size );
+
+	PipelineCacheFileHeader_t header;
+	get_pipeline_cache_header( this, &header );
+	header.dataSize = data.size();
+
+	// Write it next to the old one and rename it over, so that a crash or a
+	// second gamescope instance never leaves a truncated cache behind
+	std::string tmpPath = m_pipelineCachePath + "." + std::to_string( getpid() );
+	FILE *file = fopen( tmpPath.c_str(), "wb" );
+	if ( !file )
+		return;
+
+	bool bWritten = fwrite( &header, sizeof( header ), 1, file ) == 1 &&
+		fwrite( data.data(), 1, data.size(), file ) == data.size();
+	bWritten = fclose( file ) == 0 && bWritten;
+
+	if ( !bWritten || rename( tmpPath.c_str(), m_pipelineCachePath.c_str() ) != 0 )
+	{
+		vk_log.errorf( "failed to write pipeline cache to %s", m_pipelineCachePath.c_str() );
+		unlink( tmpPath.c_str() );
+		return;
+	}
+
+	vk_log.debugf( "saved %zu bytes of pipeline cache to %s", data.size(), m_pipelineCachePath.c_str() );
+}
+
+// Pipelines compiled on demand after warm-up would be compiled again on
+// every start otherwise
+void CVulkanDevice::markPipelineCacheDirty()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		m_bPipelineCacheDirty = true;
+	}
+	m_compileCV.notify_one();
+}
+
 VkSampler CVulkanDevice::sampler( SamplerState key )
 {
 	if ( m_samplerCache.count(key) != 0 )
@@ -1243,7 +1944,7 @@ VkSampler CVulkanDevice::sampler( SamplerState key )
 
 VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMask, ShaderType type, uint32_t blur_layer_count, bool composite_debug)
 {
-	const std::array<VkSpecializationMapEntry, 4> specializationEntries = {{
+	const std::array<VkSpecializationMapEntry, 5> specializationEntries = {{
 		{
 			.constantID = 0,
 			.offset     = sizeof(uint32_t) * 0,
@@ -1264,6 +1965,11 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 			.offset     = sizeof(uint32_t) * 3,
 			.size       = sizeof(uint32_t)
 		},
+		{
+			.constantID = 4,
+			.offset     = sizeof(uint32_t) * 4,
+			.size       = sizeof(uint32_t)
+		},
 	}};
 
 	struct {
@@ -1271,11 +1977,13 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 		uint32_t ycbcrMask;
 		uint32_t debug;
 		uint32_t blur_layer_count;
+		uint32_t dynamic;
 	} specializationData = {
 		.layerCount   = layerCount,
 		.ycbcrMask    = ycbcrMask,
 		.debug        = composite_debug,
 		.blur_layer_count = blur_layer_count,
+		.dynamic      = layerCount == 0,
 	};
 
 	VkSpecializationInfo specializationInfo = {
@@ -1299,7 +2007,7 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 
 	VkPipeline result;
 
-	VkResult res = vk.CreateComputePipelines(device(), VK_NULL_HANDLE, 1, &computePipelineCreateInfo, nullptr, &result);
+	VkResult res = vk.CreateComputePipelines(device(), m_pipelineCache, 1, &computePipelineCreateInfo, nullptr, &result);
 	if (res != VK_SUCCESS) {
 		vk_errorf( res, "vkCreateComputePipelines failed" );
 		return VK_NULL_HANDLE;
@@ -1308,10 +2016,24 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 	return result;
 }
 
-void CVulkanDevice::compileAllPipelines()
+// Lower goes first. Plain blits of a few layers are what almost every
+// frame needs. The other BLIT permutations can make do with the uber-shader
+// in the meantime, everything else stalls a frame if it's missing.
+static int pipeline_compile_priority(const PipelineInfo_t &info)
 {
-	pthread_setname_np( pthread_self(), "gamescope-shdr" );
+	if (info == k_uberBlitPipeline)
+		return 0;
+	if (info.shaderType == SHADER_TYPE_BLIT && info.layerCount <= 3 && info.ycbcrMask == 0)
+		return 1;
+	if (info.shaderType != SHADER_TYPE_BLIT && info.ycbcrMask == 0)
+		return 2;
+	if (info.shaderType != SHADER_TYPE_BLIT)
+		return 3;
+	return 4;
+}
 
+void CVulkanDevice::startPipelineCompiler()
+{
 	std::array<PipelineInfo_t, SHADER_TYPE_COUNT> pipelineInfos;
 #define SHADER(type, layer_count, max_ycbcr, blur_layers) pipelineInfos[SHADER_TYPE_##type] = {SHADER_TYPE_##type, layer_count, max_ycbcr, blur_layers, false}
 	SHADER(BLIT, k_nMaxLayers, k_nMaxYcbcrMask_ToPreCompile, 1);
@@ -1322,8 +2044,10 @@ void CVulkanDevice::compileAllPipelines()
 	SHADER(EASU, 1, 1, 1);
 	SHADER(NIS, 1, 1, 1);
 	SHADER(RGB_TO_NV12, 1, 1, 1);
+	SHADER(LAYERS, 1, 1, 1);
 #undef SHADER
 
+	std::vector<PipelineInfo_t> jobs = { k_uberBlitPipeline };
 	for (auto& info : pipelineInfos) {
 		for (uint32_t layerCount = 1; layerCount <= info.layerCount; layerCount++) {
 			for (uint32_t ycbcrMask = 0; ycbcrMask < info.ycbcrMask; ycbcrMask++) {
@@ -1333,37 +2057,174 @@ void CVulkanDevice::compileAllPipelines()
 					if (blur_layers > layerCount)
 						continue;
 
-					VkPipeline newPipeline = compilePipeline(layerCount, ycbcrMask, info.shaderType, blur_layers, info.compositeDebug);
-					{
-						std::lock_guard<std::mutex> lock(m_pipelineMutex);
-						PipelineInfo_t key = {info.shaderType, layerCount, ycbcrMask, blur_layers, info.compositeDebug};
-						auto result = m_pipelineMap.emplace(std::make_pair(key, newPipeline));
-						if (!result.second)
-							vk.DestroyPipeline(device(), newPipeline, nullptr);
-					}
+					jobs.push_back({info.shaderType, layerCount, ycbcrMask, blur_layers, info.compositeDebug});
 				}
 			}
 		}
 	}
+
+	std::stable_sort(jobs.begin(), jobs.end(), [](const PipelineInfo_t &a, const PipelineInfo_t &b) {
+		return pipeline_compile_priority(a) < pipeline_compile_priority(b);
+	});
+
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		m_compileQueue.assign(jobs.begin(), jobs.end());
+		m_compileRequested.insert(jobs.begin(), jobs.end());
+		m_compileStartTime = get_time_in_nanos();
+	}
+
+	// Leave some cores to the game, it's starting up too
+	uint32_t threadCount = std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 2));
+	for (uint32_t i = 0; i < threadCount; i++) {
+		std::thread compilerThread([this](){pipelineCompilerThread();});
+		compilerThread.detach();
+	}
+}
+
+// Compiles the permutation in the background, ahead of whatever's queued
+void CVulkanDevice::requestPipeline(const PipelineInfo_t &key)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		if (!m_compileRequested.insert(key).second)
+			return;
+		m_compileQueue.push_front(key);
+	}
+	m_compileCV.notify_one();
+}
+
+void CVulkanDevice::pipelineCompilerThread()
+{
+	pthread_setname_np( pthread_self(), "gamescope-shdr" );
+
+	while (true) {
+		PipelineInfo_t key;
+		bool bSave = false;
+		{
+			std::unique_lock<std::mutex> lock(m_compileMutex);
+			m_compileCV.wait(lock, [this]{
+				return !m_compileQueue.empty() || (m_bPipelinesWarm && m_bPipelineCacheDirty && m_nCompilesInFlight == 0);
+			});
+
+			if (m_compileQueue.empty()) {
+				m_bPipelineCacheDirty = false;
+				bSave = true;
+			} else {
+				key = m_compileQueue.front();
+				m_compileQueue.pop_front();
+				m_nCompilesInFlight++;
+			}
+		}
+
+		if (bSave) {
+			savePipelineCache();
+			continue;
+		}
+
+		bool bCompiled = false;
+		{
+			std::lock_guard<std::mutex> lock(m_pipelineMutex);
+			bCompiled = m_pipelineMap.count(key) != 0;
+		}
+
+		if (!bCompiled) {
+			VkPipeline newPipeline = compilePipeline(key.layerCount, key.ycbcrMask, key.shaderType, key.blurLayerCount, key.compositeDebug);
+
+			std::lock_guard<std::mutex> lock(m_pipelineMutex);
+			auto result = m_pipelineMap.emplace(std::make_pair(key, newPipeline));
+			if (!result.second)
+				vk.DestroyPipeline(device(), newPipeline, nullptr);
+		}
+
+		bool bWarm = false;
+		size_t pipelineCount = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_compileMutex);
+			m_nCompilesInFlight--;
+
+			if (m_bPipelinesWarm && !bCompiled)
+				m_bPipelineCacheDirty = true;
+
+			if (!m_bPipelinesWarm && m_compileQueue.empty() && m_nCompilesInFlight == 0) {
+				m_bPipelinesWarm = bWarm = true;
+				m_pipelineWarmupTime = get_time_in_nanos() - m_compileStartTime;
+				pipelineCount = m_compileRequested.size();
+				// Saved below
+				m_bPipelineCacheDirty = false;
+			}
+		}
+
+		if (bWarm) {
+			vk_log.infof( "compiled %zu pipelines in %" PRIu64 "ms, %" PRIu64 " frames used the uber-shader meanwhile, %" PRIu64 " stalled",
+				pipelineCount, m_pipelineWarmupTime / 1'000'000lu, m_nPipelineStallsAvoided.load(), m_nPipelineStalls.load() );
+
+			savePipelineCache();
+		}
+	}
 }
 
 VkPipeline CVulkanDevice::pipeline(ShaderType type, uint32_t layerCount, uint32_t ycbcrMask, uint32_t blur_layers)
 {
-	std::lock_guard<std::mutex> lock(m_pipelineMutex);
 	PipelineInfo_t key = {type, layerCount, ycbcrMask, blur_layers, g_bIsCompositeDebug};
-	auto search = m_pipelineMap.find(key);
-	if (search == m_pipelineMap.end())
 	{
-		VkPipeline result = compilePipeline(layerCount, ycbcrMask, type, blur_layers, g_bIsCompositeDebug);
-		m_pipelineMap[key] = result;
-		return result;
+		std::lock_guard<std::mutex> lock(m_pipelineMutex);
+		auto search = m_pipelineMap.find(key);
+		if (search != m_pipelineMap.end())
+			return search->second;
+
+		// The uber-shader does the same as any plain blit, only slower,
+		// use it until the real one is ready
+		auto uber = m_pipelineMap.find(k_uberBlitPipeline);
+		if (type == SHADER_TYPE_BLIT && !g_bIsCompositeDebug && uber != m_pipelineMap.end())
+		{
+			VkPipeline result = uber->second;
+			m_bFrameUsedUber = true;
+			requestPipeline(key);
+			return result;
+		}
 	}
-	else
+
+	// Not compiled (yet) and nothing to stand in for it, this one stalls
+	// the frame
+	uint64_t startTime = get_time_in_nanos();
+	VkPipeline result = compilePipeline(layerCount, ycbcrMask, type, blur_layers, g_bIsCompositeDebug);
+	m_bFrameStalled = true;
+	vk_log.debugf( "compiled pipeline %u/%u/%u/%u on demand in %" PRIu64 "us", type, layerCount, ycbcrMask, blur_layers, ( get_time_in_nanos() - startTime ) / 1'000lu );
+
+	markPipelineCacheDirty();
+
+	std::lock_guard<std::mutex> lock(m_pipelineMutex);
+	auto inserted = m_pipelineMap.emplace(std::make_pair(key, result));
+	if (!inserted.second)
 	{
-		return search->second;
+		// A compiler thread beat us to it
+		vk.DestroyPipeline(device(), result, nullptr);
+		return inserted.first->second;
 	}
+	return result;
 }
 
+// A frame that stalled on one pipeline and used the uber-shader for another
+// counts as stalled
+void CVulkanDevice::countPipelineFrame()
+{
+	bool bStalled = m_bFrameStalled.exchange(false);
+	bool bUsedUber = m_bFrameUsedUber.exchange(false);
+
+	if (bStalled)
+		m_nPipelineStalls++;
+	else if (bUsedUber)
+		m_nPipelineStallsAvoided++;
+}
+
+void CVulkanDevice::getPipelineStats(VulkanPipelineStats_t *stats)
+{
+	stats->stalls = m_nPipelineStalls;
+	stats->stallsAvoided = m_nPipelineStallsAvoided;
+	stats->warmupTime = m_pipelineWarmupTime;
+	stats->initTime = m_initTime;
+}
 
 int32_t CVulkanDevice::findMemoryType( VkMemoryPropertyFlags properties, uint32_t requiredTypeBits )
 {
@@ -1381,15 +2242,20 @@ int32_t CVulkanDevice::findMemoryType( VkMemoryPropertyFlags properties, uint32_
 	return -1;
 }
 
-std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer()
+// bAsync asks for the async queue, for work nothing on the main queue has
+// to wait for right away. Without one, that goes on the main queue too.
+std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer(bool bAsync)
 {
+	bAsync = bAsync && hasAsyncQueue();
+	auto& unusedCmdBufs = bAsync ? m_unusedAsyncCmdBufs : m_unusedCmdBufs;
+
 	std::unique_ptr<CVulkanCmdBuffer> cmdBuffer;
-	if (m_unusedCmdBufs.empty())
+	if (unusedCmdBufs.empty())
 	{
 		VkCommandBuffer rawCmdBuffer;
 		VkCommandBufferAllocateInfo commandBufferAllocateInfo = {
 			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-			.commandPool = m_commandPool,
+			.commandPool = commandPool(bAsync),
 			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
 			.commandBufferCount = 1
 		};
@@ -1401,12 +2267,12 @@ std::unique_ptr<CVulkanCmdBuffer> CVulkanDevice::commandBuffer()
 			return nullptr;
 		}
 
-		cmdBuffer = std::make_unique<CVulkanCmdBuffer>(this, rawCmdBuffer);
+		cmdBuffer = std::make_unique<CVulkanCmdBuffer>(this, rawCmdBuffer, bAsync);
 	}
 	else
 	{
-		cmdBuffer = std::move(m_unusedCmdBufs.back());
-		m_unusedCmdBufs.pop_back();
+		cmdBuffer = std::move(unusedCmdBufs.back());
+		unusedCmdBufs.pop_back();
 	}
 
 	cmdBuffer->begin();
@@ -1417,44 +2283,285 @@ uint64_t CVulkanDevice::submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuffer)
 {
 	cmdBuffer->end();
 
-	// The seq no of the last submission.
-	const uint64_t lastSubmissionSeqNo = m_submissionSeqNo++;
+	const bool bAsync = cmdBuffer->async();
+
+	// The seq no of the last submission to this queue.
+	const uint64_t lastSubmissionSeqNo = bAsync ? m_asyncSubmissionSeqNo++ : m_submissionSeqNo++;
 
-	// This is the seq no of the command buffer we are going to submit.
-	const uint64_t nextSeqNo = lastSubmissionSeqNo + 1;
+	// This is the value the command buffer we are going to submit signals.
+	const uint64_t nextValue = lastSubmissionSeqNo + 1;
+	const uint64_t nextSeqNo = bAsync ? nextValue | k_ulAsyncSubmission : nextValue;
+
+	// Submissions to the same queue are ordered by the barriers, only the
+	// other queue needs waiting for
+	const uint64_t waitValue = cmdBuffer->waitSeqNo();
+	VkSemaphore waitSemaphore = bAsync ? m_scratchTimelineSemaphore : m_asyncTimelineSemaphore;
+	const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
 
 	VkTimelineSemaphoreSubmitInfo timelineInfo = {
 		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
-		// no need to ensure order of cmd buffer submission, we only have one queue
-		.waitSemaphoreValueCount = 0,
-		.pWaitSemaphoreValues = nullptr,
+		.waitSemaphoreValueCount = waitValue != 0 ? 1u : 0u,
+		.pWaitSemaphoreValues = &waitValue,
 		.signalSemaphoreValueCount = 1,
-		.pSignalSemaphoreValues = &nextSeqNo,
+		.pSignalSemaphoreValues = &nextValue,
 	};
 
 	VkCommandBuffer rawCmdBuffer = cmdBuffer->rawBuffer();
+	VkSemaphore signalSemaphore = bAsync ? m_asyncTimelineSemaphore : m_scratchTimelineSemaphore;
 
 	VkSubmitInfo submitInfo = {
 		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
 		.pNext = &timelineInfo,
+		.waitSemaphoreCount = waitValue != 0 ? 1u : 0u,
+		.pWaitSemaphores = &waitSemaphore,
+		.pWaitDstStageMask = &waitStage,
 		.commandBufferCount = 1,
 		.pCommandBuffers = &rawCmdBuffer,
 		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = &m_scratchTimelineSemaphore,
+		.pSignalSemaphores = &signalSemaphore,
 	};
 
-	VkResult res = vk.QueueSubmit( queue(), 1, &submitInfo, VK_NULL_HANDLE );
+	VkResult res = vk.QueueSubmit( bAsync ? m_asyncQueue : queue(), 1, &submitInfo, VK_NULL_HANDLE );
 
 	if ( res != VK_SUCCESS )
 	{
 		assert( 0 );
 	}
 
-	m_pendingCmdBufs.emplace(nextSeqNo, std::move(cmdBuffer));
+	for (uint32_t index : cmdBuffer->usedDescriptorSets())
+		m_descriptorSetCache[index].lastUsed(bAsync) = nextSeqNo;
+	for (uint32_t slot : cmdBuffer->usedLayerSlots())
+		m_layerSlotSeqNo[slot] = nextSeqNo;
+	for (VkDeviceSize offset : cmdBuffer->usedStaging())
+	{
+		// Another command buffer being recorded can have allocations before
+		// or after ours, live ones never share an offset
+		auto it = std::find_if(m_stagingAllocations.rbegin(), m_stagingAllocations.rend(), [offset](const StagingAllocation_t &allocation) {
+			return allocation.offset == offset && allocation.seqNo == k_ulNotSubmitted;
+		});
+		assert(it != m_stagingAllocations.rend());
+		if (it != m_stagingAllocations.rend())
+			it->seqNo = nextSeqNo;
+	}
+
+	auto& pendingCmdBufs = bAsync ? m_pendingAsyncCmdBufs : m_pendingCmdBufs;
+	pendingCmdBufs.emplace(nextSeqNo, std::move(cmdBuffer));
 
 	return nextSeqNo;
 }
 
+// Room for one frame's worth of layers in the layer buffer, pBase is the
+// index of the first one
+LayerInfo_t *CVulkanDevice::layerInfo(CVulkanCmdBuffer *cmdBuffer, uint32_t *pBase)
+{
+	uint32_t slot = m_nextLayerSlot;
+	m_nextLayerSlot = (m_nextLayerSlot + 1) % k_nLayerBufferSlots;
+
+	// Wrapped around onto a slot the GPU may still be reading
+	assert(m_layerSlotSeqNo[slot] != k_ulNotSubmitted);
+	wait(m_layerSlotSeqNo[slot]);
+
+	m_layerSlotSeqNo[slot] = k_ulNotSubmitted;
+	cmdBuffer->useLayerSlot(slot);
+
+	*pBase = slot * k_nMaxCompositeLayers;
+	return &m_layerBufferData[*pBase];
+}
+
+// Room for size bytes of upload data, to be copied from *pBuffer at
+// *pOffset by cmdBuffer. Only waits on the GPU if the ring is full of
+// uploads still in flight.
+void *CVulkanDevice::stagingAllocation(CVulkanCmdBuffer *cmdBuffer, VkDeviceSize size, VkBuffer *pBuffer, VkDeviceSize *pOffset)
+{
+	size = (size + k_ulStagingAlignment - 1) & ~(k_ulStagingAlignment - 1);
+
+	if (size > k_ulStagingRingSize)
+		return dedicatedStagingBuffer(cmdBuffer, size, pBuffer, pOffset);
+
+	VkDeviceSize offset;
+	for (;;)
+	{
+		retireStagingAllocations();
+
+		if (findStagingSpace(size, &offset))
+			break;
+
+		// Whatever is in the way hasn't been submitted yet, nothing to wait on
+		const StagingAllocation_t &oldest = m_stagingAllocations.front();
+		if (oldest.seqNo == k_ulNotSubmitted)
+			return dedicatedStagingBuffer(cmdBuffer, size, pBuffer, pOffset);
+
+		vk_log.debugf( "staging ring full, waiting for submission %" PRIu64, oldest.seqNo );
+		wait(oldest.seqNo);
+	}
+
+	m_stagingAllocations.push_back({ offset, size, k_ulNotSubmitted });
+	m_stagingHead = offset + size;
+	cmdBuffer->useStaging(offset);
+
+	*pBuffer = m_stagingBuffer;
+	*pOffset = offset;
+	return m_stagingBufferData + offset;
+}
+
+void CVulkanDevice::retireStagingAllocations()
+{
+	while (!m_stagingAllocations.empty() && isSubmissionDone(m_stagingAllocations.front().seqNo))
+		m_stagingAllocations.pop_front();
+
+	if (m_stagingAllocations.empty())
+		m_stagingHead = 0;
+}
+
+bool CVulkanDevice::findStagingSpace(VkDeviceSize size, VkDeviceSize *pOffset)
+{
+	if (m_stagingAllocations.empty())
+	{
+		*pOffset = 0;
+		return true;
+	}
+
+	const VkDeviceSize tail = m_stagingAllocations.front().offset;
+
+	if (m_stagingHead > tail)
+	{
+		// Free space is after the head and, wrapping around, before the tail
+		if (m_stagingHead + size <= k_ulStagingRingSize)
+		{
+			*pOffset = m_stagingHead;
+			return true;
+		}
+		if (size <= tail)
+		{
+			*pOffset = 0;
+			return true;
+		}
+	}
+	else if (m_stagingHead < tail && m_stagingHead + size <= tail)
+	{
+		*pOffset = m_stagingHead;
+		return true;
+	}
+
+	return false;
+}
+
+void *CVulkanDevice::dedicatedStagingBuffer(CVulkanCmdBuffer *cmdBuffer, VkDeviceSize size, VkBuffer *pBuffer, VkDeviceSize *pOffset)
+{
+	VkBufferCreateInfo bufferCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	};
+	VkBuffer buffer;
+	VkResult res = vk.CreateBuffer( device(), &bufferCreateInfo, nullptr, &buffer );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateBuffer failed" );
+		return nullptr;
+	}
+
+	VkMemoryRequirements memRequirements;
+	vk.GetBufferMemoryRequirements(device(), buffer, &memRequirements);
+
+	uint32_t memTypeIndex = findMemoryType(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
+	if ( memTypeIndex == ~0u )
+	{
+		vk_log.errorf( "findMemoryType failed" );
+		vk.DestroyBuffer( device(), buffer, nullptr );
+		return nullptr;
+	}
+
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = memRequirements.size,
+		.memoryTypeIndex = memTypeIndex,
+	};
+
+	VkDeviceMemory memory;
+	res = vk.AllocateMemory( device(), &allocInfo, nullptr, &memory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkAllocateMemory failed" );
+		vk.DestroyBuffer( device(), buffer, nullptr );
+		return nullptr;
+	}
+
+	vk.BindBufferMemory( device(), buffer, memory, 0 );
+
+	void *data;
+	res = vk.MapMemory( device(), memory, 0, VK_WHOLE_SIZE, 0, &data );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkMapMemory failed" );
+		vk.DestroyBuffer( device(), buffer, nullptr );
+		vk.FreeMemory( device(), memory, nullptr );
+		return nullptr;
+	}
+
+	// Unmapped along with the free once the copy is done
+	cmdBuffer->holdBuffer(buffer, memory);
+
+	*pBuffer = buffer;
+	*pOffset = 0;
+	return data;
+}
+
+// Returns the set for these bindings, and whether it still needs writing.
+// On a miss, the least recently used set the GPU is done with is recycled.
+VkDescriptorSet CVulkanDevice::cachedDescriptorSet(const DescriptorSetKey_t &key, bool bAsync, uint32_t *pIndex, bool *pbNeedsUpdate)
+{
+	auto search = m_descriptorSetLookup.find(key);
+	if (search != m_descriptorSetLookup.end())
+	{
+		CachedDescriptorSet_t &entry = m_descriptorSetCache[search->second];
+		entry.lastUsed(bAsync) = k_ulNotSubmitted;
+		entry.lastUse = ++m_ulDescriptorSetLookups;
+		*pIndex = search->second;
+		*pbNeedsUpdate = false;
+		return entry.set;
+	}
+
+	uint32_t victim = ~0u;
+	for (uint32_t i = 0; i < m_descriptorSetCache.size(); i++)
+	{
+		const CachedDescriptorSet_t &entry = m_descriptorSetCache[i];
+		if (entry.lastUsedSeqNo == k_ulNotSubmitted || entry.lastUsedAsyncSeqNo == k_ulNotSubmitted)
+			continue;
+		if (victim == ~0u || entry.lastUse < m_descriptorSetCache[victim].lastUse)
+			victim = i;
+	}
+
+	// Every set is in a command buffer being recorded, which would take
+	// far more dispatches than any frame does
+	assert(victim != ~0u);
+
+	CachedDescriptorSet_t &entry = m_descriptorSetCache[victim];
+	for (uint64_t seqNo : { entry.lastUsedSeqNo, entry.lastUsedAsyncSeqNo })
+	{
+		if (!isSubmissionDone(seqNo))
+		{
+			vk_log.debugf( "descriptor set cache full, waiting for submission %" PRIu64, seqNo );
+			wait(seqNo);
+		}
+	}
+
+	if (entry.bValid)
+		m_descriptorSetLookup.erase(entry.key);
+
+	entry.key = key;
+	entry.bValid = true;
+	entry.lastUsedSeqNo = 0;
+	entry.lastUsedAsyncSeqNo = 0;
+	entry.lastUsed(bAsync) = k_ulNotSubmitted;
+	entry.lastUse = ++m_ulDescriptorSetLookups;
+	m_descriptorSetLookup[key] = victim;
+
+	*pIndex = victim;
+	*pbNeedsUpdate = true;
+	return entry.set;
+}
+
 void CVulkanDevice::garbageCollect( void )
 {
 	uint64_t currentSeqNo;
@@ -1462,15 +2569,44 @@ void CVulkanDevice::garbageCollect( void )
 	assert( res == VK_SUCCESS );
 
 	resetCmdBuffers(currentSeqNo);
+
+	if (hasAsyncQueue())
+	{
+		res = vk.GetSemaphoreCounterValue(device(), m_asyncTimelineSemaphore, &currentSeqNo);
+		assert( res == VK_SUCCESS );
+
+		resetCmdBuffers(currentSeqNo | k_ulAsyncSubmission);
+	}
+}
+
+VkSemaphore CVulkanDevice::timelineSemaphore(uint64_t sequence)
+{
+	return (sequence & k_ulAsyncSubmission) ? m_asyncTimelineSemaphore : m_scratchTimelineSemaphore;
+}
+
+// Never true for k_ulNotSubmitted, whatever the semaphores say
+bool CVulkanDevice::isSubmissionDone(uint64_t sequence)
+{
+	if (sequence == k_ulNotSubmitted)
+		return false;
+
+	uint64_t currentValue;
+	VkResult res = vk.GetSemaphoreCounterValue(device(), timelineSemaphore(sequence), &currentValue);
+	assert( res == VK_SUCCESS );
+
+	return (sequence & ~k_ulAsyncSubmission) <= currentValue;
 }
 
 void CVulkanDevice::wait(uint64_t sequence)
 {
+	VkSemaphore semaphore = timelineSemaphore(sequence);
+	uint64_t value = sequence & ~k_ulAsyncSubmission;
+
 	VkSemaphoreWaitInfo waitInfo = {
 		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
 		.semaphoreCount = 1,
-		.pSemaphores = &m_scratchTimelineSemaphore,
-		.pValues = &sequence,
+		.pSemaphores = &semaphore,
+		.pValues = &value,
 	} ;
 
 	VkResult res = vk.WaitSemaphores(device(), &waitInfo, ~0ull);
@@ -1479,111 +2615,357 @@ void CVulkanDevice::wait(uint64_t sequence)
 	resetCmdBuffers(sequence);
 }
 
+// Unlike wait(), leaves the command buffers alone, so this can be called
+// from any thread. False if it timed out.
+bool CVulkanDevice::waitForSubmission(uint64_t sequence, uint64_t timeout)
+{
+	VkSemaphore semaphore = timelineSemaphore(sequence);
+	uint64_t value = sequence & ~k_ulAsyncSubmission;
+
+	VkSemaphoreWaitInfo waitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &semaphore,
+		.pValues = &value,
+	};
+
+	VkResult res = vk.WaitSemaphores(device(), &waitInfo, timeout);
+	if (res != VK_SUCCESS && res != VK_TIMEOUT)
+		vk_errorf( res, "vkWaitSemaphores failed" );
+
+	return res == VK_SUCCESS;
+}
+
 void CVulkanDevice::waitIdle()
 {
 	wait(m_submissionSeqNo);
+	if (hasAsyncQueue())
+		wait(m_asyncSubmissionSeqNo | k_ulAsyncSubmission);
 }
 
 void CVulkanDevice::resetCmdBuffers(uint64_t sequence)
 {
-	auto last = m_pendingCmdBufs.find(sequence);
-	if (last == m_pendingCmdBufs.end())
+	const bool bAsync = sequence & k_ulAsyncSubmission;
+	auto& pendingCmdBufs = bAsync ? m_pendingAsyncCmdBufs : m_pendingCmdBufs;
+	auto& unusedCmdBufs = bAsync ? m_unusedAsyncCmdBufs : m_unusedCmdBufs;
+
+	auto last = pendingCmdBufs.find(sequence);
+	if (last == pendingCmdBufs.end())
 		return;
 
-	for (auto it = m_pendingCmdBufs.begin(); ; it++)
+	for (auto it = pendingCmdBufs.begin(); ; it++)
 	{
 		it->second->reset();
-		m_unusedCmdBufs.push_back(std::move(it->second));
+		unusedCmdBufs.push_back(std::move(it->second));
 		if (it == last)
 			break;
 	}
 
-	m_pendingCmdBufs.erase(m_pendingCmdBufs.begin(), ++last);
+	pendingCmdBufs.erase(pendingCmdBufs.begin(), ++last);
 }
 
-CVulkanCmdBuffer::CVulkanCmdBuffer(CVulkanDevice *parent, VkCommandBuffer cmdBuffer)
-	: m_cmdBuffer(cmdBuffer), m_device(parent)
-{
-}
+// Small images go to small blocks, big ones to big blocks, so that a few
+// big images coming and going don't leave holes all over the place.
+// Anything bigger than that gets a dedicated allocation.
+static const VkDeviceSize k_ulArenaSmallLimit = 4 << 20;
+static const VkDeviceSize k_ulArenaSmallBlockSize = 32 << 20;
+static const VkDeviceSize k_ulArenaLargeLimit = 64 << 20;
+static const VkDeviceSize k_ulArenaLargeBlockSize = 128 << 20;
 
-CVulkanCmdBuffer::~CVulkanCmdBuffer()
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
 {
-	m_device->vk.FreeCommandBuffers(m_device->device(), m_device->commandPool(), 1, &m_cmdBuffer);
+	return (value + alignment - 1) / alignment * alignment;
 }
 
-void CVulkanCmdBuffer::reset()
+// Rounds up to the size class, 0 if it's too big for the arena
+static VkDeviceSize arena_size_class(VkDeviceSize size)
 {
-	VkResult res = m_device->vk.ResetCommandBuffer(m_cmdBuffer, 0);
-	assert(res == VK_SUCCESS);
-	m_textureRefs.clear();
-	m_textureState.clear();
+	if (size > k_ulArenaLargeLimit)
+		return 0;
+	if (size > k_ulArenaSmallLimit)
+		return align_up(size, 1 << 20);
+
+	VkDeviceSize sizeClass = 64 << 10;
+	while (sizeClass < size)
+		sizeClass *= 2;
+	return sizeClass;
 }
 
-void CVulkanCmdBuffer::begin()
+void CVulkanMemoryArena::init(CVulkanDevice *device)
 {
-	VkCommandBufferBeginInfo commandBufferBeginInfo = {
-		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
-	};
-
-	VkResult res = m_device->vk.BeginCommandBuffer(m_cmdBuffer, &commandBufferBeginInfo);
-	assert(res == VK_SUCCESS);
+	m_device = device;
 
-	clearState();
+	const char *pchDisable = getenv( "GAMESCOPE_VK_MEMORY_ARENA_DISABLE" );
+	m_bDisabled = pchDisable != nullptr && pchDisable[0] == '1';
 }
 
-void CVulkanCmdBuffer::end()
+bool CVulkanMemoryArena::allocateFromBlock(Block_t *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *pOffset)
 {
-	insertBarrier(true);
-	VkResult res = m_device->vk.EndCommandBuffer(m_cmdBuffer);
-	assert(res == VK_SUCCESS);
-}
+	for (auto it = block->freeRanges.begin(); it != block->freeRanges.end(); it++)
+	{
+		VkDeviceSize rangeStart = it->first;
+		VkDeviceSize rangeEnd = it->first + it->second;
+		VkDeviceSize offset = align_up(rangeStart, alignment);
+		if (offset + size > rangeEnd)
+			continue;
 
-void CVulkanCmdBuffer::bindTexture(uint32_t slot, std::shared_ptr<CVulkanTexture> texture)
-{
-	m_boundTextures[slot] = texture.get();
-	if (texture)
-		m_textureRefs.emplace(texture.get(), texture);
-}
+		block->freeRanges.erase(it);
+		if (offset > rangeStart)
+			block->freeRanges[rangeStart] = offset - rangeStart;
+		if (offset + size < rangeEnd)
+			block->freeRanges[offset + size] = rangeEnd - (offset + size);
 
-void CVulkanCmdBuffer::setTextureSrgb(uint32_t slot, bool srgb)
-{
-	m_useSrgb[slot] = srgb;
-}
+		block->allocations[offset] = size;
+		*pOffset = offset;
+		return true;
+	}
 
-void CVulkanCmdBuffer::setSamplerNearest(uint32_t slot, bool nearest)
-{
-	m_samplerState[slot].bNearest = nearest;
+	return false;
 }
 
-void CVulkanCmdBuffer::setSamplerUnnormalized(uint32_t slot, bool unnormalized)
+bool CVulkanMemoryArena::allocate(const VkMemoryRequirements &requirements, uint32_t memoryTypeIndex, VkDeviceMemory *pMemory, VkDeviceSize *pOffset)
 {
-	m_samplerState[slot].bUnnormalized = unnormalized;
-}
+	if (m_bDisabled)
+		return false;
 
-void CVulkanCmdBuffer::bindTarget(std::shared_ptr<CVulkanTexture> target)
-{
-	m_target = target.get();
-	if (target)
-		m_textureRefs.emplace(target.get(), target);
-}
+	VkDeviceSize size = arena_size_class(requirements.size);
+	if (size == 0)
+		return false;
 
-void CVulkanCmdBuffer::clearState()
-{
-	for (auto& texture : m_boundTextures)
-		texture = nullptr;
+	bool bLarge = size > k_ulArenaSmallLimit;
 
-	for (auto& sampler : m_samplerState)
-		sampler = {};
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	m_target = nullptr;
-	m_useSrgb.reset();
-}
+	for (auto& block : m_blocks)
+	{
+		if (block->memoryTypeIndex != memoryTypeIndex || block->bLarge != bLarge)
+			continue;
 
-template<class PushData, class... Args>
-void CVulkanCmdBuffer::pushConstants(Args&&... args)
-{
-	static_assert(sizeof(PushData) <= 256, "Only 256 bytes push constants.");
+		if (allocateFromBlock(block.get(), size, requirements.alignment, pOffset))
+		{
+			*pMemory = block->memory;
+			return true;
+		}
+	}
+
+	auto block = std::make_unique<Block_t>();
+	block->memoryTypeIndex = memoryTypeIndex;
+	block->bLarge = bLarge;
+	block->size = bLarge ? k_ulArenaLargeBlockSize : k_ulArenaSmallBlockSize;
+	block->freeRanges[0] = block->size;
+
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = block->size,
+		.memoryTypeIndex = memoryTypeIndex,
+	};
+
+	VkResult res = m_device->vk.AllocateMemory(m_device->device(), &allocInfo, nullptr, &block->memory);
+	if (res != VK_SUCCESS)
+	{
+		// Let the caller try a dedicated allocation, which may still fit
+		vk_errorf( res, "vkAllocateMemory failed for a %" PRIu64 "MiB arena block", block->size >> 20 );
+		return false;
+	}
+
+	vk_log.debugf( "new %" PRIu64 "MiB arena block for memory type %u", block->size >> 20, memoryTypeIndex );
+
+	bool bAllocated = allocateFromBlock(block.get(), size, requirements.alignment, pOffset);
+	assert(bAllocated);
+	*pMemory = block->memory;
+
+	m_blocks.push_back(std::move(block));
+	return true;
+}
+
+void CVulkanMemoryArena::free(VkDeviceMemory memory, VkDeviceSize offset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto blockIter = std::find_if(m_blocks.begin(), m_blocks.end(), [memory](const std::unique_ptr<Block_t> &block) {
+		return block->memory == memory;
+	});
+	assert(blockIter != m_blocks.end());
+	Block_t *block = blockIter->get();
+
+	auto allocation = block->allocations.find(offset);
+	assert(allocation != block->allocations.end());
+	VkDeviceSize size = allocation->second;
+	block->allocations.erase(allocation);
+
+	// Merge with the free ranges on either side
+	auto next = block->freeRanges.lower_bound(offset);
+	if (next != block->freeRanges.end() && next->first == offset + size)
+	{
+		size += next->second;
+		next = block->freeRanges.erase(next);
+	}
+	if (next != block->freeRanges.begin())
+	{
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset)
+		{
+			offset = prev->first;
+			size += prev->second;
+			block->freeRanges.erase(prev);
+		}
+	}
+	block->freeRanges[offset] = size;
+
+	if (!block->allocations.empty())
+		return;
+
+	// Keep one empty block of each kind around for whatever comes next,
+	// e.g. the scratch image that gets recreated on a resolution change
+	for (auto& other : m_blocks)
+	{
+		if (other.get() != block && other->allocations.empty() &&
+			other->memoryTypeIndex == block->memoryTypeIndex && other->bLarge == block->bLarge)
+		{
+			m_device->vk.FreeMemory(m_device->device(), block->memory, nullptr);
+			m_blocks.erase(blockIter);
+			return;
+		}
+	}
+}
+
+void CVulkanMemoryArena::getStats(VulkanMemoryStats_t *stats)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	stats->arenaBlocks = m_blocks.size();
+	stats->arenaSubAllocations = 0;
+	stats->arenaBytes = 0;
+	stats->arenaBytesUsed = 0;
+
+	for (auto& block : m_blocks)
+	{
+		stats->arenaSubAllocations += block->allocations.size();
+		stats->arenaBytes += block->size;
+		for (auto& allocation : block->allocations)
+			stats->arenaBytesUsed += allocation.second;
+	}
+}
+
+CVulkanCmdBuffer::CVulkanCmdBuffer(CVulkanDevice *parent, VkCommandBuffer cmdBuffer, bool bAsync)
+	: m_cmdBuffer(cmdBuffer), m_device(parent), m_bAsync(bAsync)
+{
+}
+
+CVulkanCmdBuffer::~CVulkanCmdBuffer()
+{
+	for (auto& held : m_heldBuffers)
+	{
+		m_device->vk.DestroyBuffer(m_device->device(), held.first, nullptr);
+		m_device->vk.FreeMemory(m_device->device(), held.second, nullptr);
+	}
+	m_device->vk.FreeCommandBuffers(m_device->device(), m_device->commandPool(m_bAsync), 1, &m_cmdBuffer);
+}
+
+void CVulkanCmdBuffer::reset()
+{
+	VkResult res = m_device->vk.ResetCommandBuffer(m_cmdBuffer, 0);
+	assert(res == VK_SUCCESS);
+	m_textureRefs.clear();
+	m_textureState.clear();
+	m_usedDescriptorSets.clear();
+	m_usedLayerSlots.clear();
+	m_usedStaging.clear();
+	m_ulWaitSeqNo = 0;
+
+	for (auto& held : m_heldBuffers)
+	{
+		m_device->vk.DestroyBuffer(m_device->device(), held.first, nullptr);
+		m_device->vk.FreeMemory(m_device->device(), held.second, nullptr);
+	}
+	m_heldBuffers.clear();
+}
+
+void CVulkanCmdBuffer::holdBuffer(VkBuffer buffer, VkDeviceMemory memory)
+{
+	m_heldBuffers.emplace_back(buffer, memory);
+}
+
+uint32_t CVulkanCmdBuffer::queueFamily()
+{
+	return m_device->queueFamily(m_bAsync);
+}
+
+void CVulkanCmdBuffer::waitFor(uint64_t sequence)
+{
+	if (sequence == 0 || sequence == k_ulNotSubmitted)
+		return;
+	if (bool(sequence & k_ulAsyncSubmission) == m_bAsync)
+		return;
+
+	m_ulWaitSeqNo = std::max(m_ulWaitSeqNo, sequence & ~k_ulAsyncSubmission);
+}
+
+void CVulkanCmdBuffer::begin()
+{
+	VkCommandBufferBeginInfo commandBufferBeginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+
+	VkResult res = m_device->vk.BeginCommandBuffer(m_cmdBuffer, &commandBufferBeginInfo);
+	assert(res == VK_SUCCESS);
+
+	clearState();
+}
+
+void CVulkanCmdBuffer::end()
+{
+	insertBarrier(true);
+	VkResult res = m_device->vk.EndCommandBuffer(m_cmdBuffer);
+	assert(res == VK_SUCCESS);
+}
+
+void CVulkanCmdBuffer::bindTexture(uint32_t slot, std::shared_ptr<CVulkanTexture> texture)
+{
+	m_boundTextures[slot] = texture.get();
+	if (texture)
+		m_textureRefs.emplace(texture.get(), texture);
+}
+
+void CVulkanCmdBuffer::setTextureSrgb(uint32_t slot, bool srgb)
+{
+	m_useSrgb[slot] = srgb;
+}
+
+void CVulkanCmdBuffer::setSamplerNearest(uint32_t slot, bool nearest)
+{
+	m_samplerState[slot].bNearest = nearest;
+}
+
+void CVulkanCmdBuffer::setSamplerUnnormalized(uint32_t slot, bool unnormalized)
+{
+	m_samplerState[slot].bUnnormalized = unnormalized;
+}
+
+void CVulkanCmdBuffer::bindTarget(std::shared_ptr<CVulkanTexture> target)
+{
+	m_target = target.get();
+	if (target)
+		m_textureRefs.emplace(target.get(), target);
+}
+
+void CVulkanCmdBuffer::clearState()
+{
+	for (auto& texture : m_boundTextures)
+		texture = nullptr;
+
+	for (auto& sampler : m_samplerState)
+		sampler = {};
+
+	m_target = nullptr;
+	m_useSrgb.reset();
+}
+
+template<class PushData, class... Args>
+void CVulkanCmdBuffer::pushConstants(Args&&... args)
+{
+	static_assert(sizeof(PushData) <= 256, "Only 256 bytes push constants.");
 	PushData data(std::forward<Args>(args)...);
 	m_device->vk.CmdPushConstants(m_cmdBuffer, m_device->pipelineLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(data), &data);
 }
@@ -1604,9 +2986,42 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 	prepareDestImage(m_target);
 	insertBarrier();
 
-	VkDescriptorSet descriptorSet = m_device->descriptorSet();
+	if (m_device->supportsPushDescriptors())
+	{
+		writeDescriptors(VK_NULL_HANDLE);
+	}
+	else
+	{
+		DescriptorSetKey_t key = {};
+		key.targetID = m_target->id();
+		for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
+		{
+			key.textureIDs[i] = m_boundTextures[i] ? m_boundTextures[i]->id() : 0;
+			key.srgbMask |= uint32_t(m_useSrgb[i]) << i;
+			key.samplerBits |= (uint32_t(m_samplerState[i].bNearest) | (uint32_t(m_samplerState[i].bUnnormalized) << 1)) << (i * 2);
+		}
+
+		uint32_t index;
+		bool bNeedsUpdate;
+		VkDescriptorSet descriptorSet = m_device->cachedDescriptorSet(key, m_bAsync, &index, &bNeedsUpdate);
+		m_usedDescriptorSets.push_back(index);
+
+		if (bNeedsUpdate)
+			writeDescriptors(descriptorSet);
+
+		m_device->vk.CmdBindDescriptorSets(m_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_device->pipelineLayout(), 0, 1, &descriptorSet, 0, nullptr);
+	}
+
+	m_device->vk.CmdDispatch(m_cmdBuffer, x, y, z);
+
+	markDirty(m_target);
+}
 
-	std::array<VkWriteDescriptorSet, 4> writeDescriptorSets;
+// Pushes the bound state straight into the command buffer when
+// descriptorSet is null, writes it to descriptorSet otherwise
+void CVulkanCmdBuffer::writeDescriptors(VkDescriptorSet descriptorSet)
+{
+	std::array<VkWriteDescriptorSet, 5> writeDescriptorSets;
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> imageDescriptors = {};
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> ycbcrImageDescriptors = {};
 	std::array<VkDescriptorImageInfo, VKR_TARGET_SLOTS> targetDescriptors = {};
@@ -1651,6 +3066,24 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 		.pImageInfo = ycbcrImageDescriptors.data(),
 	};
 
+	// The same for every dispatch, shaders pick their slot through push
+	// constants
+	VkDescriptorBufferInfo layerBufferDescriptor = {
+		.buffer = m_device->layerBuffer(),
+		.offset = 0,
+		.range = VK_WHOLE_SIZE,
+	};
+
+	writeDescriptorSets[4] = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = descriptorSet,
+		.dstBinding = 4,
+		.dstArrayElement = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		.pBufferInfo = &layerBufferDescriptor,
+	};
+
 	for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
 	{
 		imageDescriptors[i].sampler = m_device->sampler(m_samplerState[i]);
@@ -1681,13 +3114,10 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 		targetDescriptors[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
 	}
 
-	m_device->vk.UpdateDescriptorSets(m_device->device(), writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
-
-	m_device->vk.CmdBindDescriptorSets(m_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_device->pipelineLayout(), 0, 1, &descriptorSet, 0, nullptr);
-
-	m_device->vk.CmdDispatch(m_cmdBuffer, x, y, z);
-
-	markDirty(m_target);
+	if (descriptorSet == VK_NULL_HANDLE)
+		m_device->vk.CmdPushDescriptorSetKHR(m_cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_device->pipelineLayout(), 0, writeDescriptorSets.size(), writeDescriptorSets.data());
+	else
+		m_device->vk.UpdateDescriptorSets(m_device->device(), writeDescriptorSets.size(), writeDescriptorSets.data(), 0, nullptr);
 }
 
 void CVulkanCmdBuffer::copyImage(std::shared_ptr<CVulkanTexture> src, std::shared_ptr<CVulkanTexture> dst)
@@ -1745,8 +3175,34 @@ void CVulkanCmdBuffer::copyBufferToImage(VkBuffer buffer, VkDeviceSize offset, u
 	markDirty(dst.get());
 }
 
+void CVulkanCmdBuffer::updateImage(VkBuffer buffer, const std::vector<VkBufferImageCopy> &regions, std::shared_ptr<CVulkanTexture> dst)
+{
+	m_textureRefs.emplace(dst.get(), dst);
+	waitFor(dst->writeSeqNo());
+	// Not discarded, and no barrier against earlier reads either: the
+	// caller only updates an image nothing holds anymore, see
+	// CVulkanShmSurface::imageFree, so the GPU is done with it
+	m_textureState.emplace(dst.get(), TextureState());
+	insertBarrier();
+
+	m_device->vk.CmdCopyBufferToImage(m_cmdBuffer, buffer, dst->vkImage(), VK_IMAGE_LAYOUT_GENERAL, regions.size(), regions.data());
+
+	markDirty(dst.get());
+}
+
+void CVulkanCmdBuffer::resetTimestamps(uint32_t first, uint32_t count)
+{
+	m_device->vk.CmdResetQueryPool(m_cmdBuffer, m_device->timestampQueryPool(), first, count);
+}
+
+void CVulkanCmdBuffer::writeTimestamp(uint32_t query)
+{
+	m_device->vk.CmdWriteTimestamp(m_cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_device->timestampQueryPool(), query);
+}
+
 void CVulkanCmdBuffer::prepareSrcImage(CVulkanTexture *image)
 {
+	waitFor(image->writeSeqNo());
 	auto result = m_textureState.emplace(image, TextureState());
 	// no need to reimport if the image didn't change
 	if (!result.second)
@@ -1759,6 +3215,7 @@ void CVulkanCmdBuffer::prepareSrcImage(CVulkanTexture *image)
 
 void CVulkanCmdBuffer::prepareDestImage(CVulkanTexture *image)
 {
+	waitFor(image->writeSeqNo());
 	auto result = m_textureState.emplace(image, TextureState());
 	// no need to discard if the image is already image/in the correct layout
 	if (!result.second)
@@ -1811,8 +3268,8 @@ void CVulkanCmdBuffer::insertBarrier(bool flush)
 			.dstAccessMask = flush ? 0u : read_bits | write_bits,
 			.oldLayout = (state.discarded || state.needsImport) ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL,
 			.newLayout = isPresent ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_GENERAL,
-			.srcQueueFamilyIndex = isExport ? m_device->queueFamily() : state.needsImport ? externalQueue : VK_QUEUE_FAMILY_IGNORED,
-			.dstQueueFamilyIndex = isExport ? externalQueue : state.needsImport ? m_device->queueFamily() : VK_QUEUE_FAMILY_IGNORED,
+			.srcQueueFamilyIndex = isExport ? queueFamily() : state.needsImport ? externalQueue : VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = isExport ? externalQueue : state.needsImport ? queueFamily() : VK_QUEUE_FAMILY_IGNORED,
 			.image = image->vkImage(),
 			.subresourceRange = subResRange
 		};
@@ -1898,6 +3355,9 @@ static VkResult getModifierProps( const VkImageCreateInfo *imageInfo, uint64_t m
 	return g_device.vk.GetPhysicalDeviceImageFormatProperties2(g_device.physDev(), &imageFormatInfo, &imageProps);
 }
 
+// Texture memory not coming from the arena, for VulkanMemoryStats_t
+static std::atomic<uint32_t> s_nDedicatedTextureAllocations = { 0 };
+
 bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t drmFormat, createFlags flags, wlr_dmabuf_attributes *pDMA /* = nullptr */,  uint32_t contentWidth /* = 0 */, uint32_t contentHeight /* =  0 */)
 {
 	VkResult res = VK_ERROR_INITIALIZATION_FAILED;
@@ -1968,6 +3428,17 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t drmFormat,
 
 	assert( imageInfo.format != VK_FORMAT_UNDEFINED );
 
+	// Updates only write part of the image, so what's there has to carry
+	// over between the queues, without an ownership transfer each way
+	const uint32_t queueFamilies[2] = { g_device.queueFamily(), g_device.queueFamily( true ) };
+	if ( flags.bConcurrent && g_device.asyncQueueShared() )
+	{
+		assert( pDMA == nullptr && !flags.bExportable );
+		imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		imageInfo.queueFamilyIndexCount = 2;
+		imageInfo.pQueueFamilyIndices = queueFamilies;
+	}
+
 	std::array<VkFormat, 2> formats = {
 		DRMFormatToVulkan(drmFormat, false),
 		DRMFormatToVulkan(drmFormat, true),
@@ -2136,6 +3607,10 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t drmFormat,
 
 	m_size = allocInfo.allocationSize;
 
+	// Nobody else gets to see this one, so it can share memory with others
+	if ( flags.bExportable == false && pDMA == nullptr && flags.bMappable == false && tiling == VK_IMAGE_TILING_OPTIMAL )
+		m_bArenaMemory = g_device.memoryArena().allocate( memRequirements, allocInfo.memoryTypeIndex, &m_vkImageMemory, &m_memoryOffset );
+
 	if ( flags.bExportable == true || pDMA != nullptr )
 	{
 		memory_dedicated_info = {
@@ -2185,14 +3660,18 @@ bool CVulkanTexture::BInit( uint32_t width, uint32_t height, uint32_t drmFormat,
 		};
 	}
 	
-	res = g_device.vk.AllocateMemory( g_device.device(), &allocInfo, nullptr, &m_vkImageMemory );
-	if ( res != VK_SUCCESS )
+	if ( !m_bArenaMemory )
 	{
-		vk_errorf( res, "vkAllocateMemory failed" );
-		return false;
+		res = g_device.vk.AllocateMemory( g_device.device(), &allocInfo, nullptr, &m_vkImageMemory );
+		if ( res != VK_SUCCESS )
+		{
+			vk_errorf( res, "vkAllocateMemory failed" );
+			return false;
+		}
+		s_nDedicatedTextureAllocations++;
 	}
 	
-	res = g_device.vk.BindImageMemory( g_device.device(), m_vkImage, m_vkImageMemory, 0 );
+	res = g_device.vk.BindImageMemory( g_device.device(), m_vkImage, m_vkImageMemory, m_memoryOffset );
 	if ( res != VK_SUCCESS )
 	{
 		vk_errorf( res, "vkBindImageMemory failed" );
@@ -2480,6 +3959,8 @@ bool CVulkanTexture::BInitFromSwapchain( VkImage image, uint32_t width, uint32_t
 
 CVulkanTexture::CVulkanTexture( void )
 {
+	static std::atomic<uint64_t> s_ulNextID = { 0 };
+	m_ulID = ++s_ulNextID;
 }
 
 CVulkanTexture::~CVulkanTexture( void )
@@ -2519,30 +4000,21 @@ CVulkanTexture::~CVulkanTexture( void )
 			m_vkImage = VK_NULL_HANDLE;
 		}
 
-		g_device.vk.FreeMemory( g_device.device(), m_vkImageMemory, nullptr );
+		if ( m_bArenaMemory )
+		{
+			g_device.memoryArena().free( m_vkImageMemory, m_memoryOffset );
+		}
+		else
+		{
+			g_device.vk.FreeMemory( g_device.device(), m_vkImageMemory, nullptr );
+			s_nDedicatedTextureAllocations--;
+		}
 		m_vkImageMemory = VK_NULL_HANDLE;
 	}
 
 	m_bInitialized = false;
 }
 
-int CVulkanTexture::memoryFence()
-{
-	const VkMemoryGetFdInfoKHR memory_get_fd_info = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
-		.memory = m_vkImageMemory,
-		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
-	};
-	int fence = -1;
-	VkResult res = g_device.vk.GetMemoryFdKHR(g_device.device(), &memory_get_fd_info, &fence);
-	if ( res != VK_SUCCESS ) {
-		fprintf( stderr, "vkGetMemoryFdKHR failed\n" );
-	}
-
-	return fence;
-}
-
-
 bool vulkan_init_format(VkFormat format, uint32_t drmFormat)
 {
 	// First, check whether the Vulkan format is supported
@@ -2778,6 +4250,11 @@ bool vulkan_remake_swapchain( void )
 	for (auto& pScreenshotImage : pOutput->pScreenshotImages)
 		pScreenshotImage = nullptr;
 
+	// Same for the partial composition images
+	pOutput->nPartialOutImage = 0;
+	for (auto& pPartialImage : pOutput->partialCompositeImages)
+		pPartialImage = nullptr;
+
 	bool bRet = vulkan_make_swapchain( pOutput );
 	assert( bRet ); // Something has gone horribly wrong!
 	return bRet;
@@ -2791,26 +4268,25 @@ static bool vulkan_make_output_images( VulkanOutput_t *pOutput )
 	outputImageflags.bTransferSrc = true; // for screenshots
 	outputImageflags.bSampled = true; // for pipewire blits
 
-	pOutput->outputImages.resize(2);
-
-	pOutput->outputImages[0] = nullptr;
-	pOutput->outputImages[1] = nullptr;
+	// One on screen, one per flip we may have queued and one to draw into.
+	// The mirror output can hold on to another two, the one it shows and
+	// the one it's flipping to.
+	pOutput->outputImages.resize( k_nMaxQueuedFlips + 2 + ( drm_mirror_requested() ? 2 : 0 ) );
 
-	pOutput->outputImages[0] = std::make_shared<CVulkanTexture>();
-	bool bSuccess = pOutput->outputImages[0]->BInit( g_nOutputWidth, g_nOutputHeight, VulkanFormatToDRM(pOutput->outputFormat), outputImageflags );
-	if ( bSuccess != true )
+	for ( auto &pOutputImage : pOutput->outputImages )
 	{
-		vk_log.errorf( "failed to allocate buffer for KMS" );
-		return false;
+		pOutputImage = std::make_shared<CVulkanTexture>();
+		bool bSuccess = pOutputImage->BInit( g_nOutputWidth, g_nOutputHeight, VulkanFormatToDRM(pOutput->outputFormat), outputImageflags );
+		if ( bSuccess != true )
+		{
+			vk_log.errorf( "failed to allocate buffer for KMS" );
+			return false;
+		}
 	}
 
-	pOutput->outputImages[1] = std::make_shared<CVulkanTexture>();
-	bSuccess = pOutput->outputImages[1]->BInit( g_nOutputWidth, g_nOutputHeight, VulkanFormatToDRM(pOutput->outputFormat), outputImageflags );
-	if ( bSuccess != true )
-	{
-		vk_log.errorf( "failed to allocate buffer for KMS" );
-		return false;
-	}
+	// Allocated on demand by vulkan_get_partial_composite_image
+	pOutput->nPartialOutImage = 0;
+	pOutput->partialCompositeImages.assign( pOutput->outputImages.size(), nullptr );
 
 	return true;
 }
@@ -2821,6 +4297,7 @@ bool vulkan_remake_output_images( void )
 	g_device.waitIdle();
 
 	pOutput->nOutImage = 0;
+	pOutput->nLastOutImage = 0;
 
 	// Delete screenshot image to be remade if needed
 	for (auto& pScreenshotImage : pOutput->pScreenshotImages)
@@ -2996,17 +4473,29 @@ std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_bits( uint32_t width,
 
 	texCreateFlags.bSampled = true;
 	texCreateFlags.bTransferDst = true;
+	texCreateFlags.bConcurrent = true;
 
 	if ( pTex->BInit( width, height, drmFormat, texCreateFlags, nullptr,  contentWidth, contentHeight) == false )
 		return nullptr;
 
-	memcpy( g_device.uploadBufferData(), bits, width * height * DRMFormatGetBPP(drmFormat) );
+	const VkDeviceSize size = width * height * DRMFormatGetBPP(drmFormat);
 
-	auto cmdBuffer = g_device.commandBuffer();
+	auto cmdBuffer = g_device.commandBuffer( true );
+
+	VkBuffer buffer;
+	VkDeviceSize offset;
+	void *dst = g_device.stagingAllocation(cmdBuffer.get(), size, &buffer, &offset);
+	if ( dst == nullptr )
+	{
+		g_device.submit(std::move(cmdBuffer));
+		return nullptr;
+	}
+
+	memcpy( dst, bits, size );
 
-	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), 0, 0, pTex);
+	cmdBuffer->copyBufferToImage(buffer, offset, 0, pTex);
 
-	g_device.submit(std::move(cmdBuffer));
+	pTex->setWriteSeqNo( g_device.submit(std::move(cmdBuffer)) );
 
 	return pTex;
 }
@@ -3023,6 +4512,11 @@ void vulkan_garbage_collect( void )
 	g_device.garbageCollect();
 }
 
+bool vulkan_wait_for_write( uint64_t sequence, uint64_t timeout )
+{
+	return g_device.waitForSubmission( sequence, timeout );
+}
+
 std::shared_ptr<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace)
 {
 	for (auto& pScreenshotImage : g_output.pScreenshotImages)
@@ -3039,6 +4533,11 @@ std::shared_ptr<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width
 				screenshotImageFlags.bLinear = true; // TODO: support multi-planar DMA-BUF export via PipeWire
 				screenshotImageFlags.bStorage = true;
 			}
+			// So KMS can write back into it directly, see drm_prepare_writeback
+			if (!BIsNested() && width == g_nOutputWidth && height == g_nOutputHeight && drm_supports_writeback(&g_DRM, drmFormat)) {
+				screenshotImageFlags.bFlippable = true;
+				screenshotImageFlags.bLinear = true;
+			}
 
 			bool bSuccess = pScreenshotImage->BInit( width, height, drmFormat, screenshotImageFlags );
 			pScreenshotImage->setStreamColorspace(colorspace);
@@ -3063,6 +4562,9 @@ struct BlitPushData_t
 	uint32_t borderMask;
 	uint32_t frameId;
 	uint32_t blurRadius;
+	// Only for the uber-shader, see k_uberBlitPipeline
+	uint32_t layerCount;
+	uint32_t ycbcrMask;
 
 	explicit BlitPushData_t(const struct FrameInfo_t *frameInfo)
 	{
@@ -3075,6 +4577,8 @@ struct BlitPushData_t
 		borderMask = frameInfo->borderMask();
 		frameId = s_frameId++;
 		blurRadius = frameInfo->blurRadius ? ( frameInfo->blurRadius * 2 ) - 1 : 0;
+		layerCount = frameInfo->layerCount;
+		ycbcrMask = frameInfo->ycbcrMask();
 	}
 
 	explicit BlitPushData_t(float blit_scale) {
@@ -3083,6 +4587,23 @@ struct BlitPushData_t
 		opacity[0] = 1.0f;
 		borderMask = 0;
 		frameId = s_frameId;
+		blurRadius = 0;
+		layerCount = 1;
+		ycbcrMask = 0;
+	}
+};
+
+struct LayersPushData_t
+{
+	uint32_t layerBase;
+	uint32_t layerCount;
+	uint32_t frameId;
+
+	LayersPushData_t(uint32_t base, uint32_t count)
+	{
+		layerBase = base;
+		layerCount = count;
+		frameId = s_frameId++;
 	}
 };
 
@@ -3199,16 +4720,298 @@ void bind_all_layers(CVulkanCmdBuffer* cmdBuffer, const struct FrameInfo_t *fram
 	}
 }
 
-bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
+// Composites any number of layers with the one pipeline, taking their
+// geometry from the layer buffer instead of specialization and push constants
+static void composite_layer_list(CVulkanCmdBuffer* cmdBuffer, const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> target)
 {
-	auto compositeImage = g_output.outputImages[ g_output.nOutImage ];
-
-	auto cmdBuffer = g_device.commandBuffer();
+	uint32_t layerBase;
+	LayerInfo_t *layerInfos = g_device.layerInfo(cmdBuffer, &layerBase);
 
-	if ( frameInfo->useFSRLayer0 )
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
 	{
-		uint32_t inputX = frameInfo->layers[0].tex->width();
-		uint32_t inputY = frameInfo->layers[0].tex->height();
+		const FrameInfo_t::Layer_t *layer = &frameInfo->layers[i];
+		LayerInfo_t *info = &layerInfos[i];
+
+		info->scale = layer->scale;
+		info->offset = layer->offsetPixelCenter();
+		info->opacity = layer->opacity;
+		info->texIndex = i;
+		info->flags = 0;
+		if ( layer->isYcbcr() )
+			info->flags |= LAYER_FLAG_YCBCR;
+		if ( layer->blackBorder )
+			info->flags |= LAYER_FLAG_BORDER;
+
+		// Where sampling lands inside the texture, give or take a pixel
+		if ( layer->tex != nullptr )
+		{
+			info->bounds[0] = -info->offset.x - 1.0f;
+			info->bounds[1] = -info->offset.y - 1.0f;
+			info->bounds[2] = layer->tex->width() / layer->scale.x - info->offset.x + 1.0f;
+			info->bounds[3] = layer->tex->height() / layer->scale.y - info->offset.y + 1.0f;
+		}
+		else
+		{
+			info->bounds[0] = info->bounds[1] = info->bounds[2] = info->bounds[3] = 0.0f;
+		}
+	}
+
+	// Precompiled like every other single variant shader, see
+	// startPipelineCompiler
+	cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_LAYERS, 1, 0, 1));
+	bind_all_layers(cmdBuffer, frameInfo);
+	cmdBuffer->bindTarget(target);
+	cmdBuffer->pushConstants<LayersPushData_t>(layerBase, frameInfo->layerCount);
+
+	const int pixelsPerGroup = 8;
+
+	cmdBuffer->dispatch(div_roundup(target->width(), pixelsPerGroup), div_roundup(target->height(), pixelsPerGroup));
+}
+
+struct GPUTimestampFrame_t
+{
+	bool bPending = false;
+	bool bInPass = false;
+	uint32_t firstQuery = 0;
+	// The composite, and the capture if it went to the async queue
+	uint64_t seqNo = 0;
+	uint64_t asyncSeqNo = 0;
+	uint32_t nPasses = 0;
+	std::array<EGPUPass, k_nMaxTimestampPasses> passes;
+	std::bitset<k_nMaxTimestampPasses> asyncPasses;
+};
+
+static std::array<GPUTimestampFrame_t, k_nTimestampFrames> s_timestampFrames;
+static uint32_t s_nTimestampFrame = 0;
+
+static std::mutex s_gpuTimingsMutex;
+static VulkanGPUTimings_t s_gpuTimings = {};
+
+static const char *s_gpuPassNames[k_EGPUPass_Count] = {
+	"easu",
+	"rcas",
+	"nis",
+	"blur_first_pass",
+	"blur",
+	"blit",
+	"layer_list",
+	"capture",
+};
+
+// Picks up whatever composites the GPU is done with, oldest first. Never
+// waits, what isn't back yet is left for the next frame.
+static void resolve_gpu_timestamps()
+{
+	for (uint32_t i = 1; i <= k_nTimestampFrames; i++)
+	{
+		GPUTimestampFrame_t &frame = s_timestampFrames[(s_nTimestampFrame + i) % k_nTimestampFrames];
+		if (!frame.bPending)
+			continue;
+		if (!g_device.isSubmissionDone(frame.seqNo) || (frame.asyncSeqNo != 0 && !g_device.isSubmissionDone(frame.asyncSeqNo)))
+			continue;
+
+		std::array<uint64_t, k_nTimestampQueriesPerFrame> ticks;
+		VkResult res = g_device.vk.GetQueryPoolResults(g_device.device(), g_device.timestampQueryPool(), frame.firstQuery, 2 * frame.nPasses,
+			sizeof(ticks), ticks.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+		if (res == VK_NOT_READY)
+			continue;
+
+		frame.bPending = false;
+		if (res != VK_SUCCESS)
+		{
+			vk_errorf( res, "vkGetQueryPoolResults failed" );
+			continue;
+		}
+
+		VulkanGPUTimings_t timings = {};
+		const uint64_t mask = g_device.timestampMask();
+		uint64_t drawBegin = 0;
+		uint64_t drawEnd = 0;
+		bool bDraw = false;
+
+		for (uint32_t pass = 0; pass < frame.nPasses; pass++)
+		{
+			const bool bAsync = frame.asyncPasses[pass];
+			const uint64_t passMask = g_device.timestampMask(bAsync);
+			const uint64_t begin = ticks[2 * pass] & passMask;
+			const uint64_t end = ticks[2 * pass + 1] & passMask;
+
+			timings.passTime[frame.passes[pass]] += uint64_t(double((end - begin) & passMask) * g_device.timestampPeriod());
+
+			if (!bAsync)
+			{
+				if (!bDraw)
+					drawBegin = begin;
+				drawEnd = end;
+				bDraw = true;
+			}
+		}
+
+		if (bDraw)
+			timings.drawTime = uint64_t(double((drawEnd - drawBegin) & mask) * g_device.timestampPeriod());
+
+		for (uint32_t pass = 0; pass < k_EGPUPass_Count; pass++)
+		{
+			if (timings.passTime[pass] != 0)
+				gpuvis_trace_printf( "gpu %s %" PRIu64 "us", s_gpuPassNames[pass], timings.passTime[pass] / 1'000lu );
+		}
+		gpuvis_trace_printf( "gpu draw %" PRIu64 "us", timings.drawTime / 1'000lu );
+
+		g_uVblankGPUDrawTimeNS = timings.drawTime;
+
+		std::lock_guard<std::mutex> lock(s_gpuTimingsMutex);
+		timings.frameCount = s_gpuTimings.frameCount + 1;
+		s_gpuTimings = timings;
+	}
+}
+
+// Where the timestamps of the composite being recorded go, nullptr if the
+// GPU can't do timestamps or this composite doesn't get timed
+static GPUTimestampFrame_t *begin_gpu_timestamps(CVulkanCmdBuffer *cmdBuffer)
+{
+	if (g_device.timestampQueryPool() == VK_NULL_HANDLE)
+		return nullptr;
+
+	resolve_gpu_timestamps();
+
+	// The GPU is k_nTimestampFrames composites behind. Resetting queries a
+	// submission may still write isn't allowed, so this one goes untimed.
+	uint32_t nextFrame = (s_nTimestampFrame + 1) % k_nTimestampFrames;
+	const GPUTimestampFrame_t &next = s_timestampFrames[nextFrame];
+	if (next.bPending && (!g_device.isSubmissionDone(next.seqNo) || (next.asyncSeqNo != 0 && !g_device.isSubmissionDone(next.asyncSeqNo))))
+		return nullptr;
+
+	// Done but the results never showed up, those get lost
+	s_nTimestampFrame = nextFrame;
+	GPUTimestampFrame_t &frame = s_timestampFrames[s_nTimestampFrame];
+	frame = GPUTimestampFrame_t();
+	frame.firstQuery = s_nTimestampFrame * k_nTimestampQueriesPerFrame;
+
+	cmdBuffer->resetTimestamps(frame.firstQuery, k_nTimestampQueriesPerFrame);
+	return &frame;
+}
+
+// Around the dispatches of a pass, cmdBuffer can be on either queue
+static void begin_gpu_pass(CVulkanCmdBuffer *cmdBuffer, GPUTimestampFrame_t *frame, EGPUPass pass)
+{
+	if (frame == nullptr || frame->nPasses == k_nMaxTimestampPasses)
+		return;
+	if (g_device.timestampMask(cmdBuffer->async()) == 0)
+		return;
+
+	cmdBuffer->writeTimestamp(frame->firstQuery + 2 * frame->nPasses);
+	frame->passes[frame->nPasses] = pass;
+	frame->asyncPasses[frame->nPasses] = cmdBuffer->async();
+	frame->bInPass = true;
+}
+
+static void end_gpu_pass(CVulkanCmdBuffer *cmdBuffer, GPUTimestampFrame_t *frame)
+{
+	if (frame == nullptr || !frame->bInPass)
+		return;
+
+	cmdBuffer->writeTimestamp(frame->firstQuery + 2 * frame->nPasses + 1);
+	frame->nPasses++;
+	frame->bInPass = false;
+}
+
+static void end_gpu_timestamps(GPUTimestampFrame_t *frame, uint64_t seqNo, uint64_t asyncSeqNo)
+{
+	if (frame == nullptr)
+		return;
+
+	frame->seqNo = seqNo;
+	frame->asyncSeqNo = asyncSeqNo;
+	frame->bPending = frame->nPasses != 0;
+}
+
+// Copies or converts the composited frame into pScreenshotTexture
+static void record_capture( CVulkanCmdBuffer *cmdBuffer, std::shared_ptr<CVulkanTexture> compositeImage, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
+{
+	if (compositeImage->format() == pScreenshotTexture->format() &&
+		compositeImage->width() == pScreenshotTexture->width() &&
+	    compositeImage->height() == pScreenshotTexture->height()) {
+		cmdBuffer->copyImage(compositeImage, pScreenshotTexture);
+	} else {
+		const bool ycbcr = pScreenshotTexture->isYcbcr();
+
+		float scale = (float)compositeImage->width() / pScreenshotTexture->width();
+		if ( ycbcr )
+		{
+			CaptureConvertBlitData_t constants( scale, colorspace_to_conversion_from_srgb_matrix( compositeImage->streamColorspace() ) );
+			constants.halfExtent[0] = pScreenshotTexture->width() / 2.0f;
+			constants.halfExtent[1] = pScreenshotTexture->height() / 2.0f;
+			cmdBuffer->pushConstants<CaptureConvertBlitData_t>(constants);
+		}
+		else
+		{
+			BlitPushData_t constants( scale );
+			cmdBuffer->pushConstants<BlitPushData_t>(constants);
+		}
+
+		cmdBuffer->bindPipeline(g_device.pipeline( ycbcr ? SHADER_TYPE_RGB_TO_NV12 : SHADER_TYPE_BLIT ));
+		cmdBuffer->bindTexture(0, compositeImage);
+		cmdBuffer->setTextureSrgb(0, false);
+		cmdBuffer->setSamplerNearest(0, false);
+		cmdBuffer->setSamplerUnnormalized(0, true);
+		for (uint32_t i = 1; i < VKR_SAMPLER_SLOTS; i++)
+		{
+			cmdBuffer->bindTexture(i, nullptr);
+		}
+		cmdBuffer->bindTarget(pScreenshotTexture);
+
+		const int pixelsPerGroup = 8;
+
+		// For ycbcr, we operate on 2 pixels at a time, so use the half-extent.
+		const int dispatchSize = ycbcr ? pixelsPerGroup * 2 : pixelsPerGroup;
+
+		cmdBuffer->dispatch(div_roundup(pScreenshotTexture->width(), dispatchSize), div_roundup(pScreenshotTexture->height(), 1));
+	}
+}
+
+static uint64_t g_ulFirstCompositeTime = 0;
+
+bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
+{
+	uint64_t ulCompositeStart = get_time_in_nanos();
+
+	// Flips may have gone through since the last composite picked this RT,
+	// look again, and never draw over one that's still on screen
+	if ( BIsNested() == false && drm_fbid_in_flight( &g_DRM, g_output.outputImages[ g_output.nOutImage ]->fbid() ) )
+	{
+		std::vector< uint32_t > fbids;
+		for ( uint32_t i = 1; i < g_output.outputImages.size(); i++ )
+			fbids.push_back( g_output.outputImages[ ( g_output.nOutImage + i ) % g_output.outputImages.size() ]->fbid() );
+
+		int nFree = drm_wait_for_free_fbid( &g_DRM, fbids );
+		if ( nFree < 0 )
+		{
+			vk_log.errorf( "every RT is still on screen, skipping the composite" );
+			return false;
+		}
+
+		g_output.nOutImage = ( g_output.nOutImage + 1 + nFree ) % g_output.outputImages.size();
+	}
+
+	auto compositeImage = g_output.outputImages[ g_output.nOutImage ];
+
+	auto cmdBuffer = g_device.commandBuffer();
+
+	// The last capture may still be reading the RT about to be overwritten
+	cmdBuffer->waitFor( g_output.ulLastCaptureSeqNo );
+
+	GPUTimestampFrame_t *pTimestamps = begin_gpu_timestamps( cmdBuffer.get() );
+
+	// The specialized shaders stop at k_nMaxLayers. The layer list can also
+	// be forced for everything, to compare the two.
+	static bool bForceLayerList = getenv( "GAMESCOPE_COMPOSITE_LAYER_LIST" ) != nullptr &&
+		getenv( "GAMESCOPE_COMPOSITE_LAYER_LIST" )[0] == '1';
+	const bool bLayerList = frameInfo->layerCount > k_nMaxLayers || bForceLayerList;
+
+	if ( frameInfo->useFSRLayer0 )
+	{
+		uint32_t inputX = frameInfo->layers[0].tex->width();
+		uint32_t inputY = frameInfo->layers[0].tex->height();
 
 		uint32_t tempX = frameInfo->layers[0].integerWidth();
 		uint32_t tempY = frameInfo->layers[0].integerHeight();
@@ -3225,18 +5028,37 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 
 		int pixelsPerGroup = 16;
 
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_EASU);
 		cmdBuffer->dispatch(div_roundup(tempX, pixelsPerGroup), div_roundup(tempY, pixelsPerGroup));
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 
-		cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_RCAS, frameInfo->layerCount, frameInfo->ycbcrMask() & ~1));
-		bind_all_layers(cmdBuffer.get(), frameInfo);
-		cmdBuffer->bindTexture(0, g_output.tmpOutput);
-		cmdBuffer->setTextureSrgb(0, true);
-		cmdBuffer->setSamplerUnnormalized(0, false);
-		cmdBuffer->setSamplerNearest(0, false);
-		cmdBuffer->bindTarget(compositeImage);
-		cmdBuffer->pushConstants<RcasPushData_t>(frameInfo, g_upscaleFilterSharpness / 10.0f);
+		if ( bLayerList )
+		{
+			// No RCAS for these, the upscaled layer goes in as is
+			struct FrameInfo_t fsrFrameInfo = *frameInfo;
+			fsrFrameInfo.layers[0].tex = g_output.tmpOutput;
+			fsrFrameInfo.layers[0].scale.x = 1.0f;
+			fsrFrameInfo.layers[0].scale.y = 1.0f;
+
+			begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_LayerList);
+			composite_layer_list(cmdBuffer.get(), &fsrFrameInfo, compositeImage);
+			end_gpu_pass(cmdBuffer.get(), pTimestamps);
+		}
+		else
+		{
+			cmdBuffer->bindPipeline(g_device.pipeline(SHADER_TYPE_RCAS, frameInfo->layerCount, frameInfo->ycbcrMask() & ~1));
+			bind_all_layers(cmdBuffer.get(), frameInfo);
+			cmdBuffer->bindTexture(0, g_output.tmpOutput);
+			cmdBuffer->setTextureSrgb(0, true);
+			cmdBuffer->setSamplerUnnormalized(0, false);
+			cmdBuffer->setSamplerNearest(0, false);
+			cmdBuffer->bindTarget(compositeImage);
+			cmdBuffer->pushConstants<RcasPushData_t>(frameInfo, g_upscaleFilterSharpness / 10.0f);
 
-		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+			begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_RCAS);
+			cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+			end_gpu_pass(cmdBuffer.get(), pTimestamps);
+		}
 	}
 	else if ( frameInfo->useNISLayer0 )
 	{
@@ -3267,21 +5089,41 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 		int pixelsPerGroupX = 32;
 		int pixelsPerGroupY = 24;
 
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_NIS);
 		cmdBuffer->dispatch(div_roundup(tempX, pixelsPerGroupX), div_roundup(tempY, pixelsPerGroupY));
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 
 		struct FrameInfo_t nisFrameInfo = *frameInfo;
 		nisFrameInfo.layers[0].tex = g_output.tmpOutput;
 		nisFrameInfo.layers[0].scale.x = 1.0f;
 		nisFrameInfo.layers[0].scale.y = 1.0f;
 
-		cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, nisFrameInfo.layerCount, nisFrameInfo.ycbcrMask()));
-		bind_all_layers(cmdBuffer.get(), &nisFrameInfo);
-		cmdBuffer->bindTarget(compositeImage);
-		cmdBuffer->pushConstants<BlitPushData_t>(&nisFrameInfo);
+		if ( bLayerList )
+		{
+			begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_LayerList);
+			composite_layer_list(cmdBuffer.get(), &nisFrameInfo, compositeImage);
+			end_gpu_pass(cmdBuffer.get(), pTimestamps);
+		}
+		else
+		{
+			cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, nisFrameInfo.layerCount, nisFrameInfo.ycbcrMask()));
+			bind_all_layers(cmdBuffer.get(), &nisFrameInfo);
+			cmdBuffer->bindTarget(compositeImage);
+			cmdBuffer->pushConstants<BlitPushData_t>(&nisFrameInfo);
 
-		int pixelsPerGroup = 8;
+			int pixelsPerGroup = 8;
 
-		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+			begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_Blit);
+			cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+			end_gpu_pass(cmdBuffer.get(), pTimestamps);
+		}
+	}
+	else if ( bLayerList )
+	{
+		// The blur shaders are specialized too, these go without
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_LayerList);
+		composite_layer_list(cmdBuffer.get(), frameInfo, compositeImage);
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 	}
 	else if ( frameInfo->blurLayer0 )
 	{
@@ -3307,7 +5149,9 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 
 		int pixelsPerGroup = 8;
 
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_BlurFirstPass);
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 
 		type = frameInfo->blurLayer0 == BLUR_MODE_COND ? SHADER_TYPE_BLUR_COND : SHADER_TYPE_BLUR;
 		cmdBuffer->bindPipeline(g_device.pipeline(type, frameInfo->layerCount, frameInfo->ycbcrMask(), blur_layer_count));
@@ -3318,7 +5162,9 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 		cmdBuffer->setSamplerUnnormalized(VKR_BLUR_EXTRA_SLOT, true);
 		cmdBuffer->setSamplerNearest(VKR_BLUR_EXTRA_SLOT, false);
 
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_Blur);
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 	}
 	else
 	{
@@ -3329,58 +5175,64 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 
 		const int pixelsPerGroup = 8;
 
+		begin_gpu_pass(cmdBuffer.get(), pTimestamps, k_EGPUPass_Blit);
 		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+		end_gpu_pass(cmdBuffer.get(), pTimestamps);
 	}
 
-	if ( pScreenshotTexture != nullptr )
+	// Captures of the RTs go on the async queue if there is one, so that
+	// the conversion doesn't hold up the flip. The RTs are external images,
+	// so handing one over goes through the foreign queue family like for
+	// KMS. Swapchain images stay with the queue presenting them.
+	const bool bAsyncCapture = pScreenshotTexture != nullptr && g_device.hasAsyncQueue() && compositeImage->externalImage();
+
+	if ( pScreenshotTexture != nullptr && !bAsyncCapture )
 	{
-		if (compositeImage->format() == pScreenshotTexture->format() &&
-			compositeImage->width() == pScreenshotTexture->width() &&
-		    compositeImage->height() == pScreenshotTexture->height()) {
-			cmdBuffer->copyImage(compositeImage, pScreenshotTexture);
-		} else {
-			const bool ycbcr = pScreenshotTexture->isYcbcr();
+		begin_gpu_pass( cmdBuffer.get(), pTimestamps, k_EGPUPass_Capture );
+		record_capture( cmdBuffer.get(), compositeImage, pScreenshotTexture );
+		end_gpu_pass( cmdBuffer.get(), pTimestamps );
+	}
 
-			float scale = (float)compositeImage->width() / pScreenshotTexture->width();
-			if ( ycbcr )
-			{
-				CaptureConvertBlitData_t constants( scale, colorspace_to_conversion_from_srgb_matrix( compositeImage->streamColorspace() ) );
-				constants.halfExtent[0] = pScreenshotTexture->width() / 2.0f;
-				constants.halfExtent[1] = pScreenshotTexture->height() / 2.0f;
-				cmdBuffer->pushConstants<CaptureConvertBlitData_t>(constants);
-			}
-			else
-			{
-				BlitPushData_t constants( scale );
-				cmdBuffer->pushConstants<BlitPushData_t>(constants);
-			}
+	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+	compositeImage->setWriteSeqNo( sequence );
 
-			cmdBuffer->bindPipeline(g_device.pipeline( ycbcr ? SHADER_TYPE_RGB_TO_NV12 : SHADER_TYPE_BLIT ));
-			cmdBuffer->bindTexture(0, compositeImage);
-			cmdBuffer->setTextureSrgb(0, false);
-			cmdBuffer->setSamplerNearest(0, false);
-			cmdBuffer->setSamplerUnnormalized(0, true);
-			for (uint32_t i = 1; i < VKR_SAMPLER_SLOTS; i++)
-			{
-				cmdBuffer->bindTexture(i, nullptr);
-			}
-			cmdBuffer->bindTarget(pScreenshotTexture);
+	uint64_t captureSequence = 0;
+	if ( bAsyncCapture )
+	{
+		// Waits for the composite, see CVulkanCmdBuffer::prepareSrcImage
+		auto captureCmdBuffer = g_device.commandBuffer( true );
+		begin_gpu_pass( captureCmdBuffer.get(), pTimestamps, k_EGPUPass_Capture );
+		record_capture( captureCmdBuffer.get(), compositeImage, pScreenshotTexture );
+		end_gpu_pass( captureCmdBuffer.get(), pTimestamps );
+		captureSequence = g_device.submit( std::move( captureCmdBuffer ) );
+		g_output.ulLastCaptureSeqNo = captureSequence;
+		pScreenshotTexture->setWriteSeqNo( captureSequence );
+	}
+	else if ( pScreenshotTexture != nullptr )
+	{
+		pScreenshotTexture->setWriteSeqNo( sequence );
+	}
 
-			const int pixelsPerGroup = 8;
+	end_gpu_timestamps( pTimestamps, sequence, captureSequence );
 
-			// For ycbcr, we operate on 2 pixels at a time, so use the half-extent.
-			const int dispatchSize = ycbcr ? pixelsPerGroup * 2 : pixelsPerGroup;
+	g_device.wait(sequence);
 
-			cmdBuffer->dispatch(div_roundup(pScreenshotTexture->width(), dispatchSize), div_roundup(pScreenshotTexture->height(), 1));
-		}
+	if ( BIsNested() == false )
+	{
+		g_output.nLastOutImage = g_output.nOutImage;
+
+		// The mirror output flips at its own pace, so the next RT in line
+		// may still be on screen there, see the top of vulkan_composite
+		g_output.nOutImage = ( g_output.nOutImage + 1 ) % g_output.outputImages.size();
 	}
 
-	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
-	g_device.wait(sequence);
+	g_device.countPipelineFrame();
 
-	if ( BIsNested() == false )
+	// Recording included, which is where a missing pipeline stalls
+	if ( g_ulFirstCompositeTime == 0 )
 	{
-		g_output.nOutImage = !g_output.nOutImage;
+		g_ulFirstCompositeTime = get_time_in_nanos() - ulCompositeStart;
+		vk_log.infof( "first frame composited in %" PRIu64 "us", g_ulFirstCompositeTime / 1'000lu );
 	}
 
 	return true;
@@ -3388,7 +5240,66 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 
 std::shared_ptr<CVulkanTexture> vulkan_get_last_output_image( void )
 {
-	return g_output.outputImages[ !g_output.nOutImage ];
+	if ( BIsNested() == true )
+		return g_output.outputImages[ !g_output.nOutImage ];
+
+	return g_output.outputImages[ g_output.nLastOutImage ];
+}
+
+std::shared_ptr<CVulkanTexture> vulkan_get_partial_composite_image( void )
+{
+	if ( g_output.partialCompositeImages.empty() )
+		return nullptr;
+
+	auto &pImage = g_output.partialCompositeImages[ g_output.nPartialOutImage ];
+
+	if ( pImage == nullptr )
+	{
+		CVulkanTexture::createFlags partialImageFlags;
+		partialImageFlags.bFlippable = true;
+		partialImageFlags.bStorage = true;
+		partialImageFlags.bSampled = true;
+
+		pImage = std::make_shared<CVulkanTexture>();
+		// Needs alpha, it gets blended over the planes below it.
+		if ( !pImage->BInit( g_nOutputWidth, g_nOutputHeight, DRM_FORMAT_ARGB8888, partialImageFlags ) )
+		{
+			vk_log.errorf( "failed to allocate buffer for partial composition" );
+			pImage = nullptr;
+		}
+	}
+
+	return pImage;
+}
+
+bool vulkan_composite_partial( const struct FrameInfo_t *frameInfo )
+{
+	if ( g_output.nPartialOutImage >= g_output.partialCompositeImages.size() )
+		return false;
+
+	auto compositeImage = g_output.partialCompositeImages[ g_output.nPartialOutImage ];
+	if ( compositeImage == nullptr )
+		return false;
+
+	auto cmdBuffer = g_device.commandBuffer();
+
+	cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, frameInfo->layerCount, frameInfo->ycbcrMask()));
+	bind_all_layers(cmdBuffer.get(), frameInfo);
+	cmdBuffer->bindTarget(compositeImage);
+	cmdBuffer->pushConstants<BlitPushData_t>(frameInfo);
+
+	const int pixelsPerGroup = 8;
+
+	cmdBuffer->dispatch(div_roundup(compositeImage->width(), pixelsPerGroup), div_roundup(compositeImage->height(), pixelsPerGroup));
+
+	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+	g_device.wait(sequence);
+
+	g_output.nPartialOutImage = ( g_output.nPartialOutImage + 1 ) % g_output.partialCompositeImages.size();
+
+	g_device.countPipelineFrame();
+
+	return true;
 }
 
 bool vulkan_primary_dev_id(dev_t *id)
@@ -3397,6 +5308,29 @@ bool vulkan_primary_dev_id(dev_t *id)
 	return g_device.hasDrmPrimaryDevId();
 }
 
+void vulkan_get_pipeline_stats( VulkanPipelineStats_t *stats )
+{
+	g_device.getPipelineStats( stats );
+	stats->firstFrameTime = g_ulFirstCompositeTime;
+}
+
+void vulkan_get_memory_stats( VulkanMemoryStats_t *stats )
+{
+	g_device.memoryArena().getStats( stats );
+	stats->allocations = s_nDedicatedTextureAllocations + stats->arenaBlocks;
+}
+
+void vulkan_get_gpu_timings( VulkanGPUTimings_t *timings )
+{
+	std::lock_guard<std::mutex> lock( s_gpuTimingsMutex );
+	*timings = s_gpuTimings;
+}
+
+const char *vulkan_gpu_pass_name( EGPUPass pass )
+{
+	return s_gpuPassNames[ pass ];
+}
+
 bool vulkan_supports_modifiers(void)
 {
 	return g_device.supportsModifiers();
@@ -3496,6 +5430,132 @@ struct wlr_renderer *vulkan_renderer_create( void )
 	return &renderer->base;
 }
 
+struct ShmRowCopy_t
+{
+	uint8_t *dst;
+	const uint8_t *src;
+	size_t dstStride;
+	size_t srcStride;
+	size_t rowSize;
+	uint32_t rows;
+};
+
+// Past this much, copies out of SHM buffers are split across threads, one
+// core doesn't get anywhere near the memory bandwidth
+static const size_t k_ulThreadedCopyThreshold = 4 << 20;
+static const uint32_t k_nMaxCopyThreads = 4;
+
+static void copy_shm_rows_part( const ShmRowCopy_t *copies, size_t count, uint32_t part, uint32_t parts )
+{
+	for ( size_t i = 0; i < count; i++ )
+	{
+		const ShmRowCopy_t &copy = copies[ i ];
+		uint32_t first = uint64_t( copy.rows ) * part / parts;
+		uint32_t last = uint64_t( copy.rows ) * ( part + 1 ) / parts;
+
+		if ( copy.rowSize == copy.dstStride && copy.rowSize == copy.srcStride )
+		{
+			memcpy( copy.dst + first * copy.dstStride, copy.src + first * copy.srcStride, ( last - first ) * copy.rowSize );
+			continue;
+		}
+
+		for ( uint32_t row = first; row < last; row++ )
+			memcpy( copy.dst + row * copy.dstStride, copy.src + row * copy.srcStride, copy.rowSize );
+	}
+}
+
+// Helpers for copy_shm_rows, started on first use and kept around, as the
+// copies come every frame. One copy at a time, the caller takes part 0 and
+// helper i part i.
+struct ShmCopyPool_t
+{
+	std::mutex copyMutex;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::condition_variable doneCV;
+	const ShmRowCopy_t *copies = nullptr;
+	size_t count = 0;
+	uint32_t parts = 0;
+	uint32_t partsLeft = 0;
+	uint64_t generation = 0;
+
+	uint32_t threadCount = 0;
+};
+
+static ShmCopyPool_t g_shmCopyPool;
+
+static void shm_copy_thread_run( uint32_t part )
+{
+	pthread_setname_np( pthread_self(), "gamescope-shmcp" );
+
+	ShmCopyPool_t &pool = g_shmCopyPool;
+	uint64_t generation = 0;
+
+	while ( true )
+	{
+		const ShmRowCopy_t *copies;
+		size_t count;
+		uint32_t parts;
+		{
+			std::unique_lock< std::mutex > lock( pool.mutex );
+			pool.cv.wait( lock, [&]{ return pool.generation != generation; } );
+			generation = pool.generation;
+
+			if ( part >= pool.parts )
+				continue;
+
+			copies = pool.copies;
+			count = pool.count;
+			parts = pool.parts;
+		}
+
+		copy_shm_rows_part( copies, count, part, parts );
+
+		std::lock_guard< std::mutex > lock( pool.mutex );
+		if ( --pool.partsLeft == 0 )
+			pool.doneCV.notify_one();
+	}
+}
+
+static void copy_shm_rows( const std::vector<ShmRowCopy_t> &copies )
+{
+	size_t totalSize = 0;
+	for ( auto& copy : copies )
+		totalSize += copy.rowSize * copy.rows;
+
+	uint32_t threadCount = std::min( { size_t( k_nMaxCopyThreads ), size_t( std::thread::hardware_concurrency() ), totalSize / k_ulThreadedCopyThreshold } );
+	if ( threadCount <= 1 )
+	{
+		copy_shm_rows_part( copies.data(), copies.size(), 0, 1 );
+		return;
+	}
+
+	ShmCopyPool_t &pool = g_shmCopyPool;
+	std::lock_guard< std::mutex > copyLock( pool.copyMutex );
+
+	while ( pool.threadCount < threadCount - 1 )
+	{
+		std::thread copyThread( shm_copy_thread_run, ++pool.threadCount );
+		copyThread.detach();
+	}
+
+	{
+		std::lock_guard< std::mutex > lock( pool.mutex );
+		pool.copies = copies.data();
+		pool.count = copies.size();
+		pool.parts = threadCount;
+		pool.partsLeft = threadCount - 1;
+		pool.generation++;
+	}
+	pool.cv.notify_all();
+
+	copy_shm_rows_part( copies.data(), copies.size(), 0, threadCount );
+
+	std::unique_lock< std::mutex > lock( pool.mutex );
+	pool.doneCV.wait( lock, [&]{ return pool.partsLeft == 0; } );
+}
+
 std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wlr_buffer *buf )
 {
 
@@ -3505,8 +5565,6 @@ std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wl
 		return vulkan_create_texture_from_dmabuf( &dmabuf );
 	}
 
-	VkResult result;
-
 	void *src;
 	uint32_t drmFormat;
 	size_t stride;
@@ -3518,81 +5576,374 @@ std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wl
 	uint32_t width = buf->width;
 	uint32_t height = buf->height;
 
-	VkBufferCreateInfo bufferCreateInfo = {
-		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = stride * height,
-		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-	};
-	VkBuffer buffer;
-	result = g_device.vk.CreateBuffer( g_device.device(), &bufferCreateInfo, nullptr, &buffer );
-	if ( result != VK_SUCCESS )
+	std::shared_ptr<CVulkanTexture> pTex = std::make_shared<CVulkanTexture>();
+	CVulkanTexture::createFlags texCreateFlags;
+	texCreateFlags.bSampled = true;
+	texCreateFlags.bTransferDst = true;
+	texCreateFlags.bConcurrent = true;
+	if ( pTex->BInit( width, height, drmFormat, texCreateFlags ) == false )
 	{
 		wlr_buffer_end_data_ptr_access( buf );
-		return 0;
+		return nullptr;
 	}
 
-	VkMemoryRequirements memRequirements;
-	g_device.vk.GetBufferMemoryRequirements(g_device.device(), buffer, &memRequirements);
+	auto cmdBuffer = g_device.commandBuffer( true );
 
-	uint32_t memTypeIndex =  g_device.findMemoryType(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
-	if ( memTypeIndex == ~0u )
+	VkBuffer buffer;
+	VkDeviceSize offset;
+	void *dst = g_device.stagingAllocation( cmdBuffer.get(), stride * height, &buffer, &offset );
+	if ( dst == nullptr )
 	{
 		wlr_buffer_end_data_ptr_access( buf );
-		return 0;
+		g_device.submit(std::move(cmdBuffer));
+		return nullptr;
 	}
 
-	VkMemoryAllocateInfo allocInfo = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = memRequirements.size,
-		.memoryTypeIndex = memTypeIndex,
-	};
+	copy_shm_rows( { { (uint8_t *)dst, (const uint8_t *)src, stride, stride, stride, height } } );
 
-	VkDeviceMemory bufferMemory;
-	result = g_device.vk.AllocateMemory( g_device.device(), &allocInfo, nullptr, &bufferMemory);
-	if ( result != VK_SUCCESS )
+	wlr_buffer_end_data_ptr_access( buf );
+
+	// bufferRowLength is in texels
+	cmdBuffer->copyBufferToImage( buffer, offset, stride / DRMFormatGetBPP( drmFormat ), pTex );
+
+	// Not waiting here, the commit is only done once this submission is,
+	// see imageWaitThreadMain
+	pTex->setWriteSeqNo( g_device.submit(std::move(cmdBuffer)) );
+
+	return pTex;
+}
+
+// Damage past this many rectangles is uploaded as its bounding box instead
+static const int k_nMaxShmDamageRects = 16;
+// Keeps every region's offset a multiple of the texel size
+static const VkDeviceSize k_ulShmRegionAlignment = 16;
+// Importing a buffer means an allocation and pinning all of its pages on
+// every commit, which only beats copying the damage into the staging ring
+// when that's big and a good part of the buffer
+static const VkDeviceSize k_ulShmImportMinDamage = 512 << 10;
+static const VkDeviceSize k_ulShmImportMinDamageFraction = 4;
+
+void CVulkanShmSurface::addDamage( const std::vector<wlr_box> &damage )
+{
+	for ( auto& image : m_images )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return 0;
+		for ( auto& box : damage )
+			pixman_region32_union_rect( &image.damage, &image.damage, box.x, box.y, box.width, box.height );
 	}
+}
 
-	result = g_device.vk.BindBufferMemory( g_device.device(), buffer, bufferMemory, 0 );
-	if ( result != VK_SUCCESS )
+bool CVulkanShmSurface::imageFree( uint32_t index ) const
+{
+	// Queued commits, frames and command buffers all hold a reference
+	return !m_images[ index ].tex || m_images[ index ].tex.use_count() == 1;
+}
+
+void CVulkanShmSurface::reset()
+{
+	for ( auto& image : m_images )
 	{
-		wlr_buffer_end_data_ptr_access( buf );
-		return 0;
+		image.tex = nullptr;
+		pixman_region32_clear( &image.damage );
 	}
+}
 
-	void *dst;
-	result = g_device.vk.MapMemory( g_device.device(), bufferMemory, 0, VK_WHOLE_SIZE, 0, &dst );
-	if ( result != VK_SUCCESS )
+std::shared_ptr<CVulkanTexture> CVulkanShmSurface::update( struct wlr_surface *surf, struct wlr_buffer *buf, const std::vector<wlr_box> &damage, std::shared_ptr<CVulkanHostBuffer> *pHostBuffer )
+{
+	void *src;
+	uint32_t drmFormat;
+	size_t stride;
+	if ( !wlr_buffer_begin_data_ptr_access( buf, WLR_BUFFER_DATA_PTR_ACCESS_READ, &src, &drmFormat, &stride ) )
+	{
+		return nullptr;
+	}
+
+	const uint32_t width = buf->width;
+	const uint32_t height = buf->height;
+
+	if ( surf != m_surface || width != m_width || height != m_height || drmFormat != m_drmFormat )
 	{
+		reset();
+		m_surface = surf;
+		m_width = width;
+		m_height = height;
+		m_drmFormat = drmFormat;
+	}
+
+	addDamage( damage );
+
+	// The other image is the older one, so usually the one nothing holds
+	uint32_t index = ( m_nLastImage + 1 ) % m_images.size();
+	if ( !imageFree( index ) && !imageFree( m_nLastImage ) )
+	{
+		// Command buffers the GPU is done with may still hold one
+		g_device.garbageCollect();
+	}
+	if ( !imageFree( index ) && imageFree( m_nLastImage ) )
+		index = m_nLastImage;
+
+	Image_t &image = m_images[ index ];
+	if ( !imageFree( index ) )
+	{
+		// Both still in use, leave this one to whoever has it
+		image.tex = nullptr;
+	}
+
+	bool bNewImage = false;
+	if ( !image.tex )
+	{
+		image.tex = std::make_shared<CVulkanTexture>();
+		CVulkanTexture::createFlags texCreateFlags;
+		texCreateFlags.bSampled = true;
+		texCreateFlags.bTransferDst = true;
+		texCreateFlags.bConcurrent = true;
+		if ( image.tex->BInit( width, height, drmFormat, texCreateFlags ) == false )
+		{
+			image.tex = nullptr;
+			wlr_buffer_end_data_ptr_access( buf );
+			return nullptr;
+		}
+
+		pixman_region32_union_rect( &image.damage, &image.damage, 0, 0, width, height );
+		bNewImage = true;
+	}
+
+	pixman_region32_intersect_rect( &image.damage, &image.damage, 0, 0, width, height );
+
+	int nRects = 0;
+	const pixman_box32_t *pRects = pixman_region32_rectangles( &image.damage, &nRects );
+	if ( nRects > k_nMaxShmDamageRects )
+	{
+		pRects = pixman_region32_extents( &image.damage );
+		nRects = 1;
+	}
+
+	m_nLastImage = index;
+
+	if ( nRects == 0 )
+	{
+		// Nothing changed, e.g. a commit just to get a frame callback
 		wlr_buffer_end_data_ptr_access( buf );
-		return 0;
+		return image.tex;
 	}
 
-	memcpy( dst, src, stride * height );
+	const uint32_t bpp = DRMFormatGetBPP( drmFormat );
 
-	g_device.vk.UnmapMemory( g_device.device(), bufferMemory );
+	VkDeviceSize damageSize = 0;
+	for ( int i = 0; i < nRects; i++ )
+		damageSize += VkDeviceSize( pRects[ i ].x2 - pRects[ i ].x1 ) * ( pRects[ i ].y2 - pRects[ i ].y1 ) * bpp;
 
-	wlr_buffer_end_data_ptr_access( buf );
+	auto cmdBuffer = g_device.commandBuffer( true );
 
-	std::shared_ptr<CVulkanTexture> pTex = std::make_shared<CVulkanTexture>();
-	CVulkanTexture::createFlags texCreateFlags;
-	texCreateFlags.bSampled = true;
-	texCreateFlags.bTransferDst = true;
-	if ( pTex->BInit( width, height, drmFormat, texCreateFlags ) == false )
-		return nullptr;
+	// Copying straight out of the client's buffer, where the driver takes
+	// it, saves the memcpy into the staging ring. Every region's offset
+	// needs to stay a multiple of the texel size and of 4 then.
+	std::shared_ptr<CVulkanHostBuffer> hostBuffer;
+	const bool bLargeDamage = damageSize >= k_ulShmImportMinDamage &&
+		damageSize * k_ulShmImportMinDamageFraction >= VkDeviceSize( stride ) * height;
+	if ( g_device.supportsHostImport() && bLargeDamage && bpp % 4 == 0 && stride % bpp == 0 )
+	{
+		hostBuffer = std::make_shared<CVulkanHostBuffer>();
+		if ( !hostBuffer->BInit( src, stride * height ) || hostBuffer->offset() % bpp != 0 )
+			hostBuffer = nullptr;
+	}
 
-	auto cmdBuffer = g_device.commandBuffer();
+	VkBuffer buffer;
+	VkDeviceSize offset;
+	uint32_t rowLength;
+	std::vector<VkBufferImageCopy> regions;
 
-	cmdBuffer->copyBufferToImage( buffer, 0, stride, pTex);
+	if ( hostBuffer )
+	{
+		buffer = hostBuffer->buffer();
+		offset = hostBuffer->offset();
+		rowLength = stride / bpp;
+
+		for ( int i = 0; i < nRects; i++ )
+		{
+			const pixman_box32_t &rect = pRects[ i ];
+
+			regions.push_back( VkBufferImageCopy{
+				.bufferOffset = offset + rect.y1 * stride + rect.x1 * bpp,
+				.bufferRowLength = rowLength,
+				.imageSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1,
+				},
+				.imageOffset = { rect.x1, rect.y1, 0 },
+				.imageExtent = { uint32_t( rect.x2 - rect.x1 ), uint32_t( rect.y2 - rect.y1 ), 1 },
+			} );
+		}
+	}
+	else
+	{
+		VkDeviceSize stagingSize = 0;
+		for ( int i = 0; i < nRects; i++ )
+		{
+			const pixman_box32_t &rect = pRects[ i ];
+			stagingSize += VkDeviceSize( rect.x2 - rect.x1 ) * ( rect.y2 - rect.y1 ) * bpp;
+			stagingSize = ( stagingSize + k_ulShmRegionAlignment - 1 ) & ~( k_ulShmRegionAlignment - 1 );
+		}
+
+		uint8_t *dst = (uint8_t *)g_device.stagingAllocation( cmdBuffer.get(), stagingSize, &buffer, &offset );
+		if ( dst == nullptr )
+		{
+			wlr_buffer_end_data_ptr_access( buf );
+			g_device.submit(std::move(cmdBuffer));
+			return nullptr;
+		}
+
+		// Tightly packed
+		rowLength = 0;
+
+		std::vector<ShmRowCopy_t> copies;
+		VkDeviceSize regionOffset = 0;
+		for ( int i = 0; i < nRects; i++ )
+		{
+			const pixman_box32_t &rect = pRects[ i ];
+			const uint32_t rectWidth = rect.x2 - rect.x1;
+			const uint32_t rectHeight = rect.y2 - rect.y1;
+
+			copies.push_back( ShmRowCopy_t{
+				.dst = dst + regionOffset,
+				.src = (const uint8_t *)src + rect.y1 * stride + rect.x1 * bpp,
+				.dstStride = rectWidth * bpp,
+				.srcStride = stride,
+				.rowSize = rectWidth * bpp,
+				.rows = rectHeight,
+			} );
+
+			regions.push_back( VkBufferImageCopy{
+				.bufferOffset = offset + regionOffset,
+				.imageSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1,
+				},
+				.imageOffset = { rect.x1, rect.y1, 0 },
+				.imageExtent = { rectWidth, rectHeight, 1 },
+			} );
+
+			regionOffset += VkDeviceSize( rectWidth ) * rectHeight * bpp;
+			regionOffset = ( regionOffset + k_ulShmRegionAlignment - 1 ) & ~( k_ulShmRegionAlignment - 1 );
+		}
+
+		copy_shm_rows( copies );
+	}
+
+	// The mapping itself stays until the wlr_buffer goes, see commit_t
+	wlr_buffer_end_data_ptr_access( buf );
+
+	// A new image has nothing worth keeping, and isn't in a layout to
+	// keep it in either
+	if ( bNewImage )
+		cmdBuffer->copyBufferToImage( buffer, offset, rowLength, image.tex );
+	else
+		cmdBuffer->updateImage( buffer, regions, image.tex );
+
+	pixman_region32_clear( &image.damage );
 
 	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+	image.tex->setWriteSeqNo( sequence );
 
-	g_device.wait(sequence);
+	if ( hostBuffer )
+	{
+		hostBuffer->setLastUseSeqNo( sequence );
+		*pHostBuffer = std::move( hostBuffer );
+	}
 
-	g_device.vk.DestroyBuffer(g_device.device(), buffer, nullptr);
-	g_device.vk.FreeMemory(g_device.device(), bufferMemory, nullptr);
+	return image.tex;
+}
 
-	return pTex;
+CVulkanHostBuffer::~CVulkanHostBuffer()
+{
+	// Normally long done, the commit holding this only finishes once the
+	// copy has. Commits dropped before that end up waiting here.
+	if ( m_ulLastUseSeqNo != 0 )
+		g_device.waitForSubmission( m_ulLastUseSeqNo, ~0ull );
+
+	if ( m_buffer != VK_NULL_HANDLE )
+		g_device.vk.DestroyBuffer( g_device.device(), m_buffer, nullptr );
+	if ( m_memory != VK_NULL_HANDLE )
+		g_device.vk.FreeMemory( g_device.device(), m_memory, nullptr );
+}
+
+bool CVulkanHostBuffer::BInit( void *data, size_t size )
+{
+	// Imports have to start and end on the driver's alignment, which is
+	// normally the page size, the SHM pool's mapping is whole pages too
+	const uintptr_t alignment = g_device.hostPointerAlignment();
+	const uintptr_t start = uintptr_t( data ) & ~( alignment - 1 );
+	const uintptr_t end = ( uintptr_t( data ) + size + alignment - 1 ) & ~( alignment - 1 );
+	const VkDeviceSize importSize = end - start;
+	m_offset = uintptr_t( data ) - start;
+
+	VkMemoryHostPointerPropertiesEXT hostPointerProps = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+	};
+	VkResult res = g_device.vk.GetMemoryHostPointerPropertiesEXT( g_device.device(), VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, (void *)start, &hostPointerProps );
+	if ( res != VK_SUCCESS )
+	{
+		vk_log.debugf( "vkGetMemoryHostPointerPropertiesEXT failed, copying" );
+		return false;
+	}
+
+	VkExternalMemoryBufferCreateInfo externalMemoryBufferInfo = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+	};
+
+	VkBufferCreateInfo bufferCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.pNext = &externalMemoryBufferInfo,
+		.size = importSize,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+	};
+
+	res = g_device.vk.CreateBuffer( g_device.device(), &bufferCreateInfo, nullptr, &m_buffer );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateBuffer failed" );
+		return false;
+	}
+
+	VkMemoryRequirements memRequirements;
+	g_device.vk.GetBufferMemoryRequirements( g_device.device(), m_buffer, &memRequirements );
+
+	if ( memRequirements.size > importSize )
+		return false;
+
+	uint32_t memTypeIndex = g_device.findMemoryType( 0, memRequirements.memoryTypeBits & hostPointerProps.memoryTypeBits );
+	if ( memTypeIndex == ~0u )
+	{
+		vk_log.debugf( "no memory type for SHM buffer import, copying" );
+		return false;
+	}
+
+	VkImportMemoryHostPointerInfoEXT importInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+		.pHostPointer = (void *)start,
+	};
+
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = &importInfo,
+		.allocationSize = importSize,
+		.memoryTypeIndex = memTypeIndex,
+	};
+
+	res = g_device.vk.AllocateMemory( g_device.device(), &allocInfo, nullptr, &m_memory );
+	if ( res != VK_SUCCESS )
+	{
+		vk_log.debugf( "SHM buffer import failed, copying" );
+		return false;
+	}
+
+	res = g_device.vk.BindBufferMemory( g_device.device(), m_buffer, m_memory, 0 );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkBindBufferMemory failed" );
+		return false;
+	}
+
+	return true;
 }
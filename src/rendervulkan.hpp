@@ -22,6 +22,10 @@
 // 5: Primary Overlay (Steam Overlay)
 // 6: Cursor
 #define k_nMaxLayers 6
+// What a frame can hold when it gets composited, e.g. the streaming UI with
+// an override on top. Frames above k_nMaxLayers skip scanout and the
+// specialized shaders, see cs_composite_layers. One sampler slot each.
+#define k_nMaxCompositeLayers 16
 #define k_nMaxYcbcrMask 16
 #define k_nMaxYcbcrMask_ToPreCompile 3
 
@@ -46,6 +50,7 @@ enum EStreamColorspace : int
 
 #include "drm.hpp"
 
+#include <array>
 #include <memory>
 #include <unordered_map>
 #include <vector>
@@ -56,9 +61,12 @@ extern "C" {
 #define static
 #include <wlr/render/dmabuf.h>
 #include <wlr/render/interface.h>
+#include <wlr/util/box.h>
 #undef static
 }
 
+#include <pixman.h>
+
 #define VK_NO_PROTOTYPES
 #include <vulkan/vulkan.h>
 #include <drm_fourcc.h>
@@ -89,6 +97,7 @@ public:
 			bTransferDst = false;
 			bLinear = false;
 			bExportable = false;
+			bConcurrent = false;
 		}
 
 		bool bFlippable : 1;
@@ -99,6 +108,9 @@ public:
 		bool bTransferDst : 1;
 		bool bLinear : 1;
 		bool bExportable : 1;
+		// Written on the async queue and read on the main one, see
+		// CVulkanDevice::commandBuffer
+		bool bConcurrent : 1;
 	};
 
 	bool BInit( uint32_t width, uint32_t height, uint32_t drmFormat, createFlags flags, wlr_dmabuf_attributes *pDMA = nullptr, uint32_t contentWidth = 0, uint32_t contentHeight = 0 );
@@ -115,6 +127,9 @@ public:
 	inline uint32_t contentHeight() {return m_contentHeight; }
 	inline uint32_t rowPitch() { return m_unRowPitch; }
 	inline uint32_t fbid() { return m_FBID; }
+	// Unique for the lifetime of the process, unlike the views, whose
+	// handles can be reused once the texture is gone
+	inline uint64_t id() const { return m_ulID; }
 	inline uint8_t *mappedData() { return m_pMappedData; }
 	inline VkFormat format() const { return m_format; }
 	inline const struct wlr_dmabuf_attributes& dmabuf() { return m_dmabuf; }
@@ -136,7 +151,12 @@ public:
 		return format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
 	}
 
-	int memoryFence();
+	// Last submission writing the pixels, e.g. the upload for textures made
+	// from SHM buffers or a capture, 0 if there's nothing to wait for. Other
+	// command buffers using the texture wait for it if it went to the other
+	// queue. Atomic, as the pipewire thread reads it.
+	inline uint64_t writeSeqNo() const { return m_ulWriteSeqNo; }
+	inline void setWriteSeqNo(uint64_t seqNo) { m_ulWriteSeqNo = seqNo; }
 
 	CVulkanTexture( void );
 	~CVulkanTexture( void );
@@ -145,6 +165,13 @@ private:
 	bool m_bInitialized = false;
 	bool m_bExternal = false;
 
+	uint64_t m_ulID = 0;
+	std::atomic<uint64_t> m_ulWriteSeqNo = { 0 };
+
+	// m_vkImageMemory is shared with other textures, see CVulkanMemoryArena
+	bool m_bArenaMemory = false;
+	VkDeviceSize m_memoryOffset = 0;
+
 	VkImage m_vkImage = VK_NULL_HANDLE;
 	VkDeviceMemory m_vkImageMemory = VK_NULL_HANDLE;
 	
@@ -179,6 +206,71 @@ private:
 	struct wlr_dmabuf_attributes m_dmabuf = {};
 };
 
+// A client's SHM buffer imported with VK_EXT_external_memory_host, so that
+// the GPU copies straight out of it. Has to go before the wlr_buffer does,
+// as that unmaps it.
+class CVulkanHostBuffer
+{
+public:
+	bool BInit( void *data, size_t size );
+
+	inline VkBuffer buffer() { return m_buffer; }
+	// Where data starts in the buffer, imports start at an aligned address
+	inline VkDeviceSize offset() const { return m_offset; }
+	inline void setLastUseSeqNo( uint64_t seqNo ) { m_ulLastUseSeqNo = seqNo; }
+
+	CVulkanHostBuffer( void ) = default;
+	~CVulkanHostBuffer( void );
+	CVulkanHostBuffer( const CVulkanHostBuffer& other ) = delete;
+	CVulkanHostBuffer& operator=( const CVulkanHostBuffer& other ) = delete;
+
+private:
+	VkBuffer m_buffer = VK_NULL_HANDLE;
+	VkDeviceMemory m_memory = VK_NULL_HANDLE;
+	VkDeviceSize m_offset = 0;
+	uint64_t m_ulLastUseSeqNo = 0;
+};
+
+// The images an SHM surface's buffers get copied into, so that a commit
+// only uploads what the client damaged rather than a whole new image.
+// Double-buffered: a commit never writes the image that a queued commit or
+// an in-flight composite still holds, it gets the other one.
+class CVulkanShmSurface
+{
+public:
+	// nullptr if buf isn't an SHM buffer. damage is buffer-local. If buf got
+	// imported rather than copied, *pHostBuffer is set and needs to outlive
+	// the copy.
+	std::shared_ptr<CVulkanTexture> update( struct wlr_surface *surf, struct wlr_buffer *buf, const std::vector<wlr_box> &damage, std::shared_ptr<CVulkanHostBuffer> *pHostBuffer );
+	// For commits that never got to update(), so that the next one still
+	// copies what they changed
+	void addDamage( const std::vector<wlr_box> &damage );
+
+private:
+	struct Image_t
+	{
+		Image_t() { pixman_region32_init( &damage ); }
+		~Image_t() { pixman_region32_fini( &damage ); }
+		Image_t( const Image_t& other ) = delete;
+		Image_t& operator=( const Image_t& other ) = delete;
+
+		std::shared_ptr<CVulkanTexture> tex;
+		// What this image is missing from the latest buffer
+		pixman_region32_t damage;
+	};
+
+	bool imageFree( uint32_t index ) const;
+	void reset();
+
+	struct wlr_surface *m_surface = nullptr;
+	uint32_t m_width = 0;
+	uint32_t m_height = 0;
+	uint32_t m_drmFormat = 0;
+
+	std::array<Image_t, 2> m_images;
+	uint32_t m_nLastImage = 0;
+};
+
 struct vec2_t
 {
 	float x, y;
@@ -223,7 +315,7 @@ struct FrameInfo_t
 			float y = offset.y + 0.5f / scale.y;
 			return { x, y };
 		}
-	} layers[ k_nMaxLayers ];
+	} layers[ k_nMaxCompositeLayers ];
 
 	uint32_t borderMask() const {
 		uint32_t result = 0;
@@ -257,15 +349,79 @@ std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wl
 
 bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture );
 std::shared_ptr<CVulkanTexture> vulkan_get_last_output_image( void );
+std::shared_ptr<CVulkanTexture> vulkan_get_partial_composite_image( void );
+bool vulkan_composite_partial( const struct FrameInfo_t *frameInfo );
 std::shared_ptr<CVulkanTexture> vulkan_acquire_screenshot_texture(uint32_t width, uint32_t height, bool exportable, uint32_t drmFormat, EStreamColorspace colorspace = k_EStreamColorspace_Unknown);
 
 void vulkan_present_to_window( void );
 
 void vulkan_garbage_collect( void );
+// Thread-safe, false if the submission, see CVulkanTexture::writeSeqNo, is
+// still going after timeout ns
+bool vulkan_wait_for_write( uint64_t sequence, uint64_t timeout );
 bool vulkan_remake_swapchain( void );
 bool vulkan_remake_output_images( void );
 bool acquire_next_image( void );
 
+struct VulkanPipelineStats_t
+{
+	// Frames that had to wait for a pipeline to compile
+	uint64_t stalls;
+	// Frames that used the uber-shader instead
+	uint64_t stallsAvoided;
+	// Time until every permutation was compiled, 0 if still going
+	uint64_t warmupTime;
+	// Time vulkan_init took, pipeline cache loading included
+	uint64_t initTime;
+	// Time the first vulkan_composite took, 0 until there was one
+	uint64_t firstFrameTime;
+};
+
+void vulkan_get_pipeline_stats( VulkanPipelineStats_t *stats );
+
+struct VulkanMemoryStats_t
+{
+	// Live vkAllocateMemory allocations behind textures, arena blocks included
+	uint32_t allocations;
+	uint32_t arenaBlocks;
+	uint32_t arenaSubAllocations;
+	uint64_t arenaBytes;
+	uint64_t arenaBytesUsed;
+};
+
+void vulkan_get_memory_stats( VulkanMemoryStats_t *stats );
+
+// The passes of a composite timed on the GPU
+enum EGPUPass
+{
+	k_EGPUPass_EASU,
+	k_EGPUPass_RCAS,
+	k_EGPUPass_NIS,
+	k_EGPUPass_BlurFirstPass,
+	k_EGPUPass_Blur,
+	k_EGPUPass_Blit,
+	k_EGPUPass_LayerList,
+	// Copy or NV12 conversion for screenshots and PipeWire
+	k_EGPUPass_Capture,
+	k_EGPUPass_Count
+};
+
+struct VulkanGPUTimings_t
+{
+	// ns each pass took in the latest composite with its timestamps back,
+	// 0 for the ones it didn't have
+	uint64_t passTime[ k_EGPUPass_Count ];
+	// From its first pass starting to its last one ending on the main
+	// queue, so without captures on the async queue
+	uint64_t drawTime;
+	// Composites timed so far, stays 0 if the GPU can't do timestamps
+	uint64_t frameCount;
+};
+
+// Thread-safe
+void vulkan_get_gpu_timings( VulkanGPUTimings_t *timings );
+const char *vulkan_gpu_pass_name( EGPUPass pass );
+
 bool vulkan_primary_dev_id(dev_t *id);
 bool vulkan_supports_modifiers(void);
 
@@ -46,6 +46,9 @@ void compositing_debug(uvec2 coord) {
     }
 }
 
+// Shaders taking their layers from a buffer bring their own, see
+// cs_composite_layers
+#ifndef COMPOSITE_LAYER_BUFFER
 vec4 sampleLayer(sampler2D layerSampler, uint layerIdx, vec2 uv, bool unnormalized) {
     vec2 coord = ((uv + u_offset[layerIdx]) * u_scale[layerIdx]);
     vec2 texSize = textureSize(layerSampler, 0);
@@ -65,3 +68,4 @@ vec4 sampleLayer(sampler2D layerSampler, uint layerIdx, vec2 uv, bool unnormaliz
 
     return textureLod(layerSampler, coord, 0.0f);
 }
+#endif
@@ -162,6 +162,9 @@ struct commit_t
 	}
     ~commit_t()
     {
+		// Unlocking buf may unmap what this imported
+		hostBuffer = nullptr;
+
         if ( fb_id != 0 )
 		{
 			drm_unlock_fbid( &g_DRM, fb_id );
@@ -176,6 +179,8 @@ struct commit_t
 	struct wlr_buffer *buf = nullptr;
 	uint32_t fb_id = 0;
 	std::shared_ptr<CVulkanTexture> vulkanTex;
+	// SHM buffer imported for the upload into vulkanTex, if it was
+	std::shared_ptr<CVulkanHostBuffer> hostBuffer;
 	uint64_t commitID = 0;
 	bool done = false;
 	bool async = false;
@@ -274,6 +279,11 @@ struct win {
 	xwayland_ctx_t *ctx;
 
 	std::vector< std::shared_ptr<commit_t> > commit_queue;
+
+	// What SHM buffers get copied into, for each surface that can commit
+	// to this window
+	CVulkanShmSurface shmSurface;
+	CVulkanShmSurface shmOverrideSurface;
 };
 
 Window x11_win(win *w) {
@@ -461,6 +471,8 @@ struct WaitListEntry_t
 {
 	xwayland_ctx_t *ctx;
 	int fence;
+	// For SHM buffers, which have no fence: the submission uploading them
+	uint64_t uploadSeqNo;
 	// Josh: Whether or not to nudge mangoapp that we got
 	// a frame as soon as we know this commit is done.
 	// This could technically be out of date if we change windows
@@ -509,16 +521,23 @@ retry:
 	assert( bFound == true );
 
 	gpuvis_trace_begin_ctx_printf( entry.commitID, "wait fence" );
-	struct pollfd fd = { entry.fence, POLLIN, 0 };
-	int ret = poll( &fd, 1, 100 );
-	if ( ret < 0 )
+	if ( entry.fence >= 0 )
+	{
+		struct pollfd fd = { entry.fence, POLLIN, 0 };
+		int ret = poll( &fd, 1, 100 );
+		if ( ret < 0 )
+		{
+			xwm_log.errorf_errno( "failed to poll fence FD" );
+		}
+
+		close( entry.fence );
+	}
+	else if ( entry.uploadSeqNo != 0 )
 	{
-		xwm_log.errorf_errno( "failed to poll fence FD" );
+		vulkan_wait_for_write( entry.uploadSeqNo, 100'000'000ul );
 	}
 	gpuvis_trace_end_ctx_printf( entry.commitID, "wait fence" );
 
-	close( entry.fence );
-
 	uint64_t frametime;
 	if ( entry.mangoapp_nudge )
 	{
@@ -652,6 +671,14 @@ get_time_in_milliseconds(void)
 	return (unsigned int)(get_time_in_nanos() / 1'000'000ul);
 }
 
+// Fades advance once per vblank, so step them on the vblank we're painting
+// for rather than on whenever we happened to get scheduled.
+static unsigned int
+get_vblank_time_in_milliseconds(void)
+{
+	return (unsigned int)(g_SteamCompMgrVBlankTime / 1'000'000ul);
+}
+
 static void
 discard_ignore(xwayland_ctx_t *ctx, unsigned long sequence)
 {
@@ -778,14 +805,26 @@ destroy_buffer( struct wl_listener *listener, void * )
 }
 
 static std::shared_ptr<commit_t>
-import_commit ( struct wlr_buffer *buf, bool async )
+import_commit ( struct wlr_buffer *buf, bool async, struct wlr_surface *surf, CVulkanShmSurface *shmSurface, const std::vector<wlr_box> &damage )
 {
 	std::shared_ptr<commit_t> commit = std::make_shared<commit_t>();
-	std::unique_lock<std::mutex> lock( wlr_buffer_map_lock );
 
 	commit->buf = buf;
 	commit->async = async;
 
+	// SHM buffers aren't cached per buffer, a client drawing into the same
+	// buffer again would get the old contents. They're copied into the
+	// surface's images instead, only where damaged.
+	struct wlr_dmabuf_attributes dmabuf = {0};
+	if ( !wlr_buffer_get_dmabuf( buf, &dmabuf ) )
+	{
+		commit->vulkanTex = shmSurface->update( surf, buf, damage, &commit->hostBuffer );
+		assert( commit->vulkanTex );
+		return commit;
+	}
+
+	std::unique_lock<std::mutex> lock( wlr_buffer_map_lock );
+
 	auto it = wlr_buffer_map.find( buf );
 	if ( it != wlr_buffer_map.end() )
 	{
@@ -825,8 +864,7 @@ import_commit ( struct wlr_buffer *buf, bool async )
 	commit->vulkanTex = vulkan_create_texture_from_wlr_buffer( buf );
 	assert( commit->vulkanTex );
 
-	struct wlr_dmabuf_attributes dmabuf = {0};
-	if ( BIsNested() == false && wlr_buffer_get_dmabuf( buf, &dmabuf ) )
+	if ( BIsNested() == false )
 	{
 		commit->fb_id = drm_fbid_from_dmabuf( &g_DRM, buf, &dmabuf );
 
@@ -1054,11 +1092,12 @@ void MouseCursor::resetPosition()
 	warp(m_x, m_y);
 }
 
-void MouseCursor::setDirty()
+void MouseCursor::setDirty(unsigned long serial)
 {
 	// We can't prove it's empty until checking again
 	m_imageEmpty = false;
 	m_dirty = true;
+	m_dirtySerial = serial;
 }
 
 bool MouseCursor::setCursorImage(char *data, int w, int h, int hx, int hy)
@@ -1205,7 +1244,8 @@ void MouseCursor::move(int x, int y)
 
 	if (window) {
 		// If mouse moved and we're on the hook for showing the cursor, repaint
-		if (!m_hideForMovement && !m_imageEmpty) {
+		// unless we can just move the cursor plane
+		if (!m_hideForMovement && !m_imageEmpty && !updateCursorPlane()) {
 			hasRepaintNonBasePlane = true;
 		}
 
@@ -1252,18 +1292,54 @@ int MouseCursor::y() const
 	return m_y;
 }
 
+static const size_t k_nMaxCachedCursors = 16;
+
+bool MouseCursor::useCachedCursor(unsigned long serial)
+{
+	auto iter = std::find_if(m_cachedCursors.begin(), m_cachedCursors.end(),
+		[serial](const CachedCursor_t &entry) { return entry.serial == serial; });
+
+	if (iter == m_cachedCursors.end())
+		return false;
+
+	// Move it to the front so it's the last one we evict
+	std::rotate(m_cachedCursors.begin(), iter, iter + 1);
+
+	const CachedCursor_t &entry = m_cachedCursors.front();
+	m_texture = entry.texture;
+	m_hotspotX = entry.hotspotX;
+	m_hotspotY = entry.hotspotY;
+	m_imageEmpty = entry.empty;
+
+	m_dirty = false;
+	updateCursorFeedback();
+
+	return true;
+}
+
 bool MouseCursor::getTexture()
 {
 	if (!m_dirty) {
 		return !m_imageEmpty;
 	}
 
+	// If XFixes told us which cursor this is and we've seen it before,
+	// skip the round-trip and the upload entirely.
+	if (m_dirtySerial != 0 && useCachedCursor(m_dirtySerial)) {
+		return !m_imageEmpty;
+	}
+
 	auto *image = XFixesGetCursorImage(m_ctx->dpy);
 
 	if (!image) {
 		return false;
 	}
 
+	if (useCachedCursor(image->cursor_serial)) {
+		XFree(image);
+		return !m_imageEmpty;
+	}
+
 	m_hotspotX = image->xhot;
 	m_hotspotY = image->yhot;
 
@@ -1282,49 +1358,53 @@ bool MouseCursor::getTexture()
 
 	m_texture = nullptr;
 
-	// Assume the cursor is fully translucent unless proven otherwise.
-	bool bNoCursor = true;
+	// XFixes hands us one pixel per unsigned long, so we can't just memcpy
+	// the rows. Accumulate the alpha while we're at it, so we don't have to
+	// go over the image again to find out whether it's fully translucent.
+	uint32_t alphaMask = 0;
 
 	auto cursorBuffer = std::vector<uint32_t>(surfaceWidth * surfaceHeight);
 	for (int i = 0; i < image->height; i++) {
+		const unsigned long *src = &image->pixels[i * image->width];
+		uint32_t *dst = &cursorBuffer[i * surfaceWidth];
 		for (int j = 0; j < image->width; j++) {
-			cursorBuffer[i * surfaceWidth + j] = image->pixels[i * image->width + j];
-
-			if ( cursorBuffer[i * surfaceWidth + j] & 0xff000000 ) {
-				bNoCursor = false;
-			}
+			dst[j] = src[j];
+			alphaMask |= dst[j];
 		}
 	}
 
-	if (bNoCursor != m_imageEmpty) {
-		m_imageEmpty = bNoCursor;
-
-		if (m_imageEmpty) {
-// 				fprintf( stderr, "grab?\n" );
-		}
-	}
+	m_imageEmpty = !(alphaMask & 0xff000000);
 
 	m_dirty = false;
 	updateCursorFeedback();
 
-	if (m_imageEmpty) {
+	if (!m_imageEmpty) {
+		CVulkanTexture::createFlags texCreateFlags;
+		if ( BIsNested() == false )
+		{
+			texCreateFlags.bFlippable = true;
+			texCreateFlags.bLinear = true; // cursor buffer needs to be linear
+			// TODO: choose format & modifiers from cursor plane
+		}
 
-		return false;
+		m_texture = vulkan_create_texture_from_bits(surfaceWidth, surfaceHeight, image->width, image->height, DRM_FORMAT_ARGB8888, texCreateFlags, cursorBuffer.data());
+		assert(m_texture);
 	}
 
-	CVulkanTexture::createFlags texCreateFlags;
-	if ( BIsNested() == false )
-	{
-		texCreateFlags.bFlippable = true;
-		texCreateFlags.bLinear = true; // cursor buffer needs to be linear
-		// TODO: choose format & modifiers from cursor plane
-	}
+	if (m_cachedCursors.size() >= k_nMaxCachedCursors)
+		m_cachedCursors.pop_back();
+
+	m_cachedCursors.insert(m_cachedCursors.begin(), CachedCursor_t{
+		.serial = image->cursor_serial,
+		.texture = m_texture,
+		.hotspotX = m_hotspotX,
+		.hotspotY = m_hotspotY,
+		.empty = m_imageEmpty,
+	});
 
-	m_texture = vulkan_create_texture_from_bits(surfaceWidth, surfaceHeight, image->width, image->height, DRM_FORMAT_ARGB8888, texCreateFlags, cursorBuffer.data());
-	assert(m_texture);
 	XFree(image);
 
-	return true;
+	return !m_imageEmpty;
 }
 
 void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
@@ -1342,6 +1422,15 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 		return;
 	}
 
+	int curLayer = frameInfo->layerCount++;
+
+	FrameInfo_t::Layer_t *layer = &frameInfo->layers[ curLayer ];
+
+	getLayer(window, fit, winX, winY, layer);
+}
+
+void MouseCursor::getLayer(win *window, win *fit, int winX, int winY, FrameInfo_t::Layer_t *layer)
+{
 	uint32_t sourceWidth = window->a.width;
 	uint32_t sourceHeight = window->a.height;
 
@@ -1376,10 +1465,6 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 	scaledX = scaledX - m_hotspotX;
 	scaledY = scaledY - m_hotspotY;
 
-	int curLayer = frameInfo->layerCount++;
-
-	FrameInfo_t::Layer_t *layer = &frameInfo->layers[ curLayer ];
-
 	layer->opacity = 1.0;
 
 	layer->scale.x = 1.0;
@@ -1397,6 +1482,28 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 	layer->blackBorder = false;
 }
 
+bool MouseCursor::updateCursorPlane()
+{
+	if ( BIsNested() || m_dirty || !m_texture )
+		return false;
+
+	// Only the cursor of the input focus is painted
+	win *window = global_focus.inputFocusWindow;
+	if ( global_focus.cursor != this || !window )
+		return false;
+
+	// Zooming moves the whole scene along with the cursor
+	if ( zoomScaleRatio != 1.0 )
+		return false;
+
+	win *fit = global_focus.focusWindow == window ? global_focus.overrideWindow : nullptr;
+
+	FrameInfo_t::Layer_t layer = {};
+	getLayer(window, fit, m_x, m_y, &layer);
+
+	return drm_update_cursor( &g_DRM, &layer );
+}
+
 void MouseCursor::updateCursorFeedback( bool bForce )
 {
 	// Can't resolve this until cursor is un-dirtied.
@@ -1438,6 +1545,8 @@ paint_cached_base_layer(const std::shared_ptr<commit_t>& commit, const BaseLayer
 	layer->offset.y = base.offset[1];
 	layer->opacity = base.opacity * flOpacityScale;
 
+	layer->zpos = g_zposBase;
+
 	layer->tex = commit->vulkanTex;
 	layer->fbid = commit->fb_id;
 
@@ -1483,7 +1592,7 @@ paint_window(win *w, win *scaleW, struct FrameInfo_t *frameInfo,
 		{
 			if ( g_bPendingFade )
 			{
-				fadeOutStartTime = get_time_in_milliseconds();
+				fadeOutStartTime = get_vblank_time_in_milliseconds();
 				g_bPendingFade = false;
 			}
 		}
@@ -1593,6 +1702,13 @@ paint_window(win *w, win *scaleW, struct FrameInfo_t *frameInfo,
 
 	layer->zpos = g_zposBase;
 
+	// Keep the window we're fading to on its own plane above the cached
+	// one, so the crossfade can be done with plane alpha.
+	if ( flags & PaintWindowFlag::FadeTarget )
+	{
+		layer->zpos = g_zposFadeTarget;
+	}
+
 	if ( w != scaleW )
 	{
 		layer->zpos = g_zposOverride;
@@ -1663,7 +1779,8 @@ paint_all(bool async)
 	win *input;
 
 	unsigned int currentTime = get_time_in_milliseconds();
-	bool fadingOut = ( currentTime - fadeOutStartTime < g_FadeOutDuration || g_bPendingFade ) && g_HeldCommits[HELD_COMMIT_FADE];
+	unsigned int fadeTime = get_vblank_time_in_milliseconds();
+	bool fadingOut = ( fadeTime - fadeOutStartTime < g_FadeOutDuration || g_bPendingFade ) && g_HeldCommits[HELD_COMMIT_FADE];
 
 	w = global_focus.focusWindow;
 	overlay = global_focus.overlayWindow;
@@ -1688,6 +1805,30 @@ paint_all(bool async)
 		{
 			stats_printf( "focus=%i\n", w ? w->appID : 0 );
 		}
+
+		VulkanPipelineStats_t pipelineStats;
+		vulkan_get_pipeline_stats( &pipelineStats );
+		stats_printf( "pipeline_stalls=%lu\n", (unsigned long)pipelineStats.stalls );
+		stats_printf( "pipeline_stalls_avoided=%lu\n", (unsigned long)pipelineStats.stallsAvoided );
+		stats_printf( "pipeline_warmup_ms=%lu\n", (unsigned long)( pipelineStats.warmupTime / 1'000'000lu ) );
+		stats_printf( "vulkan_init_ms=%lu\n", (unsigned long)( pipelineStats.initTime / 1'000'000lu ) );
+		stats_printf( "first_frame_us=%lu\n", (unsigned long)( pipelineStats.firstFrameTime / 1'000lu ) );
+
+		VulkanMemoryStats_t memoryStats;
+		vulkan_get_memory_stats( &memoryStats );
+		stats_printf( "vk_allocations=%u\n", memoryStats.allocations );
+		stats_printf( "vk_arena_blocks=%u\n", memoryStats.arenaBlocks );
+		stats_printf( "vk_arena_suballocations=%u\n", memoryStats.arenaSubAllocations );
+		stats_printf( "vk_arena_mb=%lu/%lu\n", (unsigned long)( memoryStats.arenaBytesUsed >> 20 ), (unsigned long)( memoryStats.arenaBytes >> 20 ) );
+
+		VulkanGPUTimings_t gpuTimings;
+		vulkan_get_gpu_timings( &gpuTimings );
+		if ( gpuTimings.frameCount != 0 )
+		{
+			stats_printf( "gpu_draw_us=%lu\n", (unsigned long)( gpuTimings.drawTime / 1'000lu ) );
+			for ( int i = 0; i < k_EGPUPass_Count; i++ )
+				stats_printf( "gpu_%s_us=%lu\n", vulkan_gpu_pass_name( (EGPUPass)i ), (unsigned long)( gpuTimings.passTime[i] / 1'000lu ) );
+		}
 	}
 
 	struct FrameInfo_t frameInfo = {};
@@ -1735,7 +1876,7 @@ paint_all(bool async)
 			{
 				float opacityScale = g_bPendingFade
 					? 0.0f
-					: ((currentTime - fadeOutStartTime) / (float)g_FadeOutDuration);
+					: ((fadeTime - fadeOutStartTime) / (float)g_FadeOutDuration);
 		
 				paint_cached_base_layer(g_HeldCommits[HELD_COMMIT_FADE], g_CachedPlanes[HELD_COMMIT_FADE], &frameInfo, 1.0f - opacityScale);
 				paint_window(w, w, &frameInfo, global_focus.cursor, PaintWindowFlag::BasePlane | PaintWindowFlag::FadeTarget | PaintWindowFlag::DrawBorders, opacityScale, override);
@@ -1769,9 +1910,9 @@ paint_all(bool async)
 
 	// TODO: We want to paint this at the same scale as the normal window and probably
 	// with an offset.
-	// Josh: No override if we're streaming video
-	// as we will have too many layers. Better to be safe than sorry.
-	if ( override && w && !w->isSteamStreamingClient )
+	// With the streaming video underneath this can go past k_nMaxLayers,
+	// vulkan_composite takes care of those frames.
+	if ( override && w )
 	{
 		paint_window(override, w, &frameInfo, global_focus.cursor, 0, 1.0f, override);
 		// Don't update touch scaling for frameInfo. We don't ever make it our
@@ -1872,6 +2013,31 @@ paint_all(bool async)
 
 	bool bCapture = takeScreenshot || pw_buffer != nullptr;
 
+	std::shared_ptr<CVulkanTexture> pCaptureTexture = nullptr;
+#if HAVE_PIPEWIRE
+	if ( pw_buffer != nullptr )
+	{
+		pCaptureTexture = pw_buffer->texture;
+	}
+#endif
+	constexpr bool bHackForceNV12DumpScreenshot = false;
+
+	uint32_t drmCaptureFormat = bHackForceNV12DumpScreenshot
+		? DRM_FORMAT_NV12
+		: DRM_FORMAT_XRGB8888;
+
+	// Capture through the KMS writeback connector if we can, so that we
+	// don't need to composite planes we could otherwise scan out directly.
+	bool bWritebackCapture = false;
+	int writebackFenceFD = -1;
+	if ( bCapture && !BIsNested() && drm_supports_writeback( &g_DRM, drmCaptureFormat ) )
+	{
+		if ( pCaptureTexture == nullptr )
+			pCaptureTexture = vulkan_acquire_screenshot_texture(g_nOutputWidth, g_nOutputHeight, false, drmCaptureFormat);
+
+		bWritebackCapture = pCaptureTexture != nullptr && pCaptureTexture->fbid() != 0;
+	}
+
 	int nDynamicRefresh = g_nDynamicRefreshRate[drm_get_screen_type( &g_DRM )];
 
 	int nTargetRefresh = nDynamicRefresh && steamcompmgr_window_should_limit_fps( global_focus.focusWindow )// && !global_focus.overlayWindow
@@ -1880,51 +2046,114 @@ paint_all(bool async)
 
 	uint64_t now = get_time_in_nanos();
 
-	if ( g_nOutputRefresh == nTargetRefresh )
+	int nRefresh = drm_get_refresh( &g_DRM );
+
+	if ( nRefresh == nTargetRefresh )
 		g_uDynamicRefreshEqualityTime = now;
 
-	if ( !BIsNested() && g_nOutputRefresh != nTargetRefresh && g_uDynamicRefreshEqualityTime + g_uDynamicRefreshDelay < now )
+	// The delay is there to avoid blanking the screen over and over, no
+	// need for it if it won't.
+	if ( !BIsNested() && nRefresh != nTargetRefresh &&
+	     ( g_uDynamicRefreshEqualityTime + g_uDynamicRefreshDelay < now || drm_can_switch_refresh_seamlessly( &g_DRM, nTargetRefresh ) ) )
 		drm_set_refresh( &g_DRM, nTargetRefresh );
 
 	bool bNeedsNearest = g_upscaleFilter == GamescopeUpscaleFilter::NEAREST && frameInfo.layers[0].scale.x != 1.0f && frameInfo.layers[0].scale.y != 1.0f;
 
 	bool bNeedsComposite = BIsNested();
 	bNeedsComposite |= alwaysComposite;
-	bNeedsComposite |= bCapture;
+	bNeedsComposite |= bCapture && !bWritebackCapture;
 	bNeedsComposite |= bWasFirstFrame;
 	bNeedsComposite |= frameInfo.useFSRLayer0;
 	bNeedsComposite |= frameInfo.useNISLayer0;
 	bNeedsComposite |= frameInfo.blurLayer0;
 	bNeedsComposite |= bNeedsNearest;
-	bNeedsComposite |= bDrewCursor;
+	bNeedsComposite |= !BIsNested() && drm_mirror_active( &g_DRM );
+
+	if ( bDrewCursor )
+	{
+		// Some hardware applies the scaling of the plane below to the cursor
+		// plane, so only try to scan out the cursor directly when nothing
+		// under it is scaled.
+		bool bCursorOnPlane = !BIsNested() && drm_has_cursor_plane( &g_DRM ) && zoomScaleRatio == 1.0;
+		for ( int i = 0; i < frameInfo.layerCount - 1 && bCursorOnPlane; i++ )
+		{
+			if ( frameInfo.layers[ i ].scale.x != 1.0f || frameInfo.layers[ i ].scale.y != 1.0f )
+				bCursorOnPlane = false;
+		}
+
+		bNeedsComposite |= !bCursorOnPlane;
+	}
+
+	bool bDidPartialComposite = false;
 
 	if ( !bNeedsComposite )
 	{
-		int ret = drm_prepare( &g_DRM, async, &frameInfo );
+		// Layers liftoff can't put on a plane may get composited on their
+		// own into this, instead of compositing the whole scene.
+		FrameInfo_t::Layer_t compositionLayer = {};
+		compositionLayer.tex = vulkan_get_partial_composite_image();
+		if ( compositionLayer.tex != nullptr )
+		{
+			compositionLayer.fbid = compositionLayer.tex->fbid();
+			compositionLayer.scale.x = 1.0f;
+			compositionLayer.scale.y = 1.0f;
+			compositionLayer.opacity = 1.0f;
+		}
+
+		int ret = drm_prepare( &g_DRM, async, &frameInfo, &compositionLayer );
 		if ( ret == 0 )
+		{
 			bDoComposite = false;
+
+			uint32_t compositedLayers = drm_get_composited_layers( &g_DRM );
+			if ( compositedLayers != 0 )
+			{
+				// Start off with a transparent layer, see cs_composite_blit.
+				struct FrameInfo_t partialFrameInfo = {};
+				partialFrameInfo.layerCount = 1;
+				partialFrameInfo.layers[ 0 ].scale.x = 1.0f;
+				partialFrameInfo.layers[ 0 ].scale.y = 1.0f;
+				partialFrameInfo.layers[ 0 ].opacity = 0.0f;
+
+				for ( int i = 0; i < frameInfo.layerCount; i++ )
+				{
+					if ( compositedLayers & ( 1u << i ) )
+						partialFrameInfo.layers[ partialFrameInfo.layerCount++ ] = frameInfo.layers[ i ];
+				}
+
+				gpuvis_trace_printf( "partial composite %i of %i layers", partialFrameInfo.layerCount - 1, frameInfo.layerCount );
+
+				if ( vulkan_composite_partial( &partialFrameInfo ) )
+				{
+					bDidPartialComposite = true;
+				}
+				else
+				{
+					xwm_log.errorf("vulkan_composite_partial failed, compositing everything");
+					drm_drop_prepared( &g_DRM );
+					bDoComposite = true;
+				}
+			}
+
+			if ( bDoComposite == false && bCapture )
+			{
+				if ( drm_prepare_writeback( &g_DRM, pCaptureTexture->fbid(), &writebackFenceFD ) != 0 )
+				{
+					xwm_log.errorf("drm_prepare_writeback failed, compositing everything");
+					drm_drop_prepared( &g_DRM );
+					bDoComposite = true;
+				}
+			}
+		}
 		else if ( ret == -EACCES )
 			return;
 	}
 
 	// Update to let the vblank manager know we are currently compositing.
-	g_bCurrentlyCompositing = bDoComposite;
+	g_bCurrentlyCompositing = bDoComposite || bDidPartialComposite;
 
 	if ( bDoComposite == true )
 	{
-		std::shared_ptr<CVulkanTexture> pCaptureTexture = nullptr;
-#if HAVE_PIPEWIRE
-		if ( pw_buffer != nullptr )
-		{
-			pCaptureTexture = pw_buffer->texture;
-		}
-#endif
-		constexpr bool bHackForceNV12DumpScreenshot = false;
-
-		uint32_t drmCaptureFormat = bHackForceNV12DumpScreenshot
-			? DRM_FORMAT_NV12
-			: DRM_FORMAT_XRGB8888;
-
 		if ( bCapture && pCaptureTexture == nullptr )
 		{
 			pCaptureTexture = vulkan_acquire_screenshot_texture(g_nOutputWidth, g_nOutputHeight, false, drmCaptureFormat);
@@ -2003,105 +2232,137 @@ paint_all(bool async)
 
 			drm_commit( &g_DRM, &frameInfo );
 		}
+	}
+	else
+	{
+		assert( BIsNested() == false );
+
+		drm_commit( &g_DRM, &frameInfo );
 
-		if ( takeScreenshot )
+		// The commit didn't go through, so KMS wrote nothing back. Composite
+		// the capture instead rather than hand out a stale texture.
+		if ( bCapture && writebackFenceFD < 0 )
 		{
-			assert( pCaptureTexture != nullptr );
+			xwm_log.errorf("writeback capture failed, compositing it instead");
+
+			if ( vulkan_composite( &frameInfo, pCaptureTexture ) != true )
+				xwm_log.errorf("vulkan_composite failed");
+		}
+	}
 
-			std::thread screenshotThread = std::thread([=] {
-				pthread_setname_np( pthread_self(), "gamescope-scrsh" );
+	if ( takeScreenshot )
+	{
+		assert( pCaptureTexture != nullptr );
+
+		int screenshotFenceFD = writebackFenceFD >= 0 ? fcntl( writebackFenceFD, F_DUPFD_CLOEXEC, 0 ) : -1;
 
-				const uint8_t *mappedData = pCaptureTexture->mappedData();
+		std::thread screenshotThread = std::thread([=] {
+			pthread_setname_np( pthread_self(), "gamescope-scrsh" );
+
+			if ( screenshotFenceFD >= 0 )
+			{
+				// Wait for KMS to be done writing the frame back
+				struct pollfd fence = { .fd = screenshotFenceFD, .events = POLLIN };
+				if ( poll( &fence, 1, 1000 ) <= 0 )
+					xwm_log.errorf( "Timed out waiting for the writeback capture" );
+				close( screenshotFenceFD );
+			}
+			else if ( !vulkan_wait_for_write( pCaptureTexture->writeSeqNo(), 1'000'000'000ul ) )
+			{
+				// The capture may still be going on the async queue
+				xwm_log.errorf( "Timed out waiting for the capture" );
+			}
 
-				if (pCaptureTexture->format() == VK_FORMAT_B8G8R8A8_UNORM)
+			const uint8_t *mappedData = pCaptureTexture->mappedData();
+
+			if (pCaptureTexture->format() == VK_FORMAT_B8G8R8A8_UNORM)
+			{
+				// Make our own copy of the image to remove the alpha channel.
+				auto imageData = std::vector<uint8_t>(currentOutputWidth * currentOutputHeight * 4);
+				const uint32_t comp = 4;
+				const uint32_t pitch = currentOutputWidth * comp;
+				for (uint32_t y = 0; y < currentOutputHeight; y++)
 				{
-					// Make our own copy of the image to remove the alpha channel.
-					auto imageData = std::vector<uint8_t>(currentOutputWidth * currentOutputHeight * 4);
-					const uint32_t comp = 4;
-					const uint32_t pitch = currentOutputWidth * comp;
-					for (uint32_t y = 0; y < currentOutputHeight; y++)
+					for (uint32_t x = 0; x < currentOutputWidth; x++)
 					{
-						for (uint32_t x = 0; x < currentOutputWidth; x++)
-						{
-							// BGR...
-							imageData[y * pitch + x * comp + 0] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 2];
-							imageData[y * pitch + x * comp + 1] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 1];
-							imageData[y * pitch + x * comp + 2] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 0];
-							imageData[y * pitch + x * comp + 3] = 255;
-						}
+						// BGR...
+						imageData[y * pitch + x * comp + 0] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 2];
+						imageData[y * pitch + x * comp + 1] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 1];
+						imageData[y * pitch + x * comp + 2] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 0];
+						imageData[y * pitch + x * comp + 3] = 255;
 					}
+				}
 
-					char pTimeBuffer[1024] = "/tmp/gamescope.png";
+				char pTimeBuffer[1024] = "/tmp/gamescope.png";
 
-					if ( !propertyRequestedScreenshot )
-					{
-						time_t currentTime = time(0);
-						struct tm *localTime = localtime( &currentTime );
-						strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.png", localTime );
-					}
+				if ( !propertyRequestedScreenshot )
+				{
+					time_t currentTime = time(0);
+					struct tm *localTime = localtime( &currentTime );
+					strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.png", localTime );
+				}
 
-					if ( stbi_write_png(pTimeBuffer, currentOutputWidth, currentOutputHeight, 4, imageData.data(), pitch) )
-					{
-						xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
-					}
-					else
-					{
-						xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
-					}
+				if ( stbi_write_png(pTimeBuffer, currentOutputWidth, currentOutputHeight, 4, imageData.data(), pitch) )
+				{
+					xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
 				}
-				else if (pCaptureTexture->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM)
+				else
 				{
-					char pTimeBuffer[1024] = "/tmp/gamescope.raw";
+					xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
+				}
+			}
+			else if (pCaptureTexture->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM)
+			{
+				char pTimeBuffer[1024] = "/tmp/gamescope.raw";
 
-					if ( !propertyRequestedScreenshot )
-					{
-						time_t currentTime = time(0);
-						struct tm *localTime = localtime( &currentTime );
-						strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.raw", localTime );
-					}
+				if ( !propertyRequestedScreenshot )
+				{
+					time_t currentTime = time(0);
+					struct tm *localTime = localtime( &currentTime );
+					strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.raw", localTime );
+				}
 
-					FILE *file = fopen(pTimeBuffer, "wb");
-					if (file)
-					{
-						fwrite(mappedData, 1, pCaptureTexture->totalSize(), file );
-						fclose(file);
+				FILE *file = fopen(pTimeBuffer, "wb");
+				if (file)
+				{
+					fwrite(mappedData, 1, pCaptureTexture->totalSize(), file );
+					fclose(file);
 
-						char cmd[4096];
-						sprintf(cmd, "ffmpeg -f rawvideo -pixel_format nv12 -video_size %dx%d -i %s %s_encoded.png", pCaptureTexture->width(), pCaptureTexture->height(), pTimeBuffer, pTimeBuffer);
+					char cmd[4096];
+					sprintf(cmd, "ffmpeg -f rawvideo -pixel_format nv12 -video_size %dx%d -i %s %s_encoded.png", pCaptureTexture->width(), pCaptureTexture->height(), pTimeBuffer, pTimeBuffer);
 
-						system(cmd);
+					system(cmd);
 
-						xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
-					}
-					else
-					{
-						xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
-					}
+					xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
+				}
+				else
+				{
+					xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
 				}
+			}
 
-				XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
-			});
+			XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
+		});
 
-			screenshotThread.detach();
+		screenshotThread.detach();
 
-			takeScreenshot = false;
-		}
+		takeScreenshot = false;
+	}
 
 #if HAVE_PIPEWIRE
-		if ( pw_buffer != nullptr )
-		{
-			push_pipewire_buffer(pw_buffer);
-			// TODO: make sure the pw_buffer isn't lost in one of the failure
-			// code-paths above
-		}
-#endif
-	}
-	else
+	if ( pw_buffer != nullptr )
 	{
-		assert( BIsNested() == false );
+		if ( writebackFenceFD >= 0 )
+			pw_buffer->capture_fence_fd = fcntl( writebackFenceFD, F_DUPFD_CLOEXEC, 0 );
 
-		drm_commit( &g_DRM, &frameInfo );
+		push_pipewire_buffer(pw_buffer);
+		// TODO: make sure the pw_buffer isn't lost in one of the failure
+		// code-paths above
 	}
+#endif
+
+	if ( writebackFenceFD >= 0 )
+		close( writebackFenceFD );
 
 	gpuvis_trace_end_ctx_printf( paintID, "paint_all" );
 	gpuvis_trace_printf( "paint_all %i layers, composite %i", (int)frameInfo.layerCount, bDoComposite );
@@ -4706,8 +4967,9 @@ void check_new_wayland_res(xwayland_ctx_t *ctx)
 	for ( uint32_t i = 0; i < tmp_queue.size(); i++ )
 	{
 		struct wlr_buffer *buf = tmp_queue[ i ].buf;
+		struct wlr_surface *surf = tmp_queue[ i ].surf;
 
-		win	*w = find_win( ctx, tmp_queue[ i ].surf );
+		win	*w = find_win( ctx, surf );
 
 		if ( w == nullptr )
 		{
@@ -4718,13 +4980,22 @@ void check_new_wayland_res(xwayland_ctx_t *ctx)
 			continue;
 		}
 
+		// An SHM buffer committed again has new pixels to copy, whereas a
+		// dmabuf's texture already shows whatever the client drew
+		struct wlr_dmabuf_attributes dmabuf = {0};
+		const bool bDmabuf = wlr_buffer_get_dmabuf( buf, &dmabuf );
 		bool already_exists = false;
-		for ( const auto& existing_commit : w->commit_queue )
+		if ( bDmabuf )
 		{
-			if (existing_commit->buf == buf)
-				already_exists = true;
+			for ( const auto& existing_commit : w->commit_queue )
+			{
+				if (existing_commit->buf == buf)
+					already_exists = true;
+			}
 		}
 
+		CVulkanShmSurface *shmSurface = surf == w->surface.override_surface ? &w->shmOverrideSurface : &w->shmSurface;
+
 		if ( already_exists )
 		{
 			wlserver_lock();
@@ -4734,19 +5005,19 @@ void check_new_wayland_res(xwayland_ctx_t *ctx)
 			continue;
 		}
 
-		std::shared_ptr<commit_t> newCommit = import_commit( buf, wlserver_surface_is_async(tmp_queue[ i ].surf) );
+		std::shared_ptr<commit_t> newCommit = import_commit( buf, wlserver_surface_is_async( surf ), surf, shmSurface, tmp_queue[ i ].damage );
 
 		int fence = -1;
+		uint64_t uploadSeqNo = 0;
 		if ( newCommit )
 		{
-			struct wlr_dmabuf_attributes dmabuf = {0};
-			if ( wlr_buffer_get_dmabuf( buf, &dmabuf ) )
+			if ( bDmabuf )
 			{
 				fence = dup( dmabuf.fd[0] );
 			}
 			else
 			{
-				fence = newCommit->vulkanTex->memoryFence();
+				uploadSeqNo = newCommit->vulkanTex->writeSeqNo();
 			}
 
 			// Whether or not to nudge mango app when this commit is done.
@@ -4760,6 +5031,7 @@ void check_new_wayland_res(xwayland_ctx_t *ctx)
 				{
 					.ctx = ctx,
 					.fence = fence,
+					.uploadSeqNo = uploadSeqNo,
 					.mangoapp_nudge = mango_nudge,
 					.commitID = newCommit->commitID,
 				};
@@ -5042,7 +5314,7 @@ dispatch_x11( xwayland_ctx_t *ctx )
 				}
 				else if (ev.type == ctx->xfixes_event + XFixesCursorNotify)
 				{
-					cursor->setDirty();
+					cursor->setDirty( ((XFixesCursorNotifyEvent *) &ev)->cursor_serial );
 				}
 				break;
 		}
@@ -5145,6 +5417,7 @@ load_mouse_cursor( MouseCursor *cursor, const char *path, int hx, int hy )
 enum steamcompmgr_event_type {
 	EVENT_VBLANK,
 	EVENT_NUDGE,
+	EVENT_FLIP_FENCE,
 	EVENT_X11,
 	// Any past here are X11
 };
@@ -5596,6 +5869,11 @@ steamcompmgr_main(int argc, char **argv)
 			.fd = g_nudgePipe[ 0 ],
 			.events = POLLIN,
 	});
+	// EVENT_FLIP_FENCE, filled in below when there's a flip in flight
+	pollfds.push_back(pollfd {
+			.fd = -1,
+			.events = POLLIN,
+	});
 	// EVENT_X11
 	{
 		gamescope_xwayland_server_t *server = NULL;
@@ -5627,6 +5905,11 @@ steamcompmgr_main(int argc, char **argv)
 			}
 		}
 
+		// Wake up as soon as the oldest flip in flight is on screen, to
+		// release the buffers it flipped away from.
+		if ( BIsNested() == false && pollfds[ EVENT_FLIP_FENCE ].fd < 0 )
+			pollfds[ EVENT_FLIP_FENCE ].fd = drm_dup_flip_out_fence( &g_DRM );
+
 		if ( poll( pollfds.data(), pollfds.size(), -1 ) < 0)
 		{
 			if ( errno == EAGAIN )
@@ -5661,6 +5944,13 @@ steamcompmgr_main(int argc, char **argv)
 			vblank = dispatch_vblank( vblankFD );
 		if ( pollfds[ EVENT_NUDGE ].revents & POLLIN )
 			dispatch_nudge( g_nudgePipe[ 0 ] );
+		if ( pollfds[ EVENT_FLIP_FENCE ].revents & ( POLLIN | POLLERR ) )
+		{
+			close( pollfds[ EVENT_FLIP_FENCE ].fd );
+			pollfds[ EVENT_FLIP_FENCE ].fd = -1;
+
+			drm_retire_signalled_flips( &g_DRM );
+		}
 
 		if ( g_bRun == false )
 		{
@@ -5697,6 +5987,9 @@ steamcompmgr_main(int argc, char **argv)
 
 				update_mode_atoms(root_ctx);
 			}
+
+			// Release the FBs page-flips are done with
+			drm_reclaim_fbs( &g_DRM );
 		}
 
 		if ( !BIsNested() )
@@ -5832,12 +6125,8 @@ steamcompmgr_main(int argc, char **argv)
 			hasRepaintNonBasePlane = false;
 			nIgnoredOverlayRepaints = 0;
 
-			// If we're in the middle of a fade, pump an event into the loop to
-			// make sure we keep pushing frames even if the app isn't updating.
-			if ( is_fading_out() )
-			{
-				nudge_steamcompmgr();
-			}
+			// No need to nudge ourselves during fades: bForceSyncFlip makes
+			// us paint on every vblank until the fade is done.
 		}
 
 		update_vrr_atoms(root_ctx, false);
@@ -5868,7 +6157,7 @@ steamcompmgr_main(int argc, char **argv)
 						wlr_surface *current_surface = w->surface.current_surface();
 						bool bSendCallback = main_surface != nullptr;
 
-						int nRefresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+						int nRefresh = g_nNestedRefresh ? g_nNestedRefresh : drm_get_refresh( &g_DRM );
 						int nTargetFPS = g_nSteamCompMgrTargetFPS;
 						if ( g_nSteamCompMgrTargetFPS && steamcompmgr_window_should_limit_fps( w ) && nRefresh > nTargetFPS )
 						{
@@ -30,10 +30,11 @@ struct xwayland_ctx_t;
 class gamescope_xwayland_server_t;
 
 static const uint32_t g_zposBase = 0;
-static const uint32_t g_zposOverride = 1;
-static const uint32_t g_zposExternalOverlay = 2;
-static const uint32_t g_zposOverlay = 3;
-static const uint32_t g_zposCursor = 4;
+static const uint32_t g_zposFadeTarget = 1;
+static const uint32_t g_zposOverride = 2;
+static const uint32_t g_zposExternalOverlay = 3;
+static const uint32_t g_zposOverlay = 4;
+static const uint32_t g_zposCursor = 5;
 
 extern EStreamColorspace g_ForcedNV12ColorSpace;
 
@@ -51,7 +52,8 @@ public:
 	void resetPosition();
 
 	void paint(struct win *window, struct win *fit, struct FrameInfo_t *frameInfo);
-	void setDirty();
+	// serial is the XFixes cursor serial of the new image, if known.
+	void setDirty(unsigned long serial = 0);
 
 	// Will take ownership of data.
 	bool setCursorImage(char *data, int w, int h, int hx, int hy);
@@ -76,6 +78,9 @@ private:
 	void queryButtonMask(unsigned int &mask);
 
 	bool getTexture();
+	bool useCachedCursor(unsigned long serial);
+	void getLayer(struct win *window, struct win *fit, int winX, int winY, FrameInfo_t::Layer_t *layer);
+	bool updateCursorPlane();
 
 	void updateCursorFeedback( bool bForce = false );
 
@@ -85,6 +90,18 @@ private:
 	std::shared_ptr<CVulkanTexture> m_texture;
 	bool m_dirty;
 	bool m_imageEmpty;
+	unsigned long m_dirtySerial = 0;
+
+	// Cursor images we already uploaded, keyed by XFixes cursor serial,
+	// most recently used first.
+	struct CachedCursor_t
+	{
+		unsigned long serial;
+		std::shared_ptr<CVulkanTexture> texture;
+		int hotspotX, hotspotY;
+		bool empty;
+	};
+	std::vector<CachedCursor_t> m_cachedCursors;
 
 	unsigned int m_lastMovedTime = 0;
 	bool m_hideForMovement;
@@ -30,6 +30,10 @@ const uint64_t g_uStartingDrawTime = 3'000'000;
 // This is the last time a draw took.
 std::atomic<uint64_t> g_uVblankDrawTimeNS = { g_uStartingDrawTime };
 
+// How long the last composite took on the GPU, 0 if we can't tell.
+// Compositing can't take less than that, whatever the CPU side measured.
+std::atomic<uint64_t> g_uVblankGPUDrawTimeNS = { 0 };
+
 // 1.3ms by default. (g_uDefaultMinVBlankTime)
 // This accounts for some time we cannot account for (which (I think) is the drm_commit -> triggering the pageflip)
 // It would be nice to make this lower if we can find a way to track that effectively
@@ -70,7 +74,8 @@ void vblankThreadRun( void )
 	const uint64_t range = g_uVBlankRateOfDecayMax;
 	while ( true )
 	{
-		const int refresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+		// With VRR, drm may be pacing us at a lower refresh than the mode's
+		const int refresh = g_nNestedRefresh ? g_nNestedRefresh : drm_get_refresh( &g_DRM );
 		const uint64_t nsecInterval = 1'000'000'000ul / refresh;
 		// The redzone is relative to 60Hz, scale it by our
 		// target refresh so we don't miss submitting for vblank in DRM.
@@ -90,7 +95,10 @@ void vblankThreadRun( void )
 			uint64_t drawTime = g_uVblankDrawTimeNS;
 
 			if ( g_bCurrentlyCompositing )
+			{
 				drawTime = std::max(drawTime, g_uVBlankDrawTimeMinCompositing);
+				drawTime = std::max(drawTime, g_uVblankGPUDrawTimeNS.load());
+			}
 			// This is a rolling average when drawTime < rollingMaxDrawTime,
 			// and a a max when drawTime > rollingMaxDrawTime.
 			// This allows us to deal with spikes in the draw buffer time very easily.
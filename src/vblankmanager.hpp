@@ -5,6 +5,8 @@ int vblank_init( void );
 void vblank_mark_possible_vblank( uint64_t nanos );
 
 extern std::atomic<uint64_t> g_uVblankDrawTimeNS;
+// GPU time of the last composite, see vulkan_get_gpu_timings
+extern std::atomic<uint64_t> g_uVblankGPUDrawTimeNS;
 
 const unsigned int g_uDefaultVBlankRedZone = 1'650'000;
 const unsigned int g_uDefaultMinVBlankTime = 350'000; // min vblank time for fps limiter to care about
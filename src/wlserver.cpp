@@ -89,7 +89,7 @@ std::vector<ResListEntry_t> gamescope_xwayland_server_t::retrieve_commits()
 	return commits;
 }
 
-void gamescope_xwayland_server_t::wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf)
+void gamescope_xwayland_server_t::wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf, std::vector<wlr_box> damage)
 {
 	{
 		std::lock_guard<std::mutex> lock( wayland_commit_lock );
@@ -97,8 +97,9 @@ void gamescope_xwayland_server_t::wayland_commit(struct wlr_surface *surf, struc
 		ResListEntry_t newEntry = {
 			.surf = surf,
 			.buf = buf,
+			.damage = std::move( damage ),
 		};
-		wayland_commit_queue.push_back( newEntry );
+		wayland_commit_queue.push_back( std::move( newEntry ) );
 	}
 
 	nudge_steamcompmgr();
@@ -108,6 +109,7 @@ struct PendingCommit_t
 {
 	struct wlr_surface *surf;
 	struct wlr_buffer *buf;
+	std::vector<wlr_box> damage;
 };
 
 std::list<PendingCommit_t> g_PendingCommits;
@@ -130,15 +132,31 @@ void xwayland_surface_commit(struct wlr_surface *wlr_surface) {
 
 	gpuvis_trace_printf( "xwayland_surface_commit wlr_surface %p", wlr_surface );
 
+	// What changed since the surface's previous buffer, so that SHM
+	// buffers don't need to be copied in full every commit
+	std::vector<wlr_box> damage;
+	int nRects = 0;
+	const pixman_box32_t *pRects = pixman_region32_rectangles( &wlr_surface->buffer_damage, &nRects );
+	damage.reserve( nRects );
+	for ( int i = 0; i < nRects; i++ )
+	{
+		damage.push_back( wlr_box{
+			.x = pRects[ i ].x1,
+			.y = pRects[ i ].y1,
+			.width = pRects[ i ].x2 - pRects[ i ].x1,
+			.height = pRects[ i ].y2 - pRects[ i ].y1,
+		} );
+	}
+
 	wlserver_x11_surface_info *wlserver_x11_surface_info = get_wl_surface_info(wlr_surface)->x11_surface;
 	if (wlserver_x11_surface_info)
 	{
 		assert(wlserver_x11_surface_info->xwayland_server);
-		wlserver_x11_surface_info->xwayland_server->wayland_commit( wlr_surface, buf );
+		wlserver_x11_surface_info->xwayland_server->wayland_commit( wlr_surface, buf, std::move( damage ) );
 	}
 	else
 	{
-		g_PendingCommits.push_back(PendingCommit_t{ wlr_surface, buf });
+		g_PendingCommits.push_back(PendingCommit_t{ wlr_surface, buf, std::move( damage ) });
 	}
 }
 
@@ -717,6 +735,12 @@ bool wlsession_init( void ) {
 	if ( BIsNested() )
 		return true;
 
+#if HAVE_DRM_BENCHMARK
+	// The fake KMS device doesn't need a seat
+	if ( drm_fake_requested() )
+		return true;
+#endif
+
 	wlserver.wlr.session = wlr_session_create( wlserver.display );
 	if ( wlserver.wlr.session == nullptr )
 	{
@@ -1283,7 +1307,7 @@ static void wlserver_x11_surface_info_set_wlr( struct wlserver_x11_surface_info
 			wlserver_x11_surface_info *wlserver_x11_surface_info = get_wl_surface_info(wlr_surf)->x11_surface;
 			assert(wlserver_x11_surface_info);
 			assert(wlserver_x11_surface_info->xwayland_server);
-			wlserver_x11_surface_info->xwayland_server->wayland_commit( pending.surf, pending.buf );
+			wlserver_x11_surface_info->xwayland_server->wayland_commit( pending.surf, pending.buf, std::move( pending.damage ) );
 
 			it = g_PendingCommits.erase(it);
 		}
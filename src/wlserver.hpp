@@ -10,6 +10,10 @@
 #include <map>
 #include <set>
 
+extern "C" {
+#include <wlr/util/box.h>
+}
+
 #define WLSERVER_BUTTON_COUNT 4
 
 struct _XDisplay;
@@ -18,6 +22,8 @@ struct xwayland_ctx_t;
 struct ResListEntry_t {
 	struct wlr_surface *surf;
 	struct wlr_buffer *buf;
+	// Buffer-local, only used for SHM buffers, see CVulkanShmSurface
+	std::vector<wlr_box> damage;
 };
 
 struct wlserver_content_override;
@@ -40,7 +46,7 @@ public:
 
 	std::unique_ptr<xwayland_ctx_t> ctx;
 
-	void wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf);
+	void wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf, std::vector<wlr_box> damage);
 
 	std::vector<ResListEntry_t> retrieve_commits();
 